@@ -0,0 +1,120 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+
+/*
+ * Asynchronous logging.
+ *
+ * Each thread writes log records into its own fixed size ring buffer without
+ * taking a lock.  A background thread drains the buffers and writes the
+ * records to stderr.  When a thread's buffer is full, further records from
+ * that thread are dropped (and counted) rather than blocking it, so logging
+ * never holds up a request and the memory used is bounded.
+ */
+namespace logger
+{
+    enum class level
+    {
+        debug = 0,
+        info = 1,
+        warning = 2,
+        error = 3
+    };
+
+    /*
+     * Set the lowest level of message that will be logged.  The default is
+     * info.
+     */
+    void set_level(level l);
+    /*
+     * Parse the name of a level ("debug", "info", "warning" or "error").
+     * Throws std::invalid_argument for any other name.
+     */
+    level parse_level(const std::string& name);
+    /*
+     * Check whether messages of a level are being logged.
+     */
+    bool enabled(level l);
+
+    /*
+     * A line of text to log.  Values are streamed to the line as they would
+     * be to a std::ostream, and the line is queued when the object is
+     * destroyed.  Lines longer than the record size are truncated.
+     *
+     * Example:
+     *
+     * logger::info() << "opened " << filename;
+     */
+    class line
+    {
+        public:
+            explicit line(level l);
+            line(line&& o);
+            ~line();
+
+            template<typename Output>
+            line& operator<<(const Output& output)
+            {
+                if(m_stream != nullptr)
+                    *m_stream << output;
+                return *this;
+            }
+        private:
+            line(const line&) = delete;
+            line& operator=(const line&) = delete;
+
+            level m_level;
+            // Null if the level is disabled.
+            std::ostream *m_stream;
+    };
+
+    /*
+     * Backslashes and control characters in a line are escaped (as \\, \n,
+     * \r, \t or \xHH) when it is written, so that text taken from a request
+     * cannot end the line.
+     */
+    line debug();
+    line info();
+    line warning();
+    line error();
+
+    /*
+     * Log a request in the access log.  The duration is the time between
+     * receiving the request and the response being sent.
+     */
+    void access(
+            const char *method,
+            const char *url,
+            unsigned status,
+            uint64_t bytes,
+            uint64_t duration_us
+            );
+
+    /*
+     * Append a field of an access log line (such as the path, which clients
+     * choose) to out.  Control characters, spaces, quotes and percent signs
+     * are percent-encoded, so the field cannot end the line or pass for
+     * another field.
+     */
+    void escape_field(const char *text, std::size_t length, std::string& out);
+
+    /*
+     * The number of records dropped because a thread's buffer was full.
+     */
+    uint64_t dropped();
+    /*
+     * Write all records queued so far before returning.
+     */
+    void flush();
+    /*
+     * Write records to a file instead of stderr.  Records queued but not yet
+     * written may go to either.
+     */
+    void set_output(std::FILE *output);
+}
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/*
+ * Counters and latency histograms, exposed in the Prometheus text format.
+ *
+ * Every counter and histogram is split into shards, each on its own cache
+ * line.  A thread always updates the same shard with a relaxed atomic
+ * addition, so recording never takes a lock and threads rarely contend for a
+ * cache line.  The shards are summed when the metrics are read.
+ */
+namespace metrics
+{
+    // Number of shards in each counter and histogram.
+    const std::size_t s_shards = 8;
+    // Size of a cache line; each shard is padded to a multiple of this.
+    const std::size_t s_cache_line = 64;
+
+    class counter
+    {
+        public:
+            counter();
+            void add(uint64_t n = 1);
+            uint64_t value() const;
+        private:
+            counter(const counter&) = delete;
+            counter& operator=(const counter&) = delete;
+
+            struct shard
+            {
+                std::atomic<uint64_t> value;
+                char padding[s_cache_line - sizeof(std::atomic<uint64_t>)];
+            };
+            shard m_shards[s_shards];
+    };
+
+    /*
+     * A histogram with log-linear buckets, as HDR histograms have: each
+     * power of two is split into sub_buckets buckets of equal width, so a
+     * bucket is never wider than a quarter of the values it holds.  Bucket 0
+     * counts zero, and the next sub_buckets buckets count 1, 2, 3 and 4.
+     * Every bucket counts values greater than the previous bucket's upper
+     * bound, up to and including its own, as Prometheus buckets do.
+     *
+     * The upper bounds are 0, 1, 2, 3, 4, 5, 6, 7, 8, 10, 12, 14, 16, 20, 24
+     * and so on, up to 2^27 (over two minutes, in microseconds).  The last
+     * bucket counts every larger value.
+     */
+    class histogram
+    {
+        public:
+            static const unsigned sub_bucket_bits = 2;
+            static const std::size_t sub_buckets = std::size_t(1) << sub_bucket_bits;
+            // Bucket 0, the buckets up to sub_buckets, sub_buckets for each
+            // larger power of two up to 2^27, and one for larger values.
+            static const std::size_t bucket_count =
+                1 + sub_buckets + (27 - sub_bucket_bits) * sub_buckets + 1;
+
+            struct snapshot
+            {
+                uint64_t buckets[bucket_count];
+                uint64_t count;
+                uint64_t sum;
+            };
+
+            histogram();
+            void record(uint64_t value);
+            snapshot read() const;
+            /*
+             * Get the (inclusive) upper bound of a bucket other than the
+             * last.
+             */
+            static uint64_t upper_bound(std::size_t bucket);
+            /*
+             * Get the bucket which counts a value.
+             */
+            static std::size_t bucket(uint64_t value);
+        private:
+            histogram(const histogram&) = delete;
+            histogram& operator=(const histogram&) = delete;
+
+            struct shard
+            {
+                std::atomic<uint64_t> buckets[bucket_count];
+                std::atomic<uint64_t> sum;
+                char padding[
+                    s_cache_line -
+                    (bucket_count + 1) * sizeof(std::atomic<uint64_t>) % s_cache_line
+                    ];
+            };
+            static_assert(
+                    sizeof(shard) % s_cache_line == 0,
+                    "histogram shards must fill whole cache lines"
+                    );
+            shard m_shards[s_shards];
+    };
+
+    /*
+     * Metrics for the requests served by one request function.
+     */
+    class endpoint
+    {
+        public:
+            // Status codes are counted from 0 (no response) up to, but not
+            // including, this.  Larger codes are counted as 0.
+            static const unsigned status_limit = 600;
+
+            endpoint(const std::string& route, const std::string& method);
+            ~endpoint();
+            /*
+             * Record a completed request.  A status of zero means that no
+             * response was queued.
+             */
+            void record(unsigned status, uint64_t bytes, uint64_t duration_us);
+            /*
+             * Get the number of requests answered with a status code.
+             */
+            uint64_t responses(unsigned status) const;
+
+            const std::string route;
+            const std::string method;
+            counter bytes;
+            histogram duration_us;
+        private:
+            endpoint(const endpoint&) = delete;
+            endpoint& operator=(const endpoint&) = delete;
+
+            // Responses by status code.  A counter is only created when a
+            // code is first recorded, as an endpoint sends few of them.
+            std::atomic<counter*> m_responses[status_limit];
+    };
+
+    /*
+     * Get the counter with the given name, creating it on first use.  The
+     * counter lasts for the lifetime of the program, so callers can keep the
+     * reference (typically in a function local static variable).
+     */
+    counter& get_counter(const std::string& name, const std::string& help);
+    /*
+     * Create the metrics for a request function.
+     */
+    endpoint& add_endpoint(const std::string& route, const std::string& method);
+
+    /*
+     * Render every metric in the Prometheus text exposition format.
+     */
+    std::string prometheus_text();
+    // Content type of the Prometheus text exposition format.
+    constexpr const char prometheus_content_type[] = "text/plain; version=0.0.4";
+}
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef SCHEMA_HPP
+#define SCHEMA_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include "slide.hpp"
+
+/*
+ * The schema of the photograph database, and the queries the API runs on
+ * it.
+ */
+namespace schema
+{
+    /*
+     * The migrations building the schema, oldest first.  A database's
+     * user_version is the number of them it has had applied.  Migrations
+     * must never be changed once released; add a new one instead.
+     */
+    const std::vector<slide::migration>& migrations();
+    /*
+     * Create the schema in a new database, or bring an existing one up to
+     * date.  Returns the number of migrations applied.
+     */
+    int migrate(slide::connection& conn);
+
+    /*
+     * The fixed queries used by the API.
+     */
+    namespace sql
+    {
+        constexpr const char album_by_id[] =
+            "SELECT album_id, name FROM helios_album WHERE album_id = ? ";
+        constexpr const char albums[] =
+            "SELECT album_id, name FROM helios_album ORDER BY name ";
+        constexpr const char photograph_albums[] =
+            "SELECT album_id, name FROM helios_album "
+            "NATURAL JOIN helios_photograph_in_album "
+            "WHERE photograph_id = ? "
+            "ORDER BY name ";
+        constexpr const char photograph_albums_with_id[] =
+            "SELECT album_id, name, photograph_id FROM helios_album "
+            "NATURAL JOIN helios_photograph_in_album "
+            "WHERE photograph_id = ? "
+            "ORDER BY name ";
+        constexpr const char delete_photograph_albums[] =
+            "DELETE FROM helios_photograph_in_album WHERE photograph_id = ? ";
+        constexpr const char insert_photograph_album[] =
+            "INSERT INTO helios_photograph_in_album(photograph_id, album_id) "
+            "VALUES(?, ?) ";
+        constexpr const char photograph_tags[] =
+            "SELECT tag FROM helios_photograph_tagged "
+            "WHERE photograph_id = ? "
+            "ORDER BY tag ";
+        constexpr const char delete_photograph_tags[] =
+            "DELETE FROM helios_photograph_tagged WHERE photograph_id = ? ";
+        constexpr const char insert_photograph_tag[] =
+            "INSERT INTO helios_photograph_tagged(photograph_id, tag) "
+            "VALUES(?, ?) ";
+        constexpr const char album_photographs[] =
+            "SELECT helios_photograph.photograph_id, "
+            " title, caption, location, taken, "
+            " (helios_photograph_starred.photograph_id IS NOT NULL) AS starred "
+            "FROM helios_photograph "
+            "JOIN helios_photograph_in_album "
+            "ON helios_photograph.photograph_id = helios_photograph_in_album.photograph_id "
+            "LEFT OUTER JOIN helios_photograph_location "
+            "ON helios_photograph.photograph_id = helios_photograph_location.photograph_id "
+            "LEFT OUTER JOIN helios_photograph_starred "
+            "ON helios_photograph.photograph_id = helios_photograph_starred.photograph_id "
+            "WHERE album_id = ?";
+        constexpr const char uncategorised_photographs[] =
+            "SELECT helios_photograph.photograph_id, title, caption, location, taken, "
+            " (helios_photograph_starred.photograph_id IS NOT NULL) AS starred "
+            "FROM helios_photograph "
+            "LEFT OUTER JOIN helios_photograph_location "
+            "ON helios_photograph.photograph_id = helios_photograph_location.photograph_id "
+            "LEFT OUTER JOIN helios_photograph_in_album "
+            "ON helios_photograph.photograph_id = helios_photograph_in_album.photograph_id "
+            "LEFT OUTER JOIN helios_photograph_starred "
+            "ON helios_photograph.photograph_id = helios_photograph_starred.photograph_id "
+            "WHERE album_id IS NULL";
+        constexpr const char update_album[] =
+            "UPDATE helios_album SET album_id = ?, name = ? WHERE album_id = ? ";
+        constexpr const char insert_album[] =
+            "INSERT INTO helios_album(name) values(?)";
+        constexpr const char delete_album[] =
+            "DELETE FROM helios_album WHERE album_id = ?";
+        constexpr const char photograph_by_id[] =
+            "SELECT helios_photograph.photograph_id, title, caption, location, taken, "
+            " (helios_photograph_starred.photograph_id IS NOT NULL) AS starred "
+            "FROM helios_photograph "
+            "LEFT OUTER JOIN helios_photograph_location "
+            "ON helios_photograph.photograph_id = helios_photograph_location.photograph_id "
+            "LEFT OUTER JOIN helios_photograph_starred "
+            "ON helios_photograph.photograph_id = helios_photograph_starred.photograph_id "
+            "WHERE helios_photograph.photograph_id = ?";
+        constexpr const char photograph_summary[] =
+            "SELECT helios_photograph.photograph_id, title, taken, location, "
+            " (helios_photograph_starred.photograph_id IS NOT NULL) AS starred "
+            "FROM helios_photograph "
+            "LEFT OUTER JOIN helios_photograph_location "
+            "ON helios_photograph.photograph_id = helios_photograph_location.photograph_id "
+            "LEFT OUTER JOIN helios_photograph_starred "
+            "ON helios_photograph.photograph_id = helios_photograph_starred.photograph_id "
+            "WHERE helios_photograph.photograph_id = ? ";
+        constexpr const char update_photograph[] =
+            "UPDATE helios_photograph SET title = ?, "
+            "caption = ?, "
+            "taken = ? "
+            "WHERE photograph_id = ?";
+        constexpr const char update_photograph_location[] =
+            "UPDATE helios_photograph_location SET location = ? "
+            "WHERE photograph_id = ?";
+        constexpr const char star_photograph[] =
+            "INSERT OR REPLACE INTO helios_photograph_starred(photograph_id) "
+            "VALUES(?)";
+        constexpr const char unstar_photograph[] =
+            "DELETE FROM helios_photograph_starred WHERE photograph_id = ?";
+        constexpr const char delete_photograph[] =
+            "DELETE FROM helios_photograph WHERE photograph_id = ?";
+        constexpr const char tags[] =
+            "SELECT tag, COUNT(photograph_id) "
+            "FROM helios_photograph_tagged "
+            "WHERE tag IS NOT NULL AND tag != '' "
+            "GROUP BY helios_photograph_tagged.tag ";
+        constexpr const char tag_photographs[] =
+            "SELECT helios_photograph.photograph_id, "
+            " title, caption, location, taken, "
+            " (helios_photograph_starred.photograph_id IS NOT NULL) AS starred "
+            "FROM helios_photograph "
+            "JOIN helios_photograph_tagged "
+            "LEFT OUTER JOIN helios_photograph_location "
+            "ON helios_photograph.photograph_id = helios_photograph_location.photograph_id "
+            "LEFT OUTER JOIN helios_photograph_starred "
+            "ON helios_photograph.photograph_id = helios_photograph_starred.photograph_id "
+            "WHERE tag LIKE ? "
+            "AND helios_photograph.photograph_id = helios_photograph_tagged.photograph_id ";
+        constexpr const char years[] =
+            "SELECT taken_year, count(photograph_id) "
+            "FROM helios_photograph "
+            "WHERE taken_year > 0 "
+            "GROUP BY taken_year "
+            "ORDER BY taken_year";
+        // Photographs with a year but no month are listed as month 0.
+        constexpr const char year_months[] =
+            "SELECT taken_year, coalesce(taken_month, 0), count(photograph_id) "
+            "FROM helios_photograph "
+            "WHERE taken_year = ? "
+            "GROUP BY taken_month "
+            "ORDER BY taken_month";
+        constexpr const char months[] =
+            "SELECT taken_year, coalesce(taken_month, 0), count(photograph_id) "
+            "FROM helios_photograph "
+            "WHERE taken_year > 0 "
+            "GROUP BY taken_year, taken_month "
+            "ORDER BY taken_year, taken_month";
+        constexpr const char month_photographs[] =
+            "SELECT photograph_id, title FROM helios_photograph "
+            "WHERE taken_year = ?1 AND taken_month IS nullif(?2, 0) "
+            "ORDER BY taken_day, taken";
+    }
+
+    struct named_query
+    {
+        const char *name;
+        const char *sql;
+    };
+
+    // Every query used by the API, so their plans can be checked.
+    constexpr named_query queries[] = {
+        { "album_by_id", sql::album_by_id },
+        { "albums", sql::albums },
+        { "photograph_albums", sql::photograph_albums },
+        { "photograph_albums_with_id", sql::photograph_albums_with_id },
+        { "delete_photograph_albums", sql::delete_photograph_albums },
+        { "insert_photograph_album", sql::insert_photograph_album },
+        { "photograph_tags", sql::photograph_tags },
+        { "delete_photograph_tags", sql::delete_photograph_tags },
+        { "insert_photograph_tag", sql::insert_photograph_tag },
+        { "album_photographs", sql::album_photographs },
+        { "uncategorised_photographs", sql::uncategorised_photographs },
+        { "update_album", sql::update_album },
+        { "insert_album", sql::insert_album },
+        { "delete_album", sql::delete_album },
+        { "photograph_by_id", sql::photograph_by_id },
+        { "photograph_summary", sql::photograph_summary },
+        { "update_photograph", sql::update_photograph },
+        { "update_photograph_location", sql::update_photograph_location },
+        { "star_photograph", sql::star_photograph },
+        { "unstar_photograph", sql::unstar_photograph },
+        { "delete_photograph", sql::delete_photograph },
+        { "tags", sql::tags },
+        { "tag_photographs", sql::tag_photographs },
+        { "years", sql::years },
+        { "year_months", sql::year_months },
+        { "months", sql::months },
+        { "month_photographs", sql::month_photographs }
+    };
+}
+
+#endif
@@ -1,13 +1,27 @@
 #ifndef SLIDE_HPP
 #define SLIDE_HPP
 
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <exception>
+#include <future>
+#include <iterator>
 #include <list>
+#include <memory>
+#include <mutex>
 #include <sqlite3.h>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 #include "jsmn.h"
@@ -15,11 +29,13 @@
 namespace slide
 {
     /*
-     * Escape a string which may contain quotes to make it suitable for JSON encoding.
+     * Escape a string as required for the contents of a JSON string
+     * (RFC 8259), without adding the surrounding quotes.
      */
     std::string escape(const std::string&);
     /*
-     * Unescape a string from JSON.
+     * Unescape the contents of a JSON string (RFC 8259), decoding \uXXXX
+     * escapes as UTF-8.
      */
     std::string unescape(const std::string&);
     /*
@@ -67,8 +83,171 @@ namespace slide
             }
     };
 
+    /*
+     * A TEXT column read without copying it.  The view points into SQLite's
+     * memory, and is only valid until the query it was read from steps to
+     * the next row (or is destroyed), so views can only be read through
+     * slide::query.
+     */
+    class text_view
+    {
+        public:
+            text_view() :
+                m_data(""),
+                m_size(0)
+            {
+            }
+            text_view(const char *data, std::size_t size) :
+                m_data(data),
+                m_size(size)
+            {
+            }
+            const char *data() const
+            {
+                return m_data;
+            }
+            std::size_t size() const
+            {
+                return m_size;
+            }
+            std::string str() const
+            {
+                return std::string(m_data, m_size);
+            }
+            bool operator==(const std::string& o) const
+            {
+                return o.length() == m_size && std::memcmp(o.data(), m_data, m_size) == 0;
+            }
+        private:
+            const char *m_data;
+            std::size_t m_size;
+    };
+
+    /*
+     * A BLOB column read without copying it.  Valid for the same time as a
+     * text_view.  Written to JSON as a base64 string.
+     */
+    class blob_view
+    {
+        public:
+            blob_view() :
+                m_data(nullptr),
+                m_size(0)
+            {
+            }
+            blob_view(const unsigned char *data, std::size_t size) :
+                m_data(data),
+                m_size(size)
+            {
+            }
+            const unsigned char *data() const
+            {
+                return m_data;
+            }
+            std::size_t size() const
+            {
+                return m_size;
+            }
+        private:
+            const unsigned char *m_data;
+            std::size_t m_size;
+    };
+
+    /*
+     * Appends JSON to a string.
+     *
+     * Strings are escaped as required by RFC 8259.  Doubles are written with
+     * the fewest digits that read back as the same value; infinities and NaN,
+     * which JSON cannot represent, are written as null.
+     */
+    class json_writer
+    {
+        public:
+            explicit json_writer(std::string& out) :
+                m_out(out)
+            {
+            }
+            void raw(const char *data, std::size_t length)
+            {
+                m_out.append(data, length);
+            }
+            void raw(char c)
+            {
+                m_out += c;
+            }
+            void value(bool b)
+            {
+                if(b)
+                    raw("true", 4);
+                else
+                    raw("false", 5);
+            }
+            void value(int i);
+            void value(double d);
+            void value(const std::string& str)
+            {
+                string(str.data(), str.length());
+            }
+            void value(const text_view& str)
+            {
+                string(str.data(), str.size());
+            }
+            /*
+             * Write a BLOB as a base64 encoded string.
+             */
+            void value(const blob_view& blob);
+            void string(const char *data, std::size_t length);
+        private:
+            std::string& m_out;
+    };
+
+    /*
+     * The calling thread's buffer for building JSON, which keeps its memory
+     * between uses so that responses are not built by repeatedly growing a
+     * new string.  If the thread's buffer is already in use, a new one is
+     * used instead.
+     */
+    class json_buffer
+    {
+        public:
+            json_buffer();
+            ~json_buffer();
+            std::string& get()
+            {
+                return *m_buffer;
+            }
+        private:
+            json_buffer(const json_buffer&) = delete;
+            json_buffer& operator=(const json_buffer&) = delete;
+
+            std::string *m_buffer;
+            bool m_thread_buffer;
+    };
+
     namespace detail
     {
+        /*
+         * True for column types that point into the statement's memory.
+         */
+        template<typename ...Types>
+        struct has_view;
+
+        template<>
+        struct has_view<> : std::false_type
+        {
+        };
+
+        template<typename Type, typename ...Types>
+        struct has_view<Type, Types...> :
+            std::integral_constant<
+                bool,
+                std::is_same<Type, text_view>::value ||
+                    std::is_same<Type, blob_view>::value ||
+                    has_view<Types...>::value
+                >
+        {
+        };
+
         //
         // SET THE VALUE OF AN ATTRIBUTE BASED ON A VALUE READ FROM JSON DATA.
         //
@@ -76,64 +255,329 @@ namespace slide
         void set_value(bool value, bool& out);
         void set_value(double value, bool& out);
         void set_value(int value, bool& out);
-        void set_value(std::string value, bool& out);
+        void set_value(const text_view& value, bool& out);
 
         void set_value(bool value, double& out);
         void set_value(double value, double& out);
         void set_value(int value, double& out);
-        void set_value(std::string value, double& out);
+        void set_value(const text_view& value, double& out);
 
         void set_value(bool value, int& out);
         void set_value(double value, int& out);
         void set_value(int value, int& out);
-        void set_value(std::string value, int& out);
+        void set_value(const text_view& value, int& out);
 
         void set_value(bool value, std::string& out);
         void set_value(double value, std::string& out);
         void set_value(int value, std::string& out);
-        void set_value(std::string value, std::string& out);
+        void set_value(const text_view& value, std::string& out);
+
+        //
+        // ENCODE ATTRIBUTE NAMES AS JSON KEYS AT COMPILE TIME.
+        //
+
+        constexpr std::size_t const_strlen(const char *str)
+        {
+            return (*str == '\0') ? 0 : 1 + const_strlen(str + 1);
+        }
+        /*
+         * True if the string can be written in JSON without escaping.
+         */
+        constexpr bool is_plain_json(const char *str)
+        {
+            return *str == '\0' || (
+                    *str != '"' && *str != '\\' &&
+                    static_cast<unsigned char>(*str) >= 0x20 &&
+                    is_plain_json(str + 1)
+                    );
+        }
+
+        template<std::size_t...>
+        struct index_list
+        {
+        };
+        template<std::size_t N, std::size_t ...I>
+        struct make_index_list : make_index_list<N - 1, N - 1, I...>
+        {
+        };
+        template<std::size_t ...I>
+        struct make_index_list<0, I...>
+        {
+            typedef index_list<I...> type;
+        };
+
+        template<const char *Attr, typename Indices>
+        struct json_key_chars;
+        template<const char *Attr, std::size_t ...I>
+        struct json_key_chars<Attr, index_list<I...>>
+        {
+            static constexpr char value[] = {'"', Attr[I]..., '"', ':', ' ', '\0'};
+            static constexpr std::size_t size = sizeof...(I) + 4;
+        };
+        template<const char *Attr, std::size_t ...I>
+        constexpr char json_key_chars<Attr, index_list<I...>>::value[];
+
+        /*
+         * An attribute name written as a JSON key, including the quotes and
+         * the following colon and space.
+         */
+        template<const char *Attr>
+        struct json_key :
+            json_key_chars<Attr, typename make_index_list<const_strlen(Attr)>::type>
+        {
+            static_assert(
+                    is_plain_json(Attr),
+                    "Attribute names must not need escaping in JSON."
+                    );
+        };
 
         //
-        // CONVERT AN ATOMIC VALUE TO A JSON STRING.
+        // MATCH JSON KEYS TO ATTRIBUTE NAMES.
         //
+        // Each key read from JSON is hashed once (FNV-1a) and compared with
+        // the hashes of the attribute names, which are computed at compile
+        // time.  A matching hash is confirmed by comparing the characters.
+        //
+
+        constexpr uint32_t const_hash(const char *str, uint32_t hash = 2166136261u)
+        {
+            return (*str == '\0') ?
+                hash :
+                const_hash(
+                        str + 1,
+                        (hash ^ static_cast<unsigned char>(*str)) * 16777619u
+                        );
+        }
+        inline uint32_t json_key_hash(const text_view& key)
+        {
+            uint32_t hash = 2166136261u;
+            for(std::size_t i = 0; i < key.size(); ++i)
+                hash = (hash ^ static_cast<unsigned char>(key.data()[i])) * 16777619u;
+            return hash;
+        }
+        template<const char *Attr>
+        struct attr_hash : std::integral_constant<uint32_t, const_hash(Attr)>
+        {
+        };
+        template<const char *Attr>
+        bool key_matches(const text_view& key, const uint32_t hash)
+        {
+            return hash == attr_hash<Attr>::value &&
+                key.size() == const_strlen(Attr) &&
+                std::memcmp(key.data(), Attr, key.size()) == 0;
+        }
 
-        void json_str(bool b, std::ostringstream& oss);
-        void json_str(double d, std::ostringstream& oss);
-        void json_str(int d, std::ostringstream& oss);
-        void json_str(std::string str, std::ostringstream& oss);
+        struct json_document_buffers;
+
+        /*
+         * A JSON document split into jsmn tokens.  The text is copied so that
+         * strings can be unescaped in place, and the token array is grown
+         * until the whole document fits.  Like json_buffer, the copy and the
+         * tokens use memory kept by the calling thread, unless the thread's
+         * buffers are already in use.
+         */
+        class json_document
+        {
+            public:
+                /*
+                 * Throws slide::exception if the text is not valid JSON.
+                 */
+                explicit json_document(const std::string& json);
+                ~json_document();
+                int size() const
+                {
+                    return m_size;
+                }
+                const jsmntok_t& token(const int i) const
+                {
+                    return m_tokens[i];
+                }
+                /*
+                 * Get the first character of a token.
+                 */
+                const char *data(const int i) const
+                {
+                    return m_text + m_tokens[i].start;
+                }
+                /*
+                 * Get the index of the token following token i and all of
+                 * its children.
+                 */
+                int skip(int i) const;
+                /*
+                 * Unescape a string token in place and get its contents.
+                 * Each token may only be read once.  The contents are
+                 * followed by a null character.
+                 */
+                text_view string(int i);
+            private:
+                json_document(const json_document&) = delete;
+                json_document& operator=(const json_document&) = delete;
+                void release();
+
+                json_document_buffers *m_buffers;
+                bool m_thread_buffers;
+                char *m_text;
+                const jsmntok_t *m_tokens;
+                int m_size;
+        };
 
         //
         // BIND VALUES TO A SQLITE STATEMENT.
         //
+        // Strings and BLOBs are bound with the given SQLite destructor.
+        // SQLITE_STATIC binds them without a copy, and may only be used when
+        // the value outlives every step of the statement; this is the case
+        // when the statement is stepped to completion before the bound row
+        // goes out of scope, as statements have their bindings cleared when
+        // they are returned to the connection.  SQLITE_TRANSIENT makes
+        // SQLite take a copy, for statements that are stepped later (by
+        // slide::query).
+        //
 
-        void bind_value(bool value, std::size_t index, sqlite3_stmt *stmt);
-        void bind_value(double value, std::size_t index, sqlite3_stmt *stmt);
-        void bind_value(int value, std::size_t index, sqlite3_stmt *stmt);
-        void bind_value(std::string value, std::size_t index, sqlite3_stmt *stmt);
+        inline void bind_value(bool value, std::size_t index, sqlite3_stmt *stmt, sqlite3_destructor_type)
+        {
+            sqlite3_bind_int(stmt, static_cast<int>(index), value ? 1 : 0);
+        }
+        inline void bind_value(double value, std::size_t index, sqlite3_stmt *stmt, sqlite3_destructor_type)
+        {
+            sqlite3_bind_double(stmt, static_cast<int>(index), value);
+        }
+        inline void bind_value(int value, std::size_t index, sqlite3_stmt *stmt, sqlite3_destructor_type)
+        {
+            sqlite3_bind_int(stmt, static_cast<int>(index), value);
+        }
+        void bind_value(
+                const std::string& value,
+                std::size_t index,
+                sqlite3_stmt *stmt,
+                sqlite3_destructor_type lifetime
+                );
+        inline void bind_value(
+                const text_view& value,
+                std::size_t index,
+                sqlite3_stmt *stmt,
+                sqlite3_destructor_type lifetime
+                )
+        {
+            sqlite3_bind_text(
+                    stmt,
+                    static_cast<int>(index),
+                    value.data(),
+                    static_cast<int>(value.size()),
+                    lifetime
+                    );
+        }
+        inline void bind_value(
+                const blob_view& value,
+                std::size_t index,
+                sqlite3_stmt *stmt,
+                sqlite3_destructor_type lifetime
+                )
+        {
+            // SQLite binds NULL for a null pointer, so empty BLOBs are given
+            // a valid one.
+            static const unsigned char empty = 0;
+            sqlite3_bind_blob(
+                    stmt,
+                    static_cast<int>(index),
+                    (value.data() == nullptr) ? &empty : value.data(),
+                    static_cast<int>(value.size()),
+                    lifetime
+                    );
+        }
+        inline void bind_value(
+                const std::vector<unsigned char>& value,
+                std::size_t index,
+                sqlite3_stmt *stmt,
+                sqlite3_destructor_type lifetime
+                )
+        {
+            bind_value(blob_view(value.data(), value.size()), index, stmt, lifetime);
+        }
 
+        /*
+         * Bind the values of a tuple to consecutive parameters, starting
+         * with parameter number first.
+         */
         template<std::size_t I = 0, typename... Types>
         inline typename std::enable_if<I == sizeof...(Types)>::type
-        bind_values(std::tuple<Types...> /*values*/, sqlite3_stmt */*stmt*/)
+        bind_values(
+                const std::tuple<Types...>&,
+                sqlite3_stmt*,
+                sqlite3_destructor_type,
+                std::size_t = 1
+                )
         {
             // Base case.
         }
 
         template<std::size_t I = 0, typename... Types>
         inline typename std::enable_if<I < sizeof...(Types)>::type
-        bind_values(std::tuple<Types...> values, sqlite3_stmt *stmt)
+        bind_values(
+                const std::tuple<Types...>& values,
+                sqlite3_stmt *stmt,
+                sqlite3_destructor_type lifetime,
+                std::size_t first = 1
+                )
         {
-            bind_value(std::get<I>(values), I + 1, stmt);
-            bind_values<I + 1, Types...>(values, stmt);
+            bind_value(std::get<I>(values), first + I, stmt, lifetime);
+            bind_values<I + 1, Types...>(values, stmt, lifetime, first);
         }
 
         //
         // GET THE VALUE OF A COLUMN FROM A SQLITE RESULT SET.
         //
 
-        void get_column(sqlite3_stmt *stmt, std::size_t index, bool& value);
-        void get_column(sqlite3_stmt *stmt, std::size_t index, double& value);
-        void get_column(sqlite3_stmt *stmt, std::size_t index, int& value);
+        inline void get_column(sqlite3_stmt *stmt, std::size_t index, bool& value)
+        {
+            value = (sqlite3_column_int(stmt, static_cast<int>(index)) != 0);
+        }
+        inline void get_column(sqlite3_stmt *stmt, std::size_t index, double& value)
+        {
+            value = sqlite3_column_double(stmt, static_cast<int>(index));
+        }
+        inline void get_column(sqlite3_stmt *stmt, std::size_t index, int& value)
+        {
+            value = sqlite3_column_int(stmt, static_cast<int>(index));
+        }
         void get_column(sqlite3_stmt *stmt, std::size_t index, std::string& value);
+        inline void get_column(sqlite3_stmt *stmt, std::size_t index, text_view& value)
+        {
+            // The text must be fetched before its size, in case SQLite has
+            // to convert it.
+            const char *data = reinterpret_cast<const char*>(
+                    sqlite3_column_text(stmt, static_cast<int>(index))
+                    );
+            value = text_view(
+                    (data == nullptr) ? "" : data,
+                    static_cast<std::size_t>(
+                        sqlite3_column_bytes(stmt, static_cast<int>(index))
+                        )
+                    );
+        }
+        inline void get_column(sqlite3_stmt *stmt, std::size_t index, blob_view& value)
+        {
+            const unsigned char *data = reinterpret_cast<const unsigned char*>(
+                    sqlite3_column_blob(stmt, static_cast<int>(index))
+                    );
+            value = blob_view(
+                    data,
+                    static_cast<std::size_t>(
+                        sqlite3_column_bytes(stmt, static_cast<int>(index))
+                        )
+                    );
+        }
+        inline void get_column(
+                sqlite3_stmt *stmt,
+                std::size_t index,
+                std::vector<unsigned char>& value
+                )
+        {
+            blob_view blob;
+            get_column(stmt, index, blob);
+            value.assign(blob.data(), blob.data() + blob.size());
+        }
 
         template<std::size_t I = 0, typename... Types>
         inline typename std::enable_if<I == sizeof...(Types)>::type
@@ -153,7 +597,11 @@ namespace slide
     class query_parameters_base
     {
         public:
-            virtual void bind_to(sqlite3_stmt*) const = 0;
+            /*
+             * Bind the parameters to a statement.  See detail::bind_value
+             * for the choice of lifetime.
+             */
+            virtual void bind_to(sqlite3_stmt*, sqlite3_destructor_type lifetime) const = 0;
     };
 
     /*
@@ -172,7 +620,7 @@ namespace slide
             static row<Types...> make_row(Types... params)
             {
                 row out;
-                out.m_tuple = std::make_tuple(params...);
+                out.m_tuple = std::tuple<Types...>(std::move(params)...);
                 return out;
             }
 
@@ -181,10 +629,10 @@ namespace slide
              * another in the order [this row, argument row].
              */
             template <typename ...Types2>
-            row<Types..., Types2...> cat(row<Types2...> b)
+            row<Types..., Types2...> cat(row<Types2...> b) const
             {
                 row<Types..., Types2...> out;
-                out.m_tuple = std::tuple_cat(m_tuple, b.m_tuple);
+                out.m_tuple = std::tuple_cat(m_tuple, std::move(b.m_tuple));
                 return out;
             }
 
@@ -199,15 +647,8 @@ namespace slide
                         "Length of types list must equal length of attributes list."
                         );
                 row<Types...> out;
-                jsmn_parser parser;
-                jsmn_init(&parser);
-
-                jsmntok_t tokens[256];
-                int token_i = 0;
-                const char *js = json.c_str();
-                jsmn_parse(&parser, js, ::strlen(js), tokens, 256);
-
-                out.parse_object<Attributes...>(js, tokens, token_i);
+                detail::json_document document(json);
+                out.parse_object<Attributes...>(document, 0);
                 return out;
             }
             /*
@@ -226,9 +667,9 @@ namespace slide
              * Bind the values in this row, in order (starting with the first
              * parameter), to a SQLite statement.
              */
-            void bind_to(sqlite3_stmt *stmt) const override
+            void bind_to(sqlite3_stmt *stmt, sqlite3_destructor_type lifetime) const override
             {
-                detail::bind_values(m_tuple, stmt);
+                detail::bind_values(m_tuple, stmt, lifetime);
             }
             /*
              * Get an element in the row by its index (starting at 0).
@@ -254,11 +695,24 @@ namespace slide
                         sizeof...(Types) == sizeof...(Attributes),
                         "Length of types list must equal length of attributes list."
                         );
-                std::ostringstream oss;
-                oss << "{ ";
-                write_json_attrs<0, Attributes...>(oss);
-                oss << " }";
-                return oss.str();
+                json_buffer buffer;
+                json_writer writer(buffer.get());
+                write_json<Attributes...>(writer);
+                return buffer.get();
+            }
+            /*
+             * Write the row as a JSON object.
+             */
+            template<const char *...Attributes>
+            void write_json(json_writer& writer) const
+            {
+                static_assert(
+                        sizeof...(Types) == sizeof...(Attributes),
+                        "Length of types list must equal length of attributes list."
+                        );
+                writer.raw("{ ", 2);
+                write_json_attrs<0, Attributes...>(writer);
+                writer.raw(" }", 2);
             }
 
         private:
@@ -268,78 +722,72 @@ namespace slide
 
             template<typename In, std::size_t I, const char *Attr>
             typename std::enable_if<I == sizeof...(Types) - 1>::type
-            set(const std::string& key, const In& value)
+            set(const text_view& key, const uint32_t hash, const In& value)
             {
-                if(key == std::string(Attr))
+                if(detail::key_matches<Attr>(key, hash))
                     detail::set_value(value, get<I>());
             }
 
             template<typename In, std::size_t I, const char *Attr1,
                 const char *Attr2, const char *...Attributes>
             typename std::enable_if<I < sizeof...(Types) - 1>::type
-            set(const std::string& key, const In& value)
+            set(const text_view& key, const uint32_t hash, const In& value)
             {
-                if(key == std::string(Attr1))
+                if(detail::key_matches<Attr1>(key, hash))
                     detail::set_value(value, get<I>());
-                set<In, I + 1, Attr2, Attributes...>(key, value);
+                set<In, I + 1, Attr2, Attributes...>(key, hash, value);
             }
 
+            /*
+             * Set attributes from the object at token i of a document.
+             * Returns the index of the token after the object.  Keys which
+             * are not attributes, and values which are arrays, objects or
+             * null, are ignored.
+             */
             template<const char *...Attributes>
-            void parse_object(const char *js, jsmntok_t *tokens, int& token_i)
+            int parse_object(detail::json_document& document, int i)
             {
-                if(tokens[token_i].type == JSMN_OBJECT)
+                if(i >= document.size())
+                    throw exception("JSON document ended early");
+                if(document.token(i).type != JSMN_OBJECT)
+                    return document.skip(i);
+                const int keys = document.token(i).size;
+                ++i;
+                for(int k = 0; k < keys; ++k)
                 {
-                    jsmntok_t *object_token = (tokens + token_i);
-                    for(int i = 0; i < object_token->size; ++i)
+                    if(i + 1 >= document.size() || document.token(i).type != JSMN_STRING)
+                        throw exception("JSON object key expected");
+                    const text_view key = document.string(i);
+                    const uint32_t hash = detail::json_key_hash(key);
+                    // Move to the value.
+                    ++i;
+                    switch(document.token(i).type)
                     {
-                        // Move to the key.
-                        ++token_i;
-                        const std::string key_(
-                                js + tokens[token_i].start, js + tokens[token_i].end
-                                );
-                        const std::string key = unescape(key_);
-                        // Move to the value.
-                        ++token_i;
-                        switch(tokens[token_i].type)
-                        {
-                            case JSMN_PRIMITIVE:
-                                if(
-                                        *(js + tokens[token_i].start) == '-' || (
-                                            *(js + tokens[token_i].start) >= '0' &&
-                                            *(js + tokens[token_i].start) <= '9'
-                                            )
-                                  )
-                                {
-                                    double value = std::stod(
-                                        std::string(js + tokens[token_i].start, js + tokens[token_i].end)
-                                        );
-                                    set<double, 0, Attributes...>(key, value);
-                                }
-                                else if(*(js + tokens[token_i].start) == 't')
-                                {
-                                    set<bool, 0, Attributes...>(key, true);
-                                }
-                                else if(*(js + tokens[token_i].start) == 'f')
-                                {
-                                    set<bool, 0, Attributes...>(key, false);
-                                }
-                                break;
-                            case JSMN_STRING:
-                                {
-                                    const std::string value(
-                                            js + tokens[token_i].start,
-                                            js + tokens[token_i].end
+                        case JSMN_PRIMITIVE:
+                            {
+                                const char *value = document.data(i);
+                                if(*value == '-' || (*value >= '0' && *value <= '9'))
+                                    set<double, 0, Attributes...>(
+                                            key,
+                                            hash,
+                                            std::strtod(value, nullptr)
                                             );
-                                    set<std::string, 0, Attributes...>(key, unescape(value));
-                                }
-                                break;
-                            case JSMN_ARRAY:
-                            case JSMN_OBJECT:
-                                // TODO
-                                break;
-                        }
+                                else if(*value == 't')
+                                    set<bool, 0, Attributes...>(key, hash, true);
+                                else if(*value == 'f')
+                                    set<bool, 0, Attributes...>(key, hash, false);
+                            }
+                            break;
+                        case JSMN_STRING:
+                            set<text_view, 0, Attributes...>(key, hash, document.string(i));
+                            break;
+                        case JSMN_ARRAY:
+                        case JSMN_OBJECT:
+                            break;
                     }
+                    i = document.skip(i);
                 }
+                return i;
             }
 
             //
@@ -351,24 +799,22 @@ namespace slide
             template<std::size_t I, const char *Attr1,
                 const char *Attr2, const char *...Attributes>
             typename std::enable_if<I + 1 < sizeof...(Types)>::type
-            write_json_attrs(std::ostringstream& oss) const
+            write_json_attrs(json_writer& writer) const
             {
                 // Inductive case.
-                detail::json_str(std::string(Attr1), oss);
-                oss << ": ";
-                detail::json_str(get<I>(), oss);
-                oss << ", ";
-                write_json_attrs<I + 1, Attr2, Attributes...>(oss);
+                writer.raw(detail::json_key<Attr1>::value, detail::json_key<Attr1>::size);
+                writer.value(get<I>());
+                writer.raw(", ", 2);
+                write_json_attrs<I + 1, Attr2, Attributes...>(writer);
             }
 
             template<std::size_t I, const char *Attr1>
             typename std::enable_if<I + 1 == sizeof...(Types)>::type
-            write_json_attrs(std::ostringstream& oss) const
+            write_json_attrs(json_writer& writer) const
             {
                 // Base case.
-                detail::json_str(std::string(Attr1), oss);
-                oss << ": ";
-                detail::json_str(get<I>(), oss);
+                writer.raw(detail::json_key<Attr1>::value, detail::json_key<Attr1>::size);
+                writer.value(get<I>());
             }
 
             std::tuple<Types...> m_tuple;
@@ -382,6 +828,10 @@ namespace slide
         template<typename ...Types>
         row<Types...> get_row(sqlite3_stmt *stmt)
         {
+            static_assert(
+                    !has_view<Types...>::value,
+                    "text_view and blob_view columns can only be read with slide::query."
+                    );
             row<Types...> out;
             get_columns(stmt, out.std_tuple());
             return out;
@@ -394,6 +844,10 @@ namespace slide
     template<typename ...Types>
     class collection
     {
+        static_assert(
+                !detail::has_view<Types...>::value,
+                "text_view and blob_view columns can only be read with slide::query."
+                );
         public:
             typedef row<Types...> row_type;
             typedef typename std::vector<row_type> internal_type;
@@ -401,14 +855,10 @@ namespace slide
             collection()
             {
             }
-            collection(const collection& c) :
-                m_vector(c.m_vector)
-            {
-            }
-            collection(collection&& c) :
-                m_vector(c.m_vector)
-            {
-            }
+            collection(const collection&) = default;
+            collection(collection&&) = default;
+            collection& operator=(const collection&) = default;
+            collection& operator=(collection&&) = default;
             collection(std::initializer_list<row_type> init) :
                 m_vector(init)
             {
@@ -450,35 +900,47 @@ namespace slide
             {
                 m_vector.push_back(r);
             }
+            void push_back(row_type&& r)
+            {
+                m_vector.push_back(std::move(r));
+            }
+            /*
+             * Append a row made from its values.
+             */
+            template<typename ...Values>
+            void emplace_back(Values&&... values)
+            {
+                m_vector.emplace_back();
+                m_vector.back().m_tuple = std::tuple<Types...>(std::forward<Values>(values)...);
+            }
+            void reserve(std::size_t n)
+            {
+                m_vector.reserve(n);
+            }
             std::size_t size() const
             {
                 return m_vector.size();
             }
 
             template<const char * ...Attributes>
-            static collection<Types...> from_json(const std::string json)
+            static collection<Types...> from_json(const std::string& json)
             {
                 static_assert(
                         sizeof...(Types) == sizeof...(Attributes),
                         "Length of types list must equal length of attributes list."
                         );
                 collection<Types...> out;
-                jsmn_parser parser;
-                jsmn_init(&parser);
-
-                jsmntok_t tokens[256];
-                int token_i = 0;
-                const char *js = json.c_str();
-                jsmn_parse(&parser, js, ::strlen(js), tokens, 256);
-
-                if(tokens[0].type == JSMN_ARRAY)
+                detail::json_document document(json);
+                if(document.token(0).type == JSMN_ARRAY)
                 {
-                    for(int i = 0; i < tokens[0].size; ++i)
+                    const int items = document.token(0).size;
+                    out.m_vector.reserve(static_cast<std::size_t>(items));
+                    int i = 1;
+                    for(int item = 0; item < items; ++item)
                     {
-                        ++token_i;
                         row_type r;
-                        r.template parse_object<Attributes...>(js, tokens, token_i);
-                        out.push_back(r);
+                        i = r.template parse_object<Attributes...>(document, i);
+                        out.push_back(std::move(r));
                     }
                 }
                 return out;
@@ -491,16 +953,17 @@ namespace slide
                         sizeof...(Types) == sizeof...(Attributes),
                         "Length of types list must equal length of attributes list."
                         );
-                std::ostringstream oss;
-                oss << "[ ";
+                json_buffer buffer;
+                json_writer writer(buffer.get());
+                writer.raw("[ ", 2);
                 for(std::size_t i = 0; i < size(); ++i)
                 {
-                    oss << at(i).template to_json<Attributes...>();
+                    at(i).template write_json<Attributes...>(writer);
                     if(i != size() - 1)
-                        oss << ", ";
+                        writer.raw(", ", 2);
                 }
-                oss << " ]";
-                return oss.str();
+                writer.raw(" ]", 2);
+                return buffer.get();
             }
 
             template<std::size_t I>
@@ -515,64 +978,325 @@ namespace slide
             internal_type m_vector;
     };
 
-    class connection;
-    class transaction;
     /*
-     * Execute a devoid query.  The query has no parameters and does not return
-     * a result set.
-     *
-     * Return the number of rows changed.
+     * A result set stored as one vector per column (a structure of arrays),
+     * rather than as a vector of rows.  A scan which reads only some of the
+     * columns, such as collecting ids or summing counts, touches only those
+     * columns' memory.
      */
-    int devoid(const std::string& query, connection& db);
-
-    class connection
+    template<typename ...Types>
+    class column_collection
     {
-    public:
-        /*
-         * Open a connection to a new in-memory database.
-         */
-        static connection in_memory_database()
-        {
-            connection c(":memory:");
-            return c;
-        }
-        /*
-         * Attempt to open a connection to the database file.  Throws an
-         * exception if the connection could not be established.
-         */
-        connection(std::string filename) :
-            m_handle(nullptr)
-        {
-            auto err = sqlite3_open(filename.c_str(), &m_handle);
-            if(err == SQLITE_OK)
+        static_assert(
+                !detail::has_view<Types...>::value,
+                "text_view and blob_view columns can only be read with slide::query."
+                );
+        public:
+            typedef row<Types...> row_type;
+            typedef std::tuple<std::vector<Types>...> internal_type;
+
+            column_collection() :
+                m_size(0)
             {
-                enable_foreign_keys();
             }
-            else
+
+            /*
+             * Get the values of one column (starting at 0).
+             */
+            template<std::size_t I>
+            const typename std::tuple_element<I, internal_type>::type& column() const
             {
-                if(m_handle)
+                return std::get<I>(m_columns);
+            }
+            std::size_t size() const
+            {
+                return m_size;
+            }
+            /*
+             * Get a copy of a row.
+             */
+            row_type at(std::size_t i) const
+            {
+                if(i >= m_size)
+                    throw std::out_of_range("column_collection::at");
+                row_type out;
+                copy_row<0>(i, out.std_tuple());
+                return out;
+            }
+            void push_back(const row_type& r)
+            {
+                push_back_values<0>(r.std_tuple());
+                ++m_size;
+            }
+            void push_back(row_type&& r)
+            {
+                push_back_values<0>(std::move(r.std_tuple()));
+                ++m_size;
+            }
+            void reserve(std::size_t n)
+            {
+                reserve_columns<0>(n);
+            }
+            /*
+             * Append the current row of a statement.
+             */
+            void read(sqlite3_stmt *stmt)
+            {
+                read_columns<0>(stmt);
+                ++m_size;
+            }
+
+            template<const char * ...Attributes>
+            std::string to_json() const
+            {
+                static_assert(
+                        sizeof...(Types) == sizeof...(Attributes),
+                        "Length of types list must equal length of attributes list."
+                        );
+                json_buffer buffer;
+                json_writer writer(buffer.get());
+                writer.raw("[ ", 2);
+                for(std::size_t i = 0; i < m_size; ++i)
                 {
-                    sqlite3_close(m_handle);
-                    m_handle = nullptr;
+                    writer.raw("{ ", 2);
+                    write_json_attrs<0, Attributes...>(i, writer);
+                    writer.raw(" }", 2);
+                    if(i != m_size - 1)
+                        writer.raw(", ", 2);
                 }
-                throw exception("Unable to open SQLite connection");
+                writer.raw(" ]", 2);
+                return buffer.get();
             }
+        private:
+            //
+            // APPLY AN OPERATION TO EACH COLUMN IN TURN.
+            //
 
-        }
-        /*
-         * Move a SQLite connection.  The old connection object will no longer
-         * be connected to a database.
-         */
-        connection(connection&& o) :
-            m_handle(o.m_handle)
+            template<std::size_t I>
+            typename std::enable_if<I == sizeof...(Types)>::type
+            copy_row(std::size_t, std::tuple<Types...>&) const
+            {
+            }
+            template<std::size_t I>
+            typename std::enable_if<I < sizeof...(Types)>::type
+            copy_row(std::size_t i, std::tuple<Types...>& out) const
+            {
+                std::get<I>(out) = std::get<I>(m_columns)[i];
+                copy_row<I + 1>(i, out);
+            }
+
+            template<std::size_t I, typename Tuple>
+            typename std::enable_if<I == sizeof...(Types)>::type
+            push_back_values(Tuple&&)
+            {
+            }
+            template<std::size_t I, typename Tuple>
+            typename std::enable_if<I < sizeof...(Types)>::type
+            push_back_values(Tuple&& values)
+            {
+                // Moves each value if the tuple is an rvalue.
+                std::get<I>(m_columns).push_back(std::get<I>(std::forward<Tuple>(values)));
+                push_back_values<I + 1>(std::forward<Tuple>(values));
+            }
+
+            template<std::size_t I>
+            typename std::enable_if<I == sizeof...(Types)>::type
+            reserve_columns(std::size_t)
+            {
+            }
+            template<std::size_t I>
+            typename std::enable_if<I < sizeof...(Types)>::type
+            reserve_columns(std::size_t n)
+            {
+                std::get<I>(m_columns).reserve(n);
+                reserve_columns<I + 1>(n);
+            }
+
+            template<std::size_t I>
+            typename std::enable_if<I == sizeof...(Types)>::type
+            read_columns(sqlite3_stmt*)
+            {
+            }
+            template<std::size_t I>
+            typename std::enable_if<I < sizeof...(Types)>::type
+            read_columns(sqlite3_stmt *stmt)
+            {
+                // Read into a local value, as std::vector<bool> has no bool
+                // elements to read into.
+                typename std::tuple_element<I, std::tuple<Types...>>::type value;
+                detail::get_column(stmt, I, value);
+                std::get<I>(m_columns).push_back(std::move(value));
+                read_columns<I + 1>(stmt);
+            }
+
+            template<std::size_t I, const char *Attr1, const char *Attr2,
+                const char *...Attributes>
+            void write_json_attrs(std::size_t i, json_writer& writer) const
+            {
+                write_json_attrs<I, Attr1>(i, writer);
+                writer.raw(", ", 2);
+                write_json_attrs<I + 1, Attr2, Attributes...>(i, writer);
+            }
+            template<std::size_t I, const char *Attr>
+            void write_json_attrs(std::size_t i, json_writer& writer) const
+            {
+                writer.raw(detail::json_key<Attr>::value, detail::json_key<Attr>::size);
+                writer.value(std::get<I>(m_columns)[i]);
+            }
+
+            internal_type m_columns;
+            std::size_t m_size;
+    };
+
+    class connection;
+    class transaction;
+    /*
+     * Execute a devoid query.  The query has no parameters and does not return
+     * a result set.
+     *
+     * Return the number of rows changed.
+     */
+    int devoid(const std::string& query, connection& db);
+
+    /*
+     * Settings applied to a connection when it is opened.  Each pragma is
+     * only set if it has been given a value, so by default a connection
+     * keeps SQLite's defaults apart from its busy timeout.
+     */
+    struct connection_options
+    {
+        connection_options();
+
+        /*
+         * Get the options of a named profile:
+         *
+         * - "default": SQLite's defaults, with a five second busy timeout.
+         * - "raspberry-pi": WAL journal, synchronous=NORMAL, an 8 MiB page
+         *   cache and 64 MiB of memory mapped I/O, for SD cards and small
+         *   memories.
+         * - "server": WAL journal, synchronous=NORMAL, a 64 MiB page cache
+         *   and 1 GiB of memory mapped I/O.
+         *
+         * Throws slide::exception if there is no such profile.
+         */
+        static connection_options profile(const std::string& name);
+        /*
+         * Set one option from a "name=value" string, where name is one of the
+         * members below and busy_timeout is given in milliseconds.  Throws
+         * slide::exception if the option or its value is not recognised.
+         */
+        void set(const std::string& option);
+
+        // How long a statement waits for a lock held by another connection
+        // before failing with SQLITE_BUSY.  SQLite retries with increasing
+        // delays during the wait.  Zero fails straight away.
+        std::chrono::milliseconds busy_timeout;
+        // PRAGMA journal_mode, such as "wal".  WAL lets readers continue
+        // while another connection writes.  Empty leaves the mode
+        // unchanged.
+        std::string journal_mode;
+        // PRAGMA synchronous: "off", "normal", "full" or "extra".
+        std::string synchronous;
+        // PRAGMA cache_size: a number of pages if positive, or KiB if
+        // negative.  Zero leaves SQLite's default.
+        int cache_size;
+        // PRAGMA mmap_size, in bytes.  Negative leaves SQLite's default.
+        int64_t mmap_size;
+        // PRAGMA temp_store: "default", "file" or "memory".
+        std::string temp_store;
+        // PRAGMA page_size, in bytes.  Only affects databases created (or
+        // vacuumed) by the connection.  Zero leaves SQLite's default.
+        int page_size;
+        // Open an existing database read only, so writes fail.  The journal
+        // mode and page size are left as the database has them.
+        bool read_only;
+    };
+
+    class connection
+    {
+    public:
+        /*
+         * Open a connection to a new in-memory database.
+         */
+        static connection in_memory_database()
+        {
+            connection c(":memory:");
+            return c;
+        }
+        /*
+         * Attempt to open a connection to the database file, and apply the
+         * options to it.  Throws an exception if the connection could not be
+         * established or configured.
+         */
+        connection(
+                std::string filename,
+                const connection_options& options = connection_options()
+                ) :
+            m_handle(nullptr),
+            m_statement_capacity(s_default_statement_capacity),
+            m_statement_hits(0),
+            m_statement_misses(0)
+        {
+            auto err = sqlite3_open_v2(
+                    filename.c_str(),
+                    &m_handle,
+                    options.read_only ?
+                        SQLITE_OPEN_READONLY :
+                        (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE),
+                    nullptr
+                    );
+            if(err == SQLITE_OK)
+            {
+                try
+                {
+                    configure(options);
+                    enable_foreign_keys();
+                }
+                catch(...)
+                {
+                    clear_statement_cache();
+                    sqlite3_close(m_handle);
+                    m_handle = nullptr;
+                    throw;
+                }
+            }
+            else
+            {
+                if(m_handle)
+                {
+                    sqlite3_close(m_handle);
+                    m_handle = nullptr;
+                }
+                throw exception("Unable to open SQLite connection");
+            }
+
+        }
+        /*
+         * Move a SQLite connection.  The old connection object will no longer
+         * be connected to a database.
+         */
+        connection(connection&& o) :
+            m_handle(o.m_handle),
+            m_statements(std::move(o.m_statements)),
+            m_statement_index(std::move(o.m_statement_index)),
+            m_statement_capacity(o.m_statement_capacity),
+            m_statement_hits(o.m_statement_hits),
+            m_statement_misses(o.m_statement_misses),
+            m_statement_slots(std::move(o.m_statement_slots))
         {
             o.m_handle = nullptr;
+            o.m_statements.clear();
+            o.m_statement_index.clear();
+            o.m_statement_slots.clear();
         }
 
         ~connection()
         {
             if(m_handle != nullptr)
             {
+                clear_statement_cache();
+                for(const statement_slot_entry& entry : m_statement_slots)
+                    sqlite3_finalize(entry.stmt);
                 sqlite3_close(m_handle);
             }
         }
@@ -615,7 +1339,95 @@ namespace slide
                 return *it;
             return nullptr;
         }
+        /*
+         * Set the number of prepared statements kept in the connection's
+         * statement cache.  When the cache is full, the least recently used
+         * statement is finalized.  A capacity of zero disables the cache.
+         */
+        void set_statement_cache_capacity(std::size_t capacity);
+        /*
+         * Finalize every cached statement not currently in use.
+         */
+        void clear_statement_cache();
+        /*
+         * The number of statements in the statement cache.
+         */
+        std::size_t statement_cache_size() const
+        {
+            return m_statements.size();
+        }
+        /*
+         * The number of times a statement was found in the cache, and the
+         * number of times one had to be prepared.
+         */
+        uint64_t statement_cache_hits() const
+        {
+            return m_statement_hits;
+        }
+        uint64_t statement_cache_misses() const
+        {
+            return m_statement_misses;
+        }
+        /*
+         * The statement held for a slide::statement type, which is nullptr
+         * until it has been prepared.
+         */
+        struct statement_slot_entry
+        {
+            sqlite3_stmt *stmt;
+            // True while the statement is being run.
+            bool in_use;
+        };
+        /*
+         * Get the slot for a slide::statement type.  The reference is only
+         * valid until another slot is first used.
+         */
+        statement_slot_entry& statement_slot(std::size_t slot)
+        {
+            if(slot >= m_statement_slots.size())
+                m_statement_slots.resize(slot + 1, statement_slot_entry{nullptr, false});
+            return m_statement_slots[slot];
+        }
     private:
+        friend class cached_statement;
+
+        static const std::size_t s_default_statement_capacity = 64;
+
+        struct statement_entry
+        {
+            std::string sql;
+            sqlite3_stmt *stmt;
+            // True while the statement is checked out.
+            bool in_use;
+        };
+        typedef std::list<statement_entry>::iterator statement_iterator;
+
+        /*
+         * Find or prepare a statement for the SQL, moving it to the front of
+         * the cache.  Returns m_statements.end() if the statement cannot be
+         * cached (because the cache is disabled or the statement for the
+         * same SQL is already in use); stmt is then prepared for the caller
+         * to finalize.
+         */
+        statement_iterator checkout_statement(
+                const std::string& sql,
+                sqlite3_stmt *& stmt
+                );
+        /*
+         * Reset a statement checked out from the cache, ready for reuse.
+         */
+        void return_statement(statement_iterator it);
+        /*
+         * Finalize the least recently used statements not in use until the
+         * cache is within its capacity.
+         */
+        void evict_statements();
+
+        /*
+         * Apply connection options.  The page size is set first, as it
+         * cannot be changed once a WAL database has been created.
+         */
+        void configure(const connection_options& options);
         void enable_foreign_keys()
         {
             devoid("PRAGMA foreign_keys = ON", *this);
@@ -624,171 +1436,776 @@ namespace slide
         sqlite3 *m_handle;
         // Stack of transactions open on the database connection.
         std::list<transaction*> m_transactions;
+        // Prepared statements, most recently used first, with an index by
+        // SQL text.
+        std::list<statement_entry> m_statements;
+        std::unordered_map<std::string, statement_iterator> m_statement_index;
+        std::size_t m_statement_capacity;
+        uint64_t m_statement_hits;
+        uint64_t m_statement_misses;
+        // Statements prepared for slide::statement types, by slot.
+        std::vector<statement_slot_entry> m_statement_slots;
     };
 
     /*
-     * Execute a devoid query.  The query may have parameters, but does not
-     * have a result set.
+     * Thrown when no pooled connection is returned in time.
+     */
+    class pool_timeout :
+        public exception
+    {
+        public:
+            pool_timeout(const std::string& message) :
+                exception(message)
+            {
+            }
+    };
+
+    /*
+     * A bounded pool of connections to one database file, shared between
+     * threads.  Connections are opened when first needed, up to the size of
+     * the pool, and kept open when returned, so their page caches and
+     * prepared statements are reused by later checkouts.  The most recently
+     * returned connection is checked out first, as its cache is the warmest.
      *
-     * Return the number of rows changed.
+     * Every handle must be destroyed before the pool.
      */
-    class transaction
+    class connection_pool
     {
     public:
         /*
-         * Open a new transaction with a named savepoint (so it can be rolled
-         * back or committed in the destructor).
+         * A connection checked out of the pool, which is returned when the
+         * handle is destroyed or assigned to.
          */
-        transaction(connection& conn, const std::string& name) :
-            m_connection(conn),
-            m_savepoint_name(name),
-            m_released(false)
+        class handle
         {
-            // Start a SQLite TRANSACTION if outside of a transaction.
-            if(m_connection.transaction_depth() == 0)
+        public:
+            handle() :
+                m_pool(nullptr),
+                m_connection(nullptr)
             {
-                devoid("BEGIN TRANSACTION", m_connection);
-#ifdef SLIDE_ENABLE_DEBUGGING
-                std::cerr << "BEGIN TRANSACTION" << std::endl;
-#endif
             }
-
-            devoid(
-                    mkstr() << "SAVEPOINT " << m_savepoint_name,
-                    m_connection
-                    );
-#ifdef SLIDE_ENABLE_DEBUGGING
-            std::cerr << "SAVEPOINT " << m_savepoint_name << std::endl;
-#endif
-
-            m_connection.enter_transaction(this);
-        }
-        ~transaction()
-        {
-            if(!m_released)
+            handle(handle&& o) :
+                m_pool(o.m_pool),
+                m_connection(o.m_connection)
             {
-                try
-                {
-                    rollback();
-                }
-                catch(const std::exception& e)
+                o.m_pool = nullptr;
+                o.m_connection = nullptr;
+            }
+            handle& operator=(handle&& o)
+            {
+                if(this != &o)
                 {
+                    reset();
+                    m_pool = o.m_pool;
+                    m_connection = o.m_connection;
+                    o.m_pool = nullptr;
+                    o.m_connection = nullptr;
                 }
+                return *this;
             }
-        }
-        void commit()
-        {
-#ifdef SLIDE_ENABLE_DEBUGGING
-            std::cerr << "commit transaction" << std::endl;
-#endif
-
-            if(m_released)
+            ~handle()
             {
-#ifdef SLIDE_ENABLE_DEBUGGING
-                std::cerr << "savepoint already released" << std::endl;
-#endif
-                throw exception("Savepoint already released");
+                reset();
             }
-
-            devoid(mkstr() << "RELEASE SAVEPOINT " << m_savepoint_name, m_connection);
-#ifdef SLIDE_ENABLE_DEBUGGING
-            std::cerr << "RELEASE SAVEPOINT " << m_savepoint_name << std::endl;
-#endif
-
-            m_connection.finish_transaction();
-            m_released = true;
-
-            if(m_connection.transaction_depth() == 0)
+            connection& operator*() const
             {
-                devoid("COMMIT TRANSACTION", m_connection);
-#ifdef SLIDE_ENABLE_DEBUGGING
-                std::cerr << "COMMIT TRANSACTION" << std::endl;
-#endif
+                return *m_connection;
             }
-        }
-        void rollback()
-        {
-            if(m_released)
-                throw exception("Savepoint already released");
-
-            devoid(
-                mkstr() << "ROLLBACK TO SAVEPOINT " <<
-                    m_savepoint_name,
-                m_connection
-                );
-#ifdef SLIDE_ENABLE_DEBUGGING
-            std::cerr << "ROLLBACK TO SAVEPOINT " <<
-                m_savepoint_name << std::endl;
-#endif
-
-            m_connection.finish_transaction();
-            m_released = true;
-
-            if(m_connection.transaction_depth() == 0)
+            connection *operator->() const
             {
-                devoid("ROLLBACK TRANSACTION", m_connection);
-#ifdef SLIDE_ENABLE_DEBUGGING
-                std::cerr << "ROLLBACK TRANSACTION" << std::endl;
-#endif
+                return m_connection;
             }
-        }
-    private:
-        connection& m_connection;
-        std::string m_savepoint_name;
-        bool m_released;
-    };
-    /*
-     * Step a SQLite statement, converting error codes into exceptions.
-     */
-    int step(sqlite3_stmt *stmt);
-    template <typename ...Types>
-    int devoid(const std::string& query, const row<Types...>& values, connection& db)
-    {
-        sqlite3_stmt *stmt = nullptr;
-        sqlite3_prepare(db.handle(), query.c_str(), -1, &stmt, nullptr);
-        if(stmt == nullptr)
-            throw exception(
-                mkstr() << "preparing SQL statement \"" << query << "\": " <<
-                    sqlite3_errmsg(db.handle())
-            );
-        detail::bind_values(values.std_tuple(), stmt);
-        //int step_ret = sqlite3_step(stmt);
-        step(stmt);
-        int finalise_ret = sqlite3_finalize(stmt);
-        //if(step_ret != SQLITE_DONE)
-            //throw exception(
-                //mkstr() << "stepping devoid SQL query \"" << query <<
-                    //"\": " << sqlite3_errmsg(db.handle())
-                //);
-        if(finalise_ret != SQLITE_OK)
-            throw exception(
-                mkstr() << "finalising devoid SQL query \"" << query <<
-                    "\": " << sqlite3_errmsg(db.handle())
-                );
-        return sqlite3_changes(db.handle());
-    }
-
-    /*
-     * Execute a devoid query for each set of parameters in a collection.
-     *
-     * Return the number of rows changed.
-     */
-    template <typename ...Types>
-    void devoid(const std::string& query, const collection<Types...>& values, connection& conn)
-    {
-        transaction tr(conn, "slide_devoid");
-        for(row<Types...> r : values)
-            try
+            explicit operator bool() const
             {
-                devoid(query, r, conn);
+                return m_connection != nullptr;
             }
-            catch(const exception&)
+            /*
+             * Return the connection to the pool now.
+             */
+            void reset()
             {
-                tr.rollback();
-                return;
+                if(m_connection != nullptr)
+                    m_pool->release(m_connection);
+                m_pool = nullptr;
+                m_connection = nullptr;
             }
-        tr.commit();
-    }
+        private:
+            friend class connection_pool;
+
+            handle(connection_pool& pool, connection *conn) :
+                m_pool(&pool),
+                m_connection(conn)
+            {
+            }
+            handle(const handle&) = delete;
+            handle& operator=(const handle&) = delete;
+
+            connection_pool *m_pool;
+            connection *m_connection;
+        };
+
+        /*
+         * Create a pool of up to size connections to the database file,
+         * opened with the given options.  A checkout waits up to wait for a
+         * connection to be returned when every connection is in use.
+         */
+        connection_pool(
+                const std::string& filename,
+                std::size_t size,
+                std::chrono::milliseconds wait = std::chrono::milliseconds(5000),
+                const connection_options& options = connection_options()
+                );
+        ~connection_pool();
+        /*
+         * Check out a connection, opening a new one if every open
+         * connection is in use and the pool is not full.  Throws
+         * pool_timeout if none is returned in time, or slide::exception if
+         * a connection cannot be opened.
+         */
+        handle acquire();
+        std::size_t size() const
+        {
+            return m_size;
+        }
+    private:
+        connection_pool(const connection_pool&) = delete;
+        connection_pool& operator=(const connection_pool&) = delete;
+
+        /*
+         * Take back a connection.  A connection left inside a transaction is
+         * closed rather than given to another user.
+         */
+        void release(connection *conn);
+
+        const std::string m_filename;
+        const connection_options m_options;
+        const std::size_t m_size;
+        const std::chrono::milliseconds m_wait;
+        std::mutex m_mutex;
+        std::condition_variable m_returned;
+        // Connections not checked out, most recently returned last.
+        std::vector<connection*> m_idle;
+        // Number of connections open, whether or not they are checked out.
+        std::size_t m_open;
+    };
+
+    namespace detail
+    {
+        /*
+         * A job queued on a write_queue.  The result of running the job is
+         * kept until the transaction it ran in has been committed, and then
+         * delivered to the waiting future.
+         */
+        class write_job
+        {
+        public:
+            virtual ~write_job()
+            {
+            }
+            virtual void run(connection& conn) = 0;
+            /*
+             * Give the result, or the exception passed to fail, to the
+             * future.
+             */
+            virtual void deliver() = 0;
+            void fail(std::exception_ptr e)
+            {
+                m_error = e;
+            }
+            bool failed() const
+            {
+                return static_cast<bool>(m_error);
+            }
+        protected:
+            std::exception_ptr m_error;
+        };
+
+        template<typename Result, typename Function>
+        class write_job_impl :
+            public write_job
+        {
+        public:
+            explicit write_job_impl(Function&& fn) :
+                m_function(std::move(fn))
+            {
+            }
+            std::future<Result> future()
+            {
+                return m_promise.get_future();
+            }
+            void run(connection& conn) override
+            {
+                m_result.reset(new Result(m_function(conn)));
+            }
+            void deliver() override
+            {
+                if(failed())
+                    m_promise.set_exception(m_error);
+                else
+                    m_promise.set_value(std::move(*m_result));
+            }
+        private:
+            Function m_function;
+            std::promise<Result> m_promise;
+            std::unique_ptr<Result> m_result;
+        };
+
+        template<typename Function>
+        class write_job_impl<void, Function> :
+            public write_job
+        {
+        public:
+            explicit write_job_impl(Function&& fn) :
+                m_function(std::move(fn))
+            {
+            }
+            std::future<void> future()
+            {
+                return m_promise.get_future();
+            }
+            void run(connection& conn) override
+            {
+                m_function(conn);
+            }
+            void deliver() override
+            {
+                if(failed())
+                    m_promise.set_exception(m_error);
+                else
+                    m_promise.set_value();
+            }
+        private:
+            Function m_function;
+            std::promise<void> m_promise;
+        };
+    }
+
+    /*
+     * Serialises writes to a database on one thread, which owns the only
+     * connection used for writing.  Jobs queued while a transaction is being
+     * run and committed are run together in the next transaction (group
+     * commit), so a burst of small writes costs a few commits instead of one
+     * each, and writers never wait for each other's locks.
+     *
+     * Each job runs in its own savepoint, so a job which throws is rolled
+     * back without affecting the others in its group.  A job's future is
+     * only made ready once its group has been committed.  If the commit
+     * fails, every job in the group fails with its exception.
+     */
+    class write_queue
+    {
+    public:
+        /*
+         * Open the write connection and start the writer thread.  Once a job
+         * is queued, the writer waits up to window for more jobs before
+         * starting a transaction, and puts at most max_group jobs in one
+         * transaction.  A window is only worthwhile if commits are much
+         * slower than the time jobs take to arrive.
+         */
+        write_queue(
+                const std::string& filename,
+                const connection_options& options = connection_options(),
+                std::chrono::microseconds window = std::chrono::microseconds(0),
+                std::size_t max_group = 64
+                );
+        /*
+         * Run every job already queued, then stop the writer thread.
+         */
+        ~write_queue();
+        /*
+         * Queue a function to be called with the write connection.  Its
+         * result (which must not refer to memory owned by the connection,
+         * such as a text_view) or exception is given to the future once the
+         * write has been committed.
+         *
+         * The function must not wait for another job, which could only run
+         * after it.
+         */
+        template<typename Function>
+        std::future<typename std::result_of<Function(connection&)>::type> submit(
+                Function fn
+                )
+        {
+            typedef typename std::result_of<Function(connection&)>::type result_type;
+            detail::write_job_impl<result_type, Function> *job =
+                new detail::write_job_impl<result_type, Function>(std::move(fn));
+            std::unique_ptr<detail::write_job> owner(job);
+            std::future<result_type> f = job->future();
+            enqueue(std::move(owner));
+            return f;
+        }
+        /*
+         * Get the number of transactions committed by every write queue
+         * (the slide_write_commits_total metric).
+         */
+        static uint64_t commits();
+    private:
+        write_queue(const write_queue&) = delete;
+        write_queue& operator=(const write_queue&) = delete;
+
+        void enqueue(std::unique_ptr<detail::write_job>&& job);
+        /*
+         * The writer thread: take groups of jobs from the queue and run
+         * them until stopped.
+         */
+        void run();
+        void run_group(std::vector<std::unique_ptr<detail::write_job>>& group);
+
+        const std::string m_filename;
+        const connection_options m_options;
+        const std::chrono::microseconds m_window;
+        const std::size_t m_max_group;
+        // Only used by the writer thread once it has started.
+        std::unique_ptr<connection> m_connection;
+        std::mutex m_mutex;
+        std::condition_variable m_queued;
+        std::deque<std::unique_ptr<detail::write_job>> m_jobs;
+        bool m_stopping;
+        std::thread m_thread;
+    };
+
+    /*
+     * An open handle to a BLOB value in the database, allowing it to be read
+     * in pieces without copying the whole value into memory.
+     *
+     * The handle is only valid while the connection it was opened on is
+     * open.  If the row is modified or deleted, further reads will fail.
+     */
+    class blob
+    {
+    public:
+        /*
+         * Open the BLOB stored in a column of the row with the given rowid
+         * (or INTEGER PRIMARY KEY) for reading.  Throws an exception if there
+         * is no such row.
+         */
+        blob(
+                connection& conn,
+                const std::string& table,
+                const std::string& column,
+                sqlite3_int64 rowid
+                ) :
+            m_blob(nullptr)
+        {
+            if(
+                    sqlite3_blob_open(
+                        conn.handle(),
+                        "main",
+                        table.c_str(),
+                        column.c_str(),
+                        rowid,
+                        0,
+                        &m_blob
+                        ) != SQLITE_OK
+              )
+            {
+                const std::string message = sqlite3_errmsg(conn.handle());
+                if(m_blob != nullptr)
+                    sqlite3_blob_close(m_blob);
+                throw exception(
+                    mkstr() << "opening BLOB " << table << "." << column <<
+                        " in row " << rowid << ": " << message
+                    );
+            }
+        }
+        blob(blob&& o) :
+            m_blob(o.m_blob)
+        {
+            o.m_blob = nullptr;
+        }
+        ~blob()
+        {
+            if(m_blob != nullptr)
+                sqlite3_blob_close(m_blob);
+        }
+        /*
+         * The size of the BLOB in bytes.
+         */
+        std::size_t size() const
+        {
+            return static_cast<std::size_t>(sqlite3_blob_bytes(m_blob));
+        }
+        /*
+         * Copy length bytes, starting at offset, into out.
+         */
+        void read(void *out, std::size_t length, std::size_t offset)
+        {
+            if(
+                    sqlite3_blob_read(
+                        m_blob,
+                        out,
+                        static_cast<int>(length),
+                        static_cast<int>(offset)
+                        ) != SQLITE_OK
+              )
+                throw exception("reading BLOB");
+        }
+    private:
+        blob(const blob&) = delete;
+        blob& operator=(const blob&) = delete;
+
+        sqlite3_blob *m_blob;
+    };
+
+    /*
+     * A prepared statement taken from a connection's statement cache (or
+     * prepared if it is not cached) and given back, reset and with its
+     * bindings cleared, when the object is destroyed.
+     *
+     * Example:
+     *
+     * cached_statement stmt(conn, "SELECT title FROM album WHERE id = ?");
+     * sqlite3_bind_int(stmt.get(), 1, id);
+     * step(stmt.get());
+     */
+    class cached_statement
+    {
+    public:
+        cached_statement(connection& conn, const std::string& sql);
+        cached_statement(cached_statement&& o);
+        ~cached_statement();
+        sqlite3_stmt *get() const
+        {
+            return m_stmt;
+        }
+    private:
+        cached_statement(const cached_statement&) = delete;
+        cached_statement& operator=(const cached_statement&) = delete;
+
+        connection *m_connection;
+        sqlite3_stmt *m_stmt;
+        // The cache entry, or the end of the cache if the statement is not
+        // cached.
+        connection::statement_iterator m_entry;
+    };
+
+    /*
+     * Execute a devoid query.  The query may have parameters, but does not
+     * have a result set.
+     *
+     * Return the number of rows changed.
+     */
+    class transaction
+    {
+    public:
+        /*
+         * Open a new transaction with a named savepoint (so it can be rolled
+         * back or committed in the destructor).
+         */
+        transaction(connection& conn, const std::string& name) :
+            m_connection(conn),
+            m_savepoint_name(name),
+            m_released(false)
+        {
+            // Start a SQLite TRANSACTION if outside of a transaction.
+            if(m_connection.transaction_depth() == 0)
+            {
+                devoid("BEGIN TRANSACTION", m_connection);
+#ifdef SLIDE_ENABLE_DEBUGGING
+                std::cerr << "BEGIN TRANSACTION" << std::endl;
+#endif
+            }
+
+            devoid(
+                    mkstr() << "SAVEPOINT " << m_savepoint_name,
+                    m_connection
+                    );
+#ifdef SLIDE_ENABLE_DEBUGGING
+            std::cerr << "SAVEPOINT " << m_savepoint_name << std::endl;
+#endif
+
+            m_connection.enter_transaction(this);
+        }
+        ~transaction()
+        {
+            if(!m_released)
+            {
+                try
+                {
+                    rollback();
+                }
+                catch(const std::exception& e)
+                {
+                }
+            }
+        }
+        void commit()
+        {
+#ifdef SLIDE_ENABLE_DEBUGGING
+            std::cerr << "commit transaction" << std::endl;
+#endif
+
+            if(m_released)
+            {
+#ifdef SLIDE_ENABLE_DEBUGGING
+                std::cerr << "savepoint already released" << std::endl;
+#endif
+                throw exception("Savepoint already released");
+            }
+
+            devoid(mkstr() << "RELEASE SAVEPOINT " << m_savepoint_name, m_connection);
+#ifdef SLIDE_ENABLE_DEBUGGING
+            std::cerr << "RELEASE SAVEPOINT " << m_savepoint_name << std::endl;
+#endif
+
+            m_connection.finish_transaction();
+            m_released = true;
+
+            if(m_connection.transaction_depth() == 0)
+            {
+                devoid("COMMIT TRANSACTION", m_connection);
+#ifdef SLIDE_ENABLE_DEBUGGING
+                std::cerr << "COMMIT TRANSACTION" << std::endl;
+#endif
+            }
+        }
+        void rollback()
+        {
+            if(m_released)
+                throw exception("Savepoint already released");
+
+            devoid(
+                mkstr() << "ROLLBACK TO SAVEPOINT " <<
+                    m_savepoint_name,
+                m_connection
+                );
+#ifdef SLIDE_ENABLE_DEBUGGING
+            std::cerr << "ROLLBACK TO SAVEPOINT " <<
+                m_savepoint_name << std::endl;
+#endif
+
+            m_connection.finish_transaction();
+            m_released = true;
+
+            if(m_connection.transaction_depth() == 0)
+            {
+                devoid("ROLLBACK TRANSACTION", m_connection);
+#ifdef SLIDE_ENABLE_DEBUGGING
+                std::cerr << "ROLLBACK TRANSACTION" << std::endl;
+#endif
+            }
+        }
+    private:
+        connection& m_connection;
+        std::string m_savepoint_name;
+        bool m_released;
+    };
+    /*
+     * Prepare a SQLite statement, throwing an exception if the SQL cannot be
+     * compiled.
+     */
+    sqlite3_stmt *prepare(connection& conn, const std::string& query);
+    /*
+     * Step a SQLite statement, converting error codes into exceptions.
+     */
+    int step(sqlite3_stmt *stmt);
+    template <typename ...Types>
+    int devoid(const std::string& query, const row<Types...>& values, connection& db)
+    {
+        cached_statement stmt(db, query);
+        detail::bind_values(values.std_tuple(), stmt.get(), SQLITE_STATIC);
+        // Errors are reported by step.
+        step(stmt.get());
+        return sqlite3_changes(db.handle());
+    }
+
+    /*
+     * How slide::write_batch treats rows which cannot be written because of
+     * their values (for example, because they break a constraint).  Other
+     * errors are always thrown.
+     */
+    enum class batch_mode
+    {
+        /*
+         * Write every row or none.  The first row which fails rolls back
+         * the batch, and batch_error is thrown.
+         */
+        all_or_nothing,
+        /*
+         * Write every row which can be written, and report the others in
+         * the batch_result.
+         */
+        best_effort
+    };
+
+    struct batch_options
+    {
+        batch_options(batch_mode mode_ = batch_mode::all_or_nothing, bool multi_row_ = false) :
+            mode(mode_),
+            multi_row(multi_row_)
+        {
+        }
+
+        batch_mode mode;
+        /*
+         * Rewrite the statement, which must be an INSERT ending with a
+         * VALUES(...) list, to insert as many rows at once as SQLite's
+         * limit on parameters allows.  If a group of rows fails, its rows
+         * are written one at a time to find the failures.
+         */
+        bool multi_row;
+    };
+
+    struct batch_failure
+    {
+        // Index of the row in the collection.
+        std::size_t row;
+        std::string message;
+    };
+
+    struct batch_result
+    {
+        batch_result() :
+            changes(0)
+        {
+        }
+
+        // Number of rows changed.
+        int changes;
+        std::vector<batch_failure> failures;
+    };
+
+    /*
+     * Thrown when a row of an all_or_nothing batch fails.
+     */
+    class batch_error :
+        public exception
+    {
+        public:
+            explicit batch_error(const batch_failure& failure) :
+                exception(
+                        mkstr() << "writing row " << failure.row << " of batch: " <<
+                            failure.message
+                        ),
+                m_failure(failure)
+            {
+            }
+            const batch_failure& failure() const
+            {
+                return m_failure;
+            }
+        private:
+            batch_failure m_failure;
+    };
+
+    namespace detail
+    {
+        /*
+         * Get the statements for a batch and run them, recording the
+         * outcome.  The rows are bound by write_batch.
+         */
+        class batch_writer
+        {
+            public:
+                batch_writer(
+                        connection& conn,
+                        const std::string& sql,
+                        std::size_t columns,
+                        const batch_options& options,
+                        batch_result& result
+                        );
+                /*
+                 * Number of rows written by each multi-row statement, or 1
+                 * if multi-row statements are not used.
+                 */
+                std::size_t group_rows() const
+                {
+                    return m_group_rows;
+                }
+                sqlite3_stmt *row_statement()
+                {
+                    return m_row_stmt.get();
+                }
+                sqlite3_stmt *group_statement();
+                /*
+                 * Run the single row statement for the row with the given
+                 * index, after its values have been bound.  Returns false if
+                 * the row failed in a best_effort batch.
+                 */
+                bool step_row(std::size_t row);
+                /*
+                 * Run the multi-row statement.  Returns false if a row
+                 * failed, in which case no row of the group was written.
+                 */
+                bool step_group();
+            private:
+                connection& m_connection;
+                const std::string m_sql;
+                const batch_options m_options;
+                batch_result& m_result;
+                cached_statement m_row_stmt;
+                std::unique_ptr<cached_statement> m_group_stmt;
+                std::size_t m_group_rows;
+        };
+
+        /*
+         * Rewrite an INSERT statement ending with VALUES(...) to insert the
+         * given number of rows.  Throws slide::exception if the statement
+         * does not end with a VALUES list.
+         */
+        std::string multi_row_sql(const std::string& sql, std::size_t rows);
+    }
+
+    /*
+     * Run a statement once for each row of parameters, preparing it once,
+     * in a transaction.  See batch_options for the choice of behaviour when
+     * rows fail.
+     */
+    template <typename ...Types>
+    batch_result write_batch(
+            connection& conn,
+            const std::string& sql,
+            const collection<Types...>& values,
+            const batch_options& options = batch_options()
+            )
+    {
+        batch_result result;
+        transaction tr(conn, "slide_batch");
+        detail::batch_writer writer(conn, sql, sizeof...(Types), options, result);
+
+        std::size_t i = 0;
+        const std::size_t group_rows = writer.group_rows();
+        if(group_rows > 1)
+            for(; i + group_rows <= values.size(); i += group_rows)
+            {
+                sqlite3_stmt *stmt = writer.group_statement();
+                for(std::size_t r = 0; r < group_rows; ++r)
+                    detail::bind_values(
+                            values.at(i + r).std_tuple(),
+                            stmt,
+                            SQLITE_STATIC,
+                            r * sizeof...(Types) + 1
+                            );
+                if(writer.step_group())
+                    continue;
+                // Find the rows which failed.
+                for(std::size_t r = i; r < i + group_rows; ++r)
+                {
+                    values.at(r).bind_to(writer.row_statement(), SQLITE_STATIC);
+                    writer.step_row(r);
+                }
+            }
+        for(; i < values.size(); ++i)
+        {
+            values.at(i).bind_to(writer.row_statement(), SQLITE_STATIC);
+            writer.step_row(i);
+        }
+
+        tr.commit();
+        return result;
+    }
+
+    /*
+     * Execute a devoid query for each set of parameters in a collection, as
+     * an all_or_nothing batch.
+     *
+     * Return the number of rows changed.
+     */
+    template <typename ...Types>
+    int devoid(const std::string& query, const collection<Types...>& values, connection& conn)
+    {
+        return write_batch(conn, query, values).changes;
+    }
 
     template<typename ...Types>
     row<Types...> get_row(
@@ -797,38 +2214,13 @@ namespace slide
             const query_parameters_base& v
             )
     {
-        sqlite3_stmt *stmt = nullptr;
-        sqlite3_prepare(conn.handle(), query.c_str(), -1, &stmt, nullptr);
-        if(stmt == nullptr)
-            throw exception(
-                mkstr() << "preparing SQL statement \"" << query << "\": " <<
-                    sqlite3_errmsg(conn.handle())
-            );
-        v.bind_to(stmt);
-
-        row<Types...> out;
+        cached_statement stmt(conn, query);
+        v.bind_to(stmt.get(), SQLITE_STATIC);
 
-        if(step(stmt) == SQLITE_ROW)
-        {
-            try
-            {
-                out = detail::get_row<Types...>(stmt);
-            }
-            catch(const std::exception&)
-            {
-                sqlite3_finalize(stmt);
-                throw;
-            }
-        }
-        else
-        {
+        if(step(stmt.get()) != SQLITE_ROW)
             throw exception("no rows returned");
-        }
 
-        if(sqlite3_finalize(stmt) != SQLITE_OK)
-            throw exception("finalizing SQLite statement");
-
-        return out;
+        return detail::get_row<Types...>(stmt.get());
     }
     template<typename ...Types>
     row<Types...> get_row(
@@ -846,33 +2238,13 @@ namespace slide
             const query_parameters_base& v
             )
     {
-        sqlite3_stmt *stmt = nullptr;
-        sqlite3_prepare(conn.handle(), query.c_str(), -1, &stmt, nullptr);
-        if(stmt == nullptr)
-            throw exception(
-                mkstr() << "preparing SQL statement \"" << query << "\": " <<
-                    sqlite3_errmsg(conn.handle())
-            );
-        v.bind_to(stmt);
+        cached_statement stmt(conn, query);
+        v.bind_to(stmt.get(), SQLITE_STATIC);
 
         collection<Types...> out;
 
-        while(step(stmt) == SQLITE_ROW)
-        {
-            try
-            {
-                row<Types...> row_ = detail::get_row<Types...>(stmt);
-                out.push_back(row_);
-            }
-            catch(const std::exception&)
-            {
-                sqlite3_finalize(stmt);
-                throw;
-            }
-        }
-
-        if(sqlite3_finalize(stmt) != SQLITE_OK)
-            throw exception("finalizing SQLite statement");
+        while(step(stmt.get()) == SQLITE_ROW)
+            out.push_back(detail::get_row<Types...>(stmt.get()));
 
         return out;
     }
@@ -884,11 +2256,546 @@ namespace slide
     {
         return get_collection<Types...>(conn, query, row<>());
     }
+
+    /*
+     * Get a result set as a column_collection.
+     */
+    template<typename ...Types>
+    column_collection<Types...> get_column_collection(
+            connection &conn,
+            std::string query,
+            const query_parameters_base& v
+            )
+    {
+        cached_statement stmt(conn, query);
+        v.bind_to(stmt.get(), SQLITE_STATIC);
+
+        column_collection<Types...> out;
+        while(step(stmt.get()) == SQLITE_ROW)
+            out.read(stmt.get());
+        return out;
+    }
+    template<typename ...Types>
+    column_collection<Types...> get_column_collection(
+            connection &conn,
+            std::string query
+            )
+    {
+        return get_column_collection<Types...>(conn, query, row<>());
+    }
+    namespace detail
+    {
+        /*
+         * Allocate the index of a connection's statement slot for a new
+         * statement type.
+         */
+        std::size_t next_statement_slot();
+
+        template<std::size_t I>
+        inline void bind_params(sqlite3_stmt*, sqlite3_destructor_type)
+        {
+        }
+
+        template<std::size_t I, typename Type, typename ...Types>
+        inline void bind_params(
+                sqlite3_stmt *stmt,
+                sqlite3_destructor_type lifetime,
+                const Type& value,
+                const Types&... values
+                )
+        {
+            bind_value(value, I, stmt, lifetime);
+            bind_params<I + 1>(stmt, lifetime, values...);
+        }
+
+        /*
+         * Use of a slide::statement's prepared statement.  The statement is
+         * either the one in the connection's slot, which is reset, has its
+         * bindings cleared and is marked free when the lease ends, or (if
+         * the slot's statement was already in use) a separate statement
+         * finalized when the lease ends.
+         */
+        class statement_lease
+        {
+        public:
+            statement_lease() :
+                m_connection(nullptr),
+                m_slot(0),
+                m_stmt(nullptr)
+            {
+            }
+            /*
+             * Lease the statement in a connection's slot, which must be
+             * prepared and free.
+             */
+            statement_lease(connection& conn, std::size_t slot) :
+                m_connection(&conn),
+                m_slot(slot),
+                m_stmt(conn.statement_slot(slot).stmt)
+            {
+                conn.statement_slot(slot).in_use = true;
+            }
+            /*
+             * Lease a statement owned by the lease.
+             */
+            explicit statement_lease(sqlite3_stmt *stmt) :
+                m_connection(nullptr),
+                m_slot(0),
+                m_stmt(stmt)
+            {
+            }
+            statement_lease(statement_lease&& o) :
+                m_connection(o.m_connection),
+                m_slot(o.m_slot),
+                m_stmt(o.m_stmt)
+            {
+                o.m_stmt = nullptr;
+            }
+            ~statement_lease()
+            {
+                if(m_stmt == nullptr)
+                    return;
+                if(m_connection == nullptr)
+                    sqlite3_finalize(m_stmt);
+                else
+                {
+                    sqlite3_reset(m_stmt);
+                    sqlite3_clear_bindings(m_stmt);
+                    m_connection->statement_slot(m_slot).in_use = false;
+                }
+            }
+            sqlite3_stmt *get() const
+            {
+                return m_stmt;
+            }
+        private:
+            statement_lease(const statement_lease&) = delete;
+            statement_lease& operator=(const statement_lease&) = delete;
+
+            connection *m_connection;
+            std::size_t m_slot;
+            sqlite3_stmt *m_stmt;
+        };
+    }
+
+    /*
+     * A result set read lazily, one row at a time, as it is iterated over.
+     *
+     * Only the current row is held in memory.  A reference to it (from the
+     * iterator) is only valid until the iterator is incremented, as the same
+     * row object is overwritten by each step.  The query can only be iterated
+     * over once.  The statement is reset when the query is destroyed.
+     *
+     * Example:
+     *
+     * for(const row<int, std::string>& r :
+     *         query<int, std::string>(conn, "SELECT album_id, name FROM album"))
+     *     std::cout << r.get<1>() << std::endl;
+     */
+    template<typename ...Types>
+    class query
+    {
+    public:
+        typedef row<Types...> row_type;
+
+        class iterator
+        {
+        public:
+            typedef std::input_iterator_tag iterator_category;
+            typedef row_type value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef const row_type *pointer;
+            typedef const row_type& reference;
+
+            explicit iterator(query *q = nullptr) :
+                m_query(q)
+            {
+            }
+            const row_type& operator*() const
+            {
+                return m_query->m_row;
+            }
+            const row_type *operator->() const
+            {
+                return &(m_query->m_row);
+            }
+            iterator& operator++()
+            {
+                if(!m_query->next())
+                    m_query = nullptr;
+                return *this;
+            }
+            bool operator==(const iterator& o) const
+            {
+                return m_query == o.m_query;
+            }
+            bool operator!=(const iterator& o) const
+            {
+                return m_query != o.m_query;
+            }
+        private:
+            query *m_query;
+        };
+
+        /*
+         * Run a query using a statement from the connection's statement
+         * cache.
+         */
+        query(
+                connection& conn,
+                const std::string& sql,
+                const query_parameters_base& params = row<>()
+             ) :
+            m_cached(new cached_statement(conn, sql)),
+            m_stmt(m_cached->get()),
+            m_state(state::not_started)
+        {
+            // The query is stepped after the parameters may have gone.
+            params.bind_to(m_stmt, SQLITE_TRANSIENT);
+        }
+        /*
+         * Run a query using a slide::statement's statement, which has
+         * already been bound.
+         */
+        explicit query(detail::statement_lease&& lease) :
+            m_lease(std::move(lease)),
+            m_stmt(m_lease.get()),
+            m_state(state::not_started)
+        {
+        }
+        query(query&& o) :
+            m_cached(std::move(o.m_cached)),
+            m_lease(std::move(o.m_lease)),
+            m_stmt(o.m_stmt),
+            m_row(std::move(o.m_row)),
+            m_state(o.m_state)
+        {
+            o.m_stmt = nullptr;
+        }
+        /*
+         * Step to the first row.  Can only be called once.
+         */
+        iterator begin()
+        {
+            if(m_state != state::not_started)
+                throw exception("query has already been iterated over");
+            return iterator(next() ? this : nullptr);
+        }
+        iterator end()
+        {
+            return iterator();
+        }
+        /*
+         * Write every row as an array of JSON objects, without holding more
+         * than one row in memory.
+         */
+        template<const char * ...Attributes>
+        std::string to_json()
+        {
+            json_buffer buffer;
+            json_writer writer(buffer.get());
+            writer.raw("[ ", 2);
+            bool first = true;
+            for(const row_type& r : *this)
+            {
+                if(!first)
+                    writer.raw(", ", 2);
+                first = false;
+                r.template write_json<Attributes...>(writer);
+            }
+            writer.raw(" ]", 2);
+            return buffer.get();
+        }
+        /*
+         * Read the remaining rows into a collection.
+         */
+        collection<Types...> to_collection()
+        {
+            collection<Types...> out;
+            for(const row_type& r : *this)
+                out.push_back(r);
+            return out;
+        }
+    private:
+        query(const query&) = delete;
+        query& operator=(const query&) = delete;
+
+        enum class state {not_started, running, finished};
+
+        /*
+         * Step the statement and, if there is another row, read it into
+         * m_row.
+         */
+        bool next()
+        {
+            if(m_state == state::finished)
+                return false;
+            m_state = state::running;
+            if(step(m_stmt) != SQLITE_ROW)
+            {
+                m_state = state::finished;
+                return false;
+            }
+            detail::get_columns(m_stmt, m_row.std_tuple());
+            return true;
+        }
+
+        // The statement is held by one of these, which resets it when the
+        // query is destroyed.
+        std::unique_ptr<cached_statement> m_cached;
+        detail::statement_lease m_lease;
+        sqlite3_stmt *m_stmt;
+        row_type m_row;
+        state m_state;
+    };
+
     /*
      * Get the id of the last inserted row.  This will be the primary key for
      * any relvar that has one.
      */
     int last_insert_rowid(connection&);
+
+    /*
+     * One step in the evolution of a database schema: SQL statements run in
+     * order.  The first migration's statements should be idempotent (CREATE
+     * ... IF NOT EXISTS and the like), so a database created before its
+     * schema was versioned can be brought up to date.  Later migrations only
+     * ever run on a database at the previous version (as migrate applies
+     * them all or none), so they may use statements such as ALTER TABLE ...
+     * ADD COLUMN which cannot be run twice.
+     */
+    struct migration
+    {
+        const char *description;
+        std::vector<const char*> statements;
+    };
+
+    /*
+     * Get the schema version recorded in the database (PRAGMA user_version).
+     */
+    int user_version(connection&);
+    /*
+     * Bring a database up to date with a list of migrations.  The database's
+     * user_version is the number of migrations already applied; the rest are
+     * run in order, in one transaction, and the version set to the number of
+     * migrations.  If any statement fails, nothing is changed.
+     *
+     * Returns the number of migrations applied.  Throws slide::exception if
+     * the database has a newer version than the list describes.
+     */
+    int migrate(connection&, const std::vector<migration>& migrations);
+
+    template<const char *Sql, typename Parameters, typename Columns>
+    class statement;
+
+    /*
+     * A SQL statement known at compile time, with the types of its
+     * parameters and result columns.
+     *
+     * The statement is prepared the first time it is used on each connection
+     * and kept in a slot of the connection reserved for it, so there is no
+     * lookup by SQL text.  When it is prepared, the number of parameters and
+     * columns is checked against the declared types, and an exception thrown
+     * if they differ.
+     *
+     * The SQL must be a constant with linkage, in the same way as the
+     * attribute names given to to_json.
+     *
+     * Example:
+     *
+     * constexpr const char album_name_sql[] =
+     *     "SELECT name FROM album WHERE album_id = ?";
+     * typedef statement<album_name_sql, row<int>, row<std::string>> album_name;
+     * std::string name = album_name::get_row(conn, 7).get<0>();
+     */
+    template<const char *Sql, typename ...Params, typename ...Cols>
+    class statement<Sql, row<Params...>, row<Cols...>>
+    {
+    public:
+        typedef row<Params...> parameters_type;
+        typedef row<Cols...> row_type;
+        typedef collection<Cols...> collection_type;
+
+        /*
+         * Get every row returned by the statement.
+         */
+        static collection<Cols...> get_collection(connection& conn, const Params&... params)
+        {
+            detail::statement_lease lease = prepared(conn);
+            sqlite3_stmt *stmt = lease.get();
+            detail::bind_params<1>(stmt, SQLITE_STATIC, params...);
+
+            collection<Cols...> out;
+            while(step(stmt) == SQLITE_ROW)
+                out.push_back(detail::get_row<Cols...>(stmt));
+            return out;
+        }
+        static collection<Cols...> get_collection(connection& conn, const row<Params...>& params)
+        {
+            detail::statement_lease lease = prepared(conn);
+            sqlite3_stmt *stmt = lease.get();
+            params.bind_to(stmt, SQLITE_STATIC);
+
+            collection<Cols...> out;
+            while(step(stmt) == SQLITE_ROW)
+                out.push_back(detail::get_row<Cols...>(stmt));
+            return out;
+        }
+        /*
+         * Get every row returned by the statement, stored by column.
+         */
+        static column_collection<Cols...> get_column_collection(
+                connection& conn,
+                const Params&... params
+                )
+        {
+            detail::statement_lease lease = prepared(conn);
+            sqlite3_stmt *stmt = lease.get();
+            detail::bind_params<1>(stmt, SQLITE_STATIC, params...);
+
+            column_collection<Cols...> out;
+            while(step(stmt) == SQLITE_ROW)
+                out.read(stmt);
+            return out;
+        }
+        static column_collection<Cols...> get_column_collection(
+                connection& conn,
+                const row<Params...>& params
+                )
+        {
+            detail::statement_lease lease = prepared(conn);
+            sqlite3_stmt *stmt = lease.get();
+            params.bind_to(stmt, SQLITE_STATIC);
+
+            column_collection<Cols...> out;
+            while(step(stmt) == SQLITE_ROW)
+                out.read(stmt);
+            return out;
+        }
+        /*
+         * Run the statement, reading its rows lazily.  If the statement is
+         * run again on the connection while the query is open, a second copy
+         * of the statement is prepared for it.
+         */
+        static query<Cols...> open(connection& conn, const Params&... params)
+        {
+            detail::statement_lease lease = prepared(conn);
+            detail::bind_params<1>(lease.get(), SQLITE_TRANSIENT, params...);
+            return query<Cols...>(std::move(lease));
+        }
+        static query<Cols...> open(connection& conn, const row<Params...>& params)
+        {
+            detail::statement_lease lease = prepared(conn);
+            params.bind_to(lease.get(), SQLITE_TRANSIENT);
+            return query<Cols...>(std::move(lease));
+        }
+        /*
+         * Get the first row returned by the statement.  Throws an exception
+         * if there are no rows.
+         */
+        static row<Cols...> get_row(connection& conn, const Params&... params)
+        {
+            detail::statement_lease lease = prepared(conn);
+            sqlite3_stmt *stmt = lease.get();
+            detail::bind_params<1>(stmt, SQLITE_STATIC, params...);
+
+            if(step(stmt) != SQLITE_ROW)
+                throw exception("no rows returned");
+            return detail::get_row<Cols...>(stmt);
+        }
+        static row<Cols...> get_row(connection& conn, const row<Params...>& params)
+        {
+            detail::statement_lease lease = prepared(conn);
+            sqlite3_stmt *stmt = lease.get();
+            params.bind_to(stmt, SQLITE_STATIC);
+
+            if(step(stmt) != SQLITE_ROW)
+                throw exception("no rows returned");
+            return detail::get_row<Cols...>(stmt);
+        }
+        /*
+         * Execute a statement without a result set, returning the number of
+         * rows changed.
+         */
+        static int devoid(connection& conn, const Params&... params)
+        {
+            static_assert(sizeof...(Cols) == 0, "devoid statements have no columns");
+            detail::statement_lease lease = prepared(conn);
+            sqlite3_stmt *stmt = lease.get();
+            detail::bind_params<1>(stmt, SQLITE_STATIC, params...);
+            step(stmt);
+            return sqlite3_changes(conn.handle());
+        }
+        static int devoid(connection& conn, const row<Params...>& params)
+        {
+            static_assert(sizeof...(Cols) == 0, "devoid statements have no columns");
+            detail::statement_lease lease = prepared(conn);
+            sqlite3_stmt *stmt = lease.get();
+            params.bind_to(stmt, SQLITE_STATIC);
+            step(stmt);
+            return sqlite3_changes(conn.handle());
+        }
+        /*
+         * Execute the statement once for each row of parameters, as an
+         * all_or_nothing batch.
+         */
+        static int devoid(connection& conn, const collection<Params...>& params)
+        {
+            return write_batch(conn, params).changes;
+        }
+        /*
+         * Execute the statement once for each row of parameters.  See
+         * slide::write_batch.
+         */
+        static batch_result write_batch(
+                connection& conn,
+                const collection<Params...>& params,
+                const batch_options& options = batch_options()
+                )
+        {
+            static_assert(sizeof...(Cols) == 0, "batches are written with devoid statements");
+            return slide::write_batch(conn, Sql, params, options);
+        }
+    private:
+        /*
+         * Lease the statement prepared on the connection, preparing it on
+         * first use.  If it is already in use, a separate copy is prepared.
+         */
+        static detail::statement_lease prepared(connection& conn)
+        {
+            static const std::size_t slot = detail::next_statement_slot();
+            connection::statement_slot_entry& entry = conn.statement_slot(slot);
+            if(entry.stmt == nullptr)
+                entry.stmt = prepare_checked(conn);
+            else if(entry.in_use)
+                return detail::statement_lease(prepare_checked(conn));
+            return detail::statement_lease(conn, slot);
+        }
+        /*
+         * Prepare the statement, checking its parameters and columns against
+         * the declared types.
+         */
+        static sqlite3_stmt *prepare_checked(connection& conn)
+        {
+            sqlite3_stmt *s = prepare(conn, Sql);
+            const int n_columns = sqlite3_column_count(s);
+            const int n_params = sqlite3_bind_parameter_count(s);
+            if(
+                    n_columns != static_cast<int>(sizeof...(Cols)) ||
+                    n_params != static_cast<int>(sizeof...(Params))
+              )
+            {
+                sqlite3_finalize(s);
+                throw exception(
+                    mkstr() << "statement \"" << Sql << "\" has " <<
+                        n_params << " parameters and " << n_columns <<
+                        " columns, but was declared with " <<
+                        sizeof...(Params) << " and " << sizeof...(Cols)
+                    );
+            }
+            return s;
+        }
+    };
 }
 
 #endif
@@ -1,14 +1,30 @@
 #ifndef WEBSERVER_HPP
 #define WEBSERVER_HPP
 
+#include <chrono>
+#include <functional>
+#include <map>
 #include <memory>
 #include <microhttpd.h>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
 namespace webserver
 {
     std::size_t matching_length(const std::string& a, const std::string& b);
 
+    /*
+     * Make a strong entity tag (including the surrounding quotes) from a hash
+     * of some content.
+     */
+    std::string content_etag(const char *data, std::size_t length);
+    /*
+     * Check whether the request's If-None-Match header matches an entity tag,
+     * meaning the client's cached copy is current.
+     */
+    bool if_none_match(struct MHD_Connection *connection, const std::string& etag);
+
     /*
      * An exception with information that can be displayed to the client.
      */
@@ -22,9 +38,74 @@ namespace webserver
             }
     };
 
+    /*
+     * Thrown when a request cannot be served because the server is too busy.
+     * The client is answered with 503 (Service Unavailable) and asked to try
+     * again shortly.
+     */
+    class service_unavailable :
+        public std::runtime_error
+    {
+        public:
+            service_unavailable(const std::string& message) :
+                std::runtime_error(message)
+            {
+            }
+    };
+
+    /*
+     * Classes of request, by the cost of serving them.  The number of requests
+     * of each class served at once is limited, both overall and for each
+     * client (see set_admission_limit).  Uncounted requests are never
+     * limited.
+     */
+    enum class cost_class
+    {
+        uncounted,
+        json,
+        cached_image,
+        thumbnail
+    };
+
+    /*
+     * The URL and method served by a request function, used to index the
+     * function in the route table.  When prefix is true, the function also
+     * serves every URL below this one (that is, the URL followed by a forward
+     * slash and a parameter); otherwise only an exact match is served.
+     */
+    struct route
+    {
+        std::string url;
+        std::string method;
+        bool prefix;
+    };
+
     class request_function
     {
         public:
+            virtual ~request_function()
+            {
+            }
+            /*
+             * Describe the URLs served by this request function.  Returns
+             * false if the function cannot be described by a single route,
+             * in which case match_strength is called for every request
+             * instead.
+             */
+            virtual bool get_route(route& /*r*/) const
+            {
+                return false;
+            }
+            /*
+             * Get the cost class of requests served by this function.  A
+             * request is only passed to the function once a slot for its
+             * class is free; if none becomes free in time, the client is
+             * answered with 503 (Service Unavailable).
+             */
+            virtual cost_class cost() const
+            {
+                return cost_class::uncounted;
+            }
             /*
              * Judge the strength of a match allowing this request function to
              * handle a request for a given URL and method.  Higher numbers
@@ -46,6 +127,16 @@ namespace webserver
                     size_t *upload_data_size,
                     void **con_cls
                     ) = 0;
+            /*
+             * Called once MicroHTTPD has finished with a request, whether or
+             * not a response was sent, with the con_cls value left by the
+             * last call to operator() (possibly nullptr).  Any per-request
+             * state must be freed here, so that requests aborted by the
+             * client do not leak it.
+             */
+            virtual void request_completed(void */*con_cls*/)
+            {
+            }
     };
 
     typedef std::unique_ptr<request_function> request_function_ptr;
@@ -73,10 +164,12 @@ namespace webserver
                     std::string mimetype = "application/json"
                     );
             /*
-             * Allow a match when the base URL is contained within the incoming
-             * URL and the method matches exactly.
+             * Allow a match when the incoming URL is the base URL or below
+             * it (the base URL followed by a forward slash), as in the route
+             * table, and the method matches exactly.
              */
             int match_strength(const char *url, const char *method) override;
+            bool get_route(route& r) const override;
             int operator()(
                     void *cls,
                     struct MHD_Connection *connection,
@@ -87,33 +180,153 @@ namespace webserver
                     size_t *upload_data_size,
                     void **con_cls
                     ) override;
+            void request_completed(void *con_cls) override;
+            cost_class cost() const override;
         private:
             const std::string m_url;
             const std::string m_method;
             const std::string m_mimetype;
             const function_type m_function;
     };
+    /*
+     * The size of content that is not known until it has all been produced.
+     */
+    const uint64_t unknown_size = MHD_SIZE_UNKNOWN;
+
+    /*
+     * A source of response data, read in pieces as the response is sent to
+     * the client.
+     */
+    class content_reader
+    {
+        public:
+            virtual ~content_reader()
+            {
+            }
+            /*
+             * The total size of the content in bytes, or unknown_size.
+             * Content of unknown size is sent with chunked transfer encoding
+             * (to HTTP/1.1 clients), and ends at the first read returning
+             * zero.
+             */
+            virtual uint64_t size() const = 0;
+            /*
+             * Copy up to max bytes of content, starting at pos, into buf.
+             * Return the number of bytes copied.  Reads are always
+             * sequential.
+             */
+            virtual std::size_t read(uint64_t pos, char *buf, std::size_t max) = 0;
+    };
+
+    typedef std::unique_ptr<content_reader> content_reader_ptr;
+
+    /*
+     * Respond to a GET request by streaming content from a content_reader.
+     *
+     * The URL parameter is obtained in the same way as for
+     * text_request_function.  The content reader is created for each request
+     * and data is read from it into a fixed size buffer as the client is
+     * ready to receive it, so the whole response is never held in memory.
+     */
+    class stream_request_function : public request_function
+    {
+        public:
+            typedef std::function<content_reader_ptr(const std::string&)> function_type;
+            typedef std::function<std::string(const std::string&)> etag_function_type;
+            /*
+             * If etag_fn is given, it is called with the URL parameter to get
+             * the entity tag of the content.  A request with a matching
+             * If-None-Match header is answered with 304 Not Modified without
+             * calling fn.  The cache_control string, if not empty, is sent as
+             * the Cache-Control header.
+             *
+             * If accept_ranges is true, Range requests are honoured, with a
+             * single range answered by 206 Partial Content and several by a
+             * multipart/byteranges body.  Only the requested bytes are read
+             * from the content reader.  Ranges are never honoured for
+             * content of unknown size.
+             *
+             * Requests are admitted as the given cost class.
+             */
+            stream_request_function(
+                    const std::string& url,
+                    function_type fn,
+                    std::string mimetype = "application/octet-stream",
+                    etag_function_type etag_fn = etag_function_type(),
+                    std::string cache_control = "",
+                    bool accept_ranges = false,
+                    cost_class cost = cost_class::cached_image
+                    );
+            /*
+             * Allow a match when the incoming URL is the base URL or below
+             * it, as in the route table, and the method is "GET".
+             */
+            int match_strength(const char *url, const char *method) override;
+            bool get_route(route& r) const override;
+            int operator()(
+                    void *cls,
+                    struct MHD_Connection *connection,
+                    const char *url,
+                    const char *method,
+                    const char *version,
+                    const char *upload_data,
+                    size_t *upload_data_size,
+                    void **con_cls
+                    ) override;
+            cost_class cost() const override;
+        private:
+            const std::string m_url;
+            const std::string m_mimetype;
+            const function_type m_function;
+            const etag_function_type m_etag_function;
+            const std::string m_cache_control;
+            const bool m_accept_ranges;
+            const cost_class m_cost;
+    };
     /*
      * A request function serving static data.
+     *
+     * The data may also be provided precompressed with any number of content
+     * codings.  One response is prepared for each coding when the request
+     * function is created, and each request is answered with the smallest
+     * one the client accepts (according to its Accept-Encoding header), so no
+     * compression is done while serving.
      */
     class static_request_function : public request_function
     {
         public:
+            /*
+             * Map of content coding (for example "gzip" or "br") to the
+             * content encoded with that coding.
+             */
+            typedef std::map<std::string, std::string> encodings_type;
             /*
              * Prepare a static response to send to clients.
              * The url, content string and mimetype are all copied into the
-             * object.
+             * object.  An entity tag is computed from the content so that
+             * clients can revalidate their cached copy.
              */
             static_request_function(
                     const std::string& url,
                     const std::string& content,
                     const std::string mimetype = "text/html"
                     );
+            /*
+             * Prepare a static response with precompressed variants.  Empty
+             * entries in the encodings map are ignored.
+             */
+            static_request_function(
+                    const std::string& url,
+                    const std::string& content,
+                    const encodings_type& encodings,
+                    const std::string mimetype = "text/html"
+                    );
             ~static_request_function();
             /*
              * An exact URL match is required.  The method must be "GET".
              */
             int match_strength(const char *url, const char *method) override;
+            bool get_route(route& r) const override;
             int operator()(
                     void */*cls*/,
                     struct MHD_Connection *connection,
@@ -125,19 +338,154 @@ namespace webserver
                     void **/*con_cls*/
                     ) override;
         private:
+            /*
+             * The content encoded with one content coding, with a response
+             * and a 304 Not Modified response ready to send.
+             */
+            struct variant
+            {
+                std::string coding;
+                std::size_t size;
+                std::string etag;
+                MHD_Response *response;
+                MHD_Response *not_modified_response;
+            };
+
+            void add_variant(
+                    const std::string& coding,
+                    const std::string& content,
+                    const std::string& mimetype
+                    );
+            /*
+             * Choose the variant to send in response to a request.
+             */
+            const variant& select_variant(struct MHD_Connection *connection) const;
+
             const std::string m_url;
-            MHD_Response *m_response;
+            // Variants in order of increasing size.  The first variant added
+            // is the unencoded content.
+            std::vector<variant> m_variants;
+    };
+    /*
+     * Index of request functions by method and URL path segments.
+     *
+     * The table is a trie per method, with one level for each segment of the
+     * path.  A lookup walks the segments of the request URL once, remembering
+     * the deepest function accepting URLs below it, so finding the longest
+     * matching route does not depend on the number of routes installed.
+     */
+    class route_table
+    {
+        public:
+            route_table();
+            ~route_table();
+            /*
+             * Add a request function to the table.  Where two functions have
+             * exactly the same route, the one inserted first is preferred.
+             */
+            void insert(const route& r, request_function *fn);
+            /*
+             * Find the request function with the longest route matching the
+             * URL and method.  Returns nullptr if there is no match, otherwise
+             * sets strength to the length of the matching route's URL.
+             */
+            request_function *find(
+                    const char *url,
+                    const char *method,
+                    int& strength
+                    ) const;
+            void clear();
+        private:
+            struct node;
+            // The children of the root are keyed by method, and below that
+            // by path segment.
+            std::unique_ptr<node> m_root;
+            unsigned m_next_order;
     };
 
+    /*
+     * Queue a response to the current request.  Request functions should use
+     * this instead of MHD_queue_response, so that the status code and size
+     * (in bytes) of the response body can be recorded in the access log.
+     */
+    int queue_response(
+            struct MHD_Connection *connection,
+            unsigned int status_code,
+            struct MHD_Response *response,
+            uint64_t size
+            );
+
     /*
      * Install a request function that will be used to serve requests for which
      * its match_strength function is highest.
+     *
+     * Request functions describing their route are indexed in the route table
+     * when installed; all request functions must be installed before the
+     * server is started.
      */
     void install_request_function(std::unique_ptr<request_function>&&);
     /*
      * Start the web server.  Has no effect if the server is already running.
+     *
+     * When threads is zero, MicroHTTPD runs in thread-per-connection mode.
+     * Otherwise a fixed pool of that many worker threads is started, each
+     * multiplexing its connections with epoll (or select where epoll is not
+     * available), so the number of threads does not grow with the number of
+     * open sockets.
      */
-    void start_server(uint16_t port);
+    void start_server(uint16_t port, unsigned threads = 0);
+    /*
+     * Set the largest request body, in bytes, accepted by text request
+     * functions (and by other request functions which check max_body_size).
+     * Larger requests are refused with status 413 (Request Entity Too
+     * Large).  The default is 1 MiB.
+     */
+    void set_max_body_size(std::size_t size);
+    std::size_t max_body_size();
+    /*
+     * Set the number of requests of a cost class which can be served at
+     * once, in total and for each client (identified by IP address).
+     */
+    void set_admission_limit(cost_class c, unsigned global, unsigned per_client);
+    /*
+     * Set how long a request waits for a slot before being refused with 503
+     * (Service Unavailable).  The default is half a second.  When the server
+     * runs a pool of worker threads, a waiting request's connection is
+     * suspended, so the worker carries on serving its other connections.
+     */
+    void set_admission_wait(std::chrono::milliseconds wait);
+    /*
+     * Set a function called on the serving thread after every call to a
+     * request function, to release anything held for the duration of the
+     * call (such as a pooled database connection).  It must not throw.  Must
+     * be set before the server is started.
+     */
+    void set_request_cleanup(std::function<void()> fn);
+
+    /*
+     * A slot for work of the given cost class, held on behalf of the client
+     * of the request being served on this thread until the ticket is
+     * destroyed.  This limits costly work that is only discovered while
+     * serving a request, such as generating a thumbnail.  The request gives
+     * up the slot it was admitted with when it takes a ticket, so it never
+     * holds slots of two classes at once.
+     *
+     * Throws service_unavailable if no slot becomes free in time.  When the
+     * server runs a pool of worker threads, the request function cannot be
+     * suspended, so it is thrown at once if no slot is free.
+     */
+    class admission_ticket
+    {
+        public:
+            explicit admission_ticket(cost_class c);
+            ~admission_ticket();
+        private:
+            admission_ticket(const admission_ticket&) = delete;
+            admission_ticket& operator=(const admission_ticket&) = delete;
+
+            const cost_class m_class;
+            const uint64_t m_client;
+    };
     /*
      * Stop the web server.  Has no effect if the sevrer is not running.
      */
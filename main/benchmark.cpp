@@ -0,0 +1,1020 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "schema.hpp"
+#include "slide.hpp"
+#include "webserver.hpp"
+
+namespace
+{
+    /*
+     * Prevent the compiler from discarding the results of benchmarked code.
+     */
+    volatile std::size_t g_sink = 0;
+
+    /*
+     * Call fn the given number of times and report the mean time per call.
+     */
+    template<typename Function>
+    void measure(const std::string& name, const std::size_t iterations, Function fn)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        for(std::size_t i = 0; i < iterations; ++i)
+            fn(i);
+        const auto end = std::chrono::steady_clock::now();
+        const double ns = static_cast<double>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()
+                );
+        std::cout << name << ": " << (ns / static_cast<double>(iterations)) <<
+            " ns per call" << std::endl;
+    }
+
+    std::string no_op(const std::string&, const std::string&)
+    {
+        return "";
+    }
+
+    /*
+     * Request function matching as it was before the route table: each
+     * request function was asked for its match strength in turn, copying the
+     * URL into a std::string to compare it.  Copied here from the original
+     * webserver.cpp so the route table is measured against it.
+     */
+    class baseline_function
+    {
+        public:
+            virtual ~baseline_function()
+            {
+            }
+            virtual int match_strength(const char *url, const char *method) = 0;
+    };
+
+    std::size_t baseline_matching_length(const std::string& a, const std::string& b)
+    {
+        for(std::size_t i = 0; i < std::min(a.length(), b.length()); ++i)
+            if(a[i] != b[i])
+                return i;
+        return std::min(a.length(), b.length());
+    }
+
+    class baseline_text_function : public baseline_function
+    {
+        public:
+            baseline_text_function(const std::string& url, const std::string& method) :
+                m_url(url),
+                m_method(method)
+            {
+            }
+            int match_strength(const char *url, const char *method) override
+            {
+                if(m_method != method)
+                    return 0;
+                const std::size_t ml = baseline_matching_length(m_url, url);
+                if(ml >= m_url.length())
+                    return static_cast<int>(ml);
+                return 0;
+            }
+        private:
+            const std::string m_url;
+            const std::string m_method;
+    };
+
+    class baseline_static_function : public baseline_function
+    {
+        public:
+            explicit baseline_static_function(const std::string& url) :
+                m_url(url)
+            {
+            }
+            int match_strength(const char *url, const char *method) override
+            {
+                return (m_url == url && std::string(method) == "GET") ?
+                    static_cast<int>(m_url.length()) : 0;
+            }
+        private:
+            const std::string m_url;
+    };
+
+    /*
+     * Compare finding the request function for a URL using the route table
+     * with the original linear match_strength scan.
+     */
+    void benchmark_dispatch()
+    {
+        std::vector<std::unique_ptr<baseline_function>> baseline;
+        std::vector<webserver::request_function_ptr> functions;
+        const char *static_urls[] = {
+            "/", "/albums.html", "/application.js", "/backbone.js", "/grid.css",
+            "/index.html", "/jquery.js", "/modal.css", "/modal.js",
+            "/months.html", "/photograph.html", "/style.css", "/tags.html",
+            "/teletype-theme.css", "/underscore.js", "/views.js"
+        };
+        for(const char *url : static_urls)
+        {
+            functions.push_back(
+                    webserver::request_function_ptr(
+                        new webserver::static_request_function(url, "")
+                        )
+                    );
+            baseline.push_back(
+                    std::unique_ptr<baseline_function>(new baseline_static_function(url))
+                    );
+        }
+        const char *text_routes[][2] = {
+            { "/api/album", "GET" }, { "/api/photograph_album", "GET" },
+            { "/api/photograph_album", "PUT" }, { "/api/photograph_tag", "GET" },
+            { "/api/photograph_tag", "PUT" }, { "/api/album_photograph", "GET" },
+            { "/api/album_photograph/uncategorised", "GET" },
+            { "/api/album", "PUT" }, { "/api/album", "POST" },
+            { "/api/album", "DELETE" }, { "/api/photograph", "GET" },
+            { "/api/photograph", "PUT" }, { "/photograph/small", "GET" },
+            { "/photograph/medium", "GET" }, { "/photograph/original", "GET" },
+            { "/api/photograph", "DELETE" }, { "/api/tag", "GET" },
+            { "/api/tag_photograph", "GET" }, { "/api/year", "GET" },
+            { "/api/month", "GET" }
+        };
+        for(const auto& r : text_routes)
+        {
+            functions.push_back(
+                    webserver::request_function_ptr(
+                        new webserver::text_request_function(r[0], r[1], no_op)
+                        )
+                    );
+            baseline.push_back(
+                    std::unique_ptr<baseline_function>(new baseline_text_function(r[0], r[1]))
+                    );
+        }
+
+        webserver::route_table table;
+        for(const webserver::request_function_ptr& fn : functions)
+        {
+            webserver::route r;
+            if(fn->get_route(r))
+                table.insert(r, fn.get());
+        }
+
+        const char *requests[][2] = {
+            { "/photograph/small/1234", "GET" },
+            { "/api/album_photograph/12", "GET" },
+            { "/api/album_photograph/uncategorised", "GET" },
+            { "/jquery.js", "GET" },
+            { "/api/photograph_tag/99", "PUT" },
+            { "/not/found", "GET" }
+        };
+        const std::size_t n_requests = sizeof(requests) / sizeof(requests[0]);
+        const std::size_t iterations = 1000000;
+
+        std::cout << "Dispatch over " << functions.size() << " request functions" <<
+            std::endl;
+        measure(
+                "linear match_strength scan (original)",
+                iterations,
+                [&baseline, &requests, n_requests](const std::size_t i)
+                {
+                    const char *url = requests[i % n_requests][0];
+                    const char *method = requests[i % n_requests][1];
+                    baseline_function *best = nullptr;
+                    int best_match = 0;
+                    for(const std::unique_ptr<baseline_function>& fn : baseline)
+                    {
+                        const int strength = fn->match_strength(url, method);
+                        if(strength > 0 && strength > best_match)
+                        {
+                            best = fn.get();
+                            best_match = strength;
+                        }
+                    }
+                    g_sink += reinterpret_cast<std::size_t>(best);
+                }
+                );
+        measure(
+                "route table",
+                iterations,
+                [&table, &requests, n_requests](const std::size_t i)
+                {
+                    int strength = 0;
+                    g_sink += reinterpret_cast<std::size_t>(
+                            table.find(
+                                requests[i % n_requests][0],
+                                requests[i % n_requests][1],
+                                strength
+                                )
+                            );
+                }
+                );
+    }
+
+    /*
+     * Time the calling thread's cost of logging a request, with the log
+     * written to /dev/null.  Records are drained between batches, outside of
+     * the timed section, so that none are dropped.
+     */
+    void benchmark_logging()
+    {
+        if(std::freopen("/dev/null", "w", stderr) == nullptr)
+            return;
+
+        const std::size_t batches = 10000;
+        const std::size_t batch_size = 100;
+        std::chrono::nanoseconds access_time(0), info_time(0), cerr_time(0);
+        for(std::size_t b = 0; b < batches; ++b)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for(std::size_t i = 0; i < batch_size; ++i)
+                logger::access("GET", "/photograph/small/1234", 200, 24576, i);
+            access_time += std::chrono::steady_clock::now() - start;
+            logger::flush();
+
+            start = std::chrono::steady_clock::now();
+            for(std::size_t i = 0; i < batch_size; ++i)
+                logger::info() << "request (stream) GET /photograph/small/1234 " << i;
+            info_time += std::chrono::steady_clock::now() - start;
+            logger::flush();
+
+            start = std::chrono::steady_clock::now();
+            for(std::size_t i = 0; i < batch_size; ++i)
+                std::cerr << "request (stream) GET /photograph/small/1234 " << i << std::endl;
+            cerr_time += std::chrono::steady_clock::now() - start;
+        }
+
+        const double calls = static_cast<double>(batches * batch_size);
+        std::cout << "Logging a request (output to /dev/null)" << std::endl;
+        std::cout << "logger::access: " <<
+            (static_cast<double>(access_time.count()) / calls) << " ns per call" <<
+            std::endl;
+        std::cout << "logger::info: " <<
+            (static_cast<double>(info_time.count()) / calls) << " ns per call" <<
+            std::endl;
+        std::cout << "std::cerr with std::endl: " <<
+            (static_cast<double>(cerr_time.count()) / calls) << " ns per call" <<
+            std::endl;
+        std::cout << "dropped records: " << logger::dropped() << std::endl;
+    }
+
+    /*
+     * Compare recording a request in sharded metrics with incrementing a
+     * single shared atomic counter, from several threads at once.
+     */
+    void benchmark_metrics()
+    {
+        const std::size_t n_threads = 4;
+        const std::size_t iterations = 1000000;
+
+        auto run_threads = [n_threads](const std::string& name, std::function<void()> fn)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> threads;
+            for(std::size_t i = 0; i < n_threads; ++i)
+                threads.push_back(std::thread(fn));
+            for(std::thread& t : threads)
+                t.join();
+            const double ns = static_cast<double>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start
+                        ).count()
+                    );
+            std::cout << name << ": " <<
+                (ns / static_cast<double>(iterations)) << " ns per call" <<
+                std::endl;
+        };
+
+        std::cout << "Recording a request on " << n_threads << " threads" <<
+            std::endl;
+        metrics::endpoint& endpoint = metrics::add_endpoint("/benchmark", "GET");
+        run_threads(
+                "sharded endpoint metrics",
+                [&endpoint, iterations]()
+                {
+                    for(std::size_t i = 0; i < iterations; ++i)
+                        endpoint.record(200, 1024, i % 5000);
+                }
+                );
+        metrics::counter sharded;
+        run_threads(
+                "sharded counter",
+                [&sharded, iterations]()
+                {
+                    for(std::size_t i = 0; i < iterations; ++i)
+                        sharded.add();
+                }
+                );
+        std::atomic<uint64_t> shared(0);
+        run_threads(
+                "single shared atomic counter",
+                [&shared, iterations]()
+                {
+                    for(std::size_t i = 0; i < iterations; ++i)
+                        shared.fetch_add(1, std::memory_order_relaxed);
+                }
+                );
+        g_sink += static_cast<std::size_t>(sharded.value() + shared.load());
+    }
+
+    constexpr const char attr_id[] = "id";
+    constexpr const char attr_title[] = "title";
+    constexpr const char attr_taken[] = "taken";
+
+    /*
+     * Create a photograph table holding n photographs with ids from zero,
+     * all with the same title.
+     */
+    /*
+     * A database file with a unique name, removed along with its journal
+     * when the benchmark finishes.
+     */
+    class temporary_database
+    {
+        public:
+            temporary_database()
+            {
+                char name[] = "/tmp/slide_benchmark_XXXXXX";
+                const int fd = mkstemp(name);
+                if(fd == -1)
+                    throw std::runtime_error("creating a temporary database");
+                close(fd);
+                filename = name;
+            }
+            ~temporary_database()
+            {
+                remove();
+            }
+
+            /*
+             * Remove the database and its journal, so it can be created
+             * again empty.
+             */
+            void remove()
+            {
+                for(const char *suffix : {"", "-journal", "-wal", "-shm"})
+                    std::remove((filename + suffix).c_str());
+            }
+
+            std::string filename;
+        private:
+            temporary_database(const temporary_database&) = delete;
+            temporary_database& operator=(const temporary_database&) = delete;
+    };
+
+    void fill_photographs(slide::connection& conn, const int n, const std::string& title)
+    {
+        slide::devoid(
+                "CREATE TABLE photograph ("
+                " photograph_id INTEGER PRIMARY KEY, title VARCHAR, taken VARCHAR"
+                ")",
+                conn
+                );
+        slide::transaction tr(conn, "benchmark");
+        for(int i = 0; i < n; ++i)
+            slide::devoid(
+                    "INSERT INTO photograph(photograph_id, title, taken) "
+                    "VALUES(?, ?, ?)",
+                    slide::row<int, std::string, std::string>::make_row(
+                        i, title, "2015-06-01T12:00:00"
+                        ),
+                    conn
+                    );
+        tr.commit();
+    }
+
+    constexpr const char photograph_by_id_sql[] =
+        "SELECT title, taken FROM photograph WHERE photograph_id = ?";
+    typedef slide::statement<
+        photograph_by_id_sql,
+        slide::row<int>,
+        slide::row<std::string, std::string>
+        > photograph_by_id;
+
+    /*
+     * Compare running a small query with its statement prepared afresh each
+     * time, taken from the connection's statement cache, and held by a typed
+     * statement.
+     */
+    void benchmark_statement_cache()
+    {
+        slide::connection conn = slide::connection::in_memory_database();
+        fill_photographs(conn, 1000, "title");
+
+        auto query = [&conn](const std::size_t i)
+        {
+            g_sink += slide::get_row<std::string, std::string>(
+                    conn,
+                    "SELECT title, taken FROM photograph WHERE photograph_id = ?",
+                    slide::row<int>::make_row(static_cast<int>(i % 1000))
+                    ).get<0>().length();
+        };
+
+        const std::size_t iterations = 200000;
+        std::cout << "Single row query by primary key" << std::endl;
+        conn.set_statement_cache_capacity(0);
+        measure("prepared on every call", iterations, query);
+        conn.set_statement_cache_capacity(64);
+        measure("statement cache", iterations, query);
+        measure(
+                "typed statement",
+                iterations,
+                [&conn](const std::size_t i)
+                {
+                    g_sink += photograph_by_id::get_row(
+                            conn,
+                            static_cast<int>(i % 1000)
+                            ).get<0>().length();
+                }
+               );
+    }
+
+    /*
+     * Compare opening a connection for each request, as a new thread did,
+     * with checking one out of a connection pool, whose statement cache and
+     * page cache are already warm.
+     */
+    void benchmark_connection_pool()
+    {
+        const temporary_database db;
+        const std::string& filename = db.filename;
+        {
+            slide::connection conn(filename);
+            fill_photographs(conn, 1000, "title");
+        }
+
+        // A request reading a few photographs.
+        auto request = [](slide::connection& conn, const std::size_t i)
+        {
+            std::size_t length = 0;
+            for(std::size_t j = 0; j < 10; ++j)
+                length += photograph_by_id::get_row(
+                        conn,
+                        static_cast<int>((i * 10 + j) % 1000)
+                        ).get<0>().length();
+            g_sink += length;
+        };
+
+        const std::size_t iterations = 10000;
+        std::cout << "Requests reading ten photographs" << std::endl;
+        measure(
+                "connection per request",
+                iterations,
+                [&filename, &request](const std::size_t i)
+                {
+                    slide::connection conn(filename);
+                    request(conn, i);
+                }
+               );
+        slide::connection_pool pool(filename, 4);
+        measure(
+                "pooled connection",
+                iterations,
+                [&pool, &request](const std::size_t i)
+                {
+                    slide::connection_pool::handle conn = pool.acquire();
+                    request(*conn, i);
+                }
+               );
+    }
+
+    /*
+     * Compare several threads each committing their own small writes, as
+     * request threads did, with queueing them for a writer thread which
+     * commits them in groups.
+     */
+    void benchmark_write_queue()
+    {
+        temporary_database db;
+        const std::string& filename = db.filename;
+        const std::size_t n_threads = 8;
+        const int writes = 200;
+        const slide::connection_options options =
+            slide::connection_options::profile("raspberry-pi");
+
+        auto run_threads = [n_threads, writes](
+                const std::string& name,
+                std::function<void(int)> fn
+                )
+        {
+            const auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> threads;
+            for(std::size_t i = 0; i < n_threads; ++i)
+                threads.push_back(std::thread(fn, static_cast<int>(i)));
+            for(std::thread& t : threads)
+                t.join();
+            const double us = static_cast<double>(
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start
+                        ).count()
+                    );
+            std::cout << name << ": " <<
+                (us / static_cast<double>(n_threads * writes)) << " us per write" <<
+                std::endl;
+        };
+        auto create = [&db, &filename, &options]()
+        {
+            db.remove();
+            slide::connection conn(filename, options);
+            slide::devoid(
+                    "CREATE TABLE star (photograph_id INTEGER PRIMARY KEY, starred INTEGER)",
+                    conn
+                    );
+        };
+        auto star = [](slide::connection& conn, const int photograph_id)
+        {
+            slide::devoid(
+                    "INSERT INTO star(photograph_id, starred) VALUES (?, 1)",
+                    slide::row<int>::make_row(photograph_id),
+                    conn
+                    );
+        };
+
+        std::cout << "Starring photographs on " << n_threads << " threads" <<
+            std::endl;
+        create();
+        run_threads(
+                "a transaction per write",
+                [&filename, &options, &star, writes](const int thread)
+                {
+                    slide::connection conn(filename, options);
+                    for(int i = 0; i < writes; ++i)
+                    {
+                        slide::transaction tr(conn, "star");
+                        star(conn, thread * writes + i);
+                        tr.commit();
+                    }
+                }
+                );
+        create();
+        {
+            slide::write_queue writer(filename, options);
+            run_threads(
+                    "write queue",
+                    [&writer, &star, writes](const int thread)
+                    {
+                        for(int i = 0; i < writes; ++i)
+                            writer.submit(
+                                    [&star, thread, writes, i](slide::connection& conn)
+                                    {
+                                        star(conn, thread * writes + i);
+                                    }
+                                    ).get();
+                    }
+                    );
+        }
+    }
+
+    /*
+     * Compare storing an uploaded photograph with SQLite copying the bound
+     * BLOB and binding it in place.
+     */
+    void benchmark_blob_insert()
+    {
+        slide::connection conn = slide::connection::in_memory_database();
+        slide::devoid(
+                "CREATE TABLE jpeg_data (photograph_id INTEGER PRIMARY KEY, data BLOB)",
+                conn
+                );
+        const std::vector<unsigned char> jpeg(4 * 1024 * 1024, 0xff);
+
+        const std::size_t iterations = 200;
+        std::cout << "Storing a 4 MiB BLOB" << std::endl;
+        for(const bool copy : {true, false})
+            measure(
+                    copy ? "SQLITE_TRANSIENT" : "SQLITE_STATIC",
+                    iterations,
+                    [&conn, &jpeg, copy](const std::size_t)
+                    {
+                        slide::cached_statement stmt(
+                                conn,
+                                "INSERT OR REPLACE INTO jpeg_data(photograph_id, data) "
+                                "VALUES(1, ?)"
+                                );
+                        slide::detail::bind_value(
+                                jpeg,
+                                1,
+                                stmt.get(),
+                                copy ? SQLITE_TRANSIENT : SQLITE_STATIC
+                                );
+                        slide::step(stmt.get());
+                    }
+                   );
+    }
+
+    /*
+     * Compare reading a large result set into a collection and into a
+     * column_collection, and scanning one column of each.
+     */
+    void benchmark_column_collection()
+    {
+        slide::connection conn = slide::connection::in_memory_database();
+        fill_photographs(
+                conn,
+                100000,
+                "A longer photograph title, long enough not to be stored inline"
+                );
+        const std::string sql = "SELECT photograph_id, title, taken FROM photograph";
+
+        std::cout << "Reading 100000 rows" << std::endl;
+        measure(
+                "get_collection",
+                20,
+                [&conn, &sql](const std::size_t)
+                {
+                    g_sink += slide::get_collection<int, std::string, std::string>(conn, sql)
+                        .size();
+                }
+               );
+        measure(
+                "get_column_collection",
+                20,
+                [&conn, &sql](const std::size_t)
+                {
+                    g_sink += slide::get_column_collection<int, std::string, std::string>(conn, sql)
+                        .size();
+                }
+               );
+
+        const slide::collection<int, std::string, std::string> rows =
+            slide::get_collection<int, std::string, std::string>(conn, sql);
+        const slide::column_collection<int, std::string, std::string> columns =
+            slide::get_column_collection<int, std::string, std::string>(conn, sql);
+        std::cout << "Summing the ids of 100000 rows" << std::endl;
+        measure(
+                "collection",
+                1000,
+                [&rows](const std::size_t)
+                {
+                    std::size_t sum = 0;
+                    for(const slide::row<int, std::string, std::string>& r : rows)
+                        sum += static_cast<std::size_t>(r.get<0>());
+                    g_sink += sum;
+                }
+               );
+        measure(
+                "column_collection",
+                1000,
+                [&columns](const std::size_t)
+                {
+                    std::size_t sum = 0;
+                    for(const int id : columns.column<0>())
+                        sum += static_cast<std::size_t>(id);
+                    g_sink += sum;
+                }
+               );
+    }
+
+    /*
+     * Compare inserting rows one statement at a time, as a batch with one
+     * prepared statement, and as a batch inserting many rows per statement.
+     */
+    void benchmark_write_batch()
+    {
+        slide::connection conn = slide::connection::in_memory_database();
+        slide::devoid(
+                "CREATE TABLE photograph_tagged ("
+                " photograph_id INTEGER, tag VARCHAR, PRIMARY KEY (photograph_id, tag)"
+                ")",
+                conn
+                );
+        const std::string sql =
+            "INSERT INTO photograph_tagged(photograph_id, tag) VALUES(?, ?)";
+        slide::collection<int, std::string> rows;
+        rows.reserve(100000);
+        for(int i = 0; i < 100000; ++i)
+            rows.emplace_back(i / 10, slide::mkstr() << "tag " << (i % 10));
+
+        const std::size_t iterations = 5;
+        std::cout << "Inserting 100000 rows" << std::endl;
+        measure(
+                "devoid for each row",
+                iterations,
+                [&conn, &sql, &rows](const std::size_t)
+                {
+                    slide::devoid("DELETE FROM photograph_tagged", conn);
+                    slide::transaction tr(conn, "benchmark");
+                    for(const slide::row<int, std::string>& r : rows)
+                        slide::devoid(sql, r, conn);
+                    tr.commit();
+                }
+               );
+        for(const bool multi_row : {false, true})
+            measure(
+                    multi_row ? "write_batch, multi-row" : "write_batch",
+                    iterations,
+                    [&conn, &sql, &rows, multi_row](const std::size_t)
+                    {
+                        slide::devoid("DELETE FROM photograph_tagged", conn);
+                        g_sink += static_cast<std::size_t>(
+                                slide::write_batch(
+                                    conn,
+                                    sql,
+                                    rows,
+                                    slide::batch_options(slide::batch_mode::all_or_nothing, multi_row)
+                                    ).changes
+                                );
+                    }
+                   );
+    }
+
+    /*
+     * Compare writing a large result set as JSON from a collection, which
+     * holds every row, and from a query, which holds one row at a time.
+     */
+    void benchmark_query_to_json()
+    {
+        slide::connection conn = slide::connection::in_memory_database();
+        fill_photographs(conn, 10000, "A photograph title");
+
+        const std::string sql = "SELECT photograph_id, title, taken FROM photograph";
+        const std::size_t iterations = 20;
+        std::cout << "Writing 10000 rows as JSON" << std::endl;
+        measure(
+                "get_collection then to_json",
+                iterations,
+                [&conn, &sql](const std::size_t)
+                {
+                    g_sink += slide::get_collection<int, std::string, std::string>(conn, sql)
+                        .to_json<attr_id, attr_title, attr_taken>().length();
+                }
+               );
+        measure(
+                "query to_json",
+                iterations,
+                [&conn, &sql](const std::size_t)
+                {
+                    g_sink += slide::query<int, std::string, std::string>(conn, sql)
+                        .to_json<attr_id, attr_title, attr_taken>().length();
+                }
+               );
+        measure(
+                "query to_json with text_view columns",
+                iterations,
+                [&conn, &sql](const std::size_t)
+                {
+                    g_sink += slide::query<int, slide::text_view, slide::text_view>(conn, sql)
+                        .to_json<attr_id, attr_title, attr_taken>().length();
+                }
+               );
+    }
+
+    /*
+     * Compare the calendar queries grouping and filtering on substrings of
+     * the time taken, as they did before the schema had year and month
+     * columns, with the queries using the indexed columns, on a 200000
+     * photograph library spread over twenty years.
+     */
+    void benchmark_calendar()
+    {
+        slide::connection conn = slide::connection::in_memory_database();
+        schema::migrate(conn);
+        {
+            slide::transaction tr(conn, "benchmark");
+            char taken[32];
+            for(int i = 0; i < 200000; ++i)
+            {
+                // Scatter the photographs over every day of 2000 to 2019.
+                const int day = (i * 7919) % (20 * 12 * 28);
+                std::snprintf(
+                        taken,
+                        sizeof(taken),
+                        "%04d-%02d-%02dT12:00:00",
+                        2000 + day / (12 * 28),
+                        1 + (day / 28) % 12,
+                        1 + day % 28
+                        );
+                slide::devoid(
+                        "INSERT INTO helios_photograph(title, caption, taken) "
+                        "VALUES(?, '', ?)",
+                        slide::row<std::string, std::string>::make_row(
+                            "A photograph title", taken
+                            ),
+                        conn
+                        );
+            }
+            tr.commit();
+        }
+        slide::devoid("ANALYZE", conn);
+
+        const std::size_t iterations = 20;
+        std::cout << "Calendar queries on 200000 photographs" << std::endl;
+        measure(
+                "years, substr",
+                iterations,
+                [&conn](const std::size_t)
+                {
+                    g_sink += slide::get_collection<int, int>(
+                            conn,
+                            "SELECT CAST(substr(taken, 1, 4) AS INTEGER) AS year, "
+                            "count(photograph_id) "
+                            "FROM helios_photograph "
+                            "WHERE year != 0 GROUP BY year ORDER BY year"
+                            ).size();
+                }
+               );
+        measure(
+                "years, indexed columns",
+                iterations,
+                [&conn](const std::size_t)
+                {
+                    g_sink += slide::get_collection<int, int>(conn, schema::sql::years).size();
+                }
+               );
+        measure(
+                "months, substr",
+                iterations,
+                [&conn](const std::size_t)
+                {
+                    g_sink += slide::get_collection<int, int, int>(
+                            conn,
+                            "SELECT CAST(substr(taken, 1, 4) AS INTEGER) AS year, "
+                            "CAST(substr(taken, 6, 2) AS INTEGER) AS month, "
+                            "count(photograph_id) "
+                            "FROM helios_photograph "
+                            "WHERE year != 0 GROUP BY year, month ORDER BY year, month"
+                            ).size();
+                }
+               );
+        measure(
+                "months, indexed columns",
+                iterations,
+                [&conn](const std::size_t)
+                {
+                    g_sink += slide::get_collection<int, int, int>(conn, schema::sql::months).size();
+                }
+               );
+        measure(
+                "one year's months, substr",
+                iterations,
+                [&conn](const std::size_t)
+                {
+                    g_sink += slide::get_collection<int, int, int>(
+                            conn,
+                            "SELECT CAST(substr(taken, 1, 4) AS INTEGER) AS year, "
+                            "CAST(substr(taken, 6, 2) AS INTEGER) AS month, "
+                            "count(photograph_id) "
+                            "FROM helios_photograph "
+                            "WHERE year = ? GROUP BY year, month ORDER BY year, month",
+                            slide::row<int>::make_row(2010)
+                            ).size();
+                }
+               );
+        measure(
+                "one year's months, indexed columns",
+                iterations,
+                [&conn](const std::size_t)
+                {
+                    g_sink += slide::get_collection<int, int, int>(
+                            conn, schema::sql::year_months, slide::row<int>::make_row(2010)
+                            ).size();
+                }
+               );
+        measure(
+                "one month's photographs, substr",
+                iterations,
+                [&conn](const std::size_t)
+                {
+                    g_sink += slide::query<int, slide::text_view>(
+                            conn,
+                            "SELECT photograph_id, title FROM helios_photograph "
+                            "WHERE substr(taken, 1, 7) = ? ORDER BY taken",
+                            slide::row<std::string>::make_row("2010-06")
+                            ).to_json<attr_id, attr_title>().length();
+                }
+               );
+        measure(
+                "one month's photographs, indexed columns",
+                iterations,
+                [&conn](const std::size_t)
+                {
+                    g_sink += slide::query<int, slide::text_view>(
+                            conn,
+                            schema::sql::month_photographs,
+                            slide::row<int, int>::make_row(2010, 6)
+                            ).to_json<attr_id, attr_title>().length();
+                }
+               );
+    }
+
+    constexpr const char attr_caption[] = "caption";
+    constexpr const char attr_location[] = "location";
+    constexpr const char attr_starred[] = "starred";
+    constexpr const char attr_tag[] = "tag";
+
+    /*
+     * Write a row as JSON the way slide did before json_writer, through a
+     * std::ostringstream for each row.
+     */
+    template<typename Row>
+    std::string ostringstream_row_json(const Row& r)
+    {
+        std::ostringstream oss;
+        oss << "{ \"id\": " << r.template get<0>() <<
+            ", \"title\": \"" << slide::escape(r.template get<1>()) <<
+            "\", \"caption\": \"" << slide::escape(r.template get<2>()) <<
+            "\", \"location\": \"" << slide::escape(r.template get<3>()) <<
+            "\", \"taken\": \"" << slide::escape(r.template get<4>()) <<
+            "\", \"starred\": " << (r.template get<5>() ? "true" : "false") << " }";
+        return oss.str();
+    }
+
+    /*
+     * Compare writing a 10000 photograph album as JSON through nested
+     * std::ostringstreams with json_writer.
+     */
+    void benchmark_json_writer()
+    {
+        typedef slide::collection<int, std::string, std::string, std::string, std::string, bool>
+            album_type;
+        album_type album;
+        for(int i = 0; i < 10000; ++i)
+            album.push_back(
+                    album_type::row_type::make_row(
+                        i,
+                        "A photograph title",
+                        "A longer caption, with \"quotes\" in it",
+                        "Somewhere",
+                        "2015-06-01T12:00:00",
+                        (i % 7) == 0
+                        )
+                    );
+
+        const std::size_t iterations = 50;
+        std::cout << "Writing a 10000 photograph album as JSON" << std::endl;
+        measure(
+                "nested std::ostringstream",
+                iterations,
+                [&album](const std::size_t)
+                {
+                    std::ostringstream oss;
+                    oss << "[ ";
+                    bool first = true;
+                    for(const album_type::row_type& r : album)
+                    {
+                        if(!first)
+                            oss << ", ";
+                        first = false;
+                        oss << ostringstream_row_json(r);
+                    }
+                    oss << " ]";
+                    g_sink += oss.str().length();
+                }
+               );
+        measure(
+                "json_writer",
+                iterations,
+                [&album](const std::size_t)
+                {
+                    g_sink += album.to_json<
+                        attr_id, attr_title, attr_caption, attr_location, attr_taken, attr_starred
+                        >().length();
+                }
+               );
+    }
+
+    void benchmark_from_json()
+    {
+        // The body of a PUT setting hundreds of tags on a photograph.
+        std::string body("[");
+        for(int i = 0; i < 500; ++i)
+            body += (slide::mkstr() << (i == 0 ? "" : ", ") <<
+                    "{ \"id\": " << i << ", \"tag\": \"tag number " << i << "\" }");
+        body += "]";
+
+        std::cout << "Parsing a list of 500 tags" << std::endl;
+        measure(
+                "collection::from_json",
+                1000,
+                [&body](const std::size_t)
+                {
+                    g_sink += slide::collection<int, std::string>
+                        ::from_json<attr_id, attr_tag>(body).size();
+                }
+               );
+    }
+}
+
+int main()
+{
+    benchmark_dispatch();
+    benchmark_metrics();
+    benchmark_statement_cache();
+    benchmark_connection_pool();
+    benchmark_write_queue();
+    benchmark_blob_insert();
+    benchmark_column_collection();
+    benchmark_write_batch();
+    benchmark_query_to_json();
+    benchmark_calendar();
+    benchmark_json_writer();
+    benchmark_from_json();
+    benchmark_logging();
+    return 0;
+}
@@ -1,11 +1,93 @@
+#include <cstdio>
 #include <fstream>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "imageutils_nowarnings.hpp"
+#include "schema.hpp"
 #include "slide.hpp"
 
+namespace
+{
+    namespace query
+    {
+        namespace sql
+        {
+            constexpr const char jpeg_data[] =
+                "SELECT data FROM helios_jpeg_data WHERE photograph_id = ?";
+            constexpr const char photographs[] =
+                "SELECT photograph_id, taken, title "
+                "FROM helios_photograph "
+                "ORDER BY taken";
+            constexpr const char starred_photographs[] =
+                "SELECT photograph_id, taken, title "
+                "FROM helios_photograph "
+                "NATURAL JOIN helios_photograph_starred "
+                "ORDER BY taken";
+            constexpr const char album_photographs[] =
+                "SELECT photograph_id, taken, title "
+                "FROM helios_photograph "
+                "NATURAL JOIN helios_photograph_in_album "
+                "WHERE album_id = ? "
+                "ORDER BY taken";
+            constexpr const char starred_album_photographs[] =
+                "SELECT photograph_id, taken, title "
+                "FROM helios_photograph "
+                "NATURAL JOIN helios_photograph_in_album "
+                "NATURAL JOIN helios_photograph_starred "
+                "WHERE album_id = ? "
+                "ORDER BY taken";
+            constexpr const char albums[] =
+                "SELECT album_id, name FROM helios_album";
+            constexpr const char album_by_name[] =
+                "SELECT album_id, name FROM helios_album "
+                "WHERE name LIKE ? ";
+            constexpr const char months[] =
+                "SELECT taken_year, coalesce(taken_month, 0) FROM helios_photograph "
+                "WHERE taken_year > 0 "
+                "GROUP BY taken_year, taken_month "
+                "ORDER BY taken_year, taken_month";
+            constexpr const char month_photographs[] =
+                "SELECT photograph_id, taken, title "
+                "FROM helios_photograph "
+                "WHERE taken_year = ?1 AND taken_month IS nullif(?2, 0) "
+                "ORDER BY taken_day, taken";
+            constexpr const char starred_month_photographs[] =
+                "SELECT photograph_id, taken, title "
+                "FROM helios_photograph "
+                "NATURAL JOIN helios_photograph_starred "
+                "WHERE taken_year = ?1 AND taken_month IS nullif(?2, 0) "
+                "ORDER BY taken_day, taken";
+        }
+
+        // Photograph id, time taken and title.
+        typedef slide::row<int, std::string, std::string> photograph_row;
+
+        typedef slide::statement<sql::jpeg_data, slide::row<int>, slide::row<slide::blob_view>>
+            jpeg_data;
+        typedef slide::statement<sql::photographs, slide::row<>, photograph_row>
+            photographs;
+        typedef slide::statement<sql::starred_photographs, slide::row<>, photograph_row>
+            starred_photographs;
+        typedef slide::statement<sql::album_photographs, slide::row<int>, photograph_row>
+            album_photographs;
+        typedef slide::statement<sql::starred_album_photographs, slide::row<int>, photograph_row>
+            starred_album_photographs;
+        typedef slide::statement<sql::albums, slide::row<>, slide::row<int, std::string>>
+            albums;
+        typedef slide::statement<sql::album_by_name, slide::row<std::string>, slide::row<int, std::string>>
+            album_by_name;
+        // Year and month.
+        typedef slide::statement<sql::months, slide::row<>, slide::row<int, int>>
+            months;
+        typedef slide::statement<sql::month_photographs, slide::row<int, int>, photograph_row>
+            month_photographs;
+        typedef slide::statement<sql::starred_month_photographs, slide::row<int, int>, photograph_row>
+            starred_month_photographs;
+    }
+}
+
 int main(const int argc, char * const argv[])
 {
     std::string album_name, db_file, output_dir;
@@ -59,34 +141,18 @@ int main(const int argc, char * const argv[])
                 );
 
     slide::connection database(db_file);
-
-    auto get_fullsize_jpeg =
-        [&database](const int photograph_id) -> std::vector<unsigned char>
-    {
-        std::cerr << "get_fullsize_jpeg " << photograph_id << std::endl;
-        sqlite3_stmt *stmt;
-        sqlite3_prepare(
-                database.handle(),
-                "SELECT data FROM helios_jpeg_data WHERE photograph_id = ?",
-                -1,
-                &stmt,
-                nullptr
-                );
-        sqlite3_bind_int(stmt, 1, photograph_id);
-        if(slide::step(stmt) != SQLITE_ROW)
-        {
-            sqlite3_finalize(stmt);
-            throw std::runtime_error("retrieving fullsize");
-        }
-        std::vector<unsigned char> out(
-                reinterpret_cast<const unsigned char*>(sqlite3_column_blob(stmt, 0)),
-                reinterpret_cast<const unsigned char*>(sqlite3_column_blob(stmt, 0)) + sqlite3_column_bytes(stmt, 0)
+    // The queries need an up to date schema, but exporting must not change
+    // the database (an older webserver would refuse an upgraded one).
+    const int version = slide::user_version(database);
+    const int latest = static_cast<int>(schema::migrations().size());
+    if(version < latest)
+        throw std::runtime_error(
+                slide::mkstr() << "database schema is version " << version <<
+                    ", but exporting needs version " << latest <<
+                    "; run the webserver on it once to upgrade it"
                 );
-        sqlite3_finalize(stmt);
-        return out;
-    };
 
-    auto export_photograph = [&database, fullsize, &get_fullsize_jpeg](
+    auto export_photograph = [&database, fullsize](
                 const int photograph_id,
                 const std::string& filename
                 )
@@ -102,27 +168,34 @@ int main(const int argc, char * const argv[])
             return;
         }
 
-        std::vector<unsigned char> fullsize_jpeg = get_fullsize_jpeg(photograph_id);
+        // The JPEG data is read from SQLite's memory, without copying it,
+        // while the query is open.
+        slide::query<slide::blob_view> jpeg_query =
+            query::jpeg_data::open(database, photograph_id);
+        slide::query<slide::blob_view>::iterator jpeg_row = jpeg_query.begin();
+        if(jpeg_row == jpeg_query.end())
+            throw std::runtime_error("retrieving fullsize");
+        const slide::blob_view fullsize_jpeg = jpeg_row->get<0>();
 
         std::ofstream os(filename);
         if(fullsize)
         {
-            os << std::string(
-                    (const char*)(&(fullsize_jpeg.data()[0])),
-                    fullsize_jpeg.size()
+            os.write(
+                    reinterpret_cast<const char*>(fullsize_jpeg.data()),
+                    static_cast<std::streamsize>(fullsize_jpeg.size())
                     );
         }
         else
         {
             Magick::Blob out;
             Magick::Image image(Magick::Blob(
-                reinterpret_cast<const void*>(&(fullsize_jpeg[0])), fullsize_jpeg.size())
+                reinterpret_cast<const void*>(fullsize_jpeg.data()), fullsize_jpeg.size())
                 );
             long orientation = 1;
             try
             {   // Retrieve orientation
                 auto exiv_image = Exiv2::ImageFactory::open(
-                    reinterpret_cast<const unsigned char*>(&(fullsize_jpeg[0])),
+                    fullsize_jpeg.data(),
                     static_cast<long>(fullsize_jpeg.size())
                     );
                 exiv_image->readMetadata();
@@ -169,8 +242,9 @@ int main(const int argc, char * const argv[])
         }
     };
 
+    // The photographs are read one at a time as they are exported.
     auto export_collection = [&export_photograph](
-            const slide::collection<int, std::string, std::string>& photographs,
+            slide::query<int, std::string, std::string>&& photographs,
             const std::string dir
             )
     {
@@ -181,7 +255,7 @@ int main(const int argc, char * const argv[])
 
         //std::string last_taken;
         //int index = 0;
-        for(const slide::row<int, std::string, std::string> photograph : photographs)
+        for(const slide::row<int, std::string, std::string>& photograph : photographs)
         {
             std::cerr << "Photograph " << photograph.get<2>() << " taken " <<
                 photograph.get<1>() << std::endl;
@@ -208,24 +282,13 @@ int main(const int argc, char * const argv[])
     {
         if(starred_only)
             export_collection(
-                slide::get_collection<int, std::string, std::string>(
-                    database,
-                    "SELECT photograph_id, taken, title "
-                    "FROM helios_photograph "
-                    "NATURAL JOIN helios_photograph_starred "
-                    "ORDER BY taken"
-                    ),
-                    output_dir
+                query::starred_photographs::open(database),
+                output_dir
                 );
         else
             export_collection(
-                slide::get_collection<int, std::string, std::string>(
-                    database,
-                    "SELECT photograph_id, taken, title "
-                    "FROM helios_photograph "
-                    "ORDER BY taken"
-                    ),
-                    output_dir
+                query::photographs::open(database),
+                output_dir
                 );
 
     };
@@ -243,30 +306,13 @@ int main(const int argc, char * const argv[])
 
         if(starred_only)
             export_collection(
-                slide::get_collection<int, std::string, std::string>(
-                    database,
-                    "SELECT photograph_id, taken, title "
-                    "FROM helios_photograph "
-                    "NATURAL JOIN helios_photograph_in_album "
-                    "NATURAL JOIN helios_photograph_starred "
-                    "WHERE album_id = ? "
-                    "ORDER BY taken",
-                    slide::row<int>::make_row(album.get<0>())
-                    ),
-                    directory
+                query::starred_album_photographs::open(database, album.get<0>()),
+                directory
                 );
         else
             export_collection(
-                slide::get_collection<int, std::string, std::string>(
-                    database,
-                    "SELECT photograph_id, taken, title "
-                    "FROM helios_photograph "
-                    "NATURAL JOIN helios_photograph_in_album "
-                    "WHERE album_id = ? "
-                    "ORDER BY taken",
-                    slide::row<int>::make_row(album.get<0>())
-                    ),
-                    directory
+                query::album_photographs::open(database, album.get<0>()),
+                directory
                 );
     };
 
@@ -275,67 +321,47 @@ int main(const int argc, char * const argv[])
         if(album_name.empty())
         {
             // Export all the albums.
-            slide::collection<int, std::string> albums =
-                slide::get_collection<int, std::string>(
-                    database,
-                    "SELECT album_id, name FROM helios_album"
-                    );
-            for(const slide::row<int, std::string> album : albums)
+            for(const slide::row<int, std::string>& album : query::albums::open(database))
                 export_album(album);
         }
         else
         {
             // Export just one album.
-            slide::row<int, std::string> album = slide::get_row<int, std::string>(
-                    database,
-                    "SELECT album_id, name FROM helios_album "
-                    "WHERE name LIKE ? ",
-                    slide::row<std::string>::make_row(album_name)
-                    );
+            slide::row<int, std::string> album =
+                query::album_by_name::get_row(database, album_name);
             export_album(album);
         }
     }
     else if(in_months)
     {
-        slide::collection<std::string> months = slide::get_collection<std::string>(
-                database,
-                "SELECT substr(taken, 1, 7) AS month FROM helios_photograph "
-                "WHERE month != '' "
-                "GROUP BY month "
-                "ORDER BY month"
-                );
-        for(slide::row<std::string> month : months)
+        for(const slide::row<int, int>& month : query::months::open(database))
         {
-            std::cerr << "exporting month " << month.get<0>() << std::endl;
-            std::string directory = slide::mkstr() << output_dir << '/' << month.get<0>();
+            // Photographs with a year but no month go in a directory named
+            // after the year.
+            char name[16];
+            if(month.get<1>() == 0)
+                std::snprintf(name, sizeof(name), "%04d", month.get<0>());
+            else
+                std::snprintf(name, sizeof(name), "%04d-%02d", month.get<0>(), month.get<1>());
+            std::cerr << "exporting month " << name << std::endl;
+            std::string directory = slide::mkstr() << output_dir << '/' << name;
             if(mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
                 throw std::runtime_error(
                     slide::mkstr() << "creating directory " << directory
                     );
             if(starred_only)
                 export_collection(
-                    slide::get_collection<int, std::string, std::string>(
-                        database,
-                        "SELECT photograph_id, taken, title, substr(taken, 1, 7) AS month  "
-                        "FROM helios_photograph "
-                        "NATURAL JOIN helios_photograph_starred "
-                        "WHERE month = ? "
-                        "ORDER BY taken",
-                        slide::row<std::string>::make_row(month.get<0>())
+                    query::starred_month_photographs::open(
+                        database, month.get<0>(), month.get<1>()
                         ),
-                        directory
+                    directory
                     );
             else
                 export_collection(
-                    slide::get_collection<int, std::string, std::string>(
-                        database,
-                        "SELECT photograph_id, taken, title, substr(taken, 1, 7) AS month "
-                        "FROM helios_photograph "
-                        "WHERE month = ? "
-                        "ORDER BY taken",
-                        slide::row<std::string>::make_row(month.get<0>())
+                    query::month_photographs::open(
+                        database, month.get<0>(), month.get<1>()
                         ),
-                        directory
+                    directory
                     );
         }
     }
@@ -0,0 +1,140 @@
+#define CATCH_CONFIG_MAIN
+#include "catch_nowarnings.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+
+#include "logger.hpp"
+
+namespace
+{
+    std::string escape(const char *text)
+    {
+        std::string out;
+        logger::escape_field(text, std::strlen(text), out);
+        return out;
+    }
+
+    /*
+     * Read everything written to a file so far.
+     */
+    std::string contents(std::FILE *f)
+    {
+        std::fflush(f);
+        std::rewind(f);
+        std::string out;
+        char buf[256];
+        std::size_t n;
+        while((n = std::fread(buf, 1, sizeof(buf), f)) > 0)
+            out.append(buf, n);
+        return out;
+    }
+
+    std::size_t count_lines(const std::string& text)
+    {
+        std::size_t n = 0;
+        for(const char c : text)
+            if(c == '\n')
+                ++n;
+        return n;
+    }
+}
+
+SCENARIO("logger") {
+    GIVEN("an ordinary path") {
+        THEN("it is logged unchanged") {
+            REQUIRE(escape("/api/album/1") == "/api/album/1");
+        }
+    }
+    GIVEN("a path decoded from a request for another log line") {
+        const char *path =
+            "/x\naccess method=GET path=/admin status=200 bytes=0 duration_us=1";
+
+        THEN("it stays within its field") {
+            const std::string field = escape(path);
+            REQUIRE(field.find_first_of(" \n") == std::string::npos);
+            REQUIRE(
+                    field ==
+                    "/x%0Aaccess%20method=GET%20path=/admin%20status=200"
+                    "%20bytes=0%20duration_us=1"
+                   );
+        }
+    }
+    GIVEN("a path with quotes, percent signs and control characters") {
+        THEN("they are percent-encoded") {
+            REQUIRE(escape("/\"100%\"\r\t\x7f") == "/%22100%25%22%0D%09%7F");
+        }
+    }
+    GIVEN("a message with a path decoded from a request") {
+        std::FILE *output = std::tmpfile();
+        logger::set_output(output);
+        logger::info() << "request GET /x\nINFO forged\\ \x01";
+        logger::flush();
+        logger::set_output(stderr);
+        const std::string text = contents(output);
+        std::fclose(output);
+
+        THEN("it is written on one line, with control characters escaped") {
+            REQUIRE(count_lines(text) == 1);
+            REQUIRE(text.find(" INFO request GET /x\\nINFO forged\\\\ \\x01\n") != std::string::npos);
+        }
+    }
+    GIVEN("messages logged before a flush") {
+        std::FILE *output = std::tmpfile();
+        logger::set_output(output);
+        for(int i = 0; i < 10; ++i)
+            logger::warning() << "message " << i;
+        logger::flush();
+        logger::set_output(stderr);
+        const std::string text = contents(output);
+        std::fclose(output);
+
+        THEN("every message has been written when it returns") {
+            REQUIRE(count_lines(text) == 10);
+            REQUIRE(text.find(" WARNING message 9\n") != std::string::npos);
+        }
+    }
+    GIVEN("an output which stops accepting records") {
+        // Nothing reads the pipe until the thread's buffer has overflowed,
+        // so the background thread blocks writing to it.
+        int fds[2];
+        REQUIRE(pipe(fds) == 0);
+        std::FILE *output = fdopen(fds[1], "w");
+        logger::set_output(output);
+        const uint64_t dropped_before = logger::dropped();
+        std::size_t logged = 0;
+        while(logger::dropped() == dropped_before && logged < 1000000)
+        {
+            logger::info() << "filling the buffer " << logged;
+            ++logged;
+        }
+        const uint64_t dropped = logger::dropped() - dropped_before;
+
+        std::string received;
+        std::thread reader(
+                [&received, fds]()
+                {
+                    char buf[4096];
+                    ssize_t n;
+                    while((n = read(fds[0], buf, sizeof(buf))) > 0)
+                        received.append(buf, static_cast<std::size_t>(n));
+                }
+                );
+        logger::flush();
+        logger::set_output(stderr);
+        std::fclose(output);
+        reader.join();
+        close(fds[0]);
+
+        THEN("records are dropped and counted rather than blocking the thread") {
+            REQUIRE(dropped > 0);
+        }
+        THEN("every record which was not dropped is written by the flush") {
+            REQUIRE(count_lines(received) == logged - dropped);
+        }
+    }
+}
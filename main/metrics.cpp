@@ -0,0 +1,139 @@
+#define CATCH_CONFIG_MAIN
+#include "catch_nowarnings.hpp"
+
+#include <string>
+
+#include "metrics.hpp"
+
+namespace
+{
+    /*
+     * Count the times a line appears in the Prometheus text.
+     */
+    int count_lines(const std::string& text, const std::string& line)
+    {
+        int count = 0;
+        std::size_t start = 0;
+        while(start < text.length())
+        {
+            std::size_t end = text.find('\n', start);
+            if(end == std::string::npos)
+                end = text.length();
+            if(text.compare(start, end - start, line) == 0)
+                ++count;
+            start = end + 1;
+        }
+        return count;
+    }
+
+    const char s_test_route[] = "/test/\"quoted\"";
+
+    /*
+     * Get an endpoint with some requests recorded.  Metrics last for the
+     * lifetime of the program, so they are only recorded once however many
+     * times the scenario runs.
+     */
+    metrics::endpoint& recorded_endpoint()
+    {
+        static metrics::endpoint& e = []() -> metrics::endpoint&
+        {
+            metrics::endpoint& out = metrics::add_endpoint(s_test_route, "GET");
+            out.record(503, 0, 1500);
+            out.record(503, 0, 1500);
+            out.record(500, 10, 1500);
+            out.record(0, 0, 1500);
+            metrics::get_counter("test_events_total", "Events counted by the test.").add(3);
+            return out;
+        }();
+        return e;
+    }
+}
+
+SCENARIO("metrics") {
+    GIVEN("the histogram buckets") {
+        typedef metrics::histogram histogram;
+
+        THEN("the first bounds count each small value, then split each power of two in four") {
+            const uint64_t expected[] = {
+                0, 1, 2, 3, 4, 5, 6, 7, 8, 10, 12, 14, 16, 20, 24, 28, 32, 40
+            };
+            for(std::size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i)
+            {
+                INFO(i);
+                REQUIRE(histogram::upper_bound(i) == expected[i]);
+            }
+        }
+        THEN("the last finite bound is 2^27") {
+            REQUIRE(histogram::upper_bound(histogram::bucket_count - 2) == uint64_t(1) << 27);
+        }
+        THEN("each bucket counts its upper bound, and the next bucket the value after it") {
+            for(std::size_t i = 0; i + 1 < histogram::bucket_count; ++i)
+            {
+                INFO(i);
+                REQUIRE(histogram::bucket(histogram::upper_bound(i)) == i);
+                REQUIRE(histogram::bucket(histogram::upper_bound(i) + 1) == i + 1);
+            }
+        }
+        THEN("no bucket is wider than a quarter of its lower bound") {
+            for(std::size_t i = histogram::sub_buckets + 1; i + 1 < histogram::bucket_count; ++i)
+            {
+                INFO(i);
+                const uint64_t width = histogram::upper_bound(i) - histogram::upper_bound(i - 1);
+                const uint64_t quarter = histogram::upper_bound(i - 1) / histogram::sub_buckets;
+                REQUIRE(width <= quarter);
+            }
+        }
+        THEN("larger values are counted in the last bucket") {
+            REQUIRE(histogram::bucket(uint64_t(1) << 40) == histogram::bucket_count - 1);
+            REQUIRE(histogram::bucket(~uint64_t(0)) == histogram::bucket_count - 1);
+        }
+    }
+    GIVEN("a histogram with recorded values") {
+        metrics::histogram h;
+        h.record(0);
+        h.record(9);
+        h.record(10);
+        h.record(11);
+        const metrics::histogram::snapshot s = h.read();
+
+        THEN("each value is counted in its bucket") {
+            REQUIRE(s.buckets[0] == 1);
+            REQUIRE(s.buckets[9] == 2);
+            REQUIRE(s.buckets[10] == 1);
+            REQUIRE(s.count == 4);
+            REQUIRE(s.sum == 30);
+        }
+    }
+    GIVEN("an endpoint with recorded requests") {
+        const metrics::endpoint& e = recorded_endpoint();
+        const std::string text = metrics::prometheus_text();
+        const std::string labels = "route=\"/test/\\\"quoted\\\"\",method=\"GET\"";
+
+        THEN("requests are counted by status code") {
+            REQUIRE(e.responses(503) == 2);
+            REQUIRE(e.responses(500) == 1);
+            REQUIRE(e.responses(200) == 0);
+            REQUIRE(count_lines(text, "webserver_requests_total{" + labels + ",code=\"503\"} 2") == 1);
+            REQUIRE(count_lines(text, "webserver_requests_total{" + labels + ",code=\"500\"} 1") == 1);
+            REQUIRE(count_lines(text, "webserver_requests_total{" + labels + ",code=\"none\"} 1") == 1);
+            REQUIRE(text.find("webserver_requests_total{" + labels + ",code=\"200\"}") == std::string::npos);
+        }
+        THEN("the response bytes are totalled") {
+            REQUIRE(count_lines(text, "webserver_response_bytes_total{" + labels + "} 10") == 1);
+        }
+        THEN("durations are cumulative in buckets with bounds in seconds") {
+            // 1500 us is above 1280 us and up to 1536 us.
+            REQUIRE(count_lines(text, "webserver_request_duration_seconds_bucket{" + labels + ",le=\"0.00128\"} 0") == 1);
+            REQUIRE(count_lines(text, "webserver_request_duration_seconds_bucket{" + labels + ",le=\"0.001536\"} 4") == 1);
+            REQUIRE(count_lines(text, "webserver_request_duration_seconds_bucket{" + labels + ",le=\"134.217728\"} 4") == 1);
+            REQUIRE(count_lines(text, "webserver_request_duration_seconds_bucket{" + labels + ",le=\"+Inf\"} 4") == 1);
+            REQUIRE(count_lines(text, "webserver_request_duration_seconds_sum{" + labels + "} 0.006") == 1);
+            REQUIRE(count_lines(text, "webserver_request_duration_seconds_count{" + labels + "} 4") == 1);
+        }
+        THEN("counters are written with their help and type") {
+            REQUIRE(count_lines(text, "# HELP test_events_total Events counted by the test.") == 1);
+            REQUIRE(count_lines(text, "# TYPE test_events_total counter") == 1);
+            REQUIRE(count_lines(text, "test_events_total 3") == 1);
+        }
+    }
+}
@@ -0,0 +1,195 @@
+#define CATCH_CONFIG_MAIN
+#include "catch_nowarnings.hpp"
+
+#include <string>
+
+#include "schema.hpp"
+#include "slide.hpp"
+
+namespace
+{
+    /*
+     * Queries which list every row of a table, so cannot avoid reading all
+     * of it.
+     */
+    const char *const s_whole_table_queries[] = {
+        // Every photograph which is in no album.
+        "uncategorised_photographs"
+    };
+
+    bool reads_whole_table(const std::string& name)
+    {
+        for(const char *q : s_whole_table_queries)
+            if(name == q)
+                return true;
+        return false;
+    }
+
+    /*
+     * Get the steps of a query's plan which read a whole table, one per
+     * line.  A query with parameters must search every table it reads; a
+     * query listing everything may scan an index instead of its table.
+     *
+     * Every parameter is bound to a short string, so that LIKE can be
+     * planned as an index range.
+     */
+    std::string full_scans(slide::connection& conn, const char *sql)
+    {
+        const std::string explain = std::string("EXPLAIN QUERY PLAN ") + sql;
+        sqlite3_stmt *stmt = slide::prepare(conn, explain);
+        const int parameters = sqlite3_bind_parameter_count(stmt);
+        for(int i = 1; i <= parameters; ++i)
+            sqlite3_bind_text(stmt, i, "1", 1, SQLITE_STATIC);
+        std::string scans;
+        while(sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            const std::string detail = reinterpret_cast<const char*>(
+                    sqlite3_column_text(stmt, 3)
+                    );
+            if(detail.compare(0, 5, "SCAN ") == 0 &&
+                    (parameters > 0 || detail.find(" USING ") == std::string::npos))
+                scans += detail + "\n";
+        }
+        sqlite3_finalize(stmt);
+        return scans;
+    }
+}
+
+SCENARIO("schema") {
+    GIVEN("a new database") {
+        slide::connection conn = slide::connection::in_memory_database();
+        const int applied = schema::migrate(conn);
+        const int latest = static_cast<int>(schema::migrations().size());
+
+        THEN("every migration is applied") {
+            REQUIRE(applied == latest);
+            REQUIRE(slide::user_version(conn) == latest);
+        }
+        WHEN("the migrations are run again") {
+            const int reapplied = schema::migrate(conn);
+
+            THEN("nothing is applied") {
+                REQUIRE(reapplied == 0);
+                REQUIRE(slide::user_version(conn) == latest);
+            }
+        }
+        THEN("no API query scans a whole table") {
+            for(const schema::named_query& q : schema::queries)
+            {
+                if(reads_whole_table(q.name))
+                    continue;
+                INFO(q.name);
+                REQUIRE(full_scans(conn, q.sql) == "");
+            }
+        }
+    }
+    GIVEN("a database with the calendar columns") {
+        slide::connection conn = slide::connection::in_memory_database();
+        schema::migrate(conn);
+        slide::devoid(
+                "INSERT INTO helios_photograph(title, caption, taken) "
+                "VALUES('Harbour', '', '2015-06-01T12:00:00'), "
+                "('Undated', '', '')",
+                conn
+                );
+        typedef slide::row<int, int, int> date_row;
+        const char *const select_date =
+            "SELECT taken_year, taken_month, taken_day FROM helios_photograph "
+            "WHERE title = 'Harbour'";
+
+        THEN("the columns are set when a photograph is inserted") {
+            const date_row date = slide::get_row<int, int, int>(conn, select_date);
+            REQUIRE(date.get<0>() == 2015);
+            REQUIRE(date.get<1>() == 6);
+            REQUIRE(date.get<2>() == 1);
+        }
+        THEN("they are null for a photograph with no time taken") {
+            REQUIRE(
+                    slide::get_row<int>(
+                        conn,
+                        "SELECT COUNT(*) FROM helios_photograph "
+                        "WHERE title = 'Undated' AND taken_year IS NULL "
+                        "AND taken_month IS NULL AND taken_day IS NULL"
+                        ).get<0>() == 1
+                    );
+        }
+        WHEN("the time a photograph was taken is changed") {
+            slide::devoid(
+                    "UPDATE helios_photograph SET taken = '2016-11-30T08:00:00' "
+                    "WHERE title = 'Harbour'",
+                    conn
+                    );
+            const date_row date = slide::get_row<int, int, int>(conn, select_date);
+
+            THEN("the columns are updated") {
+                REQUIRE(date.get<0>() == 2016);
+                REQUIRE(date.get<1>() == 11);
+                REQUIRE(date.get<2>() == 30);
+            }
+        }
+        WHEN("a photograph has a year but no month") {
+            slide::devoid(
+                    "INSERT INTO helios_photograph(title, caption, taken) "
+                    "VALUES('Year only', '', '2015')",
+                    conn
+                    );
+            const slide::collection<int, int, int> months =
+                slide::get_collection<int, int, int>(
+                        conn,
+                        schema::sql::year_months,
+                        slide::row<int>::make_row(2015)
+                        );
+
+            THEN("the year's months list it as month 0") {
+                REQUIRE(months.size() == 2);
+                REQUIRE(months.at(0).get<1>() == 0);
+                REQUIRE(months.at(0).get<2>() == 1);
+                REQUIRE(months.at(1).get<1>() == 6);
+            }
+            THEN("it is listed as the photographs of month 0") {
+                const slide::collection<int, std::string> photographs =
+                    slide::get_collection<int, std::string>(
+                            conn,
+                            schema::sql::month_photographs,
+                            slide::row<int, int>::make_row(2015, 0)
+                            );
+                REQUIRE(photographs.size() == 1);
+                REQUIRE(photographs.at(0).get<1>() == "Year only");
+            }
+        }
+    }
+    GIVEN("a database created before the schema was versioned") {
+        slide::connection conn = slide::connection::in_memory_database();
+        for(const char *statement : schema::migrations().front().statements)
+            slide::devoid(statement, conn);
+        slide::devoid(
+                "INSERT INTO helios_photograph(title, caption, taken) "
+                "VALUES('Harbour', '', '2015-06-01T12:00:00')",
+                conn
+                );
+        const int applied = schema::migrate(conn);
+        const int count =
+            slide::get_row<int>(conn, "SELECT COUNT(*) FROM helios_photograph").get<0>();
+
+        THEN("it is brought up to date, keeping its data") {
+            REQUIRE(applied == static_cast<int>(schema::migrations().size()));
+            REQUIRE(count == 1);
+        }
+        THEN("the calendar columns are filled in for existing photographs") {
+            REQUIRE(
+                    slide::get_row<int>(
+                        conn,
+                        "SELECT taken_month FROM helios_photograph"
+                        ).get<0>() == 6
+                    );
+        }
+    }
+    GIVEN("a database from a newer version of the program") {
+        slide::connection conn = slide::connection::in_memory_database();
+        slide::devoid("PRAGMA user_version = 1000", conn);
+
+        THEN("migrating it fails") {
+            REQUIRE_THROWS_AS(schema::migrate(conn), const slide::exception&);
+        }
+    }
+}
@@ -1,12 +1,55 @@
 #define CATCH_CONFIG_MAIN
 #include "catch_nowarnings.hpp"
 
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <unistd.h>
+#include <vector>
+
 #include "slide.hpp"
 
 namespace
 {
+    /*
+     * A database file with a unique name, so tests can run concurrently,
+     * removed (with its journal or write-ahead log) when the test ends.
+     */
+    class temporary_database
+    {
+        public:
+            temporary_database()
+            {
+                char name[] = "/tmp/slide_test_XXXXXX";
+                const int fd = mkstemp(name);
+                if(fd == -1)
+                    throw std::runtime_error("creating a temporary database");
+                close(fd);
+                filename = name;
+            }
+            ~temporary_database()
+            {
+                for(const char *suffix : {"", "-journal", "-wal", "-shm"})
+                    std::remove((filename + suffix).c_str());
+            }
+
+            std::string filename;
+        private:
+            temporary_database(const temporary_database&) = delete;
+            temporary_database& operator=(const temporary_database&) = delete;
+    };
+
     constexpr char t1_id[] = "t1_id";
     constexpr char t2_id[] = "t2_id";
+
+    constexpr const char select_title_sql[] =
+        "SELECT title FROM test WHERE t1_id = ?";
+    constexpr const char insert_test_sql[] =
+        "INSERT INTO test(t1_id, title) VALUES(?, ?)";
+    constexpr const char select_all_sql[] =
+        "SELECT t1_id, title FROM test ORDER BY t1_id";
+    constexpr const char select_id_sql[] =
+        "SELECT t1_id FROM test WHERE title = ?";
 }
 
 SCENARIO("slide") {
@@ -37,6 +80,38 @@ SCENARIO("slide") {
             REQUIRE(r.get<0>() == "1");
         }
     }
+    GIVEN("values to write as JSON") {
+        std::string out;
+        slide::json_writer writer(out);
+
+        WHEN("a string with control characters is written") {
+            writer.value(std::string("a\tb\n\"c\"\\\x01"));
+
+            THEN("it is escaped as RFC 8259 requires") {
+                REQUIRE(out == "\"a\\tb\\n\\\"c\\\"\\\\\\u0001\"");
+            }
+        }
+        WHEN("doubles are written") {
+            writer.value(0.1);
+            writer.raw(' ');
+            writer.value(0.1 + 0.2);
+            writer.raw(' ');
+            writer.value(1.0 / 0.0);
+
+            THEN("each has the fewest digits that read back exactly") {
+                REQUIRE(out == "0.1 0.30000000000000004 null");
+            }
+        }
+        WHEN("integers are written") {
+            writer.value(0);
+            writer.raw(' ');
+            writer.value(-2147483647 - 1);
+
+            THEN("they are written in full") {
+                REQUIRE(out == "0 -2147483648");
+            }
+        }
+    }
     GIVEN("a json object string with a boolean") {
         auto r = slide::row<bool>::from_json<t1_id>(
                 "{ \"t1_id\": true }"
@@ -76,6 +151,64 @@ SCENARIO("slide") {
             }
         }
     }
+    GIVEN("a collection") {
+        slide::collection<int, std::string> c;
+        c.reserve(2);
+        c.emplace_back(1, "one");
+        c.push_back(slide::row<int, std::string>::make_row(2, "two"));
+
+        WHEN("the collection is moved") {
+            const slide::collection<int, std::string> moved(std::move(c));
+            THEN("the rows are moved, not copied") {
+                REQUIRE(moved.size() == 2);
+                REQUIRE(moved.at(0).get<1>() == "one");
+                REQUIRE(c.size() == 0);
+            }
+        }
+    }
+    GIVEN("a json array with hundreds of objects") {
+        std::string json_str("[");
+        for(int i = 0; i < 500; ++i)
+            json_str += (slide::mkstr() << (i == 0 ? "" : ", ") <<
+                    "{ \"t1_id\": " << i << ", \"t2_id\": \"tag " << i << "\" }");
+        json_str += "]";
+
+        WHEN("the string is parsed to a collection") {
+            auto c = slide::collection<int, std::string>::from_json<t1_id, t2_id>(json_str);
+            THEN("every item was parsed") {
+                REQUIRE(c.size() == 500);
+                REQUIRE(c.at(0).get<1>() == "tag 0");
+                REQUIRE(c.at(499).get<0>() == 499);
+                REQUIRE(c.at(499).get<1>() == "tag 499");
+            }
+        }
+    }
+    GIVEN("a json object with escapes and nested values") {
+        const std::string json_str(
+                "{ \"t\\u0031_id\": [ 1, { \"t2_id\": 2 } ], \"t2_id\": "
+                "\"a\\n\\\"b\\\" \\u00e9 \\ud83d\\ude00\", \"t\\u0031_id\": 3 }"
+                );
+
+        WHEN("the string is parsed") {
+            auto r = slide::row<int, std::string>::from_json<t1_id, t2_id>(json_str);
+            THEN("keys and values were unescaped") {
+                REQUIRE(r.get<0>() == 3);
+                REQUIRE(r.get<1>() == "a\n\"b\" \xc3\xa9 \xf0\x9f\x98\x80");
+            }
+        }
+    }
+    GIVEN("invalid json") {
+        THEN("parsing throws") {
+            REQUIRE_THROWS_AS(
+                    slide::row<int>::from_json<t1_id>("{ \"t1_id\": [ 1 }"),
+                    const slide::exception&
+                    );
+            REQUIRE_THROWS_AS(
+                    slide::collection<int>::from_json<t1_id>("[ { \"t1_id\": 1 }"),
+                    const slide::exception&
+                    );
+        }
+    }
     GIVEN("a Slide row") {
         const slide::row<std::string, double> r = slide::row<std::string, double>::make_row("1", 2);
 
@@ -154,5 +287,517 @@ SCENARIO("slide") {
             }
         }
     }
-}
+    GIVEN("a database containing a BLOB") {
+        slide::connection conn = slide::connection::in_memory_database();
+
+        slide::devoid(
+                "CREATE TABLE test (t1_id INTEGER PRIMARY KEY, data BLOB);",
+                conn
+                );
+        slide::devoid(
+                "INSERT INTO test(t1_id, data) VALUES(7, 'abcdefgh');",
+                conn
+                );
+
+        WHEN("the BLOB is opened") {
+            slide::blob b(conn, "test", "data", 7);
+
+            THEN("the size is correct") {
+                REQUIRE(b.size() == 8);
+            }
+
+            THEN("part of the BLOB can be read") {
+                char buf[3];
+                b.read(buf, 3, 2);
+                REQUIRE(std::string(buf, 3) == "cde");
+            }
+        }
+
+        WHEN("a BLOB in a missing row is opened") {
+            THEN("an exception is thrown") {
+                REQUIRE_THROWS_AS(slide::blob(conn, "test", "data", 8), const slide::exception&);
+            }
+        }
+    }
+    GIVEN("a database with a statement cache") {
+        slide::connection conn = slide::connection::in_memory_database();
+
+        slide::devoid(
+                "CREATE TABLE test (t1_id INTEGER, title VARCHAR);",
+                conn
+                );
+        slide::devoid(
+                "INSERT INTO test(t1_id, title) VALUES(1, 'one'), (2, 'two');",
+                conn
+                );
+        const std::string query = "SELECT title FROM test WHERE t1_id = ?";
 
+        WHEN("the same query is run twice with different parameters") {
+            const uint64_t misses = conn.statement_cache_misses();
+            const std::string first = slide::get_row<std::string>(
+                    conn, query, slide::row<int>::make_row(1)
+                    ).get<0>();
+            const std::string second = slide::get_row<std::string>(
+                    conn, query, slide::row<int>::make_row(2)
+                    ).get<0>();
+
+            THEN("the statement is prepared once and rebound") {
+                REQUIRE(first == "one");
+                REQUIRE(second == "two");
+                REQUIRE(conn.statement_cache_misses() == misses + 1);
+                REQUIRE(conn.statement_cache_hits() >= 1);
+            }
+        }
+
+        WHEN("a statement is in use while the same SQL is run again") {
+            slide::cached_statement outer(conn, query);
+            sqlite3_bind_int(outer.get(), 1, 1);
+            slide::step(outer.get());
+            const std::string inner = slide::get_row<std::string>(
+                    conn, query, slide::row<int>::make_row(2)
+                    ).get<0>();
+
+            THEN("each gets its own statement") {
+                REQUIRE(inner == "two");
+                REQUIRE(
+                    std::string(
+                        reinterpret_cast<const char*>(sqlite3_column_text(outer.get(), 0))
+                        ) == "one"
+                    );
+            }
+        }
+
+        WHEN("the capacity is reduced") {
+            conn.set_statement_cache_capacity(1);
+            slide::get_row<std::string>(conn, query, slide::row<int>::make_row(1));
+            slide::get_collection<int>(conn, "SELECT t1_id FROM test");
+
+            THEN("the least recently used statements are finalized") {
+                REQUIRE(conn.statement_cache_size() == 1);
+            }
+        }
+    }
+    GIVEN("a database and typed statements") {
+        slide::connection conn = slide::connection::in_memory_database();
+
+        slide::devoid(
+                "CREATE TABLE test (t1_id INTEGER, title VARCHAR);",
+                conn
+                );
+
+        typedef slide::statement<insert_test_sql, slide::row<int, std::string>, slide::row<>>
+            insert_test;
+        typedef slide::statement<select_title_sql, slide::row<int>, slide::row<std::string>>
+            select_title;
+        typedef slide::statement<select_all_sql, slide::row<>, slide::row<int, std::string>>
+            select_all;
+
+        WHEN("rows are inserted and read back") {
+            insert_test::devoid(conn, 1, "one");
+            insert_test::devoid(conn, slide::row<int, std::string>::make_row(2, "two"));
+            const slide::collection<int, std::string> all =
+                select_all::get_collection(conn);
+
+            THEN("the rows are correct") {
+                REQUIRE(select_title::get_row(conn, 2).get<0>() == "two");
+                REQUIRE(select_title::get_row(conn, 1).get<0>() == "one");
+                REQUIRE(all.size() == 2);
+                REQUIRE(all.at(1).get<1>() == "two");
+            }
+        }
+
+        WHEN("rows are read by column") {
+            insert_test::devoid(conn, 1, "one");
+            insert_test::devoid(conn, 2, "two");
+            const slide::column_collection<int, std::string> columns =
+                select_all::get_column_collection(conn);
+            const std::vector<int> ids = {1, 2};
+
+            THEN("each column holds its values in order") {
+                REQUIRE(columns.size() == 2);
+                REQUIRE(columns.column<0>() == ids);
+                REQUIRE(columns.at(1).get<1>() == "two");
+            }
+            THEN("the JSON is the same as for a collection") {
+                const std::string by_column = columns.to_json<t1_id, t2_id>();
+                const std::string by_row =
+                    select_all::get_collection(conn).to_json<t1_id, t2_id>();
+                REQUIRE(by_column == by_row);
+            }
+        }
+
+        WHEN("rows are read lazily") {
+            insert_test::devoid(conn, 1, "one");
+            insert_test::devoid(conn, 2, "two");
+            insert_test::devoid(conn, 3, "three");
+
+            THEN("each row is read in turn") {
+                std::string titles;
+                for(const slide::row<int, std::string>& r : select_all::open(conn))
+                    titles += r.get<1>();
+                REQUIRE(titles == "onetwothree");
+            }
+            THEN("the JSON is the same as for a collection") {
+                const std::string lazy =
+                    slide::query<int, std::string>(conn, "SELECT t1_id, title FROM test ORDER BY t1_id")
+                    .to_json<t1_id, t2_id>();
+                const std::string eager =
+                    select_all::get_collection(conn).to_json<t1_id, t2_id>();
+                REQUIRE(lazy == eager);
+            }
+            THEN("a query can only be iterated over once") {
+                slide::query<int, std::string> q = select_all::open(conn);
+                REQUIRE(q.to_collection().size() == 3);
+                REQUIRE_THROWS_AS(q.begin(), const slide::exception&);
+            }
+            THEN("the statement can be run again while the query is open") {
+                slide::query<int, std::string> q = select_all::open(conn);
+                slide::query<int, std::string>::iterator it = q.begin();
+                REQUIRE(select_all::get_collection(conn).size() == 3);
+                ++it;
+                REQUIRE(it->get<1>() == "two");
+            }
+            THEN("the statement can be run again once the query is destroyed") {
+                {
+                    slide::query<int, std::string> q = select_all::open(conn);
+                    q.begin();
+                }
+                REQUIRE(select_all::get_collection(conn).size() == 3);
+            }
+        }
+
+        WHEN("text is read through views") {
+            insert_test::devoid(conn, 1, "a \"quoted\" title");
+            slide::query<int, slide::text_view> q(conn, "SELECT t1_id, title FROM test");
+            slide::query<int, slide::text_view>::iterator it = q.begin();
+
+            THEN("the view refers to the text of the current row") {
+                REQUIRE(it->get<1>() == std::string("a \"quoted\" title"));
+                REQUIRE(it->get<1>().str().length() == 16);
+            }
+            THEN("the view is escaped in JSON in the same way as a string") {
+                const std::string view_json = it->to_json<t1_id, t2_id>();
+                const std::string string_json =
+                    select_all::get_row(conn).to_json<t1_id, t2_id>();
+                REQUIRE(view_json == string_json);
+            }
+        }
+
+        WHEN("a BLOB is read through a view") {
+            slide::devoid("CREATE TABLE blob_test (data BLOB)", conn);
+            slide::devoid("INSERT INTO blob_test(data) VALUES(X'6D616E79')", conn);
+            slide::query<slide::blob_view> q(conn, "SELECT data FROM blob_test");
+            slide::query<slide::blob_view>::iterator it = q.begin();
+
+            THEN("the view has the bytes of the BLOB") {
+                REQUIRE(it->get<0>().size() == 4);
+                REQUIRE(it->get<0>().data()[0] == 'm');
+            }
+            THEN("the view is written to JSON as base64") {
+                const std::string json = it->to_json<t1_id>();
+                REQUIRE(json == "{ \"t1_id\": \"bWFueQ==\" }");
+            }
+        }
+
+        WHEN("BLOB parameters are bound") {
+            slide::devoid("CREATE TABLE blob_test (data BLOB)", conn);
+            const std::vector<unsigned char> bytes = {1, 0, 2};
+            slide::devoid(
+                    "INSERT INTO blob_test(data) VALUES(?)",
+                    slide::row<std::vector<unsigned char>>::make_row(bytes),
+                    conn
+                    );
+            slide::devoid(
+                    "INSERT INTO blob_test(data) VALUES(?)",
+                    slide::row<slide::blob_view>::make_row(slide::blob_view()),
+                    conn
+                    );
+            const slide::collection<std::vector<unsigned char>> blobs =
+                slide::get_collection<std::vector<unsigned char>>(
+                        conn,
+                        "SELECT data FROM blob_test WHERE data IS NOT NULL ORDER BY rowid"
+                        );
+
+            THEN("the BLOBs are stored and read back, and empty BLOBs are not NULL") {
+                REQUIRE(blobs.size() == 2);
+                REQUIRE(blobs.at(0).get<0>() == bytes);
+                REQUIRE(blobs.at(1).get<0>().empty());
+            }
+        }
+
+        WHEN("a query is opened with a temporary string parameter") {
+            typedef slide::statement<select_id_sql, slide::row<std::string>, slide::row<int>>
+                select_id;
+            insert_test::devoid(conn, 1, "one");
+            slide::query<int> q = select_id::open(conn, std::string("on") + "e");
+            const slide::collection<int> ids = q.to_collection();
+
+            THEN("the parameter was copied for the query") {
+                REQUIRE(ids.size() == 1);
+                REQUIRE(ids.at(0).get<0>() == 1);
+            }
+        }
+
+        WHEN("a statement is declared with the wrong number of columns") {
+            typedef slide::statement<select_title_sql, slide::row<int>, slide::row<int, std::string>>
+                wrong_columns;
+
+            THEN("an exception is thrown when it is prepared") {
+                REQUIRE_THROWS_AS(wrong_columns::get_collection(conn, 1), const slide::exception&);
+            }
+        }
+    }
+    GIVEN("a batch of rows with a duplicate key") {
+        slide::connection conn = slide::connection::in_memory_database();
+        slide::devoid("CREATE TABLE batch_test (id INTEGER PRIMARY KEY, title VARCHAR)", conn);
+        const std::string insert_sql = "INSERT INTO batch_test(id, title) VALUES (?, ?) ";
+
+        slide::collection<int, std::string> rows;
+        for(int i = 0; i < 600; ++i)
+            rows.emplace_back(i == 300 ? 10 : i, "title");
+
+        WHEN("the batch is written all or nothing") {
+            std::size_t failed_row = 0;
+            try
+            {
+                slide::write_batch(conn, insert_sql, rows);
+            }
+            catch(const slide::batch_error& e)
+            {
+                failed_row = e.failure().row;
+            }
+            const int count =
+                slide::get_row<int>(conn, "SELECT COUNT(*) FROM batch_test").get<0>();
+
+            THEN("the failed row is reported and nothing is written") {
+                REQUIRE(failed_row == 300);
+                REQUIRE(count == 0);
+            }
+        }
+        WHEN("the batch is written best effort, many rows per statement") {
+            const slide::batch_result result = slide::write_batch(
+                    conn,
+                    insert_sql,
+                    rows,
+                    slide::batch_options(slide::batch_mode::best_effort, true)
+                    );
+            const int count =
+                slide::get_row<int>(conn, "SELECT COUNT(*) FROM batch_test").get<0>();
+
+            THEN("every other row is written") {
+                REQUIRE(result.changes == 599);
+                REQUIRE(count == 599);
+                REQUIRE(result.failures.size() == 1);
+                REQUIRE(result.failures.at(0).row == 300);
+            }
+        }
+        THEN("INSERT statements are rewritten to insert many rows") {
+            REQUIRE(
+                    slide::detail::multi_row_sql(insert_sql, 3) ==
+                    "INSERT INTO batch_test(id, title) VALUES (?, ?), (?, ?), (?, ?)"
+                   );
+            REQUIRE_THROWS_AS(
+                    slide::detail::multi_row_sql("SELECT id FROM batch_test", 2),
+                    const slide::exception&
+                    );
+        }
+    }
+
+    GIVEN("a connection pool of two connections") {
+        slide::connection_pool pool(":memory:", 2, std::chrono::milliseconds(10));
+
+        WHEN("a connection is returned and checked out again") {
+            sqlite3 *first = nullptr;
+            {
+                slide::connection_pool::handle h = pool.acquire();
+                first = h->handle();
+            }
+            slide::connection_pool::handle h = pool.acquire();
+
+            THEN("the same connection is reused") {
+                REQUIRE(h->handle() == first);
+            }
+        }
+        WHEN("every connection is checked out") {
+            slide::connection_pool::handle a = pool.acquire();
+            slide::connection_pool::handle b = pool.acquire();
+
+            THEN("further checkouts time out") {
+                REQUIRE(a->handle() != b->handle());
+                REQUIRE_THROWS_AS(pool.acquire(), const slide::pool_timeout&);
+            }
+        }
+        WHEN("a connection is returned inside a transaction") {
+            {
+                slide::connection_pool::handle h = pool.acquire();
+                slide::devoid("BEGIN", *h);
+            }
+            slide::connection_pool::handle a = pool.acquire();
+            slide::connection_pool::handle b = pool.acquire();
+
+            THEN("it is closed rather than reused") {
+                REQUIRE(sqlite3_get_autocommit(a->handle()) != 0);
+                REQUIRE(sqlite3_get_autocommit(b->handle()) != 0);
+            }
+        }
+    }
+
+    GIVEN("a pool of one connection to a database with a write-ahead log") {
+        const temporary_database db;
+        slide::connection_options options = slide::connection_options::profile("raspberry-pi");
+        options.busy_timeout = std::chrono::milliseconds(0);
+        {
+            slide::connection setup(db.filename, options);
+            slide::devoid("CREATE TABLE response_test (id INTEGER PRIMARY KEY, data BLOB)", setup);
+            slide::devoid("INSERT INTO response_test(id, data) VALUES (1, x'0102030405')", setup);
+        }
+        slide::connection_pool pool(db.filename, 1, std::chrono::milliseconds(0), options);
+        slide::connection writer(db.filename, options);
+
+        WHEN("a response is sent from a BLOB held open on its own read-only connection") {
+            slide::connection_options stream_options = options;
+            stream_options.read_only = true;
+            slide::connection stream(db.filename, stream_options);
+            slide::blob b(stream, "response_test", "data", 1);
+
+            THEN("other requests get the pooled connection, and writes commit") {
+                slide::connection_pool::handle h = pool.acquire();
+                REQUIRE(h);
+                slide::devoid("INSERT INTO response_test(id, data) VALUES (2, x'00')", writer);
+            }
+            THEN("the BLOB is read at any offset") {
+                char tail[2];
+                b.read(tail, 2, 3);
+                REQUIRE(std::string(tail, 2) == "\x04\x05");
+            }
+            THEN("the stream's connection cannot write") {
+                REQUIRE_THROWS_AS(
+                        slide::devoid("INSERT INTO response_test(id, data) VALUES (3, x'00')", stream),
+                        const slide::exception&
+                        );
+            }
+        }
+        WHEN("a response is sent from a BLOB held open on the pooled connection") {
+            slide::connection_pool::handle h = pool.acquire();
+            slide::blob b(*h, "response_test", "data", 1);
+
+            THEN("the pool is exhausted") {
+                REQUIRE_THROWS_AS(pool.acquire(), const slide::pool_timeout&);
+            }
+        }
+    }
+
+    GIVEN("connection options") {
+        slide::connection_options options =
+            slide::connection_options::profile("raspberry-pi");
+
+        WHEN("options are set by name") {
+            options.set("synchronous=FULL");
+            options.set("cache_size=-2048");
+            options.set("busy_timeout=250");
+
+            THEN("the profile is overridden") {
+                REQUIRE(options.journal_mode == "wal");
+                REQUIRE(options.synchronous == "full");
+                REQUIRE(options.cache_size == -2048);
+                REQUIRE(options.busy_timeout.count() == 250);
+            }
+        }
+        THEN("unknown options and invalid values are rejected") {
+            REQUIRE_THROWS_AS(options.set("page_cache=1"), const slide::exception&);
+            REQUIRE_THROWS_AS(options.set("journal_mode=wal; DROP"), const slide::exception&);
+            REQUIRE_THROWS_AS(options.set("page_size=1000"), const slide::exception&);
+            REQUIRE_THROWS_AS(
+                    slide::connection_options::profile("laptop"),
+                    const slide::exception&
+                    );
+        }
+    }
+    GIVEN("a database in WAL mode being written") {
+        const temporary_database db;
+        const std::string& filename = db.filename;
+        slide::connection_options options =
+            slide::connection_options::profile("server");
+        options.busy_timeout = std::chrono::milliseconds(0);
+
+        slide::connection writer(filename, options);
+        slide::devoid("CREATE TABLE wal_test (id INTEGER PRIMARY KEY)", writer);
+        slide::devoid("INSERT INTO wal_test(id) VALUES (1)", writer);
+        slide::connection reader(filename, options);
+        const std::string mode =
+            slide::get_row<std::string>(reader, "PRAGMA journal_mode").get<0>();
+        slide::devoid("BEGIN IMMEDIATE", writer);
+        slide::devoid("INSERT INTO wal_test(id) VALUES (2)", writer);
+
+        WHEN("another connection reads") {
+            const int count =
+                slide::get_row<int>(reader, "SELECT COUNT(*) FROM wal_test").get<0>();
+
+            THEN("it is not blocked, and sees the last commit") {
+                REQUIRE(mode == "wal");
+                REQUIRE(count == 1);
+            }
+        }
+        slide::devoid("COMMIT", writer);
+    }
+
+    GIVEN("a write queue") {
+        const temporary_database db;
+        const std::string& filename = db.filename;
+        {
+            slide::connection setup(filename);
+            slide::devoid("CREATE TABLE write_test (id INTEGER PRIMARY KEY)", setup);
+        }
+        const uint64_t commits_before = slide::write_queue::commits();
+        slide::write_queue writer(filename);
+
+        WHEN("jobs are queued while the writer is busy") {
+            std::promise<void> gate;
+            std::shared_future<void> gate_open = gate.get_future().share();
+            std::future<int> first = writer.submit(
+                    [gate_open](slide::connection&)
+                    {
+                        gate_open.wait();
+                        return 0;
+                    }
+                    );
+            std::vector<std::future<int>> inserts;
+            for(int i = 1; i <= 10; ++i)
+                inserts.push_back(
+                        writer.submit(
+                            [i](slide::connection& conn)
+                            {
+                                slide::devoid(
+                                        "INSERT INTO write_test(id) VALUES (?)",
+                                        slide::row<int>::make_row(i),
+                                        conn
+                                        );
+                                return i;
+                            }
+                            )
+                        );
+            std::future<void> duplicate = writer.submit(
+                    [](slide::connection& conn)
+                    {
+                        slide::devoid("INSERT INTO write_test(id) VALUES (1)", conn);
+                    }
+                    );
+            gate.set_value();
+
+            int total = first.get();
+            for(std::future<int>& f : inserts)
+                total += f.get();
+            slide::connection reader(filename);
+            const int count =
+                slide::get_row<int>(reader, "SELECT COUNT(*) FROM write_test").get<0>();
+            const uint64_t groups = slide::write_queue::commits() - commits_before;
+
+            THEN("they are committed together, apart from the failed job") {
+                REQUIRE_THROWS_AS(duplicate.get(), const slide::exception&);
+                REQUIRE(total == 55);
+                REQUIRE(count == 10);
+                REQUIRE(groups <= 2);
+            }
+        }
+    }
+}
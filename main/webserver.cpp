@@ -1,5 +1,7 @@
 #include <algorithm>
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <memory>
@@ -7,10 +9,14 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <utility>
 #include <vector>
 
 #include "imageutils_nowarnings.hpp"
 
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "schema.hpp"
 #include "slide.hpp"
 #include "webserver.hpp"
 
@@ -27,28 +33,77 @@
 #define WEB_STATIC_STD_STRING(NAME) \
     std::string(&_binary_##NAME##_start, &_binary_##NAME##_end)
 
-WEB_DECLARE_STATIC(web_404_html)
-WEB_DECLARE_STATIC(web_albums_html)
-WEB_DECLARE_STATIC(web_application_js)
-WEB_DECLARE_STATIC(web_backbone_js)
-WEB_DECLARE_STATIC(web_grid_css)
-WEB_DECLARE_STATIC(web_index_html)
-WEB_DECLARE_STATIC(web_jquery_js)
-WEB_DECLARE_STATIC(web_modal_css)
-WEB_DECLARE_STATIC(web_modal_js)
-WEB_DECLARE_STATIC(web_months_html)
-WEB_DECLARE_STATIC(web_photograph_html)
-WEB_DECLARE_STATIC(web_style_css)
-WEB_DECLARE_STATIC(web_tags_html)
-WEB_DECLARE_STATIC(web_teletype_theme_css)
-WEB_DECLARE_STATIC(web_underscore_js)
-WEB_DECLARE_STATIC(web_views_js)
+/*
+ * Declare the variables required to access a web resource that might not
+ * have been linked into the binary.  The symbols are weak, so their
+ * addresses are null if the resource is missing.
+ */
+#define WEB_DECLARE_STATIC_OPTIONAL(NAME) \
+    extern "C" {\
+        extern const char _binary_##NAME##_start __attribute__((weak));\
+        extern const char _binary_##NAME##_end __attribute__((weak));\
+    }
+
+#define WEB_STATIC_OPTIONAL_STD_STRING(NAME) \
+    ((&_binary_##NAME##_start == nullptr) ? \
+        std::string() : WEB_STATIC_STD_STRING(NAME))
+
+/*
+ * Declare a web resource along with its precompressed variants.  A gzip
+ * variant is always built; a brotli variant is only built if the brotli tool
+ * is available.
+ */
+#define WEB_DECLARE_STATIC_ENCODED(NAME) \
+    WEB_DECLARE_STATIC(NAME) \
+    WEB_DECLARE_STATIC(NAME##_gz) \
+    WEB_DECLARE_STATIC_OPTIONAL(NAME##_br)
+
+#define WEB_STATIC_ENCODINGS(NAME) \
+    webserver::static_request_function::encodings_type { \
+        { "gzip", WEB_STATIC_STD_STRING(NAME##_gz) }, \
+        { "br", WEB_STATIC_OPTIONAL_STD_STRING(NAME##_br) } \
+    }
+
+WEB_DECLARE_STATIC_ENCODED(web_404_html)
+WEB_DECLARE_STATIC_ENCODED(web_albums_html)
+WEB_DECLARE_STATIC_ENCODED(web_application_js)
+WEB_DECLARE_STATIC_ENCODED(web_backbone_js)
+WEB_DECLARE_STATIC_ENCODED(web_grid_css)
+WEB_DECLARE_STATIC_ENCODED(web_index_html)
+WEB_DECLARE_STATIC_ENCODED(web_jquery_js)
+WEB_DECLARE_STATIC_ENCODED(web_modal_css)
+WEB_DECLARE_STATIC_ENCODED(web_modal_js)
+WEB_DECLARE_STATIC_ENCODED(web_months_html)
+WEB_DECLARE_STATIC_ENCODED(web_photograph_html)
+WEB_DECLARE_STATIC_ENCODED(web_style_css)
+WEB_DECLARE_STATIC_ENCODED(web_tags_html)
+WEB_DECLARE_STATIC_ENCODED(web_teletype_theme_css)
+WEB_DECLARE_STATIC_ENCODED(web_underscore_js)
+WEB_DECLARE_STATIC_ENCODED(web_views_js)
 
 namespace
 {
     std::string g_db_path = "";
     static bool g_db_path_set = false;
 
+    // Largest request body accepted unless another size is given with -b.
+    // This is larger than the library's default, to allow for uploading
+    // photographs.
+    const std::size_t s_default_max_body_size = 64 * 1024 * 1024;
+    // Default number of database connections shared by the server's
+    // threads.
+    const std::size_t s_default_pool_size = 8;
+    // Database connection profile used unless another is chosen with -P.
+    const char s_default_db_profile[] = "raspberry-pi";
+    // Longest time a request waits for a database connection before it is
+    // refused with 503 (Service Unavailable).
+    const std::chrono::milliseconds s_pool_wait(2000);
+
+    std::unique_ptr<slide::connection_pool> g_pool;
+    // The connection checked out by the request function being called on
+    // this thread, if any.
+    thread_local slide::connection_pool::handle t_database;
+
     void set_db_path(const std::string& db_path)
     {
         if(g_db_path_set)
@@ -57,156 +112,136 @@ namespace
         g_db_path_set = true;
     }
 
+    /*
+     * Get the database connection for the request function being called on
+     * this thread, checking one out of the pool on first use.  The
+     * connection is returned to the pool when the call returns (see
+     * release_database).
+     */
     slide::connection& database()
     {
         if(!g_db_path_set)
             throw std::runtime_error("db path not set");
 
-        static thread_local std::unique_ptr<slide::connection> g_conn;
-        if(!g_conn)
+        if(!t_database)
             try
             {
-                //std::cerr << "open db connection" << std::endl;
-                g_conn.reset(new slide::connection(g_db_path));
+                t_database = g_pool->acquire();
             }
-            catch(const std::exception&)
+            catch(const slide::pool_timeout& e)
             {
-                std::cerr << "warning: opening database connection with file " << g_db_path << std::endl;
+                throw webserver::service_unavailable(e.what());
             }
-        return *g_conn;
+        return *t_database;
     }
 
-    void create_db()
+    // Page cache of each connection a streamed response reads from, in KiB.
+    // A stream reads one BLOB or walks one query, so it needs little cache;
+    // pages are shared through memory mapped I/O.
+    const int s_stream_cache_kib = 512;
+    slide::connection_options g_stream_options;
+
+    /*
+     * Open a read-only connection for a response which reads from the
+     * database while it is sent.  A slow client could keep a response open
+     * for a long time, so the response has its own connection rather than
+     * one from the pool.  With a write-ahead log, its read transaction does
+     * not block the writer.
+     */
+    std::unique_ptr<slide::connection> stream_connection()
     {
-        slide::devoid(
-                "CREATE TABLE IF NOT EXISTS helios_photograph ( "
-                " photograph_id INTEGER PRIMARY KEY AUTOINCREMENT, "
-                " title VARCHAR NOT NULL, "
-                " caption VARCHAR NULL, "
-                " taken VARCHAR NULL "
-                " ) ",
-                database()
-                );
-        slide::devoid(
-                "CREATE TABLE IF NOT EXISTS helios_photograph_location ( "
-                " photograph_id INTEGER PRIMARY KEY, "
-                " location VARCHAR, "
-                " FOREIGN KEY(photograph_id) REFERENCES helios_photograph(photograph_id) "
-                "  ON DELETE CASCADE DEFERRABLE INITIALLY DEFERRED "
-                " ) ",
-                database()
-                );
-        slide::devoid(
-                "CREATE TABLE IF NOT EXISTS helios_jpeg_data ( "
-                " photograph_id INTEGER PRIMARY KEY, "
-                " data BLOB NOT NULL, "
-                " FOREIGN KEY(photograph_id) REFERENCES helios_photograph(photograph_id) "
-                "  ON DELETE CASCADE DEFERRABLE INITIALLY DEFERRED "
-                " ) ",
-                database()
-                );
-        slide::devoid(
-                "CREATE TABLE IF NOT EXISTS helios_jpeg_small ( "
-                " photograph_id INTEGER PRIMARY KEY, "
-                " data BLOB NOT NULL, "
-                " FOREIGN KEY(photograph_id) REFERENCES helios_photograph(photograph_id) "
-                "  ON DELETE CASCADE DEFERRABLE INITIALLY DEFERRED "
-                " ) ",
-                database()
-                );
-        slide::devoid(
-                "CREATE TABLE IF NOT EXISTS helios_jpeg_medium ( "
-                " photograph_id INTEGER PRIMARY KEY, "
-                " data BLOB NOT NULL, "
-                " FOREIGN KEY(photograph_id) REFERENCES helios_photograph(photograph_id) "
-                "  ON DELETE CASCADE DEFERRABLE INITIALLY DEFERRED "
-                " ) ",
-                database()
-                );
-        slide::devoid(
-                "CREATE TABLE IF NOT EXISTS helios_album ( "
-                " album_id INTEGER PRIMARY KEY AUTOINCREMENT, "
-                " name VARCHAR NOT NULL, "
-                " caption VARCHAR NULL, "
-                " UNIQUE(name) "
-                " ) ",
-                database()
-                );
-        slide::devoid(
-                "CREATE TABLE IF NOT EXISTS helios_photograph_tagged ( "
-                " photograph_id INTEGER NOT NULL, "
-                " tag VARCHAR NOT NULL, "
-                " FOREIGN KEY(photograph_id) REFERENCES helios_photograph(photograph_id) "
-                "  ON DELETE CASCADE DEFERRABLE INITIALLY DEFERRED, "
-                " UNIQUE(photograph_id, tag) "
-                " ) ",
-                database()
-                );
-        slide::devoid(
-                "CREATE TABLE IF NOT EXISTS helios_photograph_in_album ( "
-                " photograph_id INTEGER NOT NULL, "
-                " album_id INTEGER NOT NULL, "
-                " FOREIGN KEY(photograph_id) REFERENCES helios_photograph(photograph_id) "
-                "  ON DELETE CASCADE DEFERRABLE INITIALLY DEFERRED, "
-                " FOREIGN KEY(album_id) REFERENCES helios_album(album_id) "
-                "  ON DELETE CASCADE DEFERRABLE INITIALLY DEFERRED, "
-                " UNIQUE(photograph_id, album_id) "
-                " ) ",
-                database()
-                );
-        slide::devoid(
-                "CREATE TABLE IF NOT EXISTS helios_photograph_starred ( "
-                " photograph_id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
-                " FOREIGN KEY(photograph_id) "
-                " REFERENCES helios_photograph(photograph_id) "
-                " ON DELETE CASCADE DEFERRABLE INITIALLY DEFERRED "
-                ")",
-                database()
+        if(!g_db_path_set)
+            throw std::runtime_error("db path not set");
+        return std::unique_ptr<slide::connection>(
+                new slide::connection(g_db_path, g_stream_options)
                 );
     }
 
-    bool has_jpeg(const int photograph_id, const std::string& table)
+    std::unique_ptr<slide::write_queue> g_writer;
+
+    /*
+     * Run a write on the writer thread, which commits writes queued at about
+     * the same time together, and wait for it to be committed.  The function
+     * is given the writer's connection, and must not use database().
+     */
+    template<typename Function>
+    typename std::result_of<Function(slide::connection&)>::type write_database(
+            Function fn
+            )
+    {
+        return g_writer->submit(std::move(fn)).get();
+    }
+
+    /*
+     * Return this thread's database connection to the pool.
+     */
+    void release_database()
+    {
+        t_database.reset();
+    }
+
+    /*
+     * Create the database schema, or bring it up to date.
+     */
+    void migrate_db()
+    {
+        const int applied = schema::migrate(database());
+        if(applied > 0)
+            logger::info() << "applied " << applied <<
+                " schema migrations, now at version " << slide::user_version(database());
+    }
+
+    /*
+     * A table of resized JPEG data.  The SQL for each table is written out in
+     * full, rather than built on each call, so that the prepared statements
+     * can be cached.
+     */
+    struct jpeg_table
+    {
+        const char *name;
+        const char *select_sql;
+        const char *insert_sql;
+        int width;
+        int height;
+    };
+    const jpeg_table s_small_jpeg = {
+        "helios_jpeg_small",
+        "SELECT photograph_id FROM helios_jpeg_small WHERE photograph_id = ?",
+        "INSERT INTO helios_jpeg_small(photograph_id, data) VALUES(?, ?)",
+        300,
+        200
+    };
+    const jpeg_table s_medium_jpeg = {
+        "helios_jpeg_medium",
+        "SELECT photograph_id FROM helios_jpeg_medium WHERE photograph_id = ?",
+        "INSERT INTO helios_jpeg_medium(photograph_id, data) VALUES(?, ?)",
+        960,
+        640
+    };
+
+    bool has_jpeg(const int photograph_id, const jpeg_table& table)
     {
         return slide::get_collection<int>(
                 database(),
-                (slide::mkstr() << "SELECT photograph_id FROM " << table <<
-                    " WHERE photograph_id = ?").str().c_str(),
+                table.select_sql,
                 slide::row<int>::make_row(photograph_id)
                 ).size() > 0;
     }
     std::vector<unsigned char> get_fullsize_jpeg(const int photograph_id)
     {
-        std::cerr << "get_fullsize_jpeg " << photograph_id << std::endl;
-        sqlite3_stmt *stmt;
-        sqlite3_prepare(
-                database().handle(),
+        logger::debug() << "get_fullsize_jpeg " << photograph_id;
+        return slide::get_row<std::vector<unsigned char>>(
+                database(),
                 "SELECT data FROM helios_jpeg_data WHERE photograph_id = ?",
-                -1,
-                &stmt,
-                nullptr
-                );
-        sqlite3_bind_int(stmt, 1, photograph_id);
-        if(slide::step(stmt) != SQLITE_ROW)
-        {
-            sqlite3_finalize(stmt);
-            throw std::runtime_error("retrieving fullsize");
-        }
-        std::vector<unsigned char> out(
-                reinterpret_cast<const unsigned char*>(sqlite3_column_blob(stmt, 0)),
-                reinterpret_cast<const unsigned char*>(sqlite3_column_blob(stmt, 0)) + sqlite3_column_bytes(stmt, 0)
-                );
-        sqlite3_finalize(stmt);
-        return out;
+                slide::row<int>::make_row(photograph_id)
+                ).get<0>();
     }
 
 
-    void cache_jpeg(
-            const int photograph_id,
-            const std::string& table,
-            const int width,
-            const int height
-            )
+    void cache_jpeg(const int photograph_id, const jpeg_table& table)
     {
+        const int width = table.width;
+        const int height = table.height;
         std::vector<unsigned char> fullsize = get_fullsize_jpeg(photograph_id);
         Magick::Blob out;
         Magick::Image image(Magick::Blob(
@@ -259,70 +294,250 @@ namespace
         Magick::Image out_image(image.size(), Magick::Color(255,255,255));
         out_image.composite(image, 0, 0);
         out_image.write(&out, "JPEG");
-        sqlite3_stmt *stmt;
-        sqlite3_prepare(
-                database().handle(),
-                (slide::mkstr() << "INSERT INTO " << table << "(photograph_id, data) "
-                "VALUES(?, ?)").str().c_str(),
-                -1,
-                &stmt,
-                nullptr
+        // The scaled image is bound without being copied again.
+        write_database(
+                [&table, photograph_id, &out](slide::connection& conn)
+                {
+                    slide::devoid(
+                            table.insert_sql,
+                            slide::row<int, slide::blob_view>::make_row(
+                                photograph_id,
+                                slide::blob_view(
+                                    static_cast<const unsigned char*>(out.data()),
+                                    out.length()
+                                    )
+                                ),
+                            conn
+                            );
+                }
                 );
-        sqlite3_bind_int(stmt, 1, photograph_id);
-        if(
-                // TODO does SQLite need to copy all this data?
-                sqlite3_bind_blob(
-                    stmt, 2, out.data(),
-                    static_cast<int>(out.length()), SQLITE_TRANSIENT
-                    ) != SQLITE_OK
-                )
-        {
-            sqlite3_finalize(stmt);
-            throw std::runtime_error("image");
-        }
-        slide::step(stmt);
-        sqlite3_finalize(stmt);
     }
 
-    std::vector<unsigned char> get_jpeg(const int photograph_id, const std::string& table)
+    /*
+     * Make sure a scaled copy of a photograph is stored in the given table,
+     * scaling the original image if it is not.
+     */
+    void ensure_cached_jpeg(const int photograph_id, const jpeg_table& table)
     {
-        sqlite3_stmt *stmt;
-        sqlite3_prepare(
-                database().handle(),
-                (slide::mkstr() << "SELECT data FROM " << table <<
-                    " WHERE photograph_id = ?").str().c_str(),
-                -1,
-                &stmt,
-                nullptr
+        static metrics::counter& hits = metrics::get_counter(
+                "thumbnail_cache_hits_total",
+                "Requests for a resized photograph which was already cached."
                 );
-        sqlite3_bind_int(stmt, 1, photograph_id);
-        if(slide::step(stmt) != SQLITE_ROW)
+        static metrics::counter& misses = metrics::get_counter(
+                "thumbnail_cache_misses_total",
+                "Requests for a resized photograph which had to be generated."
+                );
+        if(has_jpeg(photograph_id, table))
+        {
+            hits.add();
+            return;
+        }
+        // Decoding a photograph takes a lot of memory and processor time,
+        // so only a few are resized at once.  Another request may have
+        // cached the photograph while this one waited for its turn.
+        webserver::admission_ticket ticket(webserver::cost_class::thumbnail);
+        if(has_jpeg(photograph_id, table))
         {
-            sqlite3_finalize(stmt);
-            throw std::runtime_error("retrieving jpeg data");
+            hits.add();
+            return;
         }
-        std::vector<unsigned char> out(
-                reinterpret_cast<const unsigned char*>(sqlite3_column_blob(stmt, 0)),
-                reinterpret_cast<const unsigned char*>(sqlite3_column_blob(stmt, 0)) + sqlite3_column_bytes(stmt, 0)
+        misses.add();
+        cache_jpeg(photograph_id, table);
+    }
+
+    // Photograph data never changes for a given photograph id and size (ids
+    // are not reused), so clients may cache images indefinitely.
+    const char s_image_cache_control[] = "private, max-age=31536000, immutable";
+
+    /*
+     * Get a function making the entity tag for an image of the given size
+     * from the photograph id in the URL.
+     */
+    webserver::stream_request_function::etag_function_type image_etag(
+            const std::string& size
+            )
+    {
+        return [size](const std::string& param) -> std::string
+        {
+            return slide::mkstr() << '"' << std::stoi(param) << '-' << size << '"';
+        };
+    }
+
+    /*
+     * Read JPEG data for sending to a client directly from its BLOB in the
+     * database.  Only the parts asked for are read, so a range request
+     * reads no more of a large original than it sends.
+     */
+    class jpeg_reader : public webserver::content_reader
+    {
+        public:
+            jpeg_reader(const int photograph_id, const std::string& table) :
+                m_database(stream_connection()),
+                m_blob(*m_database, table, "data", photograph_id)
+            {
+            }
+            uint64_t size() const override
+            {
+                return m_blob.size();
+            }
+            std::size_t read(uint64_t pos, char *buf, std::size_t max) override
+            {
+                const std::size_t length = static_cast<std::size_t>(
+                        std::min<uint64_t>(max, size() - pos)
+                        );
+                m_blob.read(buf, length, static_cast<std::size_t>(pos));
+                return length;
+            }
+        private:
+            // Declared first, so the BLOB is closed before the connection.
+            std::unique_ptr<slide::connection> m_database;
+            slide::blob m_blob;
+    };
+
+    /*
+     * Streams the rows of a query as a JSON array, in the same format as
+     * to_json.  Rows are only read from the database as the client is ready
+     * for them, so the first bytes are sent straight away and only one
+     * block of JSON is held in memory, however many rows there are.
+     *
+     * The query stays open until the response has been sent, on a
+     * read-only connection of the reader's own (see stream_connection).
+     */
+    template<typename Query, const char *...Attributes>
+    class json_array_reader : public webserver::content_reader
+    {
+        public:
+            json_array_reader(std::unique_ptr<slide::connection>&& conn, Query&& q) :
+                m_database(std::move(conn)),
+                m_query(std::move(q)),
+                // Step to the first row now, so that errors are reported to
+                // the client with an error status.
+                m_row(m_query.begin()),
+                m_buffer("[ "),
+                m_offset(0),
+                m_finished(false),
+                m_written(false)
+            {
+            }
+            uint64_t size() const override
+            {
+                return webserver::unknown_size;
+            }
+            std::size_t read(uint64_t /*pos*/, char *buf, std::size_t max) override
+            {
+                std::size_t copied = 0;
+                while(copied < max)
+                {
+                    if(m_offset == m_buffer.length())
+                    {
+                        if(m_finished)
+                            break;
+                        fill(max);
+                    }
+                    const std::size_t length =
+                        std::min(max - copied, m_buffer.length() - m_offset);
+                    std::memcpy(buf + copied, m_buffer.data() + m_offset, length);
+                    copied += length;
+                    m_offset += length;
+                }
+                return copied;
+            }
+        private:
+            /*
+             * Replace the buffer with at least size bytes of JSON, unless the
+             * rows run out first.
+             */
+            void fill(const std::size_t size)
+            {
+                m_buffer.clear();
+                m_offset = 0;
+                slide::json_writer writer(m_buffer);
+                while(m_row != m_query.end() && m_buffer.length() < size)
+                {
+                    if(m_written)
+                        writer.raw(", ", 2);
+                    m_row->template write_json<Attributes...>(writer);
+                    m_written = true;
+                    ++m_row;
+                }
+                if(m_row == m_query.end())
+                {
+                    writer.raw(" ]", 2);
+                    m_finished = true;
+                }
+            }
+
+            // Declared first, so the query is closed before the connection.
+            std::unique_ptr<slide::connection> m_database;
+            Query m_query;
+            typename Query::iterator m_row;
+            std::string m_buffer;
+            // Position of the next byte to send in m_buffer.
+            std::size_t m_offset;
+            // True once the end of the array is in m_buffer.
+            bool m_finished;
+            // True once a row has been written.
+            bool m_written;
+    };
+
+    /*
+     * Make a content reader streaming the rows of a statement as a JSON
+     * array, with the given attribute names.  The statement is run with the
+     * given parameters on a connection of the reader's own.
+     */
+    template<typename Statement, const char *...Attributes, typename ...Params>
+    webserver::content_reader_ptr json_array(const Params&... params)
+    {
+        std::unique_ptr<slide::connection> conn = stream_connection();
+        auto q = Statement::open(*conn, params...);
+        return webserver::content_reader_ptr(
+                new json_array_reader<decltype(q), Attributes...>(
+                    std::move(conn),
+                    std::move(q)
+                    )
                 );
-        sqlite3_finalize(stmt);
-        return out;
     }
 
-    std::vector<unsigned char> get_small_jpeg(const int photograph_id)
+    /*
+     * Log the rows of a best effort batch which could not be written (for
+     * example, a tag given twice).
+     */
+    void log_batch_failures(const char *what, const slide::batch_result& result)
     {
-        if(!has_jpeg(photograph_id, "helios_jpeg_small"))
-            cache_jpeg(photograph_id, "helios_jpeg_small", 300, 200);
+        for(const slide::batch_failure& f : result.failures)
+            logger::warning() << "skipped " << what << " " << f.row << ": " << f.message;
+    }
 
-        return get_jpeg(photograph_id, "helios_jpeg_small");
+    /*
+     * Parse a number of exactly the given count of digits, throwing a public
+     * exception if it is anything else.
+     */
+    int parse_digits(const std::string& s, const std::size_t digits)
+    {
+        if(s.length() != digits || s.find_first_not_of("0123456789") != std::string::npos)
+            throw webserver::public_exception("Invalid date");
+        return std::stoi(s);
     }
 
-    std::vector<unsigned char> get_medium_jpeg(const int photograph_id)
+    /*
+     * Parse a year given as YYYY.
+     */
+    int parse_year(const std::string& param)
     {
-        if(!has_jpeg(photograph_id, "helios_jpeg_medium"))
-            cache_jpeg(photograph_id, "helios_jpeg_medium", 960, 640);
+        return parse_digits(param, 4);
+    }
 
-        return get_jpeg(photograph_id, "helios_jpeg_medium");
+    /*
+     * Parse a month given as YYYY-MM, into its year and month.
+     */
+    std::pair<int, int> parse_month(const std::string& param)
+    {
+        if(param.length() != 7 || param[4] != '-')
+            throw webserver::public_exception("Invalid date");
+        return std::make_pair(
+                parse_digits(param.substr(0, 4), 4),
+                parse_digits(param.substr(5, 2), 2)
+                );
     }
 
     int postdata_iterator(
@@ -347,6 +562,13 @@ namespace
             {
                 return (std::string(url) == "/upload" && std::string(method) == "POST") ? 1 : -1;
             }
+            bool get_route(webserver::route& r) const override
+            {
+                r.url = "/upload";
+                r.method = "POST";
+                r.prefix = false;
+                return true;
+            }
 
             struct connection_status
             {
@@ -354,14 +576,42 @@ namespace
                 std::string title, caption, location;
                 std::vector<unsigned char> jpeg_data;
                 std::size_t data_size;
+                // Bytes of the request body received so far.
+                std::size_t received;
+                // Set when the body exceeded the maximum size; the rest of
+                // it is discarded.
+                bool too_large;
 
                 connection_status() :
                     post_processor(nullptr),
-                    data_size(0)
+                    data_size(0),
+                    received(0),
+                    too_large(false)
                 {
                 }
             };
 
+            /*
+             * Refuse an upload larger than the maximum body size.
+             */
+            static int queue_too_large(struct MHD_Connection *connection)
+            {
+                static const char message[] = "photograph too large";
+                struct MHD_Response *response = MHD_create_response_from_buffer(
+                        sizeof(message) - 1,
+                        const_cast<char*>(message),
+                        MHD_RESPMEM_PERSISTENT
+                        );
+                int ret = webserver::queue_response(
+                        connection,
+                        MHD_HTTP_REQUEST_ENTITY_TOO_LARGE,
+                        response,
+                        sizeof(message) - 1
+                        );
+                MHD_destroy_response(response);
+                return ret;
+            }
+
             int operator()(
                     void */*cls*/,
                     struct MHD_Connection *connection,
@@ -379,7 +629,19 @@ namespace
                 {
                     // New connection.
                     // There will be no POST data the first time this function is
-                    // called.
+                    // called.  Refuse a body known to be too large before
+                    // reading it.
+                    const char *content_length = MHD_lookup_connection_value(
+                            connection,
+                            MHD_HEADER_KIND,
+                            "Content-Length"
+                            );
+                    if(
+                            content_length != nullptr &&
+                            std::strtoull(content_length, nullptr, 10) >
+                                webserver::max_body_size()
+                            )
+                        return queue_too_large(connection);
                     con = new connection_status;
                     *con_cls = (void*)con;
 
@@ -397,7 +659,9 @@ namespace
                 if(*upload_data_size == 0)
                 {
                     // Upload has finished.
-                    std::cerr << "data size " << con->data_size << std::endl;
+                    if(con->too_large)
+                        return queue_too_large(connection);
+                    logger::debug() << "data size " << con->data_size;
                     // Try to insert the photograph.
                     std::string datetime;
                     try
@@ -421,7 +685,7 @@ namespace
                         if(pos != image->exifData().end())
                         {
                             datetime = pos->getValue()->toString();
-                            std::cerr << "datetime " << datetime << std::endl;
+                            logger::debug() << "datetime " << datetime;
                         }
 
                         if(datetime.length() < 19)
@@ -438,70 +702,62 @@ namespace
                     }
                     catch(const std::exception& e)
                     {
-                        std::cerr << "warning: failed to get a date time from the image" << std::endl;
-                        std::cerr << e.what() << std::endl;
+                        logger::warning() << "failed to get a date time from the image: " << e.what();
                     }
 
                     int photograph_id = 0;
 
                     try
                     {
-                        slide::transaction tr(database(), "insertphotograph");
-                        auto photograph = slide::row<std::string, std::string, std::string>::make_row(
-                                con->title,
-                                con->caption,
-                                datetime
-                                );
-                        slide::devoid(
-                                "INSERT INTO helios_photograph(title, caption, taken) "
-                                "VALUES(?, ?, ?) ",
-                                photograph,
-                                database()
-                                );
-                        photograph_id= slide::last_insert_rowid(database());
-                        std::cerr << "photograph id " << photograph_id << std::endl;
-                        auto photograph_location = slide::row<int, std::string>::make_row(
-                                photograph_id,
-                                con->location
-                                );
-                        std::cerr << "photograph_location " << con->location << std::endl;
-                        slide::devoid(
-                                "INSERT INTO helios_photograph_location(photograph_id, location) "
-                                "VALUES(?, ?) ",
-                                photograph_location,
-                                database()
-                                );
-                        sqlite3_stmt *stmt;
-                        sqlite3_prepare(
-                                database().handle(),
-                                "INSERT INTO helios_jpeg_data(photograph_id, data) VALUES (?, ?)",
-                                -1,
-                                &stmt,
-                                nullptr
-                                );
-                        sqlite3_bind_int(stmt, 1, photograph_id);
-                        sqlite3_bind_blob(
-                                stmt,
-                                2,
-                                con->jpeg_data.data(),
-                                static_cast<int>(con->data_size),
-                                SQLITE_TRANSIENT
+                        photograph_id = write_database(
+                                [con, &datetime](slide::connection& conn)
+                                {
+                                    slide::transaction tr(conn, "insertphotograph");
+                                    auto photograph = slide::row<std::string, std::string, std::string>::make_row(
+                                            con->title,
+                                            con->caption,
+                                            datetime
+                                            );
+                                    slide::devoid(
+                                            "INSERT INTO helios_photograph(title, caption, taken) "
+                                            "VALUES(?, ?, ?) ",
+                                            photograph,
+                                            conn
+                                            );
+                                    const int id = slide::last_insert_rowid(conn);
+                                    logger::debug() << "photograph id " << id;
+                                    auto photograph_location = slide::row<int, std::string>::make_row(
+                                            id,
+                                            con->location
+                                            );
+                                    logger::debug() << "photograph_location " << con->location;
+                                    slide::devoid(
+                                            "INSERT INTO helios_photograph_location(photograph_id, location) "
+                                            "VALUES(?, ?) ",
+                                            photograph_location,
+                                            conn
+                                            );
+                                    slide::devoid(
+                                            "INSERT INTO helios_jpeg_data(photograph_id, data) VALUES (?, ?)",
+                                            slide::row<int, slide::blob_view>::make_row(
+                                                id,
+                                                slide::blob_view(con->jpeg_data.data(), con->data_size)
+                                                ),
+                                            conn
+                                            );
+                                    tr.commit();
+                                    return id;
+                                }
                                 );
-                        slide::step(stmt);
-                        sqlite3_finalize(stmt);
-                        tr.commit();
                     }
                     catch(const std::exception& e)
                     {
-                        std::cerr << "error: inserting photograph into database: " << e.what() << std::endl;
+                        logger::error() << "inserting photograph into database: " << e.what();
                         throw webserver::public_exception(
                                 "failed to insert photograph into database"
                                 );
                     }
 
-                    MHD_destroy_post_processor(con->post_processor);
-                    delete con;
-
                     char response_data = 0;
                     struct MHD_Response *response = MHD_create_response_from_buffer(
                             0,
@@ -513,16 +769,34 @@ namespace
                             "Location",
                             (slide::mkstr() << "/photograph.html#" << photograph_id << ".inalbum.uncategorised").str().c_str()
                             );
-                    int ret = MHD_queue_response(connection, 303, response);
+                    int ret = webserver::queue_response(connection, 303, response, 0);
                     MHD_destroy_response(response);
                     return ret;
                 }
 
-                if(MHD_post_process(con->post_processor, upload_data, *upload_data_size) != MHD_YES)
-                    std::cerr << "post_process error" << std::endl;
+                if(!con->too_large)
+                {
+                    con->received += *upload_data_size;
+                    if(con->received > webserver::max_body_size())
+                    {
+                        con->too_large = true;
+                        std::vector<unsigned char>().swap(con->jpeg_data);
+                    }
+                    else if(MHD_post_process(con->post_processor, upload_data, *upload_data_size) != MHD_YES)
+                        logger::warning() << "post_process error";
+                }
                 *upload_data_size = 0;
                 return MHD_YES;
             }
+            void request_completed(void *con_cls) override
+            {
+                connection_status *con = reinterpret_cast<connection_status*>(con_cls);
+                if(con == nullptr)
+                    return;
+                if(con->post_processor != nullptr)
+                    MHD_destroy_post_processor(con->post_processor);
+                delete con;
+            }
         private:
     };
 
@@ -581,6 +855,76 @@ namespace rd_server
         // object.
         constexpr const char photograph_id[] = "photograph_id";
     }
+
+    /*
+     * The fixed queries used by the API, each prepared once per connection.
+     */
+    namespace query
+    {
+        namespace sql = ::schema::sql;
+
+        typedef slide::row<int, std::string, std::string, std::string, std::string, bool>
+            photograph_row;
+        // Lists are written straight to JSON as they are read, so their text
+        // is not copied.
+        typedef slide::row<int, slide::text_view, slide::text_view, slide::text_view, slide::text_view, bool>
+            photograph_view_row;
+
+        typedef slide::statement<sql::album_by_id, slide::row<int>, slide::row<int, std::string>>
+            album_by_id;
+        typedef slide::statement<sql::albums, slide::row<>, slide::row<int, slide::text_view>>
+            albums;
+        typedef slide::statement<sql::photograph_albums, slide::row<int>, slide::row<int, slide::text_view>>
+            photograph_albums;
+        typedef slide::statement<sql::photograph_albums_with_id, slide::row<int>, slide::row<int, slide::text_view, int>>
+            photograph_albums_with_id;
+        typedef slide::statement<sql::delete_photograph_albums, slide::row<int>, slide::row<>>
+            delete_photograph_albums;
+        typedef slide::statement<sql::insert_photograph_album, slide::row<int, int>, slide::row<>>
+            insert_photograph_album;
+        typedef slide::statement<sql::photograph_tags, slide::row<int>, slide::row<slide::text_view>>
+            photograph_tags;
+        typedef slide::statement<sql::delete_photograph_tags, slide::row<int>, slide::row<>>
+            delete_photograph_tags;
+        typedef slide::statement<sql::insert_photograph_tag, slide::row<int, std::string>, slide::row<>>
+            insert_photograph_tag;
+        typedef slide::statement<sql::album_photographs, slide::row<int>, photograph_view_row>
+            album_photographs;
+        typedef slide::statement<sql::uncategorised_photographs, slide::row<>, photograph_view_row>
+            uncategorised_photographs;
+        typedef slide::statement<sql::update_album, slide::row<int, std::string, int>, slide::row<>>
+            update_album;
+        typedef slide::statement<sql::insert_album, slide::row<std::string>, slide::row<>>
+            insert_album;
+        typedef slide::statement<sql::delete_album, slide::row<int>, slide::row<>>
+            delete_album;
+        typedef slide::statement<sql::photograph_by_id, slide::row<int>, photograph_row>
+            photograph_by_id;
+        typedef slide::statement<sql::photograph_summary, slide::row<int>, slide::row<int, std::string, std::string, std::string, bool>>
+            photograph_summary;
+        typedef slide::statement<sql::update_photograph, slide::row<std::string, std::string, std::string, int>, slide::row<>>
+            update_photograph;
+        typedef slide::statement<sql::update_photograph_location, slide::row<std::string, int>, slide::row<>>
+            update_photograph_location;
+        typedef slide::statement<sql::star_photograph, slide::row<int>, slide::row<>>
+            star_photograph;
+        typedef slide::statement<sql::unstar_photograph, slide::row<int>, slide::row<>>
+            unstar_photograph;
+        typedef slide::statement<sql::delete_photograph, slide::row<int>, slide::row<>>
+            delete_photograph;
+        typedef slide::statement<sql::tags, slide::row<>, slide::row<slide::text_view, int>>
+            tags;
+        typedef slide::statement<sql::tag_photographs, slide::row<std::string>, photograph_view_row>
+            tag_photographs;
+        typedef slide::statement<sql::years, slide::row<>, slide::row<int, int>>
+            years;
+        typedef slide::statement<sql::year_months, slide::row<int>, slide::row<int, int, int>>
+            year_months;
+        typedef slide::statement<sql::months, slide::row<>, slide::row<int, int, int>>
+            months;
+        typedef slide::statement<sql::month_photographs, slide::row<int, int>, slide::row<int, slide::text_view>>
+            month_photographs;
+    }
 }
 
 int main(const int argc, char * const argv[])
@@ -588,9 +932,19 @@ int main(const int argc, char * const argv[])
     using namespace rd_server;
 
     uint16_t port = 4000;
+    // Number of threads in the server's worker pool, or zero to create one
+    // thread per connection.
+    unsigned threads = 0;
+    // Number of database connections shared by the threads.
+    std::size_t pool_size = s_default_pool_size;
+    // Connection settings: a named profile, then individual options
+    // overriding it.
+    std::string db_profile = s_default_db_profile;
+    std::vector<std::string> db_options;
+    webserver::set_max_body_size(s_default_max_body_size);
 
     int option;
-    while((option = getopt(argc, argv, "p:d:")) != -1)
+    while((option = getopt(argc, argv, "p:d:t:c:P:O:l:b:")) != -1)
     {
         switch(option)
         {
@@ -610,16 +964,96 @@ int main(const int argc, char * const argv[])
                 if(optarg)
                     set_db_path(optarg);
                 break;
+            case 't':
+                if(optarg)
+                    try
+                    {
+                        threads = static_cast<unsigned>(
+                                std::stoul(optarg)
+                                );
+                    }
+                    catch(const std::exception&)
+                    {
+                    }
+                break;
+            case 'c':
+                if(optarg)
+                    try
+                    {
+                        pool_size = static_cast<std::size_t>(
+                                std::stoul(optarg)
+                                );
+                    }
+                    catch(const std::exception&)
+                    {
+                    }
+                break;
+            case 'P':
+                if(optarg)
+                    db_profile = optarg;
+                break;
+            case 'O':
+                if(optarg)
+                    db_options.push_back(optarg);
+                break;
+            case 'b':
+                if(optarg)
+                    try
+                    {
+                        webserver::set_max_body_size(
+                                static_cast<std::size_t>(std::stoul(optarg))
+                                );
+                    }
+                    catch(const std::exception&)
+                    {
+                    }
+                break;
+            case 'l':
+                if(optarg)
+                    try
+                    {
+                        logger::set_level(logger::parse_level(optarg));
+                    }
+                    catch(const std::exception& e)
+                    {
+                        std::cerr << e.what() << std::endl;
+                        return 1;
+                    }
+                break;
         }
     }
 
-    create_db();
+    slide::connection_options options;
+    try
+    {
+        options = slide::connection_options::profile(db_profile);
+        for(const std::string& o : db_options)
+            options.set(o);
+    }
+    catch(const slide::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    if(g_db_path_set)
+        g_pool.reset(
+                new slide::connection_pool(g_db_path, pool_size, s_pool_wait, options)
+                );
+    migrate_db();
+    release_database();
+    if(g_db_path_set)
+        g_writer.reset(new slide::write_queue(g_db_path, options));
+    g_stream_options = options;
+    g_stream_options.read_only = true;
+    g_stream_options.cache_size = -s_stream_cache_kib;
+    webserver::set_request_cleanup(&release_database);
 
     std::cerr << "Starting server on port " << port << "..." << std::endl;
 
     auto install_static_request_function = [](
             const std::string& url,
             const std::string& content,
+            const webserver::static_request_function::encodings_type& encodings,
             const std::string mimetype = "text/html"
             )
     {
@@ -628,6 +1062,7 @@ int main(const int argc, char * const argv[])
                 new webserver::static_request_function(
                     url,
                     content,
+                    encodings,
                     mimetype
                     )
                 )
@@ -639,28 +1074,29 @@ int main(const int argc, char * const argv[])
                 new webserver::static_request_function(
                     "",
                     WEB_STATIC_STD_STRING(web_404_html),
+                    WEB_STATIC_ENCODINGS(web_404_html),
                     "text/html"
                     )
                 )
             );
 
-    install_static_request_function("/", WEB_STATIC_STD_STRING(web_index_html));
-    install_static_request_function("/albums.html", WEB_STATIC_STD_STRING(web_albums_html));
-    install_static_request_function("/application.js", WEB_STATIC_STD_STRING(web_application_js), "text/javascript");
-    install_static_request_function("/backbone.js", WEB_STATIC_STD_STRING(web_backbone_js), "text/javascript");
-    install_static_request_function("/grid.css", WEB_STATIC_STD_STRING(web_grid_css), "text/css");
-    install_static_request_function("/index.html", WEB_STATIC_STD_STRING(web_index_html));
-    install_static_request_function("/jquery.js", WEB_STATIC_STD_STRING(web_jquery_js), "text/javascript");
-    install_static_request_function("/modal.css", WEB_STATIC_STD_STRING(web_modal_css), "text/css");
-    install_static_request_function("/modal.js", WEB_STATIC_STD_STRING(web_modal_js), "text/javascript");
-    install_static_request_function("/months.html", WEB_STATIC_STD_STRING(web_months_html));
-    install_static_request_function("/photograph.html", WEB_STATIC_STD_STRING(web_photograph_html));
-    install_static_request_function("/style.css", WEB_STATIC_STD_STRING(web_style_css), "text/css");
-    install_static_request_function("/tags.html", WEB_STATIC_STD_STRING(web_tags_html));
-    install_static_request_function("/teletype-theme.css", WEB_STATIC_STD_STRING(web_teletype_theme_css), "text/css");
-    install_static_request_function("/underscore.js", WEB_STATIC_STD_STRING(web_underscore_js), "text/javascript");
-    install_static_request_function("/views.js", WEB_STATIC_STD_STRING(web_views_js), "text/javascript");
-    //install_static_request_function("/", WEB_STATIC_STD_STRING(web_));
+    install_static_request_function("/", WEB_STATIC_STD_STRING(web_index_html), WEB_STATIC_ENCODINGS(web_index_html));
+    install_static_request_function("/albums.html", WEB_STATIC_STD_STRING(web_albums_html), WEB_STATIC_ENCODINGS(web_albums_html));
+    install_static_request_function("/application.js", WEB_STATIC_STD_STRING(web_application_js), WEB_STATIC_ENCODINGS(web_application_js), "text/javascript");
+    install_static_request_function("/backbone.js", WEB_STATIC_STD_STRING(web_backbone_js), WEB_STATIC_ENCODINGS(web_backbone_js), "text/javascript");
+    install_static_request_function("/grid.css", WEB_STATIC_STD_STRING(web_grid_css), WEB_STATIC_ENCODINGS(web_grid_css), "text/css");
+    install_static_request_function("/index.html", WEB_STATIC_STD_STRING(web_index_html), WEB_STATIC_ENCODINGS(web_index_html));
+    install_static_request_function("/jquery.js", WEB_STATIC_STD_STRING(web_jquery_js), WEB_STATIC_ENCODINGS(web_jquery_js), "text/javascript");
+    install_static_request_function("/modal.css", WEB_STATIC_STD_STRING(web_modal_css), WEB_STATIC_ENCODINGS(web_modal_css), "text/css");
+    install_static_request_function("/modal.js", WEB_STATIC_STD_STRING(web_modal_js), WEB_STATIC_ENCODINGS(web_modal_js), "text/javascript");
+    install_static_request_function("/months.html", WEB_STATIC_STD_STRING(web_months_html), WEB_STATIC_ENCODINGS(web_months_html));
+    install_static_request_function("/photograph.html", WEB_STATIC_STD_STRING(web_photograph_html), WEB_STATIC_ENCODINGS(web_photograph_html));
+    install_static_request_function("/style.css", WEB_STATIC_STD_STRING(web_style_css), WEB_STATIC_ENCODINGS(web_style_css), "text/css");
+    install_static_request_function("/tags.html", WEB_STATIC_STD_STRING(web_tags_html), WEB_STATIC_ENCODINGS(web_tags_html));
+    install_static_request_function("/teletype-theme.css", WEB_STATIC_STD_STRING(web_teletype_theme_css), WEB_STATIC_ENCODINGS(web_teletype_theme_css), "text/css");
+    install_static_request_function("/underscore.js", WEB_STATIC_STD_STRING(web_underscore_js), WEB_STATIC_ENCODINGS(web_underscore_js), "text/javascript");
+    install_static_request_function("/views.js", WEB_STATIC_STD_STRING(web_views_js), WEB_STATIC_ENCODINGS(web_views_js), "text/javascript");
+    //install_static_request_function("/", WEB_STATIC_STD_STRING(web_), WEB_STATIC_ENCODINGS(web_));
     webserver::install_request_function(
             webserver::request_function_ptr(
                 new webserver::text_request_function(
@@ -682,12 +1118,8 @@ int main(const int argc, char * const argv[])
 
                             try
                             {
-                                return slide::get_row<int, std::string>(
-                                        database(),
-                                        "SELECT album_id, name FROM helios_album "
-                                        " WHERE album_id = ? ",
-                                        slide::row<int>::make_row(id)
-                                        ).to_json<attr::id, attr::name>();
+                                return query::album_by_id::get_row(database(), id)
+                                    .to_json<attr::id, attr::name>();
                             }
                             catch(const slide::exception& e)
                             {
@@ -696,11 +1128,8 @@ int main(const int argc, char * const argv[])
                         }
                         else
                         {
-                            return slide::get_collection<int, std::string>(
-                                        database(),
-                                        "SELECT album_id, name FROM helios_album "
-                                        " ORDER BY name "
-                                        ).to_json<attr::id, attr::name>();
+                            return query::albums::open(database())
+                                .to_json<attr::id, attr::name>();
                         }
                     }
                     )
@@ -715,14 +1144,8 @@ int main(const int argc, char * const argv[])
                     [](const std::string& param, const std::string&) -> std::string
                     {
                         const int photograph_id = std::stoi(param);
-                        return slide::get_collection<int, std::string>(
-                                database(),
-                                "SELECT album_id, name FROM helios_album "
-                                "NATURAL JOIN helios_photograph_in_album "
-                                "WHERE photograph_id = ? "
-                                "ORDER BY name ",
-                                slide::row<int>::make_row(photograph_id)
-                                ).to_json<attr::id, attr::name>();
+                        return query::photograph_albums::open(database(), photograph_id)
+                            .to_json<attr::id, attr::name>();
                     }
                     )
                 )
@@ -736,31 +1159,29 @@ int main(const int argc, char * const argv[])
                     [](const std::string& param, const std::string& data) -> std::string
                     {
                         const int photograph_id = std::stoi(param);
-                        slide::transaction tr(database(), "albumphotograph");
-                        slide::devoid(
-                                "DELETE FROM helios_photograph_in_album "
-                                "WHERE photograph_id = ? ",
-                                slide::row<int>::make_row(photograph_id),
-                                database()
-                                );
                         auto c = slide::collection<int, int>
                             ::from_json<attr::photograph_id, attr::id>(data);
                         c.set_attr<0>(photograph_id);
-                        slide::devoid(
-                                "INSERT INTO helios_photograph_in_album(photograph_id, album_id) "
-                                "VALUES(?, ?) ",
-                                c,
-                                database()
+                        log_batch_failures(
+                                "album",
+                                write_database(
+                                    [photograph_id, &c](slide::connection& conn)
+                                    {
+                                        slide::transaction tr(conn, "albumphotograph");
+                                        query::delete_photograph_albums::devoid(conn, photograph_id);
+                                        slide::batch_result result =
+                                            query::insert_photograph_album::write_batch(
+                                                conn,
+                                                c,
+                                                slide::batch_options(slide::batch_mode::best_effort, true)
+                                                );
+                                        tr.commit();
+                                        return result;
+                                    }
+                                    )
                                 );
-                        tr.commit();
-                        return slide::get_collection<int, std::string, int>(
-                                database(),
-                                "SELECT album_id, name, photograph_id FROM helios_album "
-                                "NATURAL JOIN helios_photograph_in_album "
-                                "WHERE photograph_id = ? "
-                                "ORDER BY name ",
-                                slide::row<int>::make_row(photograph_id)
-                                ).to_json<attr::id, attr::name, attr::photograph_id>();
+                        return query::photograph_albums_with_id::open(database(), photograph_id)
+                            .to_json<attr::id, attr::name, attr::photograph_id>();
                     }
                     )
                 )
@@ -774,13 +1195,8 @@ int main(const int argc, char * const argv[])
                     [](const std::string& param, const std::string&) -> std::string
                     {
                         const int photograph_id = std::stoi(param);
-                        return slide::get_collection<std::string>(
-                                database(),
-                                "SELECT tag FROM helios_photograph_tagged "
-                                "WHERE photograph_id = ? "
-                                "ORDER BY tag ",
-                                slide::row<int>::make_row(photograph_id)
-                                ).to_json<attr::tag>();
+                        return query::photograph_tags::open(database(), photograph_id)
+                            .to_json<attr::tag>();
                     }
                     )
                 )
@@ -793,86 +1209,70 @@ int main(const int argc, char * const argv[])
                     "PUT",
                     [](const std::string& param, const std::string& data) -> std::string
                     {
-                        std::cerr << "update tags " << data << std::endl;
+                        logger::debug() << "update tags " << data;
                         const int photograph_id = std::stoi(param);
-                        slide::transaction tr(database(), "photographtagged");
-                        slide::devoid(
-                                "DELETE FROM helios_photograph_tagged "
-                                "WHERE photograph_id = ? ",
-                                slide::row<int>::make_row(photograph_id),
-                                database()
-                                );
                         auto c = slide::collection<int, std::string>::from_json<attr::id, attr::tag>(data);
                         c.set_attr<0>(photograph_id);
-                        for(slide::row<int, std::string> r : c)
-                            std::cerr << "row " << r.get<0>() << " " << r.get<1>() << std::endl;
-                        slide::devoid(
-                                "INSERT INTO helios_photograph_tagged(photograph_id, tag) "
-                                "VALUES(?, ?) ",
-                                c,
-                                database()
+                        for(const slide::row<int, std::string>& r : c)
+                            logger::debug() << "row " << r.get<0>() << " " << r.get<1>();
+                        log_batch_failures(
+                                "tag",
+                                write_database(
+                                    [photograph_id, &c](slide::connection& conn)
+                                    {
+                                        slide::transaction tr(conn, "photographtagged");
+                                        query::delete_photograph_tags::devoid(conn, photograph_id);
+                                        slide::batch_result result =
+                                            query::insert_photograph_tag::write_batch(
+                                                conn,
+                                                c,
+                                                slide::batch_options(slide::batch_mode::best_effort, true)
+                                                );
+                                        tr.commit();
+                                        return result;
+                                    }
+                                    )
                                 );
-                        tr.commit();
-                        return slide::get_collection<std::string>(
-                                database(),
-                                "SELECT tag FROM helios_photograph_tagged "
-                                "WHERE photograph_id = ? "
-                                "ORDER BY tag ",
-                                slide::row<int>::make_row(photograph_id)
-                                ).to_json<attr::tag>();
+                        return query::photograph_tags::open(database(), photograph_id)
+                            .to_json<attr::tag>();
                     }
                     )
                 )
             );
-    // Get a list of photographs in an album.
+    // Get a list of photographs in an album.  Albums can be large, so the
+    // list is streamed from the query, without a collection.
     webserver::install_request_function(
             webserver::request_function_ptr(
-                new webserver::text_request_function(
+                new webserver::stream_request_function(
                     "/api/album_photograph",
-                    "GET",
-                    [](const std::string& param, const std::string&) -> std::string
+                    [](const std::string& param)
                     {
                         const int album_id = std::stoi(param);
-                        return slide::get_collection<int, std::string, std::string, std::string, std::string, bool>(
-                                database(),
-                                "SELECT helios_photograph.photograph_id, "
-                                " title, caption, location, taken, "
-                                " (helios_photograph_starred.photograph_id IS NOT NULL) AS starred "
-                                "FROM helios_photograph "
-                                "JOIN helios_photograph_in_album "
-                                "ON helios_photograph.photograph_id = helios_photograph_in_album.photograph_id "
-                                "LEFT OUTER JOIN helios_photograph_location "
-                                "ON helios_photograph.photograph_id = helios_photograph_location.photograph_id "
-                                "LEFT OUTER JOIN helios_photograph_starred "
-                                "ON helios_photograph.photograph_id = helios_photograph_starred.photograph_id "
-                                "WHERE album_id = ?",
-                                slide::row<int>::make_row(album_id)
-                                ).to_json<attr::id, attr::title, attr::caption, attr::location, attr::taken, attr::starred>();
-                    }
+                        return json_array<query::album_photographs, attr::id, attr::title, attr::caption, attr::location, attr::taken, attr::starred>(
+                                album_id
+                                );
+                    },
+                    "application/json",
+                    webserver::stream_request_function::etag_function_type(),
+                    "",
+                    false,
+                    webserver::cost_class::json
                     )
                 )
             );
     webserver::install_request_function(
             webserver::request_function_ptr(
-                new webserver::text_request_function(
+                new webserver::stream_request_function(
                     "/api/album_photograph/uncategorised",
-                    "GET",
-                    [](const std::string&, const std::string&) -> std::string
+                    [](const std::string&)
                     {
-                        return slide::get_collection<int, std::string, std::string, std::string, std::string, bool>(
-                                database(),
-                                "SELECT helios_photograph.photograph_id, title, caption, location, taken, "
-                                " (helios_photograph_starred.photograph_id IS NOT NULL) AS starred "
-                                "FROM helios_photograph "
-                                "LEFT OUTER JOIN helios_photograph_location "
-                                "ON helios_photograph.photograph_id = helios_photograph_location.photograph_id "
-                                "LEFT OUTER JOIN helios_photograph_in_album "
-                                "ON helios_photograph.photograph_id = helios_photograph_in_album.photograph_id "
-                                "LEFT OUTER JOIN helios_photograph_starred "
-                                "ON helios_photograph.photograph_id = helios_photograph_starred.photograph_id "
-                                "WHERE album_id IS NULL"
-                                ).to_json<attr::id, attr::title, attr::caption, attr::location, attr::taken, attr::starred>();
-                    }
+                        return json_array<query::uncategorised_photographs, attr::id, attr::title, attr::caption, attr::location, attr::taken, attr::starred>();
+                    },
+                    "application/json",
+                    webserver::stream_request_function::etag_function_type(),
+                    "",
+                    false,
+                    webserver::cost_class::json
                     )
                 )
             );
@@ -885,19 +1285,19 @@ int main(const int argc, char * const argv[])
                     {
                         if(std::stoi(param) != slide::row<int>::from_json<attr::id>(post).get<0>())
                             throw webserver::public_exception("Ids don't match");
+                        const auto album = slide::row<int, std::string>
+                            ::from_json<attr::id, attr::name>(post)
+                            .cat(slide::row<int>::make_row(std::stoi(param)));
                         if(
-                                slide::devoid(
-                                    "UPDATE helios_album SET album_id = ?, name = ? "
-                                    " WHERE album_id = ? ",
-                                    slide::row<std::string, int>
-                                        ::from_json<attr::id, attr::name>(post)
-                                        .cat(slide::row<int>::make_row(std::stoi(param))),
-                                    database()
+                                write_database(
+                                    [&album](slide::connection& conn)
+                                    {
+                                        return query::update_album::devoid(conn, album);
+                                    }
                                     ) > 0
                           )
-                            return slide::get_row<int, std::string>(
+                            return query::album_by_id::get_row(
                                     database(),
-                                    "SELECT album_id, name FROM helios_album WHERE album_id = ? ",
                                     slide::row<int>::from_json<attr::id>(post)
                                     ).to_json<attr::id, attr::name>();
                         throw webserver::public_exception("Updating album");
@@ -912,16 +1312,16 @@ int main(const int argc, char * const argv[])
                     "POST",
                     [](const std::string&, const std::string& data)
                     {
-                        slide::devoid(
-                            "INSERT INTO helios_album(name) values(?)",
-                            slide::row<std::string>::from_json<attr::name>(data),
-                            database()
-                            );
-                        return slide::get_row<int, std::string>(
-                                database(),
-                                "SELECT album_id, name FROM helios_album WHERE album_id = ? ",
-                                slide::row<int>::make_row(slide::last_insert_rowid(database()))
-                                ).to_json<attr::id, attr::name>();
+                        const auto album = slide::row<std::string>::from_json<attr::name>(data);
+                        const int album_id = write_database(
+                                [&album](slide::connection& conn)
+                                {
+                                    query::insert_album::devoid(conn, album);
+                                    return slide::last_insert_rowid(conn);
+                                }
+                                );
+                        return query::album_by_id::get_row(database(), album_id)
+                            .to_json<attr::id, attr::name>();
                     }
                     )
                 )
@@ -933,11 +1333,13 @@ int main(const int argc, char * const argv[])
                     "DELETE",
                     [](const std::string& param, const std::string&)
                     {
+                        const int album_id = std::stoi(param);
                         if(
-                                slide::devoid(
-                                    "DELETE FROM helios_album WHERE album_id = ?",
-                                    slide::row<int>::make_row(std::stoi(param)),
-                                    database()
+                                write_database(
+                                    [album_id](slide::connection& conn)
+                                    {
+                                        return query::delete_album::devoid(conn, album_id);
+                                    }
                                     ) > 0
                           )
                             return "deleted";
@@ -954,18 +1356,8 @@ int main(const int argc, char * const argv[])
                     [](const std::string& param, const std::string&)
                     {
                         if(param.length())
-                            return slide::get_row<int, std::string, std::string, std::string, std::string, bool>(
-                                    database(),
-                                    "SELECT helios_photograph.photograph_id, title, caption, location, taken, "
-                                    " (helios_photograph_starred.photograph_id IS NOT NULL) AS starred "
-                                    "FROM helios_photograph "
-                                    "LEFT OUTER JOIN helios_photograph_location "
-                                    "ON helios_photograph.photograph_id = helios_photograph_location.photograph_id "
-                                    "LEFT OUTER JOIN helios_photograph_starred "
-                                    "ON helios_photograph.photograph_id = helios_photograph_starred.photograph_id "
-                                    "WHERE helios_photograph.photograph_id = ?",
-                                    slide::row<int>::make_row(std::stoi(param))
-                                    ).to_json<attr::id, attr::title, attr::caption, attr::location, attr::taken, attr::starred>();
+                            return query::photograph_by_id::get_row(database(), std::stoi(param))
+                                .to_json<attr::id, attr::title, attr::caption, attr::location, attr::taken, attr::starred>();
                         else
                             throw webserver::public_exception("can't get all photographs");
                     }
@@ -980,71 +1372,58 @@ int main(const int argc, char * const argv[])
                     [](const std::string& /*param*/, const std::string& data)
                     {
                         // TODO param should match id in JSON
-                        slide::transaction tr(database(), "putphotograph");
-                        try
-                        {
-                            slide::devoid(
-                                "UPDATE helios_photograph SET title = ?, "
-                                "caption = ?, "
-                                "taken = ? "
-                                "WHERE photograph_id = ?",
-                                slide::row<std::string, std::string, std::string, int>
-                                    ::from_json<attr::title, attr::caption, attr::taken, attr::id>(data),
-                                database()
-                                );
-                        }
-                        catch(const slide::exception&)
-                        {
-                            throw webserver::public_exception("Updating basic photograph details.");
-                        }
-                        try
-                        {
-                            slide::devoid(
-                                "UPDATE helios_photograph_location SET location = ? "
-                                "WHERE photograph_id = ?",
-                                slide::row<std::string, int>
-                                    ::from_json<attr::location, attr::id>(data),
-                                database()
+                        write_database(
+                                [&data](slide::connection& conn)
+                                {
+                                    slide::transaction tr(conn, "putphotograph");
+                                    try
+                                    {
+                                        query::update_photograph::devoid(
+                                            conn,
+                                            slide::row<std::string, std::string, std::string, int>
+                                                ::from_json<attr::title, attr::caption, attr::taken, attr::id>(data)
+                                            );
+                                    }
+                                    catch(const slide::exception&)
+                                    {
+                                        throw webserver::public_exception("Updating basic photograph details.");
+                                    }
+                                    try
+                                    {
+                                        query::update_photograph_location::devoid(
+                                            conn,
+                                            slide::row<std::string, int>
+                                                ::from_json<attr::location, attr::id>(data)
+                                            );
+                                    }
+                                    catch(const slide::exception&)
+                                    {
+                                        throw webserver::public_exception("Updating photograph location.");
+                                    }
+                                    try
+                                    {
+                                        const slide::row<bool> starred =
+                                            slide::row<bool>::from_json<attr::starred>(data);
+                                        if(starred.get<0>())
+                                            query::star_photograph::devoid(
+                                                conn,
+                                                slide::row<int>::from_json<attr::id>(data)
+                                                );
+                                        else
+                                            query::unstar_photograph::devoid(
+                                                conn,
+                                                slide::row<int>::from_json<attr::id>(data)
+                                                );
+                                    }
+                                    catch(const slide::exception&)
+                                    {
+                                        throw webserver::public_exception("Updating photograph starred.");
+                                    }
+                                    tr.commit();
+                                }
                                 );
-                        }
-                        catch(const slide::exception&)
-                        {
-                            throw webserver::public_exception("Updating photograph location.");
-                        }
-                        try
-                        {
-                            const slide::row<bool> starred =
-                                slide::row<bool>::from_json<attr::starred>(data);
-                            if(starred.get<0>())
-                                slide::devoid(
-                                    "INSERT OR REPLACE INTO helios_photograph_starred(photograph_id) "
-                                    "VALUES(?)",
-                                    slide::row<int>::from_json<attr::id>(data),
-                                    database()
-                                    );
-                            else
-                                slide::devoid(
-                                    "DELETE FROM helios_photograph_starred "
-                                    "WHERE photograph_id = ?",
-                                    slide::row<int>::from_json<attr::id>(data),
-                                    database()
-                                    );
-                        }
-                        catch(const slide::exception&)
-                        {
-                            throw webserver::public_exception("Updating photograph starred.");
-                        }
-                        tr.commit();
-                        return slide::get_row<int, std::string, std::string, std::string, bool>(
+                        return query::photograph_summary::get_row(
                                 database(),
-                                "SELECT helios_photograph.photograph_id, title, taken, location, "
-                                " (helios_photograph_starred.photograph_id IS NOT NULL) AS starred "
-                                "FROM helios_photograph "
-                                "LEFT OUTER JOIN helios_photograph_location "
-                                "ON helios_photograph.photograph_id = helios_photograph_location.photograph_id "
-                                "LEFT OUTER JOIN helios_photograph_starred "
-                                "ON helios_photograph.photograph_id = helios_photograph_starred.photograph_id "
-                                "WHERE helios_photograph.photograph_id = ? ",
                                 slide::row<int>::from_json<attr::id>(data)
                                 ).to_json<attr::id, attr::title, attr::taken, attr::location, attr::starred>();
                     }
@@ -1053,43 +1432,54 @@ int main(const int argc, char * const argv[])
             );
     webserver::install_request_function(
             webserver::request_function_ptr(
-                new webserver::text_request_function(
+                new webserver::stream_request_function(
                     "/photograph/small",
-                    "GET",
-                    [](const std::string& param, const std::string&)
+                    [](const std::string& param)
                     {
-                        std::vector<unsigned char> jpeg = get_small_jpeg(std::stoi(param));
-                        return std::string(reinterpret_cast<const char*>(jpeg.data()), jpeg.size());
+                        const int photograph_id = std::stoi(param);
+                        ensure_cached_jpeg(photograph_id, s_small_jpeg);
+                        return webserver::content_reader_ptr(
+                            new jpeg_reader(photograph_id, s_small_jpeg.name)
+                            );
                     },
-                    "image/jpeg"
+                    "image/jpeg",
+                    image_etag("small"),
+                    s_image_cache_control
                     )
                 )
             );
     webserver::install_request_function(
             webserver::request_function_ptr(
-                new webserver::text_request_function(
+                new webserver::stream_request_function(
                     "/photograph/medium",
-                    "GET",
-                    [](const std::string& param, const std::string&)
+                    [](const std::string& param)
                     {
-                        std::vector<unsigned char> jpeg = get_medium_jpeg(std::stoi(param));
-                        return std::string(reinterpret_cast<const char*>(jpeg.data()), jpeg.size());
+                        const int photograph_id = std::stoi(param);
+                        ensure_cached_jpeg(photograph_id, s_medium_jpeg);
+                        return webserver::content_reader_ptr(
+                            new jpeg_reader(photograph_id, s_medium_jpeg.name)
+                            );
                     },
-                    "image/jpeg"
+                    "image/jpeg",
+                    image_etag("medium"),
+                    s_image_cache_control
                     )
                 )
             );
     webserver::install_request_function(
             webserver::request_function_ptr(
-                new webserver::text_request_function(
+                new webserver::stream_request_function(
                     "/photograph/original",
-                    "GET",
-                    [](const std::string& param, const std::string&)
+                    [](const std::string& param)
                     {
-                        std::vector<unsigned char> jpeg = get_fullsize_jpeg(std::stoi(param));
-                        return std::string(reinterpret_cast<const char*>(jpeg.data()), jpeg.size());
+                        return webserver::content_reader_ptr(
+                            new jpeg_reader(std::stoi(param), "helios_jpeg_data")
+                            );
                     },
-                    "image/jpeg"
+                    "image/jpeg",
+                    image_etag("original"),
+                    s_image_cache_control,
+                    true
                     )
                 )
             );
@@ -1100,13 +1490,14 @@ int main(const int argc, char * const argv[])
                     "DELETE",
                     [](const std::string& param, const std::string&)
                     {
+                        const int photograph_id = std::stoi(param);
                         if(
-                                slide::devoid(
-                                    "DELETE FROM helios_photograph WHERE photograph_id = ?",
-                                    slide::row<int>::make_row(std::stoi(param)),
-                                    database()
-                                    )
-                                < 1
+                                write_database(
+                                    [photograph_id](slide::connection& conn)
+                                    {
+                                        return query::delete_photograph::devoid(conn, photograph_id);
+                                    }
+                                    ) < 1
                           )
                             throw webserver::public_exception("Deleting photograph");
 
@@ -1122,42 +1513,29 @@ int main(const int argc, char * const argv[])
                     "GET",
                     [](const std::string&, const std::string&)
                     {
-                        return slide::get_collection<std::string, int>(
-                                database(),
-                                "SELECT tag, COUNT(photograph_id) "
-                                "FROM helios_photograph_tagged "
-                                "WHERE tag IS NOT NULL AND tag != '' "
-                                "GROUP BY helios_photograph_tagged.tag "
-                                ).to_json<attr::tag, attr::count>();
+                        return query::tags::open(database())
+                            .to_json<attr::tag, attr::count>();
                     }
                     )
                 )
             );
     webserver::install_request_function(
             webserver::request_function_ptr(
-                new webserver::text_request_function(
+                new webserver::stream_request_function(
                     "/api/tag_photograph",
-                    "GET",
-                    [](const std::string& param, const std::string&)
+                    [](const std::string& param)
                     {
                         // TODO unescape
-                        std::string tag = param;
-                        return slide::get_collection<int, std::string, std::string, std::string, std::string, bool>(
-                                database(),
-                                "SELECT helios_photograph.photograph_id, "
-                                " title, caption, location, taken, "
-                                " (helios_photograph_starred.photograph_id IS NOT NULL) AS starred "
-                                "FROM helios_photograph "
-                                "JOIN helios_photograph_tagged "
-                                "LEFT OUTER JOIN helios_photograph_location "
-                                "ON helios_photograph.photograph_id = helios_photograph_location.photograph_id "
-                                "LEFT OUTER JOIN helios_photograph_starred "
-                                "ON helios_photograph.photograph_id = helios_photograph_starred.photograph_id "
-                                "WHERE tag LIKE ? "
-                                "AND helios_photograph.photograph_id = helios_photograph_tagged.photograph_id ",
-                                slide::row<std::string>::make_row(tag)
-                                ).to_json<attr::id, attr::title, attr::caption, attr::location, attr::taken, attr::starred>();
-                    }
+                        const std::string& tag = param;
+                        return json_array<query::tag_photographs, attr::id, attr::title, attr::caption, attr::location, attr::taken, attr::starred>(
+                                tag
+                                );
+                    },
+                    "application/json",
+                    webserver::stream_request_function::etag_function_type(),
+                    "",
+                    false,
+                    webserver::cost_class::json
                     )
                 )
             );
@@ -1173,31 +1551,13 @@ int main(const int argc, char * const argv[])
                     {
                         if(param == "")
                         {
-                            return slide::get_collection<int, int>(
-                                    database(),
-                                    "SELECT "
-                                    "CAST(substr(taken, 1, 4) AS INTEGER) AS year, "
-                                    "count(photograph_id) AS photograph_count "
-                                    "FROM helios_photograph "
-                                    "WHERE year != 0 "
-                                    "GROUP BY year "
-                                    "ORDER BY year"
-                                    ).to_json<attr::year, attr::photograph_count>();
+                            return query::years::open(database())
+                                .to_json<attr::year, attr::photograph_count>();
                             }
                             else
                             {
-                                return slide::get_collection<int, int, int>(
-                                        database(),
-                                        "SELECT "
-                                        "CAST(substr(taken, 1, 4) AS INTEGER) AS year, "
-                                        "CAST(substr(taken, 6, 2) AS INTEGER) AS month, "
-                                        "count(photograph_id) AS photograph_count "
-                                        "FROM helios_photograph "
-                                        "WHERE year == ? "
-                                        "GROUP BY year, month "
-                                        "ORDER BY year, month",
-                                        slide::row<std::string>::make_row(param)
-                                        ).to_json<attr::year, attr::month, attr::photograph_count>();
+                                return query::year_months::open(database(), parse_year(param))
+                                    .to_json<attr::year, attr::month, attr::photograph_count>();
                             }
                     }
                     )
@@ -1212,40 +1572,46 @@ int main(const int argc, char * const argv[])
                     {
                         if(param == "")
                         {
-                            return slide::get_collection<int, int, int>(
-                                    database(),
-                                    "SELECT "
-                                    "CAST(substr(taken, 1, 4) AS INTEGER) AS year, "
-                                    "CAST(substr(taken, 6, 2) AS INTEGER) AS month, "
-                                    "count(photograph_id) AS photograph_count "
-                                    "FROM helios_photograph "
-                                    "WHERE year != 0 "
-                                    "GROUP BY year, month "
-                                    "ORDER BY year, month"
-                                    ).to_json<attr::year, attr::month, attr::photograph_count>();
+                            return query::months::open(database())
+                                .to_json<attr::year, attr::month, attr::photograph_count>();
                         }
                         else
                         {
-                            return slide::get_collection<int, std::string>(
-                                database(),
-                                "SELECT photograph_id, title FROM helios_photograph "
-                                "WHERE substr(taken, 1, 7) = ? "
-                                "ORDER BY taken",
-                                slide::row<std::string>::make_row(param)
-                                ).to_json<attr::id, attr::title>();
+                            const std::pair<int, int> month = parse_month(param);
+                            return query::month_photographs::open(
+                                    database(), month.first, month.second
+                                    )
+                                .to_json<attr::id, attr::title>();
                         }
                     }
                     )
                 )
             );
+    // Request counts, latencies and other metrics, for Prometheus.
+    webserver::install_request_function(
+            webserver::request_function_ptr(
+                new webserver::text_request_function(
+                    "/metrics",
+                    "GET",
+                    [](const std::string&, const std::string&)
+                    {
+                        return metrics::prometheus_text();
+                    },
+                    metrics::prometheus_content_type
+                    )
+                )
+            );
 
-    webserver::start_server(port);
+    webserver::start_server(port, threads);
 
     std::cerr << "Server started, press return to exit." << std::endl;
     std::cin.get();
     std::cerr << "Shutting down..." << std::endl;
 
     webserver::stop_server();
+    g_writer.reset();
+    g_pool.reset();
+    logger::flush();
 
     return 0;
 }
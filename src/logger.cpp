@@ -0,0 +1,626 @@
+#include "logger.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <stdexcept>
+#include <streambuf>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    // Room for the text of a message, or the URL of an access log record.
+    const std::size_t s_text_size = 240;
+    // Number of records in each thread's buffer.
+    const std::size_t s_ring_size = 128;
+    // Time between the background thread draining the buffers while
+    // records are being logged.
+    const std::chrono::milliseconds s_drain_interval(10);
+
+    std::atomic<int> g_level(static_cast<int>(logger::level::info));
+    std::atomic<uint64_t> g_dropped(0);
+    // Set by the background thread when it finds nothing to write and goes
+    // to sleep, and cleared by the first thread to publish a record after
+    // that, which wakes it.
+    std::atomic<bool> g_idle(false);
+
+    struct record
+    {
+        // Nanoseconds since the epoch.
+        int64_t time;
+        logger::level level;
+        // If true, this is an access log record and text holds the URL.
+        bool access;
+        unsigned status;
+        uint64_t bytes;
+        uint64_t duration_us;
+        char method[8];
+        std::size_t text_length;
+        char text[s_text_size];
+    };
+
+    int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()
+                ).count();
+    }
+
+    /*
+     * A single producer, single consumer queue of records.  The owning thread
+     * is the only producer; the consumer is whoever holds g_drain_mutex.
+     */
+    class ring
+    {
+        public:
+            ring() :
+                m_head(0),
+                m_tail(0),
+                m_orphaned(false)
+            {
+            }
+            /*
+             * Get the record to fill in next, or nullptr if the ring is full.
+             */
+            record *claim()
+            {
+                const std::size_t head = m_head.load(std::memory_order_relaxed);
+                if(head - m_tail.load(std::memory_order_acquire) == s_ring_size)
+                    return nullptr;
+                return &(m_records[head % s_ring_size]);
+            }
+            /*
+             * Make the claimed record available to the consumer.
+             */
+            void publish()
+            {
+                m_head.store(
+                        m_head.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_release
+                        );
+            }
+            const record *front() const
+            {
+                const std::size_t tail = m_tail.load(std::memory_order_relaxed);
+                if(tail == m_head.load(std::memory_order_acquire))
+                    return nullptr;
+                return &(m_records[tail % s_ring_size]);
+            }
+            void pop()
+            {
+                m_tail.store(
+                        m_tail.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_release
+                        );
+            }
+            /*
+             * Called when the owning thread exits.  The ring is deleted once
+             * it has been drained.
+             */
+            void orphan()
+            {
+                m_orphaned.store(true, std::memory_order_release);
+            }
+            bool orphaned() const
+            {
+                return m_orphaned.load(std::memory_order_acquire);
+            }
+        private:
+            record m_records[s_ring_size];
+            std::atomic<std::size_t> m_head;
+            std::atomic<std::size_t> m_tail;
+            std::atomic<bool> m_orphaned;
+    };
+
+    const char *level_name(const logger::level l)
+    {
+        switch(l)
+        {
+            case logger::level::debug:
+                return "DEBUG";
+            case logger::level::info:
+                return "INFO";
+            case logger::level::warning:
+                return "WARNING";
+            case logger::level::error:
+                return "ERROR";
+        }
+        return "";
+    }
+
+    /*
+     * Append the text of a message to out, with backslashes and control
+     * characters escaped, so that text taken from a request (such as a
+     * decoded path) cannot end the line or start a forged one.
+     */
+    void escape_message(const char *text, const std::size_t length, std::string& out)
+    {
+        static const char hex[] = "0123456789abcdef";
+        for(std::size_t i = 0; i < length; ++i)
+        {
+            const unsigned char c = static_cast<unsigned char>(text[i]);
+            switch(c)
+            {
+                case '\\':
+                    out += "\\\\";
+                    break;
+                case '\n':
+                    out += "\\n";
+                    break;
+                case '\r':
+                    out += "\\r";
+                    break;
+                case '\t':
+                    out += "\\t";
+                    break;
+                default:
+                    if(c < ' ' || c == 0x7f)
+                    {
+                        out += "\\x";
+                        out += hex[c >> 4];
+                        out += hex[c & 0xf];
+                    }
+                    else
+                        out += static_cast<char>(c);
+            }
+        }
+    }
+
+    /*
+     * Append a record, formatted as a line of text, to out.
+     */
+    void format(const record& r, std::string& out)
+    {
+        const std::time_t seconds = static_cast<std::time_t>(r.time / 1000000000);
+        std::tm tm;
+        gmtime_r(&seconds, &tm);
+        char time_str[32];
+        const std::size_t time_length = std::strftime(
+                time_str,
+                sizeof(time_str),
+                "%Y-%m-%dT%H:%M:%S",
+                &tm
+                );
+        out.append(time_str, time_length);
+        char buf[96];
+        std::snprintf(
+                buf,
+                sizeof(buf),
+                ".%03dZ ",
+                static_cast<int>((r.time / 1000000) % 1000)
+                );
+        out += buf;
+
+        if(r.access)
+        {
+            out += "access method=";
+            logger::escape_field(r.method, std::strlen(r.method), out);
+            out += " path=";
+            logger::escape_field(r.text, r.text_length, out);
+            std::snprintf(
+                    buf,
+                    sizeof(buf),
+                    " status=%u bytes=%llu duration_us=%llu",
+                    r.status,
+                    static_cast<unsigned long long>(r.bytes),
+                    static_cast<unsigned long long>(r.duration_us)
+                    );
+            out += buf;
+        }
+        else
+        {
+            out += level_name(r.level);
+            out += ' ';
+            escape_message(r.text, r.text_length, out);
+        }
+        out += '\n';
+    }
+
+    std::mutex g_registry_mutex;
+    std::vector<ring*> g_rings;
+
+    // Held while draining, making the draining thread the only consumer.
+    std::mutex g_drain_mutex;
+    // Where records are written.  Guarded by g_drain_mutex.
+    std::FILE *g_output = stderr;
+
+    /*
+     * Write out every queued record.  Returns the number of records written.
+     */
+    std::size_t drain()
+    {
+        std::lock_guard<std::mutex> drain_lock(g_drain_mutex);
+
+        std::vector<ring*> rings;
+        {
+            std::lock_guard<std::mutex> lock(g_registry_mutex);
+            rings = g_rings;
+        }
+
+        std::string out;
+        std::size_t n = 0;
+        std::vector<ring*> finished;
+        for(ring *r : rings)
+        {
+            // Check before draining, so no record can be published after the
+            // ring is found to be empty.
+            const bool orphaned = r->orphaned();
+            while(const record *rec = r->front())
+            {
+                format(*rec, out);
+                r->pop();
+                ++n;
+            }
+            if(orphaned)
+                finished.push_back(r);
+        }
+
+        if(!out.empty())
+        {
+            std::fwrite(out.data(), 1, out.length(), g_output);
+            std::fflush(g_output);
+        }
+
+        if(!finished.empty())
+        {
+            std::lock_guard<std::mutex> lock(g_registry_mutex);
+            for(ring *r : finished)
+            {
+                for(auto it = g_rings.begin(); it != g_rings.end(); ++it)
+                    if(*it == r)
+                    {
+                        g_rings.erase(it);
+                        break;
+                    }
+                delete r;
+            }
+        }
+        return n;
+    }
+
+    /*
+     * Owns the background thread, which is started when the first ring is
+     * created and stopped (after a final drain) when the program exits.
+     * While records are being logged it drains the buffers at intervals, so
+     * logging threads never have to wake it; once a drain finds nothing to
+     * write, it sleeps until a record is published.
+     */
+    class drainer
+    {
+        public:
+            drainer() :
+                m_started(false),
+                m_stop(false)
+            {
+            }
+            ~drainer()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_stop = true;
+                }
+                m_condition.notify_all();
+                if(m_thread.joinable())
+                    m_thread.join();
+                drain();
+            }
+            /*
+             * Start the background thread if it is not running.  Must be
+             * called with g_registry_mutex held.
+             */
+            void start()
+            {
+                if(m_started)
+                    return;
+                m_started = true;
+                m_thread = std::thread(&drainer::run, this);
+            }
+            /*
+             * Wake the background thread after clearing g_idle.
+             */
+            void wake()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                }
+                m_condition.notify_one();
+            }
+        private:
+            void run()
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while(!m_stop)
+                {
+                    lock.unlock();
+                    std::size_t n = drain();
+                    if(n == 0)
+                    {
+                        // Drain again after setting the flag, as a record
+                        // published before it was set would not wake this
+                        // thread.
+                        g_idle.store(true, std::memory_order_seq_cst);
+                        n = drain();
+                        if(n > 0)
+                            g_idle.store(false, std::memory_order_relaxed);
+                    }
+                    lock.lock();
+                    if(n > 0)
+                        m_condition.wait_for(lock, s_drain_interval, [this]() { return m_stop; });
+                    else
+                        m_condition.wait(
+                                lock,
+                                [this]()
+                                {
+                                    return m_stop || !g_idle.load(std::memory_order_relaxed);
+                                }
+                                );
+                }
+            }
+
+            bool m_started;
+            bool m_stop;
+            std::mutex m_mutex;
+            std::condition_variable m_condition;
+            std::thread m_thread;
+    };
+
+    drainer g_drainer;
+
+    /*
+     * The calling thread's ring, created when the thread first logs.
+     */
+    class thread_ring
+    {
+        public:
+            thread_ring() :
+                m_ring(nullptr)
+            {
+            }
+            ~thread_ring()
+            {
+                if(m_ring != nullptr)
+                    m_ring->orphan();
+            }
+            ring& get()
+            {
+                if(m_ring == nullptr)
+                {
+                    m_ring = new ring;
+                    std::lock_guard<std::mutex> lock(g_registry_mutex);
+                    g_rings.push_back(m_ring);
+                    g_drainer.start();
+                }
+                return *m_ring;
+            }
+        private:
+            ring *m_ring;
+    };
+
+    thread_local thread_ring t_ring;
+
+    /*
+     * Make the record claimed from this thread's ring available, and wake
+     * the background thread if it is asleep.
+     */
+    void publish()
+    {
+        t_ring.get().publish();
+        // Pairs with the background thread setting g_idle before its last
+        // drain: either that drain sees the record, or this thread sees the
+        // flag set.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(g_idle.load(std::memory_order_relaxed) &&
+                g_idle.exchange(false, std::memory_order_acq_rel))
+            g_drainer.wake();
+    }
+
+    /*
+     * A stream buffer writing into a fixed size array, silently discarding
+     * anything that does not fit.
+     */
+    class line_buffer : public std::streambuf
+    {
+        public:
+            line_buffer()
+            {
+                reset();
+            }
+            void reset()
+            {
+                setp(m_buffer, m_buffer + s_text_size);
+            }
+            const char *data() const
+            {
+                return pbase();
+            }
+            std::size_t length() const
+            {
+                return static_cast<std::size_t>(pptr() - pbase());
+            }
+        protected:
+            int_type overflow(int_type c) override
+            {
+                return traits_type::not_eof(c);
+            }
+        private:
+            char m_buffer[s_text_size];
+    };
+
+    /*
+     * The stream used to format lines on this thread.
+     */
+    struct line_stream
+    {
+        line_buffer buffer;
+        std::ostream stream;
+        // True while a line is being formatted.
+        bool in_use;
+
+        line_stream() :
+            stream(&buffer),
+            in_use(false)
+        {
+        }
+    };
+
+    thread_local line_stream t_line_stream;
+
+    void queue_text(const logger::level l, const char *text, const std::size_t length)
+    {
+        record *r = t_ring.get().claim();
+        if(r == nullptr)
+        {
+            g_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        r->time = now();
+        r->level = l;
+        r->access = false;
+        r->text_length = std::min(length, s_text_size);
+        std::memcpy(r->text, text, r->text_length);
+        publish();
+    }
+}
+
+void logger::set_level(const level l)
+{
+    g_level.store(static_cast<int>(l), std::memory_order_relaxed);
+}
+
+logger::level logger::parse_level(const std::string& name)
+{
+    if(name == "debug")
+        return level::debug;
+    if(name == "info")
+        return level::info;
+    if(name == "warning")
+        return level::warning;
+    if(name == "error")
+        return level::error;
+    throw std::invalid_argument("unknown log level " + name);
+}
+
+bool logger::enabled(const level l)
+{
+    return static_cast<int>(l) >= g_level.load(std::memory_order_relaxed);
+}
+
+logger::line::line(const level l) :
+    m_level(l),
+    m_stream(nullptr)
+{
+    // A line formatted while another is in progress on the same thread (for
+    // example, by a function called while streaming to the first) is
+    // dropped rather than mixed into it.
+    if(enabled(l) && !t_line_stream.in_use)
+    {
+        t_line_stream.in_use = true;
+        t_line_stream.buffer.reset();
+        m_stream = &(t_line_stream.stream);
+    }
+}
+
+logger::line::line(line&& o) :
+    m_level(o.m_level),
+    m_stream(o.m_stream)
+{
+    o.m_stream = nullptr;
+}
+
+logger::line::~line()
+{
+    if(m_stream == nullptr)
+        return;
+    queue_text(
+            m_level,
+            t_line_stream.buffer.data(),
+            t_line_stream.buffer.length()
+            );
+    t_line_stream.in_use = false;
+}
+
+logger::line logger::debug()
+{
+    return line(level::debug);
+}
+
+logger::line logger::info()
+{
+    return line(level::info);
+}
+
+logger::line logger::warning()
+{
+    return line(level::warning);
+}
+
+logger::line logger::error()
+{
+    return line(level::error);
+}
+
+void logger::access(
+        const char *method,
+        const char *url,
+        const unsigned status,
+        const uint64_t bytes,
+        const uint64_t duration_us
+        )
+{
+    record *r = t_ring.get().claim();
+    if(r == nullptr)
+    {
+        g_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    r->time = now();
+    r->level = level::info;
+    r->access = true;
+    r->status = status;
+    r->bytes = bytes;
+    r->duration_us = duration_us;
+    std::strncpy(r->method, method, sizeof(r->method) - 1);
+    r->method[sizeof(r->method) - 1] = '\0';
+    r->text_length = strnlen(url, s_text_size);
+    std::memcpy(r->text, url, r->text_length);
+    publish();
+}
+
+void logger::escape_field(const char *text, const std::size_t length, std::string& out)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    for(std::size_t i = 0; i < length; ++i)
+    {
+        const unsigned char c = static_cast<unsigned char>(text[i]);
+        if(c <= ' ' || c == 0x7f || c == '"' || c == '%')
+        {
+            out += '%';
+            out += hex[c >> 4];
+            out += hex[c & 0xf];
+        }
+        else
+            out += static_cast<char>(c);
+    }
+}
+
+uint64_t logger::dropped()
+{
+    return g_dropped.load(std::memory_order_relaxed);
+}
+
+void logger::flush()
+{
+    drain();
+}
+
+void logger::set_output(std::FILE *output)
+{
+    std::lock_guard<std::mutex> lock(g_drain_mutex);
+    g_output = output;
+}
@@ -0,0 +1,362 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+    std::atomic<std::size_t> g_next_shard(0);
+
+    /*
+     * Get the shard updated by the calling thread.  Threads are given shards
+     * in turn as they first record a metric.
+     */
+    std::size_t shard_index()
+    {
+        static thread_local const std::size_t index =
+            g_next_shard.fetch_add(1, std::memory_order_relaxed) % metrics::s_shards;
+        return index;
+    }
+
+    struct named_counter
+    {
+        std::string name;
+        std::string help;
+        std::unique_ptr<metrics::counter> value;
+    };
+
+    struct registry
+    {
+        std::mutex mutex;
+        std::vector<named_counter> counters;
+        std::vector<std::unique_ptr<metrics::endpoint>> endpoints;
+    };
+
+    /*
+     * The registry is created on first use, so metrics can be registered
+     * during static initialisation.
+     */
+    registry& get_registry()
+    {
+        static registry r;
+        return r;
+    }
+
+    /*
+     * Escape a label value as required by the text exposition format.
+     */
+    std::string escape_label(const std::string& value)
+    {
+        std::string out;
+        out.reserve(value.length());
+        for(const char c : value)
+            switch(c)
+            {
+                case '\\':
+                    out += "\\\\";
+                    break;
+                case '"':
+                    out += "\\\"";
+                    break;
+                case '\n':
+                    out += "\\n";
+                    break;
+                default:
+                    out += c;
+            }
+        return out;
+    }
+
+    void append_header(
+            const char *name,
+            const char *help,
+            const char *type,
+            std::string& out
+            )
+    {
+        out += "# HELP ";
+        out += name;
+        out += ' ';
+        out += help;
+        out += "\n# TYPE ";
+        out += name;
+        out += ' ';
+        out += type;
+        out += '\n';
+    }
+
+    void append_uint(const uint64_t value, std::string& out)
+    {
+        char buf[24];
+        std::snprintf(buf, sizeof(buf), "%llu", static_cast<unsigned long long>(value));
+        out += buf;
+    }
+
+    /*
+     * Append microseconds as a number of seconds.
+     */
+    void append_seconds(const uint64_t us, std::string& out)
+    {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.9g", static_cast<double>(us) / 1e6);
+        out += buf;
+    }
+
+    std::string endpoint_labels(const metrics::endpoint& e)
+    {
+        return "route=\"" + escape_label(e.route) + "\",method=\"" +
+            escape_label(e.method) + "\"";
+    }
+}
+
+metrics::counter::counter()
+{
+    for(shard& s : m_shards)
+        s.value.store(0, std::memory_order_relaxed);
+}
+
+void metrics::counter::add(const uint64_t n)
+{
+    m_shards[shard_index()].value.fetch_add(n, std::memory_order_relaxed);
+}
+
+uint64_t metrics::counter::value() const
+{
+    uint64_t total = 0;
+    for(const shard& s : m_shards)
+        total += s.value.load(std::memory_order_relaxed);
+    return total;
+}
+
+metrics::histogram::histogram()
+{
+    for(shard& s : m_shards)
+    {
+        for(std::atomic<uint64_t>& b : s.buckets)
+            b.store(0, std::memory_order_relaxed);
+        s.sum.store(0, std::memory_order_relaxed);
+    }
+}
+
+void metrics::histogram::record(const uint64_t value)
+{
+    shard& s = m_shards[shard_index()];
+    s.buckets[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    s.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+metrics::histogram::snapshot metrics::histogram::read() const
+{
+    snapshot out;
+    out.count = 0;
+    out.sum = 0;
+    for(std::size_t i = 0; i < bucket_count; ++i)
+    {
+        out.buckets[i] = 0;
+        for(const shard& s : m_shards)
+            out.buckets[i] += s.buckets[i].load(std::memory_order_relaxed);
+        out.count += out.buckets[i];
+    }
+    for(const shard& s : m_shards)
+        out.sum += s.sum.load(std::memory_order_relaxed);
+    return out;
+}
+
+uint64_t metrics::histogram::upper_bound(const std::size_t bucket)
+{
+    if(bucket <= sub_buckets)
+        return bucket;
+    // The sub-bucket within a power of two, and the power of two as the
+    // width of its sub-buckets.
+    const std::size_t i = bucket - sub_buckets - 1;
+    const uint64_t sub = i % sub_buckets;
+    const unsigned shift = static_cast<unsigned>(i / sub_buckets);
+    return (sub_buckets + sub + 1) << shift;
+}
+
+std::size_t metrics::histogram::bucket(const uint64_t value)
+{
+    if(value == 0)
+        return 0;
+    // Buckets are inclusive of their upper bound, so place one less than
+    // the value in half-open ranges.
+    const uint64_t x = value - 1;
+    if(x < sub_buckets)
+        return static_cast<std::size_t>(x) + 1;
+    // The width of a sub-bucket within x's power of two, and which of them
+    // x falls in.
+    const unsigned shift =
+        static_cast<unsigned>(63 - __builtin_clzll(x)) - sub_bucket_bits;
+    const uint64_t sub = (x >> shift) - sub_buckets;
+    const std::size_t b = static_cast<std::size_t>(
+            1 + sub_buckets + shift * sub_buckets + sub
+            );
+    return std::min(b, bucket_count - 1);
+}
+
+metrics::endpoint::endpoint(const std::string& route_, const std::string& method_) :
+    route(route_),
+    method(method_)
+{
+    for(std::atomic<counter*>& c : m_responses)
+        c.store(nullptr, std::memory_order_relaxed);
+}
+
+metrics::endpoint::~endpoint()
+{
+    for(std::atomic<counter*>& c : m_responses)
+        delete c.load(std::memory_order_relaxed);
+}
+
+void metrics::endpoint::record(
+        const unsigned status,
+        const uint64_t bytes_,
+        const uint64_t duration_us_
+        )
+{
+    std::atomic<counter*>& slot = m_responses[(status < status_limit) ? status : 0];
+    counter *c = slot.load(std::memory_order_acquire);
+    if(c == nullptr)
+    {
+        // Another thread may create the counter at the same time; only one
+        // of them is kept.
+        std::unique_ptr<counter> created(new counter);
+        if(slot.compare_exchange_strong(c, created.get(), std::memory_order_acq_rel))
+            c = created.release();
+    }
+    c->add();
+    bytes.add(bytes_);
+    duration_us.record(duration_us_);
+}
+
+uint64_t metrics::endpoint::responses(const unsigned status) const
+{
+    if(status >= status_limit)
+        return 0;
+    const counter *c = m_responses[status].load(std::memory_order_acquire);
+    return (c == nullptr) ? 0 : c->value();
+}
+
+metrics::counter& metrics::get_counter(const std::string& name, const std::string& help)
+{
+    registry& r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for(named_counter& c : r.counters)
+        if(c.name == name)
+            return *(c.value);
+    named_counter c;
+    c.name = name;
+    c.help = help;
+    c.value.reset(new counter);
+    r.counters.push_back(std::move(c));
+    return *(r.counters.back().value);
+}
+
+metrics::endpoint& metrics::add_endpoint(const std::string& route, const std::string& method)
+{
+    registry& r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.endpoints.push_back(std::unique_ptr<endpoint>(new endpoint(route, method)));
+    return *(r.endpoints.back());
+}
+
+std::string metrics::prometheus_text()
+{
+    registry& r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    std::string out;
+
+    append_header(
+            "webserver_requests_total",
+            "Requests served, by route and response status code.",
+            "counter",
+            out
+            );
+    for(const std::unique_ptr<endpoint>& e : r.endpoints)
+    {
+        const std::string labels = endpoint_labels(*e);
+        for(unsigned status = 0; status < endpoint::status_limit; ++status)
+        {
+            const uint64_t n = e->responses(status);
+            if(n == 0)
+                continue;
+            out += "webserver_requests_total{";
+            out += labels;
+            out += ",code=\"";
+            if(status == 0)
+                out += "none";
+            else
+                append_uint(status, out);
+            out += "\"} ";
+            append_uint(n, out);
+            out += '\n';
+        }
+    }
+
+    append_header(
+            "webserver_response_bytes_total",
+            "Bytes of response bodies sent, by route.",
+            "counter",
+            out
+            );
+    for(const std::unique_ptr<endpoint>& e : r.endpoints)
+    {
+        out += "webserver_response_bytes_total{";
+        out += endpoint_labels(*e);
+        out += "} ";
+        append_uint(e->bytes.value(), out);
+        out += '\n';
+    }
+
+    append_header(
+            "webserver_request_duration_seconds",
+            "Time from receiving a request to sending the response, by route.",
+            "histogram",
+            out
+            );
+    for(const std::unique_ptr<endpoint>& e : r.endpoints)
+    {
+        const std::string labels = endpoint_labels(*e);
+        const histogram::snapshot s = e->duration_us.read();
+        uint64_t cumulative = 0;
+        for(std::size_t i = 0; i + 1 < histogram::bucket_count; ++i)
+        {
+            cumulative += s.buckets[i];
+            out += "webserver_request_duration_seconds_bucket{";
+            out += labels;
+            out += ",le=\"";
+            append_seconds(histogram::upper_bound(i), out);
+            out += "\"} ";
+            append_uint(cumulative, out);
+            out += '\n';
+        }
+        out += "webserver_request_duration_seconds_bucket{";
+        out += labels;
+        out += ",le=\"+Inf\"} ";
+        append_uint(s.count, out);
+        out += "\nwebserver_request_duration_seconds_sum{";
+        out += labels;
+        out += "} ";
+        append_seconds(s.sum, out);
+        out += "\nwebserver_request_duration_seconds_count{";
+        out += labels;
+        out += "} ";
+        append_uint(s.count, out);
+        out += '\n';
+    }
+
+    for(const named_counter& c : r.counters)
+    {
+        append_header(c.name.c_str(), c.help.c_str(), "counter", out);
+        out += c.name;
+        out += ' ';
+        append_uint(c.value->value(), out);
+        out += '\n';
+    }
+
+    return out;
+}
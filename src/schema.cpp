@@ -0,0 +1,144 @@
+#include "schema.hpp"
+
+/*
+ * Assignments setting the year, month and day columns of helios_photograph
+ * from a taken time (YYYY-MM-DDTHH:MM:SS).  A part which is missing or not a
+ * number is set to NULL.
+ */
+#define SCHEMA_SET_TAKEN_PARTS(TAKEN) \
+    " taken_year = CASE WHEN " TAKEN " GLOB '[0-9][0-9][0-9][0-9]*' " \
+    "  THEN CAST(substr(" TAKEN ", 1, 4) AS INTEGER) END, " \
+    " taken_month = CASE WHEN " TAKEN " GLOB '[0-9][0-9][0-9][0-9]-[0-9][0-9]*' " \
+    "  THEN CAST(substr(" TAKEN ", 6, 2) AS INTEGER) END, " \
+    " taken_day = CASE WHEN " TAKEN " GLOB '[0-9][0-9][0-9][0-9]-[0-9][0-9]-[0-9][0-9]*' " \
+    "  THEN CAST(substr(" TAKEN ", 9, 2) AS INTEGER) END "
+
+namespace
+{
+    std::vector<slide::migration> make_migrations()
+    {
+        std::vector<slide::migration> m;
+        m.push_back(slide::migration{
+            "create tables",
+            {
+                "CREATE TABLE IF NOT EXISTS helios_photograph ( "
+                " photograph_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                " title VARCHAR NOT NULL, "
+                " caption VARCHAR NULL, "
+                " taken VARCHAR NULL "
+                " ) ",
+                "CREATE TABLE IF NOT EXISTS helios_photograph_location ( "
+                " photograph_id INTEGER PRIMARY KEY, "
+                " location VARCHAR, "
+                " FOREIGN KEY(photograph_id) REFERENCES helios_photograph(photograph_id) "
+                "  ON DELETE CASCADE DEFERRABLE INITIALLY DEFERRED "
+                " ) ",
+                "CREATE TABLE IF NOT EXISTS helios_jpeg_data ( "
+                " photograph_id INTEGER PRIMARY KEY, "
+                " data BLOB NOT NULL, "
+                " FOREIGN KEY(photograph_id) REFERENCES helios_photograph(photograph_id) "
+                "  ON DELETE CASCADE DEFERRABLE INITIALLY DEFERRED "
+                " ) ",
+                "CREATE TABLE IF NOT EXISTS helios_jpeg_small ( "
+                " photograph_id INTEGER PRIMARY KEY, "
+                " data BLOB NOT NULL, "
+                " FOREIGN KEY(photograph_id) REFERENCES helios_photograph(photograph_id) "
+                "  ON DELETE CASCADE DEFERRABLE INITIALLY DEFERRED "
+                " ) ",
+                "CREATE TABLE IF NOT EXISTS helios_jpeg_medium ( "
+                " photograph_id INTEGER PRIMARY KEY, "
+                " data BLOB NOT NULL, "
+                " FOREIGN KEY(photograph_id) REFERENCES helios_photograph(photograph_id) "
+                "  ON DELETE CASCADE DEFERRABLE INITIALLY DEFERRED "
+                " ) ",
+                "CREATE TABLE IF NOT EXISTS helios_album ( "
+                " album_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                " name VARCHAR NOT NULL, "
+                " caption VARCHAR NULL, "
+                " UNIQUE(name) "
+                " ) ",
+                "CREATE TABLE IF NOT EXISTS helios_photograph_tagged ( "
+                " photograph_id INTEGER NOT NULL, "
+                " tag VARCHAR NOT NULL, "
+                " FOREIGN KEY(photograph_id) REFERENCES helios_photograph(photograph_id) "
+                "  ON DELETE CASCADE DEFERRABLE INITIALLY DEFERRED, "
+                " UNIQUE(photograph_id, tag) "
+                " ) ",
+                "CREATE TABLE IF NOT EXISTS helios_photograph_in_album ( "
+                " photograph_id INTEGER NOT NULL, "
+                " album_id INTEGER NOT NULL, "
+                " FOREIGN KEY(photograph_id) REFERENCES helios_photograph(photograph_id) "
+                "  ON DELETE CASCADE DEFERRABLE INITIALLY DEFERRED, "
+                " FOREIGN KEY(album_id) REFERENCES helios_album(album_id) "
+                "  ON DELETE CASCADE DEFERRABLE INITIALLY DEFERRED, "
+                " UNIQUE(photograph_id, album_id) "
+                " ) ",
+                "CREATE TABLE IF NOT EXISTS helios_photograph_starred ( "
+                " photograph_id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
+                " FOREIGN KEY(photograph_id) "
+                " REFERENCES helios_photograph(photograph_id) "
+                " ON DELETE CASCADE DEFERRABLE INITIALLY DEFERRED "
+                ")"
+            }
+        });
+        // Without these, listing an album or tag, and the month views, scan
+        // every photograph.  The index on album_id also serves the cascade
+        // when an album is deleted.  Tags are looked up with LIKE, which can
+        // only use an index with the NOCASE collation; the second index on
+        // tag serves the (case sensitive) grouping of the tag list.
+        m.push_back(slide::migration{
+            "add indexes for album, tag and date lookups",
+            {
+                "CREATE INDEX IF NOT EXISTS helios_photograph_in_album_album "
+                " ON helios_photograph_in_album(album_id) ",
+                "CREATE INDEX IF NOT EXISTS helios_photograph_tagged_tag_nocase "
+                " ON helios_photograph_tagged(tag COLLATE NOCASE) ",
+                "CREATE INDEX IF NOT EXISTS helios_photograph_tagged_tag "
+                " ON helios_photograph_tagged(tag, photograph_id) ",
+                "CREATE INDEX IF NOT EXISTS helios_photograph_taken "
+                " ON helios_photograph(taken) "
+            }
+        });
+        // The calendar views group and filter by parts of the taken time.
+        // They are stored in their own columns, kept up to date by
+        // triggers, so they can be indexed.  (Generated columns would need
+        // SQLite 3.31, newer than some distributions ship.)  The index ends
+        // with taken so a month's photographs are listed in order without
+        // sorting.
+        m.push_back(slide::migration{
+            "add indexed year, month and day columns",
+            {
+                "ALTER TABLE helios_photograph ADD COLUMN taken_year INTEGER NULL",
+                "ALTER TABLE helios_photograph ADD COLUMN taken_month INTEGER NULL",
+                "ALTER TABLE helios_photograph ADD COLUMN taken_day INTEGER NULL",
+                "UPDATE helios_photograph SET " SCHEMA_SET_TAKEN_PARTS("taken"),
+                "CREATE TRIGGER IF NOT EXISTS helios_photograph_taken_insert "
+                "AFTER INSERT ON helios_photograph "
+                "BEGIN "
+                " UPDATE helios_photograph SET " SCHEMA_SET_TAKEN_PARTS("NEW.taken")
+                " WHERE photograph_id = NEW.photograph_id; "
+                "END",
+                "CREATE TRIGGER IF NOT EXISTS helios_photograph_taken_update "
+                "AFTER UPDATE OF taken ON helios_photograph "
+                "BEGIN "
+                " UPDATE helios_photograph SET " SCHEMA_SET_TAKEN_PARTS("NEW.taken")
+                " WHERE photograph_id = NEW.photograph_id; "
+                "END",
+                "CREATE INDEX IF NOT EXISTS helios_photograph_date "
+                " ON helios_photograph(taken_year, taken_month, taken_day, taken) "
+            }
+        });
+        return m;
+    }
+}
+
+const std::vector<slide::migration>& schema::migrations()
+{
+    static const std::vector<slide::migration> m = make_migrations();
+    return m;
+}
+
+int schema::migrate(slide::connection& conn)
+{
+    return slide::migrate(conn, migrations());
+}
@@ -1,49 +1,159 @@
 #include "slide.hpp"
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
+#include <strings.h>
+
+#include "metrics.hpp"
 
 std::string slide::escape(const std::string& str)
 {
     std::string out;
     // Avoid having to reallocate the string.
     out.reserve((std::size_t)((double)str.length() * 1.1 + 4.0));
-    std::for_each(
-            str.cbegin(),
-            str.cend(),
-            [&out](const char c) {
-                switch(c)
-                {
-                // Escape the quote and backslash characters.
-                case '"':
-                case '\\':
-                    out += '\\';
-                    // Fall through.
+    json_writer(out).string(str.data(), str.length());
+    // Remove the quotes.
+    return out.substr(1, out.length() - 2);
+}
+namespace
+{
+    int hex_digit(const char c)
+    {
+        if(c >= '0' && c <= '9')
+            return c - '0';
+        if(c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if(c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+
+    /*
+     * Read the four hex digits of a \uXXXX escape.  Returns -1 if they are
+     * missing or invalid.
+     */
+    long read_hex4(const char *in, const char *end)
+    {
+        if(end - in < 4)
+            return -1;
+        long out = 0;
+        for(int i = 0; i < 4; ++i)
+        {
+            const int digit = hex_digit(in[i]);
+            if(digit < 0)
+                return -1;
+            out = (out << 4) | digit;
+        }
+        return out;
+    }
+
+    char *write_utf8(unsigned long code_point, char *out)
+    {
+        if(code_point < 0x80)
+            *out++ = static_cast<char>(code_point);
+        else if(code_point < 0x800)
+        {
+            *out++ = static_cast<char>(0xc0 | (code_point >> 6));
+            *out++ = static_cast<char>(0x80 | (code_point & 0x3f));
+        }
+        else if(code_point < 0x10000)
+        {
+            *out++ = static_cast<char>(0xe0 | (code_point >> 12));
+            *out++ = static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+            *out++ = static_cast<char>(0x80 | (code_point & 0x3f));
+        }
+        else
+        {
+            *out++ = static_cast<char>(0xf0 | (code_point >> 18));
+            *out++ = static_cast<char>(0x80 | ((code_point >> 12) & 0x3f));
+            *out++ = static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+            *out++ = static_cast<char>(0x80 | (code_point & 0x3f));
+        }
+        return out;
+    }
+
+    /*
+     * Unescape the contents of a JSON string in place.  The unescaped string
+     * is never longer than the escaped one.  Returns its length.
+     *
+     * Unknown escapes are copied without the backslash, and invalid \u
+     * escapes (including unpaired surrogates) are replaced with U+FFFD.
+     */
+    std::size_t unescape_in_place(char *str, const std::size_t length)
+    {
+        const char *in = str;
+        const char *const end = str + length;
+        char *out = str;
+        while(in != end)
+        {
+            if(*in != '\\' || in + 1 == end)
+            {
+                *out++ = *in++;
+                continue;
+            }
+            ++in;
+            switch(*in++)
+            {
+                case 'b':
+                    *out++ = '\b';
+                    break;
+                case 'f':
+                    *out++ = '\f';
+                    break;
+                case 'n':
+                    *out++ = '\n';
+                    break;
+                case 'r':
+                    *out++ = '\r';
+                    break;
+                case 't':
+                    *out++ = '\t';
+                    break;
+                case 'u':
+                    {
+                        long code_point = read_hex4(in, end);
+                        if(code_point < 0)
+                        {
+                            out = write_utf8(0xfffd, out);
+                            break;
+                        }
+                        in += 4;
+                        if(code_point >= 0xd800 && code_point < 0xdc00)
+                        {
+                            // A high surrogate must be followed by an
+                            // escaped low surrogate.
+                            const long low = (end - in >= 6 && in[0] == '\\' && in[1] == 'u') ?
+                                read_hex4(in + 2, end) : -1;
+                            if(low >= 0xdc00 && low < 0xe000)
+                            {
+                                in += 6;
+                                code_point = 0x10000 +
+                                    ((code_point - 0xd800) << 10) + (low - 0xdc00);
+                            }
+                            else
+                                code_point = 0xfffd;
+                        }
+                        else if(code_point >= 0xdc00 && code_point < 0xe000)
+                            code_point = 0xfffd;
+                        out = write_utf8(static_cast<unsigned long>(code_point), out);
+                    }
+                    break;
                 default:
-                    out += c;
-                }
+                    *out++ = in[-1];
             }
-            );
-    return out;
+        }
+        return static_cast<std::size_t>(out - str);
+    }
 }
 std::string slide::unescape(const std::string& str)
 {
-    std::string out;
-    out.reserve(str.length());
-    // The next character should be copied as a literal.
-    bool ign = false;
-    std::for_each(
-            str.cbegin(),
-            str.cend(),
-            [&out, &ign](const char c) {
-                if(!ign && c == '\\')
-                    ign = true;
-                else
-                {
-                    ign = false;
-                    out += c;
-                }
-            }
-            );
+    std::string out(str);
+    if(!out.empty())
+        out.resize(unescape_in_place(&(out[0]), out.length()));
     return out;
 }
 void slide::detail::set_value(bool value, bool& out)
@@ -58,9 +168,9 @@ void slide::detail::set_value(int value, bool& out)
 {
     out = (value != 0);
 }
-void slide::detail::set_value(std::string value, bool& out)
+void slide::detail::set_value(const text_view& value, bool& out)
 {
-    out = (value.length() > 0);
+    out = (value.size() > 0);
 }
 void slide::detail::set_value(bool value, int& out)
 {
@@ -74,11 +184,11 @@ void slide::detail::set_value(int value, int& out)
 {
     out = value;
 }
-void slide::detail::set_value(std::string value, int& out)
+void slide::detail::set_value(const text_view& value, int& out)
 {
     try
     {
-        out = std::stoi(value);
+        out = std::stoi(value.str());
     }
     catch(const std::invalid_argument&)
     {
@@ -97,11 +207,11 @@ void slide::detail::set_value(int value, double& out)
 {
     out = static_cast<double>(value);
 }
-void slide::detail::set_value(std::string value, double& out)
+void slide::detail::set_value(const text_view& value, double& out)
 {
     try
     {
-        out = std::stod(value);
+        out = std::stod(value.str());
     }
     catch(const std::invalid_argument&)
     {
@@ -120,89 +230,1010 @@ void slide::detail::set_value(int value, std::string& out)
 {
     out = (mkstr() << value);
 }
-void slide::detail::set_value(std::string value, std::string& out)
+void slide::detail::set_value(const text_view& value, std::string& out)
 {
-    out = value;
+    out.assign(value.data(), value.size());
 }
-void slide::detail::json_str(bool b, std::ostringstream& oss)
+void slide::json_writer::value(const int i)
 {
-    oss << (b ? "true" : "false");
+    char buf[16];
+    char *const end = buf + sizeof(buf);
+    char *p = end;
+    // Work with the magnitude as unsigned, so INT_MIN does not overflow.
+    unsigned u = (i < 0) ? 0u - static_cast<unsigned>(i) : static_cast<unsigned>(i);
+    do
+    {
+        *--p = static_cast<char>('0' + (u % 10));
+        u /= 10;
+    }
+    while(u != 0);
+    if(i < 0)
+        *--p = '-';
+    raw(p, static_cast<std::size_t>(end - p));
 }
-void slide::detail::json_str(double d, std::ostringstream& oss)
+void slide::json_writer::value(const double d)
 {
-    oss << d;
+    if(!std::isfinite(d))
+    {
+        raw("null", 4);
+        return;
+    }
+    // Use the shortest precision that reads back as the same value.  17
+    // significant digits are always enough for a double.
+    char buf[32];
+    int length = 0;
+    for(int precision = 15; precision <= 17; ++precision)
+    {
+        length = std::snprintf(buf, sizeof(buf), "%.*g", precision, d);
+        if(std::strtod(buf, nullptr) == d)
+            break;
+    }
+    raw(buf, static_cast<std::size_t>(length));
 }
-void slide::detail::json_str(int i, std::ostringstream& oss)
+void slide::json_writer::value(const blob_view& blob)
 {
-    oss << i;
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *data = blob.data();
+    m_out.reserve(m_out.length() + (blob.size() + 2) / 3 * 4 + 2);
+    raw('"');
+    std::size_t i = 0;
+    char quad[4];
+    for(; i + 3 <= blob.size(); i += 3)
+    {
+        const uint32_t v = (uint32_t(data[i]) << 16) |
+            (uint32_t(data[i + 1]) << 8) | uint32_t(data[i + 2]);
+        quad[0] = alphabet[(v >> 18) & 0x3f];
+        quad[1] = alphabet[(v >> 12) & 0x3f];
+        quad[2] = alphabet[(v >> 6) & 0x3f];
+        quad[3] = alphabet[v & 0x3f];
+        raw(quad, 4);
+    }
+    if(i < blob.size())
+    {
+        const bool two = (i + 2 == blob.size());
+        const uint32_t v = (uint32_t(data[i]) << 16) |
+            (two ? (uint32_t(data[i + 1]) << 8) : 0);
+        quad[0] = alphabet[(v >> 18) & 0x3f];
+        quad[1] = alphabet[(v >> 12) & 0x3f];
+        quad[2] = two ? alphabet[(v >> 6) & 0x3f] : '=';
+        quad[3] = '=';
+        raw(quad, 4);
+    }
+    raw('"');
 }
-void slide::detail::json_str(std::string str, std::ostringstream& oss)
+void slide::json_writer::string(const char *data, const std::size_t length)
 {
-    oss << "\"" << escape(str) << "\"";
+    static const char hex[] = "0123456789abcdef";
+    raw('"');
+    // Copy runs of characters that need no escaping in one go.
+    const char *run = data;
+    const char *const end = data + length;
+    for(const char *c = data; c != end; ++c)
+    {
+        const unsigned char u = static_cast<unsigned char>(*c);
+        if(u >= 0x20 && u != '"' && u != '\\')
+            continue;
+        raw(run, static_cast<std::size_t>(c - run));
+        run = c + 1;
+        switch(u)
+        {
+            case '"':
+                raw("\\\"", 2);
+                break;
+            case '\\':
+                raw("\\\\", 2);
+                break;
+            case '\b':
+                raw("\\b", 2);
+                break;
+            case '\f':
+                raw("\\f", 2);
+                break;
+            case '\n':
+                raw("\\n", 2);
+                break;
+            case '\r':
+                raw("\\r", 2);
+                break;
+            case '\t':
+                raw("\\t", 2);
+                break;
+            default:
+                {
+                    const char escaped[6] = {
+                        '\\', 'u', '0', '0', hex[u >> 4], hex[u & 0xf]
+                    };
+                    raw(escaped, 6);
+                }
+        }
+    }
+    raw(run, static_cast<std::size_t>(end - run));
+    raw('"');
 }
-int slide::step(sqlite3_stmt *stmt)
+namespace
 {
-    int ret;
-    while(true)
+    // Buffers larger than this are freed after use, rather than kept for the
+    // thread's next response.
+    const std::size_t s_max_kept_json_buffer = 4 * 1024 * 1024;
+
+    struct thread_json_buffer
+    {
+        std::string buffer;
+        bool in_use = false;
+    };
+    thread_local thread_json_buffer t_json_buffer;
+}
+slide::json_buffer::json_buffer() :
+    m_thread_buffer(!t_json_buffer.in_use)
+{
+    if(m_thread_buffer)
+    {
+        t_json_buffer.in_use = true;
+        m_buffer = &(t_json_buffer.buffer);
+        m_buffer->clear();
+    }
+    else
+        m_buffer = new std::string;
+}
+slide::json_buffer::~json_buffer()
+{
+    if(m_thread_buffer)
     {
-        ret = sqlite3_step(stmt);
-        switch(ret)
+        if(m_buffer->capacity() > s_max_kept_json_buffer)
+            std::string().swap(*m_buffer);
+        t_json_buffer.in_use = false;
+    }
+    else
+        delete m_buffer;
+}
+struct slide::detail::json_document_buffers
+{
+    std::vector<char> text;
+    // The first token is a guard: jsmn reads the token before the first
+    // when it finds a comma outside any array or object.
+    std::vector<jsmntok_t> tokens;
+    bool in_use = false;
+};
+namespace
+{
+    // Token arrays start with this many tokens, and double in size until the
+    // document fits.
+    const std::size_t s_initial_json_tokens = 256;
+    // Parse buffers larger than this are freed after use.
+    const std::size_t s_max_kept_json_document = 1024 * 1024;
+
+    thread_local slide::detail::json_document_buffers t_json_document;
+}
+slide::detail::json_document::json_document(const std::string& json) :
+    m_thread_buffers(!t_json_document.in_use)
+{
+    if(m_thread_buffers)
+    {
+        t_json_document.in_use = true;
+        m_buffers = &t_json_document;
+    }
+    else
+        m_buffers = new json_document_buffers;
+
+    try
+    {
+        m_buffers->text.assign(json.data(), json.data() + json.length());
+        m_buffers->text.push_back('\0');
+        m_text = m_buffers->text.data();
+
+        std::vector<jsmntok_t>& tokens = m_buffers->tokens;
+        if(tokens.size() < s_initial_json_tokens)
+            tokens.resize(s_initial_json_tokens);
+        std::memset(&(tokens[0]), 0, sizeof(jsmntok_t));
+        tokens[0].type = JSMN_PRIMITIVE;
+
+        jsmn_parser parser;
+        jsmn_init(&parser);
+        for(;;)
         {
-            case SQLITE_DONE:
-            case SQLITE_ROW:
-            case SQLITE_OK:
-                return ret;
-            case SQLITE_BUSY:
-                sqlite3_sleep(100);
+            // After running out of tokens jsmn can carry on from where it
+            // stopped, given a larger array.
+            const jsmnerr_t result = jsmn_parse(
+                    &parser,
+                    m_text,
+                    json.length(),
+                    tokens.data() + 1,
+                    static_cast<unsigned>(tokens.size() - 1)
+                    );
+            if(result == JSMN_ERROR_NOMEM)
+                tokens.resize(tokens.size() * 2);
+            else if(result == JSMN_ERROR_INVAL)
+                throw exception("invalid JSON");
+            else if(result == JSMN_ERROR_PART)
+                throw exception("incomplete JSON");
+            else
                 break;
-            case SQLITE_ERROR:
-                throw exception("stepping SQLite query");
-            default:
-                throw exception("unhandled SQLite return code");
         }
+        m_tokens = tokens.data() + 1;
+        m_size = static_cast<int>(parser.toknext);
+        if(m_size == 0)
+            throw exception("empty JSON document");
+    }
+    catch(...)
+    {
+        release();
+        throw;
     }
 }
-int slide::devoid(const std::string& query, connection& db)
+slide::detail::json_document::~json_document()
 {
-    return devoid(query, row<>(), db);
+    release();
 }
-void slide::detail::get_column(sqlite3_stmt *stmt, std::size_t index, bool& value)
+void slide::detail::json_document::release()
 {
-    value = (sqlite3_column_int(stmt, static_cast<int>(index)) != 0);
+    if(m_thread_buffers)
+    {
+        if(m_buffers->text.capacity() > s_max_kept_json_document)
+        {
+            std::vector<char>().swap(m_buffers->text);
+            std::vector<jsmntok_t>().swap(m_buffers->tokens);
+        }
+        m_buffers->in_use = false;
+    }
+    else
+        delete m_buffers;
 }
-void slide::detail::get_column(sqlite3_stmt *stmt, std::size_t index, double& value)
+int slide::detail::json_document::skip(int i) const
 {
-    value = sqlite3_column_double(stmt, static_cast<int>(index));
+    const int end = m_tokens[i].end;
+    for(++i; i < m_size && m_tokens[i].start < end; ++i)
+        ;
+    return i;
 }
-void slide::detail::get_column(sqlite3_stmt *stmt, std::size_t index, int& value)
+slide::text_view slide::detail::json_document::string(const int i)
 {
-    value = sqlite3_column_int(stmt, static_cast<int>(index));
+    char *const str = m_text + m_tokens[i].start;
+    const std::size_t length = unescape_in_place(
+            str,
+            static_cast<std::size_t>(m_tokens[i].end - m_tokens[i].start)
+            );
+    // Overwrites the closing quote, or the remains of the escaped string.
+    str[length] = '\0';
+    return text_view(str, length);
 }
-void slide::detail::get_column(sqlite3_stmt *stmt, std::size_t index, std::string& value)
+sqlite3_stmt *slide::prepare(connection& conn, const std::string& query)
 {
-    sqlite3_column_blob(stmt, static_cast<int>(index));
-    std::size_t n_bytes = static_cast<std::size_t>(
-            sqlite3_column_bytes(stmt, static_cast<int>(index))
+    static metrics::counter& prepared = metrics::get_counter(
+            "slide_statements_prepared_total",
+            "SQLite statements prepared."
+            );
+    sqlite3_stmt *stmt = nullptr;
+    sqlite3_prepare_v2(conn.handle(), query.c_str(), -1, &stmt, nullptr);
+    if(stmt == nullptr)
+        throw exception(
+            mkstr() << "preparing SQL statement \"" << query << "\": " <<
+                sqlite3_errmsg(conn.handle())
+        );
+    prepared.add();
+    return stmt;
+}
+namespace
+{
+    std::string lower_case(std::string s)
+    {
+        for(char& c : s)
+            if(c >= 'A' && c <= 'Z')
+                c = static_cast<char>(c - 'A' + 'a');
+        return s;
+    }
+
+    /*
+     * Check that the value of an option is one of the allowed keywords, as
+     * it is written into a PRAGMA statement.
+     */
+    std::string keyword_option(
+            const std::string& name,
+            const std::string& value,
+            std::initializer_list<const char*> allowed
+            )
+    {
+        const std::string v = lower_case(value);
+        for(const char *a : allowed)
+            if(v == a)
+                return v;
+        throw slide::exception(
+                slide::mkstr() << "invalid value \"" << value <<
+                    "\" for connection option " << name
+                );
+    }
+
+    int64_t integer_option(const std::string& name, const std::string& value)
+    {
+        std::size_t end = 0;
+        long long n = 0;
+        try
+        {
+            n = std::stoll(value, &end);
+        }
+        catch(const std::exception&)
+        {
+            end = 0;
+        }
+        if(end == 0 || end != value.length())
+            throw slide::exception(
+                    slide::mkstr() << "invalid value \"" << value <<
+                        "\" for connection option " << name
+                    );
+        return static_cast<int64_t>(n);
+    }
+
+    /*
+     * Run a PRAGMA, discarding any result.
+     */
+    void pragma(slide::connection& conn, const std::string& sql)
+    {
+        char *error = nullptr;
+        if(sqlite3_exec(conn.handle(), sql.c_str(), nullptr, nullptr, &error) != SQLITE_OK)
+        {
+            const std::string message = (error == nullptr) ? "unknown error" : error;
+            sqlite3_free(error);
+            throw slide::exception(
+                    slide::mkstr() << "running \"" << sql << "\": " << message
+                    );
+        }
+    }
+}
+slide::connection_options::connection_options() :
+    busy_timeout(5000),
+    cache_size(0),
+    mmap_size(-1),
+    page_size(0),
+    read_only(false)
+{
+}
+slide::connection_options slide::connection_options::profile(const std::string& name)
+{
+    connection_options options;
+    if(name == "default")
+        return options;
+    if(name == "raspberry-pi")
+    {
+        options.journal_mode = "wal";
+        options.synchronous = "normal";
+        options.cache_size = -8 * 1024;
+        options.mmap_size = int64_t(64) * 1024 * 1024;
+        options.temp_store = "memory";
+        options.page_size = 4096;
+        return options;
+    }
+    if(name == "server")
+    {
+        options.journal_mode = "wal";
+        options.synchronous = "normal";
+        options.cache_size = -64 * 1024;
+        options.mmap_size = int64_t(1024) * 1024 * 1024;
+        options.temp_store = "memory";
+        options.page_size = 4096;
+        return options;
+    }
+    throw exception(mkstr() << "unknown connection profile \"" << name << "\"");
+}
+void slide::connection_options::set(const std::string& option)
+{
+    const std::size_t equals = option.find('=');
+    if(equals == std::string::npos)
+        throw exception(
+                mkstr() << "connection option \"" << option <<
+                    "\" is not of the form name=value"
+                );
+    const std::string name = option.substr(0, equals);
+    const std::string value = option.substr(equals + 1);
+
+    if(name == "busy_timeout")
+    {
+        const int64_t ms = integer_option(name, value);
+        if(ms < 0 || ms > INT32_MAX)
+            throw exception(mkstr() << "busy_timeout out of range: " << value);
+        busy_timeout = std::chrono::milliseconds(ms);
+    }
+    else if(name == "journal_mode")
+        journal_mode = keyword_option(
+                name, value, {"delete", "truncate", "persist", "memory", "wal", "off"}
+                );
+    else if(name == "synchronous")
+        synchronous = keyword_option(name, value, {"off", "normal", "full", "extra"});
+    else if(name == "cache_size")
+    {
+        const int64_t n = integer_option(name, value);
+        if(n < INT32_MIN || n > INT32_MAX)
+            throw exception(mkstr() << "cache_size out of range: " << value);
+        cache_size = static_cast<int>(n);
+    }
+    else if(name == "mmap_size")
+        mmap_size = integer_option(name, value);
+    else if(name == "temp_store")
+        temp_store = keyword_option(name, value, {"default", "file", "memory"});
+    else if(name == "page_size")
+    {
+        const int64_t n = integer_option(name, value);
+        // A power of two from 512 to 65536.
+        if(n < 512 || n > 65536 || (n & (n - 1)) != 0)
+            throw exception(mkstr() << "invalid page_size: " << value);
+        page_size = static_cast<int>(n);
+    }
+    else
+        throw exception(mkstr() << "unknown connection option \"" << name << "\"");
+}
+void slide::connection::configure(const connection_options& options)
+{
+    sqlite3_busy_timeout(m_handle, static_cast<int>(options.busy_timeout.count()));
+    if(options.page_size != 0 && !options.read_only)
+        pragma(*this, mkstr() << "PRAGMA page_size = " << options.page_size);
+    if(!options.journal_mode.empty() && !options.read_only)
+        pragma(*this, mkstr() << "PRAGMA journal_mode = " << options.journal_mode);
+    if(!options.synchronous.empty())
+        pragma(*this, mkstr() << "PRAGMA synchronous = " << options.synchronous);
+    if(options.cache_size != 0)
+        pragma(*this, mkstr() << "PRAGMA cache_size = " << options.cache_size);
+    if(options.mmap_size >= 0)
+        pragma(*this, mkstr() << "PRAGMA mmap_size = " << options.mmap_size);
+    if(!options.temp_store.empty())
+        pragma(*this, mkstr() << "PRAGMA temp_store = " << options.temp_store);
+}
+void slide::connection::set_statement_cache_capacity(const std::size_t capacity)
+{
+    m_statement_capacity = capacity;
+    evict_statements();
+}
+void slide::connection::clear_statement_cache()
+{
+    for(auto it = m_statements.begin(); it != m_statements.end();)
+    {
+        if(it->in_use)
+        {
+            ++it;
+            continue;
+        }
+        sqlite3_finalize(it->stmt);
+        m_statement_index.erase(it->sql);
+        it = m_statements.erase(it);
+    }
+}
+slide::connection::statement_iterator slide::connection::checkout_statement(
+        const std::string& sql,
+        sqlite3_stmt *& stmt
+        )
+{
+    static metrics::counter& hits = metrics::get_counter(
+            "slide_statement_cache_hits_total",
+            "Statements found in a connection's statement cache."
+            );
+    static metrics::counter& misses = metrics::get_counter(
+            "slide_statement_cache_misses_total",
+            "Statements which had to be prepared."
             );
-    const void *p = sqlite3_column_blob(stmt, static_cast<int>(index));
 
-    value.resize(n_bytes, 0);
+    auto found = m_statement_index.find(sql);
+    if(found != m_statement_index.end() && !found->second->in_use)
+    {
+        ++m_statement_hits;
+        hits.add();
+        statement_iterator it = found->second;
+        m_statements.splice(m_statements.begin(), m_statements, it);
+        it->in_use = true;
+        stmt = it->stmt;
+        return it;
+    }
+
+    ++m_statement_misses;
+    misses.add();
+    stmt = prepare(*this, sql);
+    // A statement for the same SQL already in use (by a query nested inside
+    // another) is not cached a second time.
+    if(m_statement_capacity == 0 || found != m_statement_index.end())
+        return m_statements.end();
 
-    ::memcpy(reinterpret_cast<void*>(&(value[0])), p, n_bytes);
+    statement_entry entry;
+    entry.sql = sql;
+    entry.stmt = stmt;
+    entry.in_use = true;
+    m_statements.push_front(std::move(entry));
+    m_statement_index[sql] = m_statements.begin();
+    evict_statements();
+    return m_statements.begin();
+}
+void slide::connection::return_statement(const statement_iterator it)
+{
+    sqlite3_reset(it->stmt);
+    sqlite3_clear_bindings(it->stmt);
+    it->in_use = false;
+    evict_statements();
 }
-void slide::detail::bind_value(bool value, std::size_t index, sqlite3_stmt *stmt)
+void slide::connection::evict_statements()
 {
-    sqlite3_bind_int(stmt, static_cast<int>(index), value ? 1 : 0);
+    auto it = m_statements.end();
+    while(m_statements.size() > m_statement_capacity && it != m_statements.begin())
+    {
+        --it;
+        if(it->in_use)
+            continue;
+        sqlite3_finalize(it->stmt);
+        m_statement_index.erase(it->sql);
+        it = m_statements.erase(it);
+    }
 }
-void slide::detail::bind_value(double value, std::size_t index, sqlite3_stmt *stmt)
+slide::cached_statement::cached_statement(connection& conn, const std::string& sql) :
+    m_connection(&conn),
+    m_stmt(nullptr),
+    m_entry(conn.checkout_statement(sql, m_stmt))
 {
-    sqlite3_bind_double(stmt, static_cast<int>(index), value);
 }
-void slide::detail::bind_value(int value, std::size_t index, sqlite3_stmt *stmt)
+slide::cached_statement::cached_statement(cached_statement&& o) :
+    m_connection(o.m_connection),
+    m_stmt(o.m_stmt),
+    m_entry(o.m_entry)
 {
-    sqlite3_bind_int(stmt, static_cast<int>(index), value);
+    o.m_connection = nullptr;
+    o.m_stmt = nullptr;
+}
+slide::cached_statement::~cached_statement()
+{
+    if(m_connection == nullptr)
+        return;
+    if(m_entry == m_connection->m_statements.end())
+        sqlite3_finalize(m_stmt);
+    else
+        m_connection->return_statement(m_entry);
+}
+std::size_t slide::detail::next_statement_slot()
+{
+    static std::atomic<std::size_t> next(0);
+    return next.fetch_add(1, std::memory_order_relaxed);
+}
+slide::connection_pool::connection_pool(
+        const std::string& filename,
+        const std::size_t size,
+        const std::chrono::milliseconds wait,
+        const connection_options& options
+        ) :
+    m_filename(filename),
+    m_options(options),
+    m_size(std::max<std::size_t>(size, 1)),
+    m_wait(wait),
+    m_open(0)
+{
+    m_idle.reserve(m_size);
+}
+slide::connection_pool::~connection_pool()
+{
+    for(connection *conn : m_idle)
+        delete conn;
+}
+slide::connection_pool::handle slide::connection_pool::acquire()
+{
+    static metrics::counter& checkouts = metrics::get_counter(
+            "slide_pool_checkouts_total",
+            "Connections checked out of a connection pool."
+            );
+    static metrics::counter& waits = metrics::get_counter(
+            "slide_pool_waits_total",
+            "Checkouts which waited for a pooled connection to be returned."
+            );
+    static metrics::counter& wait_us = metrics::get_counter(
+            "slide_pool_wait_microseconds_total",
+            "Time spent waiting for pooled connections, in microseconds."
+            );
+    static metrics::counter& timeouts = metrics::get_counter(
+            "slide_pool_timeouts_total",
+            "Checkouts which gave up waiting for a pooled connection."
+            );
+    static metrics::counter& opened = metrics::get_counter(
+            "slide_pool_connections_opened_total",
+            "Connections opened by connection pools."
+            );
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    checkouts.add();
+    if(m_idle.empty() && m_open >= m_size)
+    {
+        waits.add();
+        const auto start = std::chrono::steady_clock::now();
+        const bool available = m_returned.wait_for(
+                lock,
+                m_wait,
+                [this]() { return !m_idle.empty() || m_open < m_size; }
+                );
+        wait_us.add(
+                static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start
+                        ).count()
+                    )
+                );
+        if(!available)
+        {
+            timeouts.add();
+            throw pool_timeout(
+                    mkstr() << "no connection to " << m_filename <<
+                        " was returned within " << m_wait.count() << " ms"
+                    );
+        }
+    }
+    if(!m_idle.empty())
+    {
+        connection *conn = m_idle.back();
+        m_idle.pop_back();
+        return handle(*this, conn);
+    }
+
+    // Reserve a place for the new connection, and open it without holding
+    // the lock.
+    ++m_open;
+    lock.unlock();
+    try
+    {
+        connection *conn = new connection(m_filename, m_options);
+        opened.add();
+        return handle(*this, conn);
+    }
+    catch(...)
+    {
+        lock.lock();
+        --m_open;
+        m_returned.notify_one();
+        throw;
+    }
 }
-void slide::detail::bind_value(std::string value, std::size_t index, sqlite3_stmt *stmt)
+void slide::connection_pool::release(connection *conn)
+{
+    if(sqlite3_get_autocommit(conn->handle()) == 0)
+    {
+        delete conn;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        --m_open;
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_idle.push_back(conn);
+    }
+    m_returned.notify_one();
+}
+namespace
+{
+    metrics::counter& write_commits()
+    {
+        static metrics::counter& commits = metrics::get_counter(
+                "slide_write_commits_total",
+                "Transactions committed by write queues, each holding one or more jobs."
+                );
+        return commits;
+    }
+}
+slide::write_queue::write_queue(
+        const std::string& filename,
+        const connection_options& options,
+        const std::chrono::microseconds window,
+        const std::size_t max_group
+        ) :
+    m_filename(filename),
+    m_options(options),
+    m_window(window),
+    m_max_group(std::max<std::size_t>(max_group, 1)),
+    m_connection(new connection(filename, options)),
+    m_stopping(false)
+{
+    m_thread = std::thread(&write_queue::run, this);
+}
+slide::write_queue::~write_queue()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_queued.notify_one();
+    m_thread.join();
+}
+uint64_t slide::write_queue::commits()
+{
+    return write_commits().value();
+}
+void slide::write_queue::enqueue(std::unique_ptr<detail::write_job>&& job)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_stopping)
+            throw exception("write queue is stopping");
+        m_jobs.push_back(std::move(job));
+    }
+    m_queued.notify_one();
+}
+void slide::write_queue::run()
+{
+    std::vector<std::unique_ptr<detail::write_job>> group;
+    group.reserve(m_max_group);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(true)
+    {
+        m_queued.wait(lock, [this]() { return m_stopping || !m_jobs.empty(); });
+        if(m_jobs.empty())
+            return;
+        // Give other writers a moment to join the group.
+        if(m_window.count() > 0 && !m_stopping && m_jobs.size() < m_max_group)
+            m_queued.wait_for(
+                    lock,
+                    m_window,
+                    [this]() { return m_stopping || m_jobs.size() >= m_max_group; }
+                    );
+        while(!m_jobs.empty() && group.size() < m_max_group)
+        {
+            group.push_back(std::move(m_jobs.front()));
+            m_jobs.pop_front();
+        }
+        lock.unlock();
+        run_group(group);
+        group.clear();
+        lock.lock();
+    }
+}
+void slide::write_queue::run_group(std::vector<std::unique_ptr<detail::write_job>>& group)
+{
+    static metrics::counter& jobs = metrics::get_counter(
+            "slide_write_jobs_total",
+            "Jobs run by write queues."
+            );
+    static metrics::counter& failures = metrics::get_counter(
+            "slide_write_job_failures_total",
+            "Write queue jobs which threw an exception or were not committed."
+            );
+    static metrics::counter& commits = write_commits();
+
+    try
+    {
+        transaction tr(*m_connection, "slide_write_group");
+        for(const std::unique_ptr<detail::write_job>& job : group)
+        {
+            try
+            {
+                transaction job_tr(*m_connection, "slide_write_job");
+                job->run(*m_connection);
+                job_tr.commit();
+            }
+            catch(...)
+            {
+                job->fail(std::current_exception());
+                // Some errors roll back the whole transaction, taking the
+                // earlier jobs with it.
+                if(sqlite3_get_autocommit(m_connection->handle()) != 0)
+                    throw;
+            }
+        }
+        tr.commit();
+        commits.add();
+    }
+    catch(...)
+    {
+        const std::exception_ptr error = std::current_exception();
+        for(const std::unique_ptr<detail::write_job>& job : group)
+            if(!job->failed())
+                job->fail(error);
+    }
+
+    // After a failed commit, the connection may be left inside a
+    // transaction it no longer tracks, so it is replaced.
+    if(sqlite3_get_autocommit(m_connection->handle()) == 0 ||
+            m_connection->transaction_depth() != 0)
+        try
+        {
+            m_connection.reset(new connection(m_filename, m_options));
+        }
+        catch(const std::exception&)
+        {
+            // Keep the old connection; the next group will fail too.
+        }
+
+    for(const std::unique_ptr<detail::write_job>& job : group)
+    {
+        jobs.add();
+        if(job->failed())
+            failures.add();
+        job->deliver();
+    }
+}
+int slide::step(sqlite3_stmt *stmt)
+{
+    static metrics::counter& rows = metrics::get_counter(
+            "slide_rows_total",
+            "Rows returned by SQLite statements."
+            );
+    static metrics::counter& busy = metrics::get_counter(
+            "slide_busy_timeouts_total",
+            "SQLite statements which gave up waiting for a locked database."
+            );
+    // Waiting for a locked database is left to SQLite's busy handler (see
+    // connection_options::busy_timeout), which retries with increasing
+    // delays, so SQLITE_BUSY means the wait has timed out.
+    const int ret = sqlite3_step(stmt);
+    switch(ret)
+    {
+        case SQLITE_ROW:
+            rows.add();
+            return ret;
+        case SQLITE_DONE:
+        case SQLITE_OK:
+            return ret;
+        case SQLITE_BUSY:
+            busy.add();
+            throw exception(
+                    mkstr() << "database is locked: " <<
+                        sqlite3_errmsg(sqlite3_db_handle(stmt))
+                    );
+        case SQLITE_ERROR:
+            throw exception("stepping SQLite query");
+        default:
+            throw exception("unhandled SQLite return code");
+    }
+}
+int slide::devoid(const std::string& query, connection& db)
+{
+    return devoid(query, row<>(), db);
+}
+namespace
+{
+    // Most rows written by one multi-row statement.  Larger statements take
+    // longer to prepare and gain little.
+    const std::size_t s_max_batch_group_rows = 256;
+
+    /*
+     * True if the last error on the connection was caused by the values
+     * being written, rather than by the database.
+     */
+    bool is_row_error(slide::connection& conn)
+    {
+        switch(sqlite3_errcode(conn.handle()) & 0xff)
+        {
+            case SQLITE_CONSTRAINT:
+            case SQLITE_MISMATCH:
+            case SQLITE_TOOBIG:
+            case SQLITE_RANGE:
+                return true;
+            default:
+                return false;
+        }
+    }
+}
+slide::detail::batch_writer::batch_writer(
+        connection& conn,
+        const std::string& sql,
+        const std::size_t columns,
+        const batch_options& options,
+        batch_result& result
+        ) :
+    m_connection(conn),
+    m_sql(sql),
+    m_options(options),
+    m_result(result),
+    m_row_stmt(conn, sql),
+    m_group_rows(1)
+{
+    if(options.multi_row && columns > 0)
+    {
+        const std::size_t max_params = static_cast<std::size_t>(
+                sqlite3_limit(conn.handle(), SQLITE_LIMIT_VARIABLE_NUMBER, -1)
+                );
+        m_group_rows = std::min(max_params / columns, s_max_batch_group_rows);
+        if(m_group_rows == 0)
+            m_group_rows = 1;
+    }
+}
+sqlite3_stmt *slide::detail::batch_writer::group_statement()
+{
+    if(!m_group_stmt)
+        m_group_stmt.reset(
+                new cached_statement(m_connection, multi_row_sql(m_sql, m_group_rows))
+                );
+    return m_group_stmt->get();
+}
+bool slide::detail::batch_writer::step_row(const std::size_t row)
+{
+    sqlite3_stmt *stmt = m_row_stmt.get();
+    try
+    {
+        step(stmt);
+        sqlite3_reset(stmt);
+        m_result.changes += sqlite3_changes(m_connection.handle());
+        return true;
+    }
+    catch(const exception&)
+    {
+        if(!is_row_error(m_connection))
+            throw;
+        batch_failure failure;
+        failure.row = row;
+        failure.message = sqlite3_errmsg(m_connection.handle());
+        sqlite3_reset(stmt);
+        if(m_options.mode == batch_mode::all_or_nothing)
+            throw batch_error(failure);
+        m_result.failures.push_back(failure);
+        return false;
+    }
+}
+bool slide::detail::batch_writer::step_group()
+{
+    sqlite3_stmt *stmt = m_group_stmt->get();
+    try
+    {
+        step(stmt);
+        sqlite3_reset(stmt);
+        m_result.changes += sqlite3_changes(m_connection.handle());
+        return true;
+    }
+    catch(const exception&)
+    {
+        if(!is_row_error(m_connection))
+            throw;
+        sqlite3_reset(stmt);
+        return false;
+    }
+}
+std::string slide::detail::multi_row_sql(const std::string& sql, const std::size_t rows)
+{
+    // Find the end of the VALUES list, ignoring a trailing semicolon.
+    std::size_t end = sql.find_last_not_of(" \t\r\n;");
+    if(end == std::string::npos || sql[end] != ')')
+        throw exception("multi-row batches need an INSERT ending with VALUES(...)");
+
+    // Find the matching opening parenthesis, skipping string literals.
+    std::size_t depth = 0;
+    bool in_string = false;
+    std::size_t begin = end + 1;
+    while(begin > 0)
+    {
+        const char c = sql[--begin];
+        if(c == '\'')
+            in_string = !in_string;
+        else if(in_string)
+            continue;
+        else if(c == ')')
+            ++depth;
+        else if(c == '(' && --depth == 0)
+            break;
+    }
+    if(depth != 0 || begin == 0)
+        throw exception("multi-row batches need an INSERT ending with VALUES(...)");
+    const std::size_t keyword_end = sql.find_last_not_of(" \t\r\n", begin - 1);
+    if(
+            keyword_end == std::string::npos ||
+            keyword_end < 5 ||
+            strncasecmp(sql.c_str() + keyword_end - 5, "VALUES", 6) != 0
+      )
+        throw exception("multi-row batches need an INSERT ending with VALUES(...)");
+
+    const std::string group = sql.substr(begin, end + 1 - begin);
+    std::string out = sql.substr(0, end + 1);
+    out.reserve(out.length() + (group.length() + 2) * rows);
+    for(std::size_t i = 1; i < rows; ++i)
+    {
+        out += ", ";
+        out += group;
+    }
+    return out;
+}
+void slide::detail::get_column(sqlite3_stmt *stmt, std::size_t index, std::string& value)
+{
+    // The value must be fetched before its size, in case SQLite has to
+    // convert it.
+    const char *p = reinterpret_cast<const char*>(
+            sqlite3_column_blob(stmt, static_cast<int>(index))
+            );
+    const std::size_t n_bytes = static_cast<std::size_t>(
+            sqlite3_column_bytes(stmt, static_cast<int>(index))
+            );
+    // Assigning keeps the string's buffer when a row is reused by a query.
+    value.assign(p == nullptr ? "" : p, n_bytes);
+}
+void slide::detail::bind_value(
+        const std::string& value,
+        std::size_t index,
+        sqlite3_stmt *stmt,
+        sqlite3_destructor_type lifetime
+        )
 {
 #ifdef SLIDE_ENABLE_DEBUGGING
     std::cerr << "binding string \"" <<
@@ -213,9 +1244,9 @@ void slide::detail::bind_value(std::string value, std::size_t index, sqlite3_stm
             sqlite3_bind_text(
                 stmt,
                 static_cast<int>(index),
-                value.c_str(),
+                value.data(),
                 static_cast<int>(value.length()),
-                SQLITE_TRANSIENT
+                lifetime
                 ) != SQLITE_OK
             )
         throw exception(
@@ -226,26 +1257,39 @@ void slide::detail::bind_value(std::string value, std::size_t index, sqlite3_stm
 }
 int slide::last_insert_rowid(connection& db)
 {
-    sqlite3_stmt *stmt = nullptr;
-    sqlite3_prepare(
-            db.handle(),
-            "SELECT last_insert_rowid()",
-            -1,
-            &stmt,
-            nullptr
-            );
-    /*int step_ret = */sqlite3_step(stmt);
-    int rowid = 0;
-    detail::get_column(stmt, 0, rowid);
-    /*int finalise_ret = */sqlite3_finalize(stmt);
-    //if(step_ret != SQLITE_DONE)
-        //throw exception(
-            //mkstr() << "stepping last_insert_rowid: " << sqlite3_errmsg(db.handle())
-            //);
-    //if(finalise_ret != SQLITE_OK)
-        //throw exception(
-            //mkstr() << "finalising last_insert_rowid: " << sqlite3_errmsg(db.handle())
-            //);
-    return rowid;
+    return static_cast<int>(sqlite3_last_insert_rowid(db.handle()));
+}
+int slide::user_version(connection& db)
+{
+    return get_row<int>(db, "PRAGMA user_version").get<0>();
+}
+int slide::migrate(connection& db, const std::vector<migration>& migrations)
+{
+    const int latest = static_cast<int>(migrations.size());
+    transaction tr(db, "slide_migrate");
+    const int current = user_version(db);
+    if(current > latest)
+        throw exception(
+                mkstr() << "database schema version " << current <<
+                    " is newer than the latest known version " << latest
+                );
+    for(std::size_t i = static_cast<std::size_t>(current); i < migrations.size(); ++i)
+        for(const char *statement : migrations[i].statements)
+            try
+            {
+                devoid(statement, db);
+            }
+            catch(const exception& e)
+            {
+                throw exception(
+                        mkstr() << "migration " << (i + 1) << " (" <<
+                            migrations[i].description << "): " << e.what() <<
+                            ": " << sqlite3_errmsg(db.handle())
+                        );
+            }
+    if(current != latest)
+        devoid(mkstr() << "PRAGMA user_version = " << latest, db);
+    tr.commit();
+    return latest - current;
 }
 
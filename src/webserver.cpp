@@ -1,19 +1,962 @@
 #include "webserver.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
-#include <iostream>
+#include <deque>
+#include <mutex>
+#include <netinet/in.h>
 #include <sstream>
+#include <strings.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include "logger.hpp"
+#include "metrics.hpp"
+
 namespace
 {
     char s_error_str[] = "Unknown error";
 
+    // Size of the buffer used to send each piece of a streamed response.
+    const std::size_t s_stream_block_size = 32 * 1024;
+
+    ssize_t read_content(void *cls, uint64_t pos, char *buf, size_t max)
+    {
+        webserver::content_reader *reader =
+            reinterpret_cast<webserver::content_reader*>(cls);
+        try
+        {
+            const std::size_t length = reader->read(pos, buf, max);
+            if(length == 0)
+                return MHD_CONTENT_READER_END_OF_STREAM;
+            return static_cast<ssize_t>(length);
+        }
+        catch(const std::exception& e)
+        {
+            logger::error() << "error reading streamed response: " << e.what();
+            return MHD_CONTENT_READER_END_WITH_ERROR;
+        }
+    }
+
+    void free_content_reader(void *cls)
+    {
+        delete reinterpret_cast<webserver::content_reader*>(cls);
+    }
+
+    /*
+     * Find the quality value given to a content coding by a client's
+     * Accept-Encoding header.  Codings the header does not mention are
+     * acceptable only if the header has a "*" entry, or if the coding is
+     * "identity".
+     */
+    double coding_quality(const char *header, const std::string& coding)
+    {
+        double any_quality = -1.0;
+        const char *p = header;
+        while(*p != '\0')
+        {
+            while(*p == ' ' || *p == '\t' || *p == ',')
+                ++p;
+            const char *name = p;
+            while(
+                    *p != '\0' && *p != ',' && *p != ';' &&
+                    *p != ' ' && *p != '\t'
+                 )
+                ++p;
+            const std::size_t name_length = static_cast<std::size_t>(p - name);
+
+            // Look for a q parameter.
+            double quality = 1.0;
+            while(*p != '\0' && *p != ',')
+            {
+                if(*p == ';')
+                {
+                    ++p;
+                    while(*p == ' ' || *p == '\t')
+                        ++p;
+                    if((*p == 'q' || *p == 'Q') && p[1] == '=')
+                        quality = std::strtod(p + 2, nullptr);
+                }
+                else
+                    ++p;
+            }
+
+            if(
+                    name_length == coding.length() &&
+                    strncasecmp(name, coding.c_str(), name_length) == 0
+              )
+                return quality;
+            if(name_length == 1 && *name == '*')
+                any_quality = quality;
+        }
+        if(any_quality >= 0.0)
+            return any_quality;
+        return (coding == "identity") ? 1.0 : 0.0;
+    }
+
+    /*
+     * Respond with 304 Not Modified, repeating the validator and caching
+     * headers of the full response.
+     */
+    int queue_not_modified(
+            struct MHD_Connection *connection,
+            const std::string& etag,
+            const std::string& cache_control
+            )
+    {
+        struct MHD_Response *response = MHD_create_response_from_buffer(
+                0,
+                nullptr,
+                MHD_RESPMEM_PERSISTENT
+                );
+        MHD_add_response_header(response, "ETag", etag.c_str());
+        if(!cache_control.empty())
+            MHD_add_response_header(response, "Cache-Control", cache_control.c_str());
+        int ret = webserver::queue_response(connection, MHD_HTTP_NOT_MODIFIED, response, 0);
+        MHD_destroy_response(response);
+        return ret;
+    }
+
+    // Limit on the number of ranges honoured in one request; requests for
+    // more are answered with the whole content.
+    const std::size_t s_max_ranges = 16;
+
+    const char s_byteranges_boundary[] = "HELIOS_BYTERANGES_a1b2c3d4e5f6";
+
+    /*
+     * An inclusive range of byte positions.
+     */
+    typedef std::pair<uint64_t, uint64_t> byte_range;
+
+    /*
+     * Parse the value of a Range header for content of the given size.
+     * Return false if the header is not a valid byte ranges specifier, in
+     * which case it should be ignored.  Otherwise, ranges is set to the
+     * satisfiable ranges, which may be none.
+     */
+    bool parse_ranges(
+            const char *header,
+            const uint64_t size,
+            std::vector<byte_range>& ranges
+            )
+    {
+        ranges.clear();
+        if(std::strncmp(header, "bytes=", 6) != 0)
+            return false;
+
+        const char *p = header + 6;
+        std::size_t n_specs = 0;
+        while(*p != '\0')
+        {
+            while(*p == ' ' || *p == '\t' || *p == ',')
+                ++p;
+            if(*p == '\0')
+                break;
+            if(++n_specs > s_max_ranges)
+                return false;
+
+            char *end = nullptr;
+            if(*p == '-')
+            {
+                // Suffix range: the last n bytes.
+                const unsigned long long n = std::strtoull(p + 1, &end, 10);
+                if(end == p + 1)
+                    return false;
+                if(n > 0 && size > 0)
+                    ranges.push_back(
+                            byte_range(size - std::min<uint64_t>(n, size), size - 1)
+                            );
+            }
+            else
+            {
+                const unsigned long long first = std::strtoull(p, &end, 10);
+                if(end == p || *end != '-')
+                    return false;
+                p = end + 1;
+                unsigned long long last = size - 1;
+                if(*p >= '0' && *p <= '9')
+                {
+                    last = std::strtoull(p, &end, 10);
+                    if(last < first)
+                        return false;
+                }
+                else
+                    end = const_cast<char*>(p);
+                if(first < size)
+                    ranges.push_back(
+                            byte_range(first, std::min<uint64_t>(last, size - 1))
+                            );
+            }
+            p = end;
+            while(*p == ' ' || *p == '\t')
+                ++p;
+            if(*p != '\0' && *p != ',')
+                return false;
+        }
+        return n_specs > 0;
+    }
+
+    /*
+     * Read a window of the content of another content reader.
+     */
+    class range_reader : public webserver::content_reader
+    {
+        public:
+            range_reader(
+                    webserver::content_reader_ptr&& reader,
+                    const byte_range& range
+                    ) :
+                m_reader(std::move(reader)),
+                m_range(range)
+            {
+            }
+            uint64_t size() const override
+            {
+                return m_range.second - m_range.first + 1;
+            }
+            std::size_t read(uint64_t pos, char *buf, std::size_t max) override
+            {
+                if(pos >= size())
+                    return 0;
+                return m_reader->read(
+                        m_range.first + pos,
+                        buf,
+                        static_cast<std::size_t>(std::min<uint64_t>(max, size() - pos))
+                        );
+            }
+        private:
+            webserver::content_reader_ptr m_reader;
+            const byte_range m_range;
+    };
+
+    /*
+     * Read several windows of the content of another content reader as a
+     * multipart/byteranges body.
+     */
+    class multipart_range_reader : public webserver::content_reader
+    {
+        public:
+            multipart_range_reader(
+                    webserver::content_reader_ptr&& reader,
+                    const std::vector<byte_range>& ranges,
+                    const std::string& mimetype
+                    ) :
+                m_reader(std::move(reader)),
+                m_size(0)
+            {
+                const uint64_t content_size = m_reader->size();
+                for(const byte_range& range : ranges)
+                {
+                    std::ostringstream oss;
+                    oss << "\r\n--" << s_byteranges_boundary << "\r\n" <<
+                        "Content-Type: " << mimetype << "\r\n" <<
+                        "Content-Range: bytes " << range.first << "-" <<
+                        range.second << "/" << content_size << "\r\n\r\n";
+                    add_part(oss.str());
+                    part p;
+                    p.start = m_size;
+                    p.length = range.second - range.first + 1;
+                    p.offset = range.first;
+                    m_parts.push_back(p);
+                    m_size += p.length;
+                }
+                add_part(
+                        std::string("\r\n--") + s_byteranges_boundary + "--\r\n"
+                        );
+            }
+            uint64_t size() const override
+            {
+                return m_size;
+            }
+            std::size_t read(uint64_t pos, char *buf, std::size_t max) override
+            {
+                // Find the part containing pos.
+                auto it = std::upper_bound(
+                        m_parts.begin(),
+                        m_parts.end(),
+                        pos,
+                        [](const uint64_t p, const part& pt) { return p < pt.start; }
+                        );
+                if(it == m_parts.begin())
+                    return 0;
+                --it;
+                const uint64_t into = pos - it->start;
+                if(into >= it->length)
+                    return 0;
+                const std::size_t length = static_cast<std::size_t>(
+                        std::min<uint64_t>(max, it->length - into)
+                        );
+                if(it->text.empty())
+                    return m_reader->read(it->offset + into, buf, length);
+                std::memcpy(buf, it->text.data() + into, length);
+                return length;
+            }
+        private:
+            /*
+             * Either some literal text (headers and boundaries) or a window
+             * of the underlying content, at position start in the body.
+             */
+            struct part
+            {
+                uint64_t start;
+                uint64_t length;
+                uint64_t offset;
+                std::string text;
+            };
+
+            void add_part(const std::string& text)
+            {
+                part p;
+                p.start = m_size;
+                p.length = text.length();
+                p.offset = 0;
+                p.text = text;
+                m_parts.push_back(p);
+                m_size += p.length;
+            }
+
+            webserver::content_reader_ptr m_reader;
+            std::vector<part> m_parts;
+            uint64_t m_size;
+    };
+
+    /*
+     * Passes reads through to another content reader, adding the number of
+     * bytes read to a counter.  Used to record the size of responses whose
+     * size is not known when they are queued.
+     */
+    class counting_reader : public webserver::content_reader
+    {
+        public:
+            counting_reader(webserver::content_reader_ptr&& reader, uint64_t& count) :
+                m_reader(std::move(reader)),
+                m_count(count)
+            {
+            }
+            uint64_t size() const override
+            {
+                return m_reader->size();
+            }
+            std::size_t read(uint64_t pos, char *buf, std::size_t max) override
+            {
+                const std::size_t length = m_reader->read(pos, buf, max);
+                m_count += length;
+                return length;
+            }
+        private:
+            webserver::content_reader_ptr m_reader;
+            uint64_t& m_count;
+    };
+
+    /*
+     * Create a response streaming from a content reader.  The response takes
+     * ownership of the reader.
+     */
+    struct MHD_Response *create_stream_response(
+            webserver::content_reader_ptr&& reader
+            )
+    {
+        struct MHD_Response *response = MHD_create_response_from_callback(
+                reader->size(),
+                s_stream_block_size,
+                &read_content,
+                reader.get(),
+                &free_content_reader
+                );
+        if(response == nullptr)
+            throw std::runtime_error("creating streamed response");
+        reader.release();
+        return response;
+    }
+
+    /*
+     * Respond to the client with an error message.
+     */
+    int queue_error(
+            struct MHD_Connection *connection,
+            const char *message,
+            unsigned status = 500
+            )
+    {
+        struct MHD_Response *response = MHD_create_response_from_buffer(
+                strlen(message),
+                const_cast<char*>(message),
+                MHD_RESPMEM_MUST_COPY
+                );
+        int ret = webserver::queue_response(connection, status, response, strlen(message));
+        MHD_destroy_response(response);
+        return ret;
+    }
+
+    const char s_too_large_str[] = "request body too large";
+    const char s_unavailable_str[] = "server busy, try again shortly";
+
+    /*
+     * Ask the client to try again after a second.
+     */
+    int queue_unavailable(struct MHD_Connection *connection)
+    {
+        static metrics::counter& refused = metrics::get_counter(
+                "webserver_requests_refused_total",
+                "Requests refused with 503 because the server was busy."
+                );
+        refused.add();
+        struct MHD_Response *response = MHD_create_response_from_buffer(
+                strlen(s_unavailable_str),
+                const_cast<char*>(s_unavailable_str),
+                MHD_RESPMEM_PERSISTENT
+                );
+        MHD_add_response_header(response, "Retry-After", "1");
+        int ret = webserver::queue_response(
+                connection,
+                MHD_HTTP_SERVICE_UNAVAILABLE,
+                response,
+                strlen(s_unavailable_str)
+                );
+        MHD_destroy_response(response);
+        return ret;
+    }
+
+    /*
+     * A request waiting for a slot while its connection is suspended, in a
+     * worker pool.
+     */
+    struct admission_waiter
+    {
+        enum outcome_type
+        {
+            waiting,
+            admitted,
+            refused
+        };
+
+        struct MHD_Connection *connection;
+        webserver::cost_class cost;
+        uint64_t client;
+        std::chrono::steady_clock::time_point deadline;
+        outcome_type outcome;
+        // True once the connection has been suspended, so whoever decides
+        // the outcome must resume it.
+        bool suspended;
+    };
+
+    /*
+     * Limits the number of requests of each cost class served at once, in
+     * total and for each client.  A request over the limit waits for a slot
+     * to be released, up to the admission wait.
+     *
+     * In thread-per-connection mode the request's thread blocks while it
+     * waits.  A worker in a pool also serves the connections which would
+     * release slots, so there the request's connection is suspended
+     * instead, and joins a wait list for its class.  Released slots are
+     * given to waiters in the order they arrived, and a timer thread
+     * refuses waiters whose wait is over.  The connection is resumed once
+     * its request has been given a slot or refused.
+     */
+    class admission_controller
+    {
+        public:
+            admission_controller() :
+                m_wait(500),
+                m_suspend(false),
+                m_running(false)
+            {
+                set_limit(webserver::cost_class::json, 16, 8);
+                set_limit(webserver::cost_class::cached_image, 32, 16);
+                set_limit(webserver::cost_class::thumbnail, 2, 2);
+            }
+            ~admission_controller()
+            {
+                stop_waiting();
+            }
+            void set_limit(
+                    const webserver::cost_class c,
+                    const unsigned global,
+                    const unsigned per_client
+                    )
+            {
+                std::vector<struct MHD_Connection*> resume;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    budget& b = m_budgets[static_cast<std::size_t>(c)];
+                    b.global_limit = global;
+                    b.per_client_limit = per_client;
+                    admit_waiters(b, resume);
+                    m_released.notify_all();
+                }
+                resume_all(resume);
+            }
+            void set_wait(const std::chrono::milliseconds wait)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_wait = wait;
+            }
+            /*
+             * Start suspending requests which wait for a slot, rather than
+             * blocking their thread, along with the thread which refuses
+             * them when their wait is over.
+             */
+            void start_waiting()
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if(m_running)
+                    return;
+                m_suspend = true;
+                m_running = true;
+                m_expiry = std::thread(&admission_controller::expire_waiters, this);
+            }
+            /*
+             * Refuse and resume every suspended request, and stop the timer
+             * thread.  Must be called before the daemon is stopped, as
+             * MicroHTTPD cannot stop with connections suspended.
+             */
+            void stop_waiting()
+            {
+                std::vector<struct MHD_Connection*> resume;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    if(!m_running)
+                        return;
+                    m_suspend = false;
+                    m_running = false;
+                    for(budget& b : m_budgets)
+                    {
+                        for(admission_waiter *w : b.waiters)
+                            decide(*w, admission_waiter::refused, resume);
+                        b.waiters.clear();
+                    }
+                    m_waiters_changed.notify_all();
+                }
+                resume_all(resume);
+                m_expiry.join();
+            }
+            /*
+             * Take a slot for the client, returning false if none became free
+             * in time.  Only blocks in thread-per-connection mode; with
+             * waiting requests suspended, it fails at once instead.
+             */
+            bool acquire(const webserver::cost_class c, const uint64_t client)
+            {
+                if(c == webserver::cost_class::uncounted)
+                    return true;
+                budget& b = m_budgets[static_cast<std::size_t>(c)];
+                std::unique_lock<std::mutex> lock(m_mutex);
+                const std::chrono::milliseconds wait =
+                    m_suspend ? std::chrono::milliseconds(0) : m_wait;
+                if(!m_released.wait_for(lock, wait, [&b, client]() { return b.available(client); }))
+                    return false;
+                b.take(client);
+                return true;
+            }
+            /*
+             * Take a slot for a request about to be suspended, or else add it
+             * to the wait list for its class.  Returns the waiter's outcome:
+             * waiting if the connection must be suspended.  Only used while
+             * waiting requests are suspended (see start_waiting).
+             */
+            admission_waiter::outcome_type admit(admission_waiter& w)
+            {
+                if(w.cost == webserver::cost_class::uncounted)
+                    return admission_waiter::admitted;
+                budget& b = m_budgets[static_cast<std::size_t>(w.cost)];
+                std::vector<struct MHD_Connection*> resume;
+                admission_waiter::outcome_type outcome;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    // Join the back of the list, so that a free slot goes to
+                    // any request which has waited longer.
+                    w.deadline = std::chrono::steady_clock::now() + m_wait;
+                    w.outcome = admission_waiter::waiting;
+                    w.suspended = false;
+                    b.waiters.push_back(&w);
+                    admit_waiters(b, resume);
+                    if(w.outcome == admission_waiter::waiting)
+                    {
+                        if(m_suspend && m_wait.count() > 0)
+                            m_waiters_changed.notify_all();
+                        else
+                        {
+                            b.waiters.pop_back();
+                            w.outcome = admission_waiter::refused;
+                        }
+                    }
+                    outcome = w.outcome;
+                }
+                resume_all(resume);
+                return outcome;
+            }
+            /*
+             * Record that a waiter's connection has been suspended.  Returns
+             * true if its outcome was decided first, in which case the caller
+             * must resume it.
+             */
+            bool suspended(admission_waiter& w)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                w.suspended = true;
+                return w.outcome != admission_waiter::waiting;
+            }
+            /*
+             * Take a waiter off its list if its request ends while it is
+             * still waiting.
+             */
+            void cancel(admission_waiter& w)
+            {
+                if(w.cost == webserver::cost_class::uncounted)
+                    return;
+                budget& b = m_budgets[static_cast<std::size_t>(w.cost)];
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if(w.outcome != admission_waiter::waiting)
+                    return;
+                b.waiters.erase(std::find(b.waiters.begin(), b.waiters.end(), &w));
+                w.outcome = admission_waiter::refused;
+            }
+            /*
+             * Get the outcome of a waiter once its connection is resumed.
+             */
+            admission_waiter::outcome_type outcome(const admission_waiter& w)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                return w.outcome;
+            }
+            void release(const webserver::cost_class c, const uint64_t client)
+            {
+                if(c == webserver::cost_class::uncounted)
+                    return;
+                budget& b = m_budgets[static_cast<std::size_t>(c)];
+                std::vector<struct MHD_Connection*> resume;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    --b.in_use;
+                    auto it = b.clients.find(client);
+                    if(it != b.clients.end() && --(it->second) == 0)
+                        b.clients.erase(it);
+                    admit_waiters(b, resume);
+                }
+                m_released.notify_all();
+                resume_all(resume);
+            }
+        private:
+            struct budget
+            {
+                unsigned global_limit;
+                unsigned per_client_limit;
+                unsigned in_use;
+                // Number of slots held by each client.
+                std::unordered_map<uint64_t, unsigned> clients;
+                // Suspended requests waiting for a slot, oldest first.
+                std::deque<admission_waiter*> waiters;
+
+                budget() :
+                    global_limit(0),
+                    per_client_limit(0),
+                    in_use(0)
+                {
+                }
+                bool available(const uint64_t client) const
+                {
+                    if(in_use >= global_limit)
+                        return false;
+                    auto it = clients.find(client);
+                    return it == clients.end() || it->second < per_client_limit;
+                }
+                void take(const uint64_t client)
+                {
+                    ++in_use;
+                    ++clients[client];
+                }
+            };
+
+            /*
+             * Decide a waiter's outcome, noting its connection to be resumed
+             * if it is suspended.  The waiter must already be off its list.
+             */
+            static void decide(
+                    admission_waiter& w,
+                    const admission_waiter::outcome_type outcome,
+                    std::vector<struct MHD_Connection*>& resume
+                    )
+            {
+                w.outcome = outcome;
+                if(w.suspended)
+                    resume.push_back(w.connection);
+            }
+            /*
+             * Give free slots to waiters in the order they arrived, skipping
+             * any whose client already holds as many as it may.
+             */
+            static void admit_waiters(
+                    budget& b,
+                    std::vector<struct MHD_Connection*>& resume
+                    )
+            {
+                for(auto it = b.waiters.begin(); it != b.waiters.end() && b.in_use < b.global_limit;)
+                {
+                    admission_waiter& w = **it;
+                    if(!b.available(w.client))
+                    {
+                        ++it;
+                        continue;
+                    }
+                    b.take(w.client);
+                    it = b.waiters.erase(it);
+                    decide(w, admission_waiter::admitted, resume);
+                }
+            }
+            /*
+             * Resume connections, without holding the lock, since MicroHTTPD
+             * takes locks of its own.
+             */
+            static void resume_all(const std::vector<struct MHD_Connection*>& resume)
+            {
+                for(struct MHD_Connection *connection : resume)
+                    MHD_resume_connection(connection);
+            }
+            /*
+             * Body of the timer thread: refuse each waiter when its wait is
+             * over.
+             */
+            void expire_waiters()
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while(m_running)
+                {
+                    const auto now = std::chrono::steady_clock::now();
+                    auto next = std::chrono::steady_clock::time_point::max();
+                    std::vector<struct MHD_Connection*> resume;
+                    for(budget& b : m_budgets)
+                        for(auto it = b.waiters.begin(); it != b.waiters.end();)
+                        {
+                            admission_waiter& w = **it;
+                            if(w.deadline <= now)
+                            {
+                                it = b.waiters.erase(it);
+                                decide(w, admission_waiter::refused, resume);
+                                continue;
+                            }
+                            next = std::min(next, w.deadline);
+                            ++it;
+                        }
+                    if(!resume.empty())
+                    {
+                        lock.unlock();
+                        resume_all(resume);
+                        lock.lock();
+                        continue;
+                    }
+                    if(next == std::chrono::steady_clock::time_point::max())
+                        m_waiters_changed.wait(lock);
+                    else
+                        m_waiters_changed.wait_until(lock, next);
+                }
+            }
+
+            std::mutex m_mutex;
+            std::condition_variable m_released;
+            budget m_budgets[4];
+            std::chrono::milliseconds m_wait;
+            // True if waiting requests are suspended rather than blocking.
+            bool m_suspend;
+            bool m_running;
+            std::condition_variable m_waiters_changed;
+            std::thread m_expiry;
+    };
+
+    admission_controller g_admission;
+    // True if requests waiting for a slot are suspended (in a worker pool).
+    bool g_suspend_waiting = false;
+
+    /*
+     * Identify the client of a connection by its IP address (ignoring the
+     * port, as browsers open several connections).
+     */
+    uint64_t client_key(struct MHD_Connection *connection)
+    {
+        const union MHD_ConnectionInfo *info = MHD_get_connection_info(
+                connection,
+                MHD_CONNECTION_INFO_CLIENT_ADDRESS
+                );
+        if(info == nullptr || info->client_addr == nullptr)
+            return 0;
+        const unsigned char *address = nullptr;
+        std::size_t length = 0;
+        if(info->client_addr->sa_family == AF_INET)
+        {
+            const sockaddr_in *in = reinterpret_cast<const sockaddr_in*>(info->client_addr);
+            address = reinterpret_cast<const unsigned char*>(&(in->sin_addr));
+            length = sizeof(in->sin_addr);
+        }
+        else if(info->client_addr->sa_family == AF_INET6)
+        {
+            const sockaddr_in6 *in6 = reinterpret_cast<const sockaddr_in6*>(info->client_addr);
+            address = reinterpret_cast<const unsigned char*>(&(in6->sin6_addr));
+            length = sizeof(in6->sin6_addr);
+        }
+        // FNV-1a.
+        uint64_t key = 14695981039346656037ULL;
+        for(std::size_t i = 0; i < length; ++i)
+        {
+            key ^= address[i];
+            key *= 1099511628211ULL;
+        }
+        return key;
+    }
+
+    std::atomic<std::size_t> g_max_body_size(1024 * 1024);
+
+    /*
+     * The body of a PUT or POST request to a text request function.
+     */
+    struct request_body
+    {
+        std::string data;
+        // Set when the body exceeded the maximum size; the rest of it is
+        // discarded.
+        bool too_large;
+    };
+
+    /*
+     * Request bodies are reused rather than being allocated for each request,
+     * so that once the server has warmed up a request only allocates when its
+     * body is larger than any seen before.
+     */
+    class request_body_pool
+    {
+        public:
+            ~request_body_pool()
+            {
+                for(request_body *body : m_free)
+                    delete body;
+            }
+            request_body *acquire()
+            {
+                request_body *body = nullptr;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    if(!m_free.empty())
+                    {
+                        body = m_free.back();
+                        m_free.pop_back();
+                    }
+                }
+                if(body == nullptr)
+                    body = new request_body;
+                body->data.clear();
+                body->too_large = false;
+                return body;
+            }
+            void release(request_body *body)
+            {
+                // Don't keep unusually large buffers alive.
+                if(body->data.capacity() > s_max_retained_capacity)
+                    std::string().swap(body->data);
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    if(m_free.size() < s_max_free)
+                    {
+                        m_free.push_back(body);
+                        return;
+                    }
+                }
+                delete body;
+            }
+        private:
+            static const std::size_t s_max_free = 16;
+            static const std::size_t s_max_retained_capacity = 64 * 1024;
+
+            std::mutex m_mutex;
+            std::vector<request_body*> m_free;
+    };
+
+    request_body_pool g_request_body_pool;
+
     std::vector<webserver::request_function_ptr> g_request_functions;
+    // Index of the installed request functions which describe their route.
+    webserver::route_table g_route_table;
+    // Installed request functions which must be asked for their match
+    // strength on every request.
+    std::vector<webserver::request_function*> g_dynamic_functions;
     webserver::request_function_ptr g_not_found_function;
+    // Metrics for each installed request function.  Request functions which
+    // do not describe their route share one set of metrics.
+    std::unordered_map<const webserver::request_function*, metrics::endpoint*> g_endpoints;
+    metrics::endpoint *g_dynamic_endpoint = nullptr;
+    // Called after every request function call (see set_request_cleanup).
+    std::function<void()> g_request_cleanup;
+
+    /*
+     * State kept for each request, from the first call to answer_connection
+     * until MicroHTTPD reports that the request has completed.
+     */
+    struct request_state
+    {
+        webserver::request_function *fn;
+        // The con_cls given to the request function.
+        void *fn_cls;
+        const char *method;
+        const char *url;
+        std::chrono::steady_clock::time_point start;
+        unsigned status;
+        uint64_t bytes;
+        uint64_t client;
+        // The cost class of the slot held by the request, if any.
+        webserver::cost_class admitted;
+        // True if the request was refused admission.
+        bool refused;
+        // True while the request's connection is suspended waiting for a
+        // slot (in a worker pool).
+        bool waiting;
+        admission_waiter waiter;
+    };
+
+    // The request whose request function is being called on this thread.
+    thread_local request_state *t_current_request = nullptr;
+
+    /*
+     * Set the current request for the duration of a request function call,
+     * and run the request cleanup function when the call returns.
+     */
+    class current_request_scope
+    {
+        public:
+            explicit current_request_scope(request_state *state)
+            {
+                t_current_request = state;
+            }
+            ~current_request_scope()
+            {
+                t_current_request = nullptr;
+                if(g_request_cleanup)
+                    g_request_cleanup();
+            }
+    };
+
+    webserver::request_function *find_request_function(
+            const char *url,
+            const char *method
+            )
+    {
+        int best_match = 0;
+        webserver::request_function *fn = g_route_table.find(url, method, best_match);
+        for(webserver::request_function *url_fn : g_dynamic_functions)
+        {
+            const int strength = url_fn->match_strength(url, method);
+            if(strength > 0 && strength > best_match)
+            {
+                fn = url_fn;
+                best_match = strength;
+            }
+        }
+        return fn;
+    }
 
     int answer_connection(
             void *cls,
@@ -26,32 +969,158 @@ namespace
             void **con_cls
             )
     {
-        webserver::request_function *fn = nullptr;
-        int best_match = 0;
-        for(const std::unique_ptr<webserver::request_function>& url_fn : g_request_functions)
+        request_state *state = reinterpret_cast<request_state*>(*con_cls);
+        if(state == nullptr)
         {
-            const int strength = url_fn->match_strength(url, method);
-            if(strength > 0 && strength > best_match)
+            // First call for this request; choose the request function once
+            // for all calls.
+            state = new request_state;
+            state->fn = find_request_function(url, method);
+            state->fn_cls = nullptr;
+            state->method = method;
+            state->url = url;
+            state->start = std::chrono::steady_clock::now();
+            state->status = 0;
+            state->bytes = 0;
+            state->client = client_key(connection);
+            state->admitted = webserver::cost_class::uncounted;
+            state->refused = false;
+            state->waiting = false;
+            state->waiter.connection = connection;
+            state->waiter.cost = (state->fn != nullptr) ?
+                state->fn->cost() : webserver::cost_class::uncounted;
+            state->waiter.client = state->client;
+            state->waiter.outcome = admission_waiter::waiting;
+            state->waiter.suspended = false;
+            *con_cls = state;
+
+            current_request_scope scope(state);
+            if(g_suspend_waiting)
             {
-                fn = url_fn.get();
-                best_match = strength;
+                switch(g_admission.admit(state->waiter))
+                {
+                    case admission_waiter::admitted:
+                        state->admitted = state->waiter.cost;
+                        break;
+                    case admission_waiter::refused:
+                        state->refused = true;
+                        return queue_unavailable(connection);
+                    case admission_waiter::waiting:
+                        // Called again when a slot is given to the request
+                        // or its wait is over.
+                        state->waiting = true;
+                        MHD_suspend_connection(connection);
+                        if(g_admission.suspended(state->waiter))
+                            MHD_resume_connection(connection);
+                        return MHD_YES;
+                }
+            }
+            else
+            {
+                if(!g_admission.acquire(state->waiter.cost, state->client))
+                {
+                    state->refused = true;
+                    return queue_unavailable(connection);
+                }
+                state->admitted = state->waiter.cost;
             }
         }
+        else if(state->waiting)
+        {
+            // Resumed after waiting for a slot.
+            state->waiting = false;
+            if(g_admission.outcome(state->waiter) != admission_waiter::admitted)
+            {
+                state->refused = true;
+                current_request_scope scope(state);
+                return queue_unavailable(connection);
+            }
+            state->admitted = state->waiter.cost;
+        }
 
-        if(fn != nullptr)
+        if(state->refused)
+        {
+            // Discard the body of a refused request.
+            *upload_data_size = 0;
+            return MHD_YES;
+        }
+
+        current_request_scope scope(state);
+
+        if(state->fn != nullptr)
             try
             {
-                return (*fn)(cls, connection, url, method, version, upload_data, upload_data_size, con_cls);
+                return (*state->fn)(cls, connection, url, method, version, upload_data, upload_data_size, &(state->fn_cls));
+            }
+            catch(const webserver::service_unavailable& e)
+            {
+                logger::warning() << "Request refused: " << e.what();
+                state->fn->request_completed(state->fn_cls);
+                state->fn_cls = nullptr;
+                state->refused = true;
+                return queue_unavailable(connection);
             }
             catch(const std::exception& e)
             {
-                std::cerr << "Error in request function: " << e.what() << std::endl;
+                logger::error() << "Error in request function: " << e.what();
+                state->fn->request_completed(state->fn_cls);
+                state->fn_cls = nullptr;
             }
 
-        if(g_not_found_function)
-            return (*g_not_found_function)(cls, connection, url, method, version, upload_data, upload_data_size, con_cls);
+        state->fn = g_not_found_function.get();
+        if(state->fn != nullptr)
+            return (*state->fn)(cls, connection, url, method, version, upload_data, upload_data_size, &(state->fn_cls));
 
-        return -1;
+        return MHD_NO;
+    }
+
+    void request_completed(
+            void */*cls*/,
+            struct MHD_Connection */*connection*/,
+            void **con_cls,
+            enum MHD_RequestTerminationCode /*toe*/
+            )
+    {
+        request_state *state = reinterpret_cast<request_state*>(*con_cls);
+        if(state == nullptr)
+            return;
+
+        const uint64_t duration_us = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - state->start
+                    ).count()
+                );
+        logger::access(
+                state->method,
+                state->url,
+                state->status,
+                state->bytes,
+                duration_us
+                );
+        auto it = g_endpoints.find(state->fn);
+        if(it != g_endpoints.end())
+            it->second->record(state->status, state->bytes, duration_us);
+
+        if(state->fn != nullptr)
+            state->fn->request_completed(state->fn_cls);
+        if(state->waiting)
+            g_admission.cancel(state->waiter);
+        g_admission.release(state->admitted, state->client);
+
+        delete state;
+        *con_cls = nullptr;
+    }
+
+    /*
+     * Check whether a URL is a route's URL or below it, comparing whole path
+     * segments as the route table does; so "/api/album" matches
+     * "/api/album/1" but not "/api/albumx".
+     */
+    bool matches_prefix_route(const std::string& route_url, const char *url)
+    {
+        const std::size_t length = route_url.length();
+        return std::strncmp(route_url.c_str(), url, length) == 0 &&
+            (url[length] == '\0' || url[length] == '/');
     }
 }
 
@@ -67,6 +1136,207 @@ std::size_t webserver::matching_length(const std::string& a, const std::string&
     return std::min(a.length(), b.length());
 }
 
+std::string webserver::content_etag(const char *data, std::size_t length)
+{
+    // 64-bit FNV-1a.
+    uint64_t hash = 14695981039346656037ULL;
+    for(std::size_t i = 0; i < length; ++i)
+    {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    char out[19];
+    std::snprintf(
+            out,
+            sizeof(out),
+            "\"%016llx\"",
+            static_cast<unsigned long long>(hash)
+            );
+    return out;
+}
+
+bool webserver::if_none_match(
+        struct MHD_Connection *connection,
+        const std::string& etag
+        )
+{
+    const char *header = MHD_lookup_connection_value(
+            connection,
+            MHD_HEADER_KIND,
+            "If-None-Match"
+            );
+    if(header == nullptr)
+        return false;
+
+    // The header is either "*" or a comma separated list of entity tags,
+    // which are compared ignoring any weakness indicator.
+    const char *p = header;
+    while(*p != '\0')
+    {
+        while(*p == ' ' || *p == '\t' || *p == ',')
+            ++p;
+        if(*p == '*')
+            return true;
+        if(p[0] == 'W' && p[1] == '/')
+            p += 2;
+        const char *end = p;
+        if(*end == '"')
+        {
+            ++end;
+            while(*end != '\0' && *end != '"')
+                ++end;
+            if(*end == '"')
+                ++end;
+        }
+        else
+            while(*end != '\0' && *end != ',')
+                ++end;
+        if(
+                static_cast<std::size_t>(end - p) == etag.length() &&
+                std::strncmp(p, etag.c_str(), etag.length()) == 0
+          )
+            return true;
+        p = end;
+        while(*p != '\0' && *p != ',')
+            ++p;
+    }
+    return false;
+}
+
+struct webserver::route_table::node
+{
+    struct handler
+    {
+        request_function *fn;
+        // Order of insertion, used to break ties between an exact and a
+        // prefix route for the same URL.
+        unsigned order;
+        int strength;
+
+        handler() :
+            fn(nullptr),
+            order(0),
+            strength(0)
+        {
+        }
+    };
+
+    // Children are few enough at each level that a linear search is faster
+    // than a map, and can be done without constructing a std::string.
+    std::vector<std::pair<std::string, std::unique_ptr<node>>> children;
+    handler exact;
+    handler prefix;
+
+    const node *child(const char *key, std::size_t length) const
+    {
+        for(const auto& c : children)
+            if(
+                    c.first.length() == length &&
+                    std::memcmp(c.first.data(), key, length) == 0
+              )
+                return c.second.get();
+        return nullptr;
+    }
+
+    node& make_child(const std::string& key)
+    {
+        for(auto& c : children)
+            if(c.first == key)
+                return *c.second;
+        children.emplace_back(key, std::unique_ptr<node>(new node));
+        return *children.back().second;
+    }
+};
+
+webserver::route_table::route_table() :
+    m_root(new node),
+    m_next_order(0)
+{
+}
+
+webserver::route_table::~route_table()
+{
+}
+
+void webserver::route_table::insert(const route& r, request_function *fn)
+{
+    node *n = &(m_root->make_child(r.method));
+    const char *segment = r.url.c_str();
+    if(*segment == '/')
+        ++segment;
+    while(true)
+    {
+        const char *end = std::strchr(segment, '/');
+        if(end == nullptr)
+            end = segment + std::strlen(segment);
+        n = &(n->make_child(std::string(segment, end)));
+        if(*end == '\0')
+            break;
+        segment = end + 1;
+    }
+
+    node::handler& h = r.prefix ? n->prefix : n->exact;
+    if(h.fn == nullptr)
+    {
+        h.fn = fn;
+        h.order = m_next_order;
+        h.strength = static_cast<int>(r.url.length());
+    }
+    ++m_next_order;
+}
+
+webserver::request_function *webserver::route_table::find(
+        const char *url,
+        const char *method,
+        int& strength
+        ) const
+{
+    const node *n = m_root->child(method, std::strlen(method));
+    if(n == nullptr)
+        return nullptr;
+
+    const node::handler *best = nullptr;
+    const char *segment = url;
+    if(*segment == '/')
+        ++segment;
+    while(true)
+    {
+        const char *end = segment;
+        while(*end != '\0' && *end != '/')
+            ++end;
+        n = n->child(segment, static_cast<std::size_t>(end - segment));
+        if(n == nullptr)
+            break;
+        if(*end == '\0')
+        {
+            // The whole URL matched; both an exact and a prefix route may
+            // end here.
+            if(n->exact.fn != nullptr)
+                best = &(n->exact);
+            if(
+                    n->prefix.fn != nullptr &&
+                    (best != &(n->exact) || n->prefix.order < n->exact.order)
+              )
+                best = &(n->prefix);
+            break;
+        }
+        if(n->prefix.fn != nullptr)
+            best = &(n->prefix);
+        segment = end + 1;
+    }
+
+    if(best == nullptr)
+        return nullptr;
+    strength = best->strength;
+    return best->fn;
+}
+
+void webserver::route_table::clear()
+{
+    m_root.reset(new node);
+    m_next_order = 0;
+}
+
 webserver::text_request_function::text_request_function(
         const std::string& url,
         const std::string& method,
@@ -84,15 +1354,21 @@ int webserver::text_request_function::match_strength(
         const char *method
         )
 {
-    if(m_method != method)
+    if(std::strcmp(m_method.c_str(), method) != 0)
         return 0;
-    const std::size_t ml = matching_length(m_url, url);
-    if(ml >= m_url.length())
-        return static_cast<int>(ml);
+    if(matches_prefix_route(m_url, url))
+        return static_cast<int>(m_url.length());
     return 0;
 }
+bool webserver::text_request_function::get_route(route& r) const
+{
+    r.url = m_url;
+    r.method = m_method;
+    r.prefix = true;
+    return true;
+}
 int webserver::text_request_function::operator()(
-        void *cls,
+        void */*cls*/,
         struct MHD_Connection *connection,
         const char *url,
         const char *method,
@@ -102,55 +1378,72 @@ int webserver::text_request_function::operator()(
         void **con_cls
         )
 {
-    struct connection_status
-    {
-        std::ostringstream oss;
-    };
-
-    connection_status *con = nullptr;
+    request_body *body = nullptr;
 
     const std::string param = m_url.length() < std::string(url).length() ?
         std::string(url).substr(m_url.length() + 1) : "";
 
-    if(cls == nullptr)
-        std::cerr << "request " << method << " " << url << "  (param " <<
-            param << ")" << std::endl;
+    logger::debug() << "request " << method << " " << url << "  (param " <<
+        param << ")";
 
     if(std::string(method) == "POST" || std::string(method) == "PUT")
     {
+        const std::size_t max_body_size = g_max_body_size.load(std::memory_order_relaxed);
         if(*con_cls == nullptr)
         {
             // There will be no POST data the first time this function is
-            // called.
-            con = new connection_status;
-            *con_cls = (void*)con;
+            // called.  Refuse a body known to be too large before reading it.
+            const char *content_length = MHD_lookup_connection_value(
+                    connection,
+                    MHD_HEADER_KIND,
+                    "Content-Length"
+                    );
+            if(
+                    content_length != nullptr &&
+                    std::strtoull(content_length, nullptr, 10) > max_body_size
+                    )
+                return queue_error(
+                        connection,
+                        s_too_large_str,
+                        MHD_HTTP_REQUEST_ENTITY_TOO_LARGE
+                        );
+            *con_cls = g_request_body_pool.acquire();
             return MHD_YES;
         }
 
-        con = (connection_status*)(*con_cls);
+        body = reinterpret_cast<request_body*>(*con_cls);
 
         if(upload_data != nullptr && *upload_data_size != 0)
         {
             // Data is being received from the client.
-            std::cerr << "Upload data " << upload_data << std::endl;
-            con->oss << std::string(upload_data, *upload_data_size);
+            if(!body->too_large)
+            {
+                if(body->data.length() + *upload_data_size > max_body_size)
+                {
+                    body->too_large = true;
+                    body->data.clear();
+                }
+                else
+                    body->data.append(upload_data, *upload_data_size);
+            }
             *upload_data_size = 0;
             return MHD_YES;
         }
 
         // upload_data_size equal to 0 indicates that all data has been
         // received.
+        if(body->too_large)
+            return queue_error(
+                    connection,
+                    s_too_large_str,
+                    MHD_HTTP_REQUEST_ENTITY_TOO_LARGE
+                    );
     }
 
     try
     {
-        const std::string post = (con != nullptr) ? con->oss.str() : "";
-        if(con != nullptr)
-        {
-            delete con;
-            con = nullptr;
-            *con_cls = nullptr;
-        }
+        static const std::string s_no_body;
+        const std::string& post = (body != nullptr) ? body->data : s_no_body;
         const std::string str = m_function(param, post);
         struct MHD_Response *response = MHD_create_response_from_buffer(
                 str.length(),
@@ -158,34 +1451,207 @@ int webserver::text_request_function::operator()(
                 MHD_RESPMEM_MUST_COPY
                 );
         MHD_add_response_header(response, "Content-Type", m_mimetype.c_str());
-        int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+        int ret = queue_response(connection, MHD_HTTP_OK, response, str.length());
         MHD_destroy_response(response);
         return ret;
     }
+    catch(const service_unavailable& e)
+    {
+        logger::warning() << "text request function refused: " << e.what();
+        return queue_unavailable(connection);
+    }
     catch(const public_exception& e)
     {
-        struct MHD_Response *response = MHD_create_response_from_buffer(
-                strlen(e.what()),
-                const_cast<char*>(e.what()),
-                MHD_RESPMEM_MUST_COPY
-                );
-        int ret = MHD_queue_response(connection, 500, response);
-        MHD_destroy_response(response);
-        std::cerr << "error in text request function (relayed to client): " << e.what() << std::endl;
-        return ret;
+        logger::warning() << "error in text request function (relayed to client): " << e.what();
+        return queue_error(connection, e.what());
     }
     catch(const std::exception& e)
     {
-        struct MHD_Response *response = MHD_create_response_from_buffer(
-                strlen(s_error_str),
-                s_error_str,
-                MHD_RESPMEM_MUST_COPY
-                );
-        int ret = MHD_queue_response(connection, 500, response);
+        logger::error() << "error in text request function: " << e.what();
+        return queue_error(connection, s_error_str);
+    }
+}
+
+void webserver::text_request_function::request_completed(void *con_cls)
+{
+    if(con_cls != nullptr)
+        g_request_body_pool.release(reinterpret_cast<request_body*>(con_cls));
+}
+
+webserver::cost_class webserver::text_request_function::cost() const
+{
+    return cost_class::json;
+}
+
+webserver::stream_request_function::stream_request_function(
+        const std::string& url,
+        function_type fn,
+        std::string mimetype,
+        etag_function_type etag_fn,
+        std::string cache_control,
+        bool accept_ranges,
+        cost_class cost
+        ) :
+    m_url(url),
+    m_mimetype(mimetype),
+    m_function(fn),
+    m_etag_function(etag_fn),
+    m_cache_control(cache_control),
+    m_accept_ranges(accept_ranges),
+    m_cost(cost)
+{
+}
+int webserver::stream_request_function::match_strength(
+        const char *url,
+        const char *method
+        )
+{
+    if(std::strcmp(method, "GET") != 0)
+        return 0;
+    if(matches_prefix_route(m_url, url))
+        return static_cast<int>(m_url.length());
+    return 0;
+}
+bool webserver::stream_request_function::get_route(route& r) const
+{
+    r.url = m_url;
+    r.method = "GET";
+    r.prefix = true;
+    return true;
+}
+int webserver::stream_request_function::operator()(
+        void */*cls*/,
+        struct MHD_Connection *connection,
+        const char *url,
+        const char *method,
+        const char */*version*/,
+        const char */*upload_data*/,
+        size_t */*upload_data_size*/,
+        void **/*con_cls*/
+        )
+{
+    const std::string param = m_url.length() < std::strlen(url) ?
+        std::string(url + m_url.length() + 1) : "";
+
+    logger::debug() << "request (stream) " << method << " " << url << "  (param " <<
+        param << ")";
+
+    try
+    {
+        std::string etag;
+        if(m_etag_function)
+        {
+            etag = m_etag_function(param);
+            if(if_none_match(connection, etag))
+                return queue_not_modified(connection, etag, m_cache_control);
+        }
+
+        content_reader_ptr reader = m_function(param);
+        const uint64_t size = reader->size();
+        unsigned status = MHD_HTTP_OK;
+        std::string content_type = m_mimetype;
+        std::string content_range;
+
+        const bool accept_ranges = m_accept_ranges && size != unknown_size;
+        const char *range_header = accept_ranges ?
+            MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Range") :
+            nullptr;
+        const char *if_range = (range_header == nullptr) ? nullptr :
+            MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "If-Range");
+        std::vector<byte_range> ranges;
+        // A range request is only honoured if the client's copy (named by
+        // If-Range) is current.  There is no Last-Modified date, so only an
+        // entity tag can match.
+        if(
+                range_header != nullptr &&
+                (if_range == nullptr || (!etag.empty() && etag == if_range)) &&
+                parse_ranges(range_header, size, ranges)
+          )
+        {
+            if(ranges.empty())
+            {
+                struct MHD_Response *response = MHD_create_response_from_buffer(
+                        0,
+                        nullptr,
+                        MHD_RESPMEM_PERSISTENT
+                        );
+                MHD_add_response_header(
+                        response,
+                        "Content-Range",
+                        (std::string("bytes */") + std::to_string(size)).c_str()
+                        );
+                int ret = queue_response(
+                        connection,
+                        MHD_HTTP_REQUESTED_RANGE_NOT_SATISFIABLE,
+                        response,
+                        0
+                        );
+                MHD_destroy_response(response);
+                return ret;
+            }
+
+            status = MHD_HTTP_PARTIAL_CONTENT;
+            if(ranges.size() == 1)
+            {
+                std::ostringstream oss;
+                oss << "bytes " << ranges.front().first << "-" <<
+                    ranges.front().second << "/" << size;
+                content_range = oss.str();
+                reader.reset(new range_reader(std::move(reader), ranges.front()));
+            }
+            else
+            {
+                content_type = std::string("multipart/byteranges; boundary=") +
+                    s_byteranges_boundary;
+                reader.reset(
+                        new multipart_range_reader(std::move(reader), ranges, m_mimetype)
+                        );
+            }
+        }
+
+        uint64_t response_size = reader->size();
+        if(response_size == unknown_size)
+        {
+            // Count the bytes as they are sent.  Reads finish before the
+            // request is completed, so the request state is still valid.
+            response_size = 0;
+            if(t_current_request != nullptr)
+                reader.reset(new counting_reader(std::move(reader), t_current_request->bytes));
+        }
+        struct MHD_Response *response = create_stream_response(std::move(reader));
+        MHD_add_response_header(response, "Content-Type", content_type.c_str());
+        if(accept_ranges)
+            MHD_add_response_header(response, "Accept-Ranges", "bytes");
+        if(!content_range.empty())
+            MHD_add_response_header(response, "Content-Range", content_range.c_str());
+        if(!etag.empty())
+            MHD_add_response_header(response, "ETag", etag.c_str());
+        if(!m_cache_control.empty())
+            MHD_add_response_header(response, "Cache-Control", m_cache_control.c_str());
+        int ret = queue_response(connection, status, response, response_size);
         MHD_destroy_response(response);
-        std::cerr << "error in text request function: " << e.what() << std::endl;
         return ret;
     }
+    catch(const service_unavailable& e)
+    {
+        logger::warning() << "stream request function refused: " << e.what();
+        return queue_unavailable(connection);
+    }
+    catch(const public_exception& e)
+    {
+        logger::warning() << "error in stream request function (relayed to client): " << e.what();
+        return queue_error(connection, e.what());
+    }
+    catch(const std::exception& e)
+    {
+        logger::error() << "error in stream request function: " << e.what();
+        return queue_error(connection, s_error_str);
+    }
+}
+
+webserver::cost_class webserver::stream_request_function::cost() const
+{
+    return m_cost;
 }
 
 webserver::static_request_function::static_request_function(
@@ -195,27 +1661,140 @@ webserver::static_request_function::static_request_function(
         ) :
     m_url(url)
 {
-    m_response = MHD_create_response_from_buffer(
+    add_variant("identity", content, mimetype);
+}
+webserver::static_request_function::static_request_function(
+        const std::string& url,
+        const std::string& content,
+        const encodings_type& encodings,
+        const std::string mimetype
+        ) :
+    m_url(url)
+{
+    try
+    {
+        add_variant("identity", content, mimetype);
+        for(const encodings_type::value_type& encoding : encodings)
+            if(!encoding.second.empty())
+                add_variant(encoding.first, encoding.second, mimetype);
+    }
+    catch(const std::exception&)
+    {
+        for(variant& v : m_variants)
+        {
+            MHD_destroy_response(v.response);
+            MHD_destroy_response(v.not_modified_response);
+        }
+        throw;
+    }
+
+    // Keep the unencoded content first, and the others in order of size.
+    std::sort(
+            m_variants.begin() + 1,
+            m_variants.end(),
+            [](const variant& a, const variant& b) { return a.size < b.size; }
+            );
+
+    if(m_variants.size() > 1)
+        for(variant& v : m_variants)
+        {
+            MHD_add_response_header(v.response, "Vary", "Accept-Encoding");
+            MHD_add_response_header(v.not_modified_response, "Vary", "Accept-Encoding");
+        }
+}
+webserver::static_request_function::~static_request_function()
+{
+    for(variant& v : m_variants)
+    {
+        MHD_destroy_response(v.response);
+        MHD_destroy_response(v.not_modified_response);
+    }
+}
+void webserver::static_request_function::add_variant(
+        const std::string& coding,
+        const std::string& content,
+        const std::string& mimetype
+        )
+{
+    variant v;
+    v.coding = coding;
+    v.size = content.length();
+    v.etag = content_etag(content.c_str(), content.length());
+    v.response = MHD_create_response_from_buffer(
             content.length(),
             const_cast<char*>(content.c_str()),
             MHD_RESPMEM_MUST_COPY
             );
-    if(m_response == nullptr)
+    if(v.response == nullptr)
         throw std::runtime_error("response object is null");
-    MHD_add_response_header(m_response, "Content-Type", mimetype.c_str());
+    MHD_add_response_header(v.response, "Content-Type", mimetype.c_str());
+    MHD_add_response_header(v.response, "ETag", v.etag.c_str());
+    if(coding != "identity")
+        MHD_add_response_header(v.response, "Content-Encoding", coding.c_str());
+
+    v.not_modified_response = MHD_create_response_from_buffer(
+            0,
+            nullptr,
+            MHD_RESPMEM_PERSISTENT
+            );
+    if(v.not_modified_response == nullptr)
+    {
+        MHD_destroy_response(v.response);
+        throw std::runtime_error("response object is null");
+    }
+    MHD_add_response_header(v.not_modified_response, "ETag", v.etag.c_str());
+
+    m_variants.push_back(v);
 }
-webserver::static_request_function::~static_request_function()
+const webserver::static_request_function::variant&
+webserver::static_request_function::select_variant(
+        struct MHD_Connection *connection
+        ) const
 {
-    MHD_destroy_response(m_response);
+    if(m_variants.size() == 1)
+        return m_variants.front();
+
+    const char *header = MHD_lookup_connection_value(
+            connection,
+            MHD_HEADER_KIND,
+            "Accept-Encoding"
+            );
+    if(header == nullptr)
+        return m_variants.front();
+
+    // Prefer the coding the client rates highest, then the smallest.  Send
+    // the unencoded content if the client accepts nothing else.
+    const variant *best = &(m_variants.front());
+    double best_quality = 0.0;
+    for(const variant& v : m_variants)
+    {
+        const double quality = coding_quality(header, v.coding);
+        if(
+                quality > best_quality ||
+                (quality > 0.0 && quality == best_quality && v.size < best->size)
+          )
+        {
+            best = &v;
+            best_quality = quality;
+        }
+    }
+    return *best;
 }
 int webserver::static_request_function::match_strength(
         const char *url,
         const char *method
         )
 {
-    return (m_url == url && std::string(method) == "GET") ?
+    return (m_url == url && std::strcmp(method, "GET") == 0) ?
         static_cast<int>(m_url.length()) : 0;
 }
+bool webserver::static_request_function::get_route(route& r) const
+{
+    r.url = m_url;
+    r.method = "GET";
+    r.prefix = false;
+    return true;
+}
 int webserver::static_request_function::operator()(
         void */*cls*/,
         struct MHD_Connection *connection,
@@ -227,13 +1806,49 @@ int webserver::static_request_function::operator()(
         void **/*con_cls*/
         )
 {
-    std::cerr << "request (static) " << url << std::endl;
+    logger::debug() << "request (static) " << url;
     // Respond to the request immediately - there should be no POST data.
-    return MHD_queue_response(connection, MHD_HTTP_OK, m_response);
+    const variant& v = select_variant(connection);
+    if(if_none_match(connection, v.etag))
+        return queue_response(
+                connection,
+                MHD_HTTP_NOT_MODIFIED,
+                v.not_modified_response,
+                0
+                );
+    return queue_response(connection, MHD_HTTP_OK, v.response, v.size);
+}
+
+int webserver::queue_response(
+        struct MHD_Connection *connection,
+        unsigned int status_code,
+        struct MHD_Response *response,
+        uint64_t size
+        )
+{
+    if(t_current_request != nullptr)
+    {
+        t_current_request->status = status_code;
+        t_current_request->bytes = size;
+    }
+    return MHD_queue_response(connection, status_code, response);
 }
 
 void webserver::install_request_function(std::unique_ptr<request_function>&& fn)
 {
+    route r;
+    if(fn->get_route(r))
+    {
+        g_route_table.insert(r, fn.get());
+        g_endpoints[fn.get()] = &metrics::add_endpoint(r.url, r.method);
+    }
+    else
+    {
+        g_dynamic_functions.push_back(fn.get());
+        if(g_dynamic_endpoint == nullptr)
+            g_dynamic_endpoint = &metrics::add_endpoint("(dynamic)", "");
+        g_endpoints[fn.get()] = g_dynamic_endpoint;
+    }
     g_request_functions.push_back(std::move(fn));
 }
 
@@ -242,9 +1857,20 @@ namespace
     static struct MHD_Daemon *g_daemon = nullptr;
 }
 
-void webserver::start_server(uint16_t port)
+void webserver::start_server(uint16_t port, unsigned threads)
 {
-    if(g_daemon == nullptr)
+    if(g_daemon != nullptr)
+        return;
+
+    // In thread-per-connection mode, a request waiting for a slot only holds
+    // up its own connection.  A worker in the pool also serves the
+    // connections which would release slots, so there a request over the
+    // limit is suspended while it waits.
+    g_suspend_waiting = (threads != 0);
+    if(g_suspend_waiting)
+        g_admission.start_waiting();
+
+    if(threads == 0)
         g_daemon = MHD_start_daemon(
                 MHD_USE_THREAD_PER_CONNECTION,
                 port,
@@ -252,11 +1878,89 @@ void webserver::start_server(uint16_t port)
                 nullptr,
                 &answer_connection,
                 nullptr,
+                MHD_OPTION_NOTIFY_COMPLETED,
+                &request_completed,
+                nullptr,
                 MHD_OPTION_END
                 );
+    else
+    {
+        // Each worker thread in the pool runs its own event loop.  Prefer
+        // epoll where this build of MicroHTTPD supports it.
+        unsigned flags = MHD_USE_SELECT_INTERNALLY | MHD_USE_SUSPEND_RESUME;
+        if(MHD_is_feature_supported(MHD_FEATURE_EPOLL) == MHD_YES)
+            flags |= MHD_USE_EPOLL_LINUX_ONLY;
+        g_daemon = MHD_start_daemon(
+                flags,
+                port,
+                nullptr,
+                nullptr,
+                &answer_connection,
+                nullptr,
+                MHD_OPTION_THREAD_POOL_SIZE,
+                threads,
+                MHD_OPTION_NOTIFY_COMPLETED,
+                &request_completed,
+                nullptr,
+                MHD_OPTION_END
+                );
+    }
 
     if(g_daemon == nullptr)
+    {
+        g_admission.stop_waiting();
         throw std::runtime_error("starting MHD server");
+    }
+}
+
+void webserver::set_max_body_size(const std::size_t size)
+{
+    g_max_body_size.store(size, std::memory_order_relaxed);
+}
+
+std::size_t webserver::max_body_size()
+{
+    return g_max_body_size.load(std::memory_order_relaxed);
+}
+
+void webserver::set_admission_limit(
+        const cost_class c,
+        const unsigned global,
+        const unsigned per_client
+        )
+{
+    g_admission.set_limit(c, global, per_client);
+}
+
+void webserver::set_admission_wait(const std::chrono::milliseconds wait)
+{
+    g_admission.set_wait(wait);
+}
+
+void webserver::set_request_cleanup(std::function<void()> fn)
+{
+    g_request_cleanup = std::move(fn);
+}
+
+webserver::admission_ticket::admission_ticket(const cost_class c) :
+    m_class(c),
+    m_client((t_current_request != nullptr) ? t_current_request->client : 0)
+{
+    // Give up the request's own slot first, so that no request holds two
+    // slots at once.  Otherwise requests holding every slot of one class
+    // could all be waiting for a slot of another.
+    if(t_current_request != nullptr)
+    {
+        g_admission.release(t_current_request->admitted, m_client);
+        t_current_request->admitted = cost_class::uncounted;
+    }
+    if(!g_admission.acquire(m_class, m_client))
+        throw service_unavailable("no slot free for costly work");
+}
+
+webserver::admission_ticket::~admission_ticket()
+{
+    g_admission.release(m_class, m_client);
 }
 
 void webserver::stop_server()
@@ -264,14 +1968,22 @@ void webserver::stop_server()
     if(g_daemon == nullptr)
         return;
 
-    g_request_functions.clear();
-
+    // Refuse the requests waiting for a slot, as their connections must be
+    // resumed before the daemon stops.
+    g_admission.stop_waiting();
     MHD_stop_daemon(g_daemon);
     g_daemon = nullptr;
+    g_suspend_waiting = false;
+
+    g_route_table.clear();
+    g_dynamic_functions.clear();
+    g_endpoints.clear();
+    g_request_functions.clear();
 }
 
 void webserver::install_not_found_function(request_function_ptr&& fn)
 {
     g_not_found_function = std::move(fn);
+    g_endpoints[g_not_found_function.get()] = &metrics::add_endpoint("(not found)", "");
 }
 